@@ -9,7 +9,7 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
-#define MAX_IP_LENGTH 16
+#define MAX_IP_LENGTH 128      // Dotted IPv4 or "unix:/path"
 #define MAX_PORT_LENGTH 6
 #define MAX_PATH_LENGTH 256
 #define MAX_USERNAME_LENGTH 64
@@ -0,0 +1,39 @@
+/*********************************
+*
+* @File: cpu.h
+* @Purpose: Runtime CPU feature detection and kernel dispatch
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __CPU_H__
+#define __CPU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CPU_LEVEL_ENV "MRJ_CPU_LEVEL"   // Optional cap: scalar, sse4.2, avx2, avx512
+
+typedef enum {
+    CPU_LEVEL_SCALAR,
+    CPU_LEVEL_SSE42,
+    CPU_LEVEL_AVX2,
+    CPU_LEVEL_AVX512
+} CpuLevel;
+
+typedef struct {
+    /* Sum of all bytes, used by the frame checksum */
+    uint32_t (*pfByteSum)(const uint8_t* pData, size_t nLen);
+    /* Full 8x8 float IDCT with level shift and clamping; NULL until dispatch runs */
+    void (*pfIdct8x8)(const float* pfCoef, uint8_t* pOut, int nStride);
+    const char* psByteSum;
+    const char* psIdct8x8;
+} CpuKernels;
+
+extern CpuKernels gKernels;
+
+void vInitCpuDispatch(void);
+CpuLevel eGetCpuLevel(void);
+const char* psCpuLevelName(CpuLevel eLevel);
+
+#endif
@@ -0,0 +1,38 @@
+/*********************************
+*
+* @File: delta.h
+* @Purpose: rsync-style delta uploads: the worker sends block signatures
+*           of the previous version of a file it holds, the client sends
+*           only literal bytes and references to matching blocks
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include "network.h"
+#include "md5.h"
+
+#define DELTA_MODE "DELTA"                  // WORKER_CONNECT option and ack option
+#define DELTA_MIN_SIZE (64 * 1024)          // Smaller files are cheaper to send whole
+#define DELTA_MIN_BLOCK 2048                // Bytes per block of small bases
+#define DELTA_MAX_BLOCKS 16384              // Larger bases get larger blocks, not more
+#define DELTA_STRONG_SIZE 8                 // Leading MD5 bytes kept per block
+#define DELTA_SIG_SIZE (4 + DELTA_STRONG_SIZE)
+
+typedef struct DeltaIndex DeltaIndex;
+
+/* Told about each literal range (nBlock < 0) or run of nCount matching
+ * blocks of the basis starting at nBlock; nonzero stops the encoding */
+typedef int (*DeltaEmitFunc)(void* pvArg, int nBlock, int nCount, unsigned long nFrom, unsigned long nLength);
+
+unsigned long nDeltaBlockSize(unsigned long nBasisSize);
+int nDeltaSendSignatures(Connection* pConn, const char* pBasis, unsigned long nBasisSize);
+DeltaIndex* pDeltaReceiveSignatures(Connection* pConn);
+void vDeltaFreeIndex(DeltaIndex* pIndex);
+int nDeltaEncode(const DeltaIndex* pIndex, const char* pData, unsigned long nSize,
+                 DeltaEmitFunc pfEmit, void* pvArg);
+int nDeltaCopyRange(const Frame* pFrame, unsigned long nBasisSize, unsigned long* pnFrom, unsigned long* pnLength);
+
+#endif
@@ -0,0 +1,29 @@
+/*********************************
+*
+* @File: jpeg.h
+* @Purpose: Baseline JPEG decoding with DCT-domain scaling and re-encoding
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __JPEG_H__
+#define __JPEG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JPEG_DEFAULT_QUALITY 85
+
+typedef struct {
+    int nWidth;             // Width in pixels
+    int nHeight;            // Height in pixels
+    int nComponents;        // 1 (grayscale) or 3 (RGB)
+    uint8_t* pPixels;       // Interleaved samples, nWidth * nComponents per row
+} JpegImage;
+
+int nJpegDecodeScaled(const uint8_t* pData, size_t nSize, int nScaleDenom, JpegImage* pImage);
+int nJpegEncode(const JpegImage* pImage, int nQuality, uint8_t** ppOut, size_t* pnOutSize);
+void vJpegFreeImage(JpegImage* pImage);
+int nJpegScaleFile(const char* psInPath, const char* psOutPath, int nScaleDenom, int nQuality);
+
+#endif
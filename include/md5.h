@@ -0,0 +1,30 @@
+/*********************************
+*
+* @File: md5.h
+* @Purpose: Incremental MD5 (RFC 1321) for single-pass transfer checks
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __MD5_H__
+#define __MD5_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MD5_DIGEST_SIZE 16
+#define MD5_HEX_SIZE 33          // 32 hex characters + '\0'
+#define MD5_DEFERRED "-"         // MD5 follows the data in a FILE_INFO trailer
+
+typedef struct {
+    uint32_t nState[4];
+    uint64_t nLength;            // Bytes hashed so far
+    uint8_t pBuffer[64];         // Pending partial block
+} Md5Context;
+
+void vMd5Init(Md5Context* pCtx);
+void vMd5Update(Md5Context* pCtx, const void* pData, size_t nLen);
+void vMd5Final(Md5Context* pCtx, uint8_t pDigest[MD5_DIGEST_SIZE]);
+void vMd5FinalHex(Md5Context* pCtx, char sHex[MD5_HEX_SIZE]);
+
+#endif
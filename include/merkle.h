@@ -0,0 +1,34 @@
+/*********************************
+*
+* @File: merkle.h
+* @Purpose: Chunked Merkle transfer mode: per-chunk MD5, Merkle root in
+*           FILE_INFO and NACK-driven retransmission of bad chunks
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __MERKLE_H__
+#define __MERKLE_H__
+
+#include "network.h"
+#include "ring.h"
+#include "md5.h"
+
+#define MERKLE_MODE "MERKLE"             // WORKER_CONNECT option and ack payload
+#define PLAIN_MODE "PLAIN"               // WORKER_CONNECT option: FILE_DATA without chunks
+#define MERKLE_HELD "H"                  // CHUNK_HASH flag: receiver already has the bytes
+#define MERKLE_CHUNK_SIZE (1024 * 1024)  // Bytes covered by one leaf
+#define MERKLE_MAX_RETRIES 3             // Resends of one chunk before giving up
+#define MERKLE_MAX_THREADS 8             // Upper bound for the verifier pool
+#define MERKLE_CHECK_KO -2               // nMerkleReceive: upload failed verification
+
+typedef uint8_t MerkleLeaf[MD5_DIGEST_SIZE];
+
+int nMerkleChunkCount(unsigned long nSize);
+unsigned long nMerkleChunkLength(unsigned long nSize, int nChunk);
+void vMerkleRoot(MerkleLeaf* pLeaves, int nChunks, char sHex[MD5_HEX_SIZE]);
+int nParseChunkRanges(const char* psRanges, char* pMarks, int nChunks);
+int nMerkleReceive(Connection* pConn, int fd, unsigned long nSize, int nHeldChunks,
+                   unsigned long nFeedFrom, Ring* pRing);
+
+#endif
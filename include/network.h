@@ -2,29 +2,94 @@
 #define __NETWORK_H__
 
 #include "protocol.h"
+#include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <logging.h>
+#include "uring.h"
+#include "shmring.h"
 #define SOCKET_TIMEOUT_SEC 10
+#define POOL_IDLE_SEC 30                 // Idle pooled client-worker connections are closed after this
+#define UNIX_ENDPOINT "unix:"            // IP field prefix selecting an AF_UNIX socket path
+#define IO_BACKEND_ENV "MRJ_IO_BACKEND"  // Optional override: posix, uring
+#define FRAME_BATCH URING_POOL_FRAMES    // Frames send_frames hands the kernel in one write
+#define BULK_MODE "BULK"                 // WORKER_CONNECT option: payload moves as BULK_DATA segments
+#define BULK_SEGMENT_SIZE (1024 * 1024)  // Most raw bytes one BULK_DATA frame announces
+#define SHM_MODE "SHM"                   // WORKER_CONNECT option: BULK_DATA bytes move through a shared ring
+#define HANDOFF_MODE "FD"                // WORKER_CONNECT option: the client passes its input and output files
+#define ZLIB_MODE "ZLIB"                 // WORKER_CONNECT option: BULK_DATA segments may be zlib-packed
+#define ZLIB_LEVEL 1                     // Fastest zlib level, the link is the bottleneck
+#define ZLIB_PROBE_BYTES (256 * 1024)    // Stream bytes compressed before deciding if it pays
+#define MAX_FRAME_FDS SHM_LINK_FDS       // Most descriptors one frame carries
+#define CACHED_MODE "CACHED"             // WORKER_CONNECT ack option: result served from the cache, no upload
+#define HELD_MODE "HAVE"                 // WORKER_CONNECT ack option: worker holds the input, no upload
+#define APPEND_MODE "APPEND"             // WORKER_CONNECT option: a grown file may continue the last job on it
+#define STREAM_WINDOW (4 * 1024 * 1024)  // Bytes one stream may have queued at its receiver
+
+typedef struct StreamMux StreamMux;
 
 typedef struct {
     int fd;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;  // sockaddr_in, or sockaddr_un for unix: endpoints
     bool is_server;
+    pthread_mutex_t send_lock;  // Serializes send_frame between threads
+    int zerocopy;               // MSG_ZEROCOPY: 0 untried, 1 enabled, -1 unavailable
+    uint32_t zc_sent;           // Zero-copy sends issued
+    uint32_t zc_done;           // Zero-copy sends the kernel has released
+    int timeout_ms;             // Receive timeout the io_uring backend links to each read
+    ShmLink* shm;               // Shared ring for BULK_DATA bytes, NULL to use the socket
+    int zlib;                   // Packing of sent BULK_DATA: 0 off, 1 probing, 2 on, -1 not worth it
+    uint64_t zlib_raw;          // Bytes offered to zlib while probing
+    uint64_t zlib_packed;       // What they packed to
+    char* zlib_send;            // Send scratch, raw then packed segment, under send_lock
+    char* zlib_recv;            // Receive scratch, packed then raw segment
+    StreamMux* mux;             // Demultiplexer once the socket carries streams, NULL before
+    uint16_t stream;            // Stream this connection stands for, 0 for the socket itself
 } Connection;
 
+typedef enum {
+    IO_BACKEND_POSIX,           // Blocking read/write, SO_RCVTIMEO timeouts
+    IO_BACKEND_URING            // Per-thread io_uring, linked timeouts
+} IoBackend;
+
+
 
+void vInitIoBackend(void);
+IoBackend eGetIoBackend(void);
 
 Connection* create_server(const char* ip, int port);
 Connection* connect_to_server(const char* ip, int port);
 Connection* accept_client(Connection* server);
+Connection* create_connection(int fd);
 void close_connection(Connection* conn);
 bool is_connected(Connection* conn);
+bool wait_for_close(Connection* conn, int timeout_sec);
+bool is_unix_endpoint(const char* ip);
+bool is_local_socket(Connection* conn);
+bool mode_has_option(const char* mode, const char* option);
+bool make_cache_key(char key[CACHE_KEY_LENGTH], const char* md5, const char* factor, const char* filename);
 
 bool send_frame(Connection* conn, const Frame* frame);
+bool send_frames(Connection* conn, uint8_t type, const char* data, size_t len);
 Frame* receive_frame(Connection* conn);
 Frame* receive_frame_timeout(Connection* conn, int timeout_sec);
+bool send_frame_fds(Connection* conn, const Frame* frame, const int* fds, int nfds);
+Frame* receive_frame_fds(Connection* conn, int* fds, int max_fds, int* nfds);
+
+bool send_bulk(Connection* conn, const void* data, size_t len);
+bool send_bulk_file(Connection* conn, int fd, off_t offset, size_t len);
+size_t bulk_length(const Frame* frame);
+bool receive_bulk_to_file(Connection* conn, const Frame* header, int fd, off_t offset);
+void enable_bulk_compression(Connection* conn);
+void reset_bulk_options(Connection* conn);
+
+bool enable_mux(Connection* conn, Frame* first, const int* fds, int nfds);
+Connection* open_stream(Connection* conn);
+Connection* accept_stream(Connection* conn, int timeout_sec, Frame** frame);
+void reset_stream(Connection* conn);
 
 const char* get_last_error(void);
 void clear_last_error(void);
@@ -0,0 +1,27 @@
+/*********************************
+*
+* @File: pack.h
+* @Purpose: Containers of small text files sent as one job: Fleck packs
+*           the files of a batch, the worker distorts every member and
+*           returns a container of the results in the same order
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __PACK_H__
+#define __PACK_H__
+
+/* A container is PACK_MAGIC, then for each member an index line
+ * "size name\n" followed by its size bytes. The result repeats the
+ * names with the distorted sizes */
+#define PACK_MAGIC "MRJPACK/1\n"
+#define PACK_MEMBER_FORMAT "%lu %s\n"
+#define PACK_LINE_SIZE 320                  // Index line, the longest file name included
+
+#define PACK_PREFIX ".pack_"                // File name of a container, ".pack_pid_batch_n.txt"
+#define PACK_ENV "MRJ_PACK"                 // "0" sends every file of a batch on its own
+#define PACK_MEMBER_MAX (64 * 1024)         // Larger files stream well on their own
+#define PACK_MAX_SIZE (1024 * 1024)         // Container size, more small files start another
+#define PACK_MIN_MEMBERS 4                  // Fewer small files are not worth a container
+
+#endif
@@ -0,0 +1,60 @@
+/*********************************
+*
+* @File: progress.h
+* @Purpose: Per-host job progress table in POSIX shared memory, so a
+*           worker taking over a crashed one continues from its last
+*           checkpoint instead of recomputing the job
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <sys/types.h>
+#include <time.h>
+#include "protocol.h"
+#include "config.h"
+#include "md5.h"
+
+#define PROGRESS_SLOTS 32                   // Jobs tracked per worker type and host
+#define PROGRESS_STATE_SIZE 256             // Engine state a checkpoint can hold
+#define PROGRESS_INTERVAL (1024 * 1024)     // Input bytes between checkpoints
+#define PROGRESS_PATH_LENGTH (MAX_PATH_LENGTH + 300)
+#define PROGRESS_EXPIRY_SEC (10 * 60)       // A failed job not resumed by then is dropped
+
+typedef struct {
+    char sJobId[JOB_ID_LENGTH];             // Empty when the slot is free
+    pid_t nOwner;                           // Worker process running the job
+    int nIsRunning;                         // A job of nOwner uses the slot; else it waits for a resume
+    time_t nUpdated;                        // Last claim, takeover or save; a waiting slot expires by it
+    char sSpoolPath[PROGRESS_PATH_LENGTH];  // Upload spool
+    char sOutPath[PROGRESS_PATH_LENGTH];    // Output spool
+    unsigned long nHashOffset;              // Upload bytes covered by inMd5
+    Md5Context inMd5;
+    int nHasCheckpoint;                     // Fields below are valid
+    unsigned long nInOffset;                // Input the engine had consumed
+    unsigned long nOutOffset;               // Output it had produced, covered by outMd5
+    Md5Context outMd5;
+    size_t nStateSize;
+    unsigned char pState[PROGRESS_STATE_SIZE];
+} ProgressEntry;
+
+typedef struct ProgressTable ProgressTable;
+
+ProgressTable* pOpenProgressTable(const char* psType);
+void vCloseProgressTable(ProgressTable* pTable);
+int nProgressClaim(ProgressTable* pTable, const char* psJobId, const char* psSpoolPath,
+                   const char* psOutPath);
+int nProgressTakeOver(ProgressTable* pTable, const char* psJobId, ProgressEntry* pEntry);
+void vProgressSaveHash(ProgressTable* pTable, int nSlot, unsigned long nOffset, const Md5Context* pMd5);
+void vProgressSaveCheckpoint(ProgressTable* pTable, int nSlot, unsigned long nInOffset,
+                             unsigned long nOutOffset, const Md5Context* pOutMd5,
+                             const void* pState, size_t nStateSize);
+void vProgressRelease(ProgressTable* pTable, int nSlot);
+void vProgressPark(ProgressTable* pTable, int nSlot);
+int nProgressExpire(ProgressTable* pTable, time_t nMaxAge);
+int nProgressHolds(ProgressTable* pTable, const char* psPath);
+int nProgressAdoptOrphans(ProgressTable* pTable);
+
+#endif
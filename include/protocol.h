@@ -18,12 +18,34 @@
 #define FRAME_DISTORT_REQ     0x10
 #define FRAME_RESUME_REQ      0x11
 #define FRAME_HEARTBEAT       0x12
+#define FRAME_NACK            0x13
+#define FRAME_CHUNK_HASH      0x14
+#define FRAME_BULK_DATA       0x15   // Payload is the length of the raw bytes that follow, or
+                                     // "raw&packed" when packed zlib bytes follow instead, or
+                                     // "raw&SHM" when the bytes go through the shared ring
+#define FRAME_CACHE_UPDATE    0x16   // Worker to Gotham: "+key" result stored, "-key" evicted, "=bytes" cache budget
+#define FRAME_WORKER_IDLE     0x17   // Worker to Gotham: client session over, free for the next job
+#define FRAME_DELTA_SIG       0x18   // Worker to client: "blockSize&blocks", then packed block signatures
+#define FRAME_DELTA_COPY      0x19   // Client to worker: "block&count" of the basis stand for upload bytes
+#define FRAME_WINDOW          0x1A   // Receiver to sender: "bytes" more may be sent on the frame's stream
 
 #define DATA_SIZE 247
+#define JOB_ID_LENGTH 24       // Job id handed out by Gotham with DISTORT_REQ
+#define CACHE_KEY_LENGTH 96    // Result cache key "inputMd5&factor&extension"
+#define CACHE_REPORT_KEYS 128  // Cached results a worker reports, and Gotham tracks, per worker
+#define DISTORT_WAIT "DISTORT_WAIT" // DISTORT_REQ reply: parked behind the same job or queued for a
+                                    // free worker, worker info follows
+#define REQUEST_TAG '#'        // DISTORT/RESUME_REQ prefix "#id&": every answer carries it back, answers
+                               // may come in any order, and the request waits for a busy worker
+#define REQUEST_TAG_LENGTH 16  // "#id&" and its terminator
+#define DISTORT_BATCH "BATCH"  // Tagged DISTORT_REQ "BATCH&batch&count&type&file&md5&factor&size": one of
+                               // count files Gotham spreads over the free workers by size once all came
+#define DISTORT_BATCH_MAX 4096 // Files one DISTORT_BATCH may count; a larger selection goes as several
 #pragma pack(push, 1)
 typedef struct {
     uint8_t type;
     uint16_t data_length;
+    uint16_t stream;        // Stream of a multiplexed connection, 0 for the connection itself
     char data[247];
     uint16_t checksum;
     uint32_t timestamp;
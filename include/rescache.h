@@ -0,0 +1,40 @@
+/*********************************
+*
+* @File: rescache.h
+* @Purpose: Content-addressed file stores in the worker's save folder,
+*           kept under a byte budget by evicting the least recently used
+*           entries. One holds distortion results, keyed by input MD5,
+*           factor and file extension; another the originals recently
+*           uploaded, keyed by their MD5; a third the engine state at the
+*           end of the last job on each file name
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __RESCACHE_H__
+#define __RESCACHE_H__
+
+#include "protocol.h"
+
+#define CACHE_DIR ".cache"                          // Results, under the save folder
+#define ORIGINALS_DIR ".originals"                  // Uploaded inputs, under the save folder
+#define ORIGINALS_TAG "original"                    // Originals do not depend on the engine
+#define APPENDS_DIR ".appends"                      // Engine end states, under the save folder
+#define CACHE_BYTES_ENV "MRJ_CACHE_BYTES"           // Optional budget of each store, 0 disables them
+#define CACHE_DEFAULT_BYTES (256UL * 1024 * 1024)
+
+typedef struct ResultCache ResultCache;
+
+/* Told about each key stored ('+') or evicted ('-') */
+typedef void (*CacheReportFunc)(void* pvArg, char cOp, const char* psKey);
+
+ResultCache* pOpenResultCache(const char* psFolder, const char* psDir, const char* psEngine);
+void vCloseResultCache(ResultCache* pCache);
+int nCacheLookup(ResultCache* pCache, const char* psKey);
+void vCacheStore(ResultCache* pCache, const char* psKey, int fd, CacheReportFunc pfReport, void* pvArg);
+void vCachePut(ResultCache* pCache, const char* psKey, const void* pData, size_t nSize);
+void vCacheDrop(ResultCache* pCache, const char* psKey, CacheReportFunc pfReport, void* pvArg);
+void vCacheList(ResultCache* pCache, int nMax, CacheReportFunc pfReport, void* pvArg);
+unsigned long nCacheBudget(const ResultCache* pCache);
+
+#endif
@@ -0,0 +1,36 @@
+/*********************************
+*
+* @File: ring.h
+* @Purpose: Bounded single-producer/single-consumer byte ring used to
+*           connect the stages of the worker pipeline
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+typedef struct {
+    char* pBuffer;              // Storage, nCapacity bytes
+    size_t nCapacity;           // Ring size
+    size_t nHead;               // Total bytes written (producer only)
+    size_t nTail;               // Total bytes read (consumer only)
+    int nIsClosed;              // Producer finished, reads drain then return 0
+    int nIsAborted;             // Pipeline failed, both sides return -1
+    pthread_mutex_t mutex;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} Ring;
+
+Ring* create_ring(size_t nCapacity);
+void destroy_ring(Ring* pRing);
+ssize_t ring_write(Ring* pRing, const void* pData, size_t nLen);
+ssize_t ring_read(Ring* pRing, void* pData, size_t nMax);
+void ring_close(Ring* pRing);
+void ring_abort(Ring* pRing);
+
+#endif
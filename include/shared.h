@@ -10,8 +10,24 @@
 #ifndef __SHARED_H__
 #define __SHARED_H__
 
+#include <stddef.h>
+
+typedef struct {
+    int fd;
+    char* pData;                // Mapping, NULL while nothing is mapped
+    size_t nMapped;             // Bytes mapped
+} MappedFile;
+
 void vWriteLog(const char* psMsg);
 int nStringToInt(const char* psStr);
 int nCreateDirectory(const char* psPath);
+int nCopyFile(const char* psSrcPath, const char* psDstPath);
+int nCopyFd(int fdSrc, int fdDst, size_t nLength);
+
+int nMapInput(MappedFile* pMap, int fd);
+int nMapOutput(MappedFile* pMap, int fd, size_t nCapacity);
+int nGrowOutput(MappedFile* pMap, size_t nCapacity);
+int nFinishOutput(MappedFile* pMap, size_t nSize);
+void vUnmapFile(MappedFile* pMap);
 
 #endif
\ No newline at end of file
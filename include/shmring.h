@@ -0,0 +1,29 @@
+/*********************************
+*
+* @File: shmring.h
+* @Purpose: Shared-memory data path between a Fleck and a worker on the
+*           same host: two single-producer/single-consumer byte rings in
+*           one memfd, one per direction, with eventfd wakeups
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SHM_RING_SIZE (4 * 1024 * 1024)  // Bytes per direction, a power of two
+#define SHM_LINK_FDS 5                   // memfd, then data/space eventfds of both rings
+
+typedef struct ShmLink ShmLink;
+
+ShmLink* pCreateShmLink(int pFds[SHM_LINK_FDS]);
+ShmLink* pAttachShmLink(const int pFds[SHM_LINK_FDS]);
+void vDestroyShmLink(ShmLink* pLink);
+int nShmSend(ShmLink* pLink, const void* pData, size_t nLen, int fdWatch, int nTimeoutMs);
+int nShmSendFile(ShmLink* pLink, int fd, off_t nOffset, size_t nLen, int fdWatch, int nTimeoutMs);
+int nShmReceiveToFile(ShmLink* pLink, int fd, off_t nOffset, size_t nLen, int fdWatch, int nTimeoutMs);
+
+#endif
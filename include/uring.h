@@ -0,0 +1,26 @@
+/*********************************
+*
+* @File: uring.h
+* @Purpose: io_uring I/O backend for the Connection API: one ring per
+*           thread with a registered frame pool, linked timeouts and
+*           batched submissions
+* @Author: Karol Korszun
+*
+*********************************/
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+#include "protocol.h"
+
+#define URING_POOL_FRAMES 32     // Registered frames per thread ring
+
+int nUringProbe(void);
+Frame* pUringFramePool(void);
+ssize_t nUringRead(int fd, void* pBuffer, size_t nLen, int nTimeoutMs);
+ssize_t nUringWrite(int fd, const void* pData, size_t nLen, int nTimeoutMs);
+ssize_t nUringSpliceToFile(int fdSocket, const int pipefd[2], int fdFile, off_t nOffset,
+                           size_t nLen, int nTimeoutMs);
+
+#endif
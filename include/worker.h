@@ -3,22 +3,56 @@
 
 #include "network.h"
 #include "config.h"
+#include "ring.h"
+#include "progress.h"
+#include "rescache.h"
 
-#define MAX_IP_LENGTH 16
-#define MAX_PORT_LENGTH 6
+#define DISTORT_NOT_STREAMABLE 1
+#define WORKER_SLOTS_ENV "MRJ_WORKER_SLOTS"  // Optional cap on concurrent jobs, default one per CPU
+
+/* Distortion engine: reads psInPath, writes psOutPath. 0 on success, -1 on failure */
+typedef int (*DistortFunc)(const char* psInPath, const char* psOutPath, const char* psFactor);
+
+/* Engine checkpoint handle. A streaming engine restores its state once at
+ * start, then saves it at points where all input it has read is reflected
+ * in the output it has written; a takeover worker resumes from there. The
+ * state at end of input is saved too, so a file that only grew later
+ * continues from it */
+typedef struct JobCheckpoint JobCheckpoint;
+
+size_t nRestoreCheckpoint(JobCheckpoint* pCheckpoint, void* pState, size_t nMax);
+void vSaveCheckpoint(JobCheckpoint* pCheckpoint, const void* pState, size_t nSize);
+void vSaveEndState(JobCheckpoint* pCheckpoint, const void* pState, size_t nSize);
+
+/* Streaming engine: consumes pIn until EOF while writing the result to pOut.
+ * Returns DISTORT_NOT_STREAMABLE, without reading, for files that must go
+ * through the whole-file DistortFunc instead */
+typedef int (*StreamDistortFunc)(const char* psFileName, const char* psFactor, Ring* pIn, Ring* pOut,
+                                 JobCheckpoint* pCheckpoint);
 
 typedef struct {
     Connection* pGothamConn;    // Connection to Gotham
     Connection* pClientConn;    // Connection to current client
     Connection* pServerConn;    // Server socket for client connections
+    Connection* pLocalConn;     // Unix socket for clients on this host, NULL if none
     WorkerConfig config;        // Worker configuration
     volatile int nIsRunning;    // Running flag
-    volatile int nIsProcessing; // Currently processing a distortion
+    volatile int nIsProcessing; // Distortions in progress
+    int nSlots;                 // Distortions run at once, more wait for a slot
+    int nPooledFd;              // Client connection idle between pooled jobs, -1 if none
     int nIsMainWorker;         // Is this the main worker
     int nIsRegistered;         // Registration status with Gotham
     char* psType;              // Worker type (Text/Media)
     char sIP[MAX_IP_LENGTH];   // Worker IP
     char sPort[MAX_PORT_LENGTH]; // Worker port
+    char sLocalIP[MAX_IP_LENGTH]; // "unix:/path" of pLocalConn, empty if none
+    DistortFunc pfDistort;     // Type-specific distortion engine
+    StreamDistortFunc pfDistortStream; // Optional streaming engine, tried first
+    ProgressTable* pProgress;  // Job progress shared with workers of this type on the host
+    const char* psEngine;      // Engine name and version, set by main; tags cached results
+    ResultCache* pCache;       // Results served again without running the engine, NULL if off
+    ResultCache* pOriginals;   // Inputs recently uploaded, not uploaded again, NULL if off
+    ResultCache* pAppends;     // Engine end states per file name, NULL if off
 } Worker;
 
 Worker* create_worker(const char* psConfigFile);
@@ -1,166 +1,157 @@
+/*********************************
+*
+* @File: Enigma.c
+* @Purpose: Text distortion worker implementation
+* @Author: Karol Korszun
+*
+*********************************/
+
 #include "worker.h"
 #include "utils.h"
-#include "protocol.h"
-#include <errno.h>
-#include <unistd.h>
+#include "cpu.h"
+#include <ctype.h>
 
-/*************************************************
-* @Name: register_with_gotham
-* @Def: Registers worker with Gotham server
-* @Arg: In: pWorker = Worker instance
-* @Ret: 0 on success, -1 on error
-*************************************************/
-int register_with_gotham(Worker* pWorker) {
-    if (!pWorker) {
-        vWriteLog("Error: Invalid worker\n");
-        return -1;
-    }
+#define TEXT_CHUNK_SIZE 4096
+#define ENGINE_VERSION "enigma/1"   // Bump when the output of the text engine changes
 
-    char data[DATA_SIZE];
-    if (snprintf(data, sizeof(data), "Text&%s&%s",
-                 pWorker->sIP, pWorker->sPort) < 0) {
-        vWriteLog("Error: Failed to create registration data\n");
-        return -1;
-    }
-
-    vWriteLog("Sending registration frame to Gotham\n");
+typedef struct {
+    size_t nMinLength;      // Words shorter than this are removed
+    char* psPending;        // Start of the current word while it is still too short
+    size_t nPending;        // Bytes held in psPending
+    int nIsKept;            // Current word already reached nMinLength
+} TextCarry;
 
-    // Send registration frame
-    Frame* frame = create_frame(FRAME_WORKER_REG, data, strlen(data));
-    if (send_frame(pWorker->pGothamConn, frame) != 0) {
-        free_frame(frame);
-        return -1;
-    }
-    free_frame(frame);
+typedef struct {
+    uint32_t nPending;
+    uint32_t nIsKept;
+} TextCheckpoint;           // Followed by the nPending carried bytes
 
-    // Wait for response
-    frame = receive_frame(pWorker->pGothamConn);
-    if (!frame) {
-        return -1;
-    }
-
-    // Check response
-    if (frame->type == FRAME_NEW_MAIN) {
-        vWriteLog("Registration successful as main worker\n");
-        pWorker->nIsMainWorker = 1;
-        free_frame(frame);
-        vWriteLog("Worker registered successfully\n");
-        return 0;
+/*************************************************
+* @Name: nDistortTextChunk
+* @Def: Removes words shorter than the factor from one chunk. A word cut
+*       by the chunk boundary is carried over in pCarry
+* @Arg: In: pCarry = word-boundary state
+*       In: pData = chunk
+*       In: nLen = chunk size
+*       Out: pOut = output, at least nLen + nMinLength bytes
+* @Ret: Bytes written to pOut
+*************************************************/
+static size_t nDistortTextChunk(TextCarry* pCarry, const char* pData, size_t nLen, char* pOut) {
+    size_t nOut = 0;
+
+    for (size_t i = 0; i < nLen; i++) {
+        char c = pData[i];
+        if (isspace((unsigned char)c)) {
+            /* A pending word ended before reaching the minimum: drop it */
+            pCarry->nPending = 0;
+            pCarry->nIsKept = 0;
+            pOut[nOut++] = c;
+        } else if (pCarry->nIsKept) {
+            pOut[nOut++] = c;
+        } else {
+            pCarry->psPending[pCarry->nPending++] = c;
+            if (pCarry->nPending >= pCarry->nMinLength) {
+                memcpy(pOut + nOut, pCarry->psPending, pCarry->nPending);
+                nOut += pCarry->nPending;
+                pCarry->nPending = 0;
+                pCarry->nIsKept = 1;
+            }
+        }
     }
-
-    free_frame(frame);
-    return -1;
+    return nOut;
 }
 
 /*************************************************
-* @Name: handle_client_connection
-* @Def: Handles connection from a Fleck client
-* @Arg: In: pWorker = Worker instance
-*       In: frame = Connection request frame
-* @Ret: 0 on success, -1 on error
+* @Name: vSaveTextCarry
+* @Def: Checkpoints the word-boundary state between chunks, or saves it at
+*       end of input. A short word pending there is not output, so it
+*       carries over into bytes appended later. Factors too large for a
+*       checkpoint simply recompute
+* @Arg: In: pCheckpoint = checkpoint handle
+*       In: pCarry = word-boundary state
+*       In: nIsEnd = input is complete
+* @Ret: None
 *************************************************/
-int handle_client_connection(Worker* pWorker, Frame* frame) {
-    // Parse connection data
-    char sUsername[64], sFilename[256], sFileSize[32], sMD5[33], sFactor[16];
-    if (sscanf(frame->data, "%[^&]&%[^&]&%[^&]&%[^&]&%s",
-               sUsername, sFilename, sFileSize, sMD5, sFactor) != 5) {
-        // Send connection rejection
-        Frame* response = create_frame(FRAME_WORKER_CONNECT, "CON_KO", 6);
-        send_frame(pWorker->pClientConn, response);
-        free_frame(response);
-        return -1;
+static void vSaveTextCarry(JobCheckpoint* pCheckpoint, const TextCarry* pCarry, int nIsEnd) {
+    unsigned char pState[PROGRESS_STATE_SIZE];
+    TextCheckpoint header = { (uint32_t)pCarry->nPending, (uint32_t)pCarry->nIsKept };
+    if (sizeof(header) + pCarry->nPending > sizeof(pState)) return;
+
+    memcpy(pState, &header, sizeof(header));
+    memcpy(pState + sizeof(header), pCarry->psPending, pCarry->nPending);
+    if (nIsEnd) {
+        vSaveEndState(pCheckpoint, pState, sizeof(header) + pCarry->nPending);
+    } else {
+        vSaveCheckpoint(pCheckpoint, pState, sizeof(header) + pCarry->nPending);
     }
-
-    vWriteLog("New request - ");
-    vWriteLog(sUsername);
-    vWriteLog(" wants to distort some text, with factor ");
-    vWriteLog(sFactor);
-    vWriteLog("\n");
-
-    // Accept connection
-    Frame* response = create_frame(FRAME_WORKER_CONNECT, NULL, 0);
-    send_frame(pWorker->pClientConn, response);
-    free_frame(response);
-
-    vWriteLog("Receiving original text...\n");
-    // For Phase 1/2, just simulate receiving and processing
-    vWriteLog("Distorting...\n");
-    sleep(1); // Simulate processing
-    vWriteLog("Sending distorted text to ");
-    vWriteLog(sUsername);
-    vWriteLog("...\n");
-
-    return 0;
 }
 
 /*************************************************
-* @Name: process_messages
-* @Def: Main message processing loop
-* @Arg: In: pWorker = Worker instance
-* @Ret: 0 on success, -1 on error
+* @Name: vRestoreTextCarry
+* @Def: Restores the word-boundary state after a takeover, or the one
+*       saved at the end of a file that has grown since
+* @Arg: In: pCheckpoint = checkpoint handle
+*       Out: pCarry = word-boundary state
+* @Ret: None
 *************************************************/
-int process_messages(Worker* pWorker) {
-    vWriteLog("Connected to Mr. J System, ready to listen to Fleck petitions\n");
-    vWriteLog("Waiting for connections...\n");
-
-    while (1) {
-        // Add debug message before receive
-        vWriteLog("Waiting for next frame...\n");
-
-        // Check connection status
-        if (!is_connected(pWorker->pGothamConn)) {
-            vWriteLog("Connection check failed - socket no longer connected\n");
-            break;
-        }
+static void vRestoreTextCarry(JobCheckpoint* pCheckpoint, TextCarry* pCarry) {
+    unsigned char pState[PROGRESS_STATE_SIZE];
+    TextCheckpoint header;
+    size_t nSize = nRestoreCheckpoint(pCheckpoint, pState, sizeof(pState));
+    if (nSize < sizeof(header)) return;
+
+    memcpy(&header, pState, sizeof(header));
+    if (header.nPending >= pCarry->nMinLength || sizeof(header) + header.nPending != nSize) return;
+    memcpy(pCarry->psPending, pState + sizeof(header), header.nPending);
+    pCarry->nPending = header.nPending;
+    pCarry->nIsKept = header.nIsKept != 0;
+}
 
-        Frame* frame = receive_frame(pWorker->pGothamConn);
-        if (!frame) {
-            char* psMsg;
-            asprintf(&psMsg, "Failed to receive frame (errno: %d)\n", errno);
-            vWriteLog(psMsg);
-            free(psMsg);
+/*************************************************
+* @Name: nDistortText
+* @Def: Streaming text engine. Output for each chunk is sent while the
+*       rest of the upload is still arriving
+* @Arg: In: psFileName = file being distorted
+*       In: psFactor = minimum word length
+*       In: pIn = input ring
+*       In: pOut = output ring
+*       In: pCheckpoint = checkpoint handle for takeovers
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nDistortText(const char* psFileName, const char* psFactor, Ring* pIn, Ring* pOut,
+                        JobCheckpoint* pCheckpoint) {
+    (void)psFileName;
+
+    int nFactor = atoi(psFactor);
+    TextCarry carry = { nFactor > 1 ? (size_t)nFactor : 1, NULL, 0, 0 };
+    carry.psPending = malloc(carry.nMinLength);
+    char* psIn = malloc(TEXT_CHUNK_SIZE);
+    char* psOut = malloc(TEXT_CHUNK_SIZE + carry.nMinLength);
+    if (!carry.psPending || !psIn || !psOut) {
+        free(carry.psPending);
+        free(psIn);
+        free(psOut);
+        return -1;
+    }
+    vRestoreTextCarry(pCheckpoint, &carry);
+
+    int nResult = 0;
+    ssize_t nBytes;
+    while ((nBytes = ring_read(pIn, psIn, TEXT_CHUNK_SIZE)) > 0) {
+        size_t nOut = nDistortTextChunk(&carry, psIn, (size_t)nBytes, psOut);
+        if (nOut > 0 && ring_write(pOut, psOut, nOut) < 0) {
+            nResult = -1;
             break;
         }
-
-        // Log received frame
-        char* psMsg;
-        asprintf(&psMsg, "Received frame - Type: 0x%02X, Length: %d\n",
-                frame->type, frame->data_length);
-        vWriteLog(psMsg);
-        free(psMsg);
-
-        switch (frame->type) {
-            case FRAME_NEW_MAIN:
-                vWriteLog("Assigned as main worker\n");
-                pWorker->nIsMainWorker = 1;
-                break;
-
-            case FRAME_WORKER_CONNECT:
-                vWriteLog("New user connected\n");
-                handle_client_connection(pWorker, frame);
-                break;
-
-            case FRAME_DISCONNECT:
-                vWriteLog("Received disconnect request\n");
-                free_frame(frame);
-                return 0;
-
-            default:
-                asprintf(&psMsg, "Received unexpected frame type: 0x%02X\n", frame->type);
-                vWriteLog(psMsg);
-                free(psMsg);
-
-                // Send error frame for unexpected types
-                Frame* error = create_frame(FRAME_ERROR, NULL, 0);
-                send_frame(pWorker->pGothamConn, error);
-                free_frame(error);
-                break;
-        }
-
-        free_frame(frame);
+        vSaveTextCarry(pCheckpoint, &carry, 0);
     }
+    if (nBytes < 0) nResult = -1;
+    if (nResult == 0) vSaveTextCarry(pCheckpoint, &carry, 1);
 
-    return -1;
+    free(carry.psPending);
+    free(psIn);
+    free(psOut);
+    return nResult;
 }
 
 int main(int nArgc, char* psArgv[]) {
@@ -169,8 +160,8 @@ int main(int nArgc, char* psArgv[]) {
         return 1;
     }
 
-    vWriteLog("Reading configuration file\n");
-    vWriteLog("Connecting Enigma worker to the system...\n");
+    vInitCpuDispatch();
+    vInitIoBackend();
 
     /* Create and initialize worker */
     Worker* pWorker = create_worker(psArgv[1]);
@@ -178,30 +169,14 @@ int main(int nArgc, char* psArgv[]) {
         vWriteLog("Failed to create worker\n");
         return 1;
     }
+    pWorker->pfDistortStream = nDistortText;
+    pWorker->psEngine = ENGINE_VERSION;
 
-    /* Register with Gotham */
-    if (register_with_gotham(pWorker) != 0) {
-        vWriteLog("Failed to register with Gotham\n");
-        destroy_worker(pWorker);
-        return 1;
-    }
-
-    /* Enter message processing loop */
-    int nResult = process_messages(pWorker);
+    /* Run worker */
+    int nResult = run_worker(pWorker);
 
     /* Cleanup */
-    if (pWorker->pGothamConn) {
-        vWriteLog("Lost connection to Gotham. Finishing current work...\n");
-
-        // Send disconnect notification
-        vWriteLog("Sending disconnect notification to Gotham\n");
-        Frame* frame = create_frame(FRAME_DISCONNECT, "Text", 4);
-        send_frame(pWorker->pGothamConn, frame);
-        free_frame(frame);
-
-        close_connection(pWorker->pGothamConn);
-    }
-
     destroy_worker(pWorker);
+
     return nResult;
-}
\ No newline at end of file
+}
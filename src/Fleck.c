@@ -11,24 +11,175 @@
 #include "config.h"
 #include "network.h"
 #include "utils.h"
+#include "cpu.h"
+#include "md5.h"
+#include "merkle.h"
+#include "delta.h"
+#include "pack.h"
 #include <pthread.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <errno.h>
 
 #define ERROR_MSG_COMMAND "ERROR: Please input a valid command.\n"
 #define ERROR_MSG_NOT_CONNECTED "Cannot distort, you are not connected to Mr. J System\n"
 #define ERROR_MSG_DISTORT_USAGE "Usage: DISTORT <file.xxx> <factor>\n"
+#define ERROR_MSG_NO_JOB "No such distortion, see STATUS\n"
 
 static FleckConfig gConfig;
 static int gnIsConnected = 0;
 static Connection *gpGothamConn = NULL;
-static Connection *gpWorkerConn = NULL;
-static char *psCurrentMediaType = NULL;
-static char *psCurrentFile = NULL;
-static char *psCurrentFactor = NULL;
+static volatile sig_atomic_t gnIsAborting = 0;  // CTRL+C: logout without waiting for the jobs
+static volatile sig_atomic_t gnIsLoggingOut = 0;  // LOGOUT is waiting for the jobs
+
+#define DOWNLOAD_DISTORT_KO -2
+#define DOWNLOAD_UPLOAD_KO -3
+#define MD5_MEMO_SIZE 8             // Input files whose MD5 is remembered between requests
+#define MD5_AHEAD_MAX (64UL * 1024 * 1024)  // Larger new inputs are hashed on the way, not read twice
+#define POOL_SIZE 4                 // Idle worker connections kept between requests
+#define PART_PREFIX ".distorted_"   // Output not yet checked, ".distorted_<file>.part"
+#define PART_SUFFIX ".part"
+
+typedef struct {
+    dev_t nDev;                 // File identity and state the MD5 was taken at;
+    ino_t nIno;                 // nIno 0 marks a free entry
+    off_t nSize;
+    struct timespec tChanged;
+    char sMD5[MD5_HEX_SIZE];
+} Md5Memo;
+
+static Md5Memo gMd5Memo[MD5_MEMO_SIZE];
+static int gnNextMemo = 0;
+static pthread_mutex_t gMemoMutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char sEndpoint[MAX_IP_LENGTH + MAX_PORT_LENGTH + 1];  // "ip&port"; pConn NULL marks a free slot
+    Connection *pConn;
+    time_t tIdleSince;
+} PooledConn;
+
+static PooledConn gPool[POOL_SIZE];
+static pthread_mutex_t gPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define JOB_WAITING 0               // Job states: Gotham has not assigned a worker yet
+#define JOB_RUNNING 1               // Transferring with its worker
+#define JOB_DONE 2                  // From here on the job is over
+#define JOB_FAILED 3
+#define JOB_CANCELLED 4
+
+/* A DISTORT command, run by a thread of its own so the prompt stays free */
+typedef struct FleckJob {
+    int nId;                    // Number the user refers to it by
+    char sFile[256];
+    char sFactor[32];
+    const char *psMediaType;    // "Text" or "Media"
+    char sMD5[MD5_HEX_SIZE];    // Input MD5 announced with the request
+    char sJobId[JOB_ID_LENGTH]; // Gotham's id for it, used to resume on another worker
+    char sWorker[MAX_IP_LENGTH + MAX_PORT_LENGTH + 1];  // "ip:port" it runs on, "" if none yet
+    char sLocalIP[MAX_IP_LENGTH];  // Worker's "unix:/path" Gotham named along, "" if none
+    Connection *pMux;           // Connection to the worker, carrying the job's stream
+    Connection *pConn;          // Stream of pMux the job runs on
+    int nState;                 // JOB_*; it and the fields above are guarded by gJobsMutex
+    int nIsCancelled;
+    unsigned long nSize;        // Input size, by which Gotham spreads a batch and sees if a result fits a cache
+    struct FleckLane *pLane;    // Batch worker whose connection it has a stream of, NULL if none
+    struct GothamRequest *pRequest;  // Batch request Gotham queued, answered later
+    struct FleckPack *pPack;    // Container the file travels in until it ends, NULL if none
+    struct FleckJob *pNext;
+} FleckJob;
+
+#define LANE_STREAMS 4  // Files of one worker's share of a batch in flight at once
+
+/* A worker Gotham gave several files of one batch: up to LANE_STREAMS of
+ * them run at once, each on a stream of one connection, and the worker
+ * stays reserved until the last one is through */
+typedef struct FleckLane {
+    char sIP[MAX_IP_LENGTH];
+    char sPort[MAX_PORT_LENGTH];
+    char sLocalIP[MAX_IP_LENGTH];
+    FleckJob **ppJobs;          // Its files, largest first
+    int nJobs;
+    int nNext;                  // File the next free stream takes
+    Connection *pMux;           // Shared by the files' streams, NULL before the first
+    int nIsUsed;                // A file was sent to the worker
+    int nIsLost;                // The connection went; the other files ask Gotham again
+    pthread_mutex_t mutex;      // Guards the fields above while the lane runs
+    struct FleckLane *pNext;
+} FleckLane;
+
+/* Files picked by one DISTORT of a glob or a LIST type */
+typedef struct {
+    FleckJob **ppJobs;
+    int nJobs;
+    unsigned int nBatch;        // Number Gotham groups the files by
+} FleckBatch;
+
+/* Small text files of a batch sent as one job. The container's own job
+ * is not in the job table; its pPack points back here, as the members' do */
+typedef struct FleckPack {
+    FleckJob job;
+    FleckJob **ppMembers;       // In the order of the container
+    int nMembers;
+} FleckPack;
+
+static unsigned int gnNextBatch = 0;
+
+static FleckJob *gpJobs = NULL;                 // Every job of the session, newest first
+static pthread_mutex_t gJobsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gJobsCond = PTHREAD_COND_INITIALIZER;    // Signalled when a job ends
+static int gnNextJobId = 0;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int nChunks;                // Chunks in the upload
+    char *pResend;              // Merkle mode: chunks NACKed by the worker, NULL otherwise
+    int nResend;                // Chunks marked in pResend
+    int nIsVerified;            // Worker confirmed every chunk and the root
+    int nIsBulk;                // Payload moves as raw BULK_DATA segments
+    int nIsHandoff;             // Worker took the files themselves; nothing is transferred
+    int nIsAnnounced;           // Input MD5 went with the request, no trailer follows the data
+    int nIsCached;              // Worker holds the result or the input; nothing is uploaded
+    char sMD5[MD5_HEX_SIZE];    // MD5 hashed on the way when not announced, "" until the upload ends
+} UploadControl;
+
+typedef struct {
+    Connection *pConn;          // Worker connection, read side only
+    const char *psPath;         // Where the distorted file is written
+    UploadControl *pUpload;     // Upload state fed by NACK and MD5_CHECK frames
+    unsigned long nOffset;      // Output bytes kept from an earlier attempt at the job
+    unsigned long nSizeHint;    // Input size, the first guess at the output size
+    volatile int nIsDone;       // Set when the download ends, stops the upload early
+    int nResult;                // 0 ok, -1 worker lost, DOWNLOAD_DISTORT_KO/UPLOAD_KO on worker error
+    int nIsIntact;              // Received MD5 matches the one announced in FILE_INFO
+} DownloadState;
+
+typedef struct GothamRequest {
+    unsigned int nId;           // Tag the request and its answers carry
+    Frame *pResponse;           // Answer with the tag stripped, NULL until it comes
+    int nIsWaiting;             // Gotham queued the request and said DISTORT_WAIT
+    struct GothamRequest *pNext;
+} GothamRequest;
+
+/* Requests in flight on the Gotham connection, answered by vMonitorGotham */
+static GothamRequest *gpRequests = NULL;
+static pthread_mutex_t gRequestMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gRequestCond = PTHREAD_COND_INITIALIZER;
+static unsigned int gnNextRequest = 0;
+static int gnIsGothamLost = 0;              // The reader saw the connection end
+static pthread_t gGothamReader;
+static int gnHasReader = 0;
+
+typedef struct {
+    const MappedFile *pFile;    // File being uploaded
+    DownloadState *pDownload;
+    unsigned long nLiteral;     // Bytes sent as they are
+} DeltaUpload;
 
 /* Function declarations */
 void vHandleConnect(void);
@@ -36,12 +187,42 @@ void vHandleLogout(void);
 void vListFiles(const char *psType);
 void vHandleCommand(char *psCommand);
 void vHandleDistort(const char *psFile, const char *psFactor);
+void vHandleStatus(void);
+void vHandleWait(int nId);
+void vHandleCancel(int nId);
 void vHandleGothamCrash(void);
-void vHandleWorkerCrash(void);
-void vConnectToWorker(const char* psIP, const char* psPort, const char* psFile, const char* psFactor);
-void vSimulateFileTransfer(void);
+int nHandleWorkerCrash(FleckJob *pJob);
+int nConnectToWorker(FleckJob *pJob, const char* psIP, const char* psPort, int nIsResume);
 void *vMonitorGotham(void *pvArg);
 void *vMonitorWorker(void *pvArg);
+static void vAwaitHandoff(DownloadState *pState);
+static void *vReceiveDistorted(void *pvArg);
+static int nUploadFile(const MappedFile *pFile, unsigned long nOffset, DownloadState *pDownload);
+static int nUploadDelta(const MappedFile *pFile, const DeltaIndex *pDelta, DownloadState *pDownload);
+static int nUploadMerkle(const MappedFile *pFile, int nHeldChunks, DownloadState *pDownload);
+static int nCheckAppend(Connection *pConn, const char *psPath, const char *psDistortedPath,
+                        const char *psPartPath, unsigned long *pnInOffset, unsigned long *pnOutOffset);
+static Connection *pTakePooled(const char *psIP, const char *psPort);
+static void vReturnPooled(const char *psIP, const char *psPort, Connection *pConn);
+static void vDrainPool(void);
+static void vCloseWorker(FleckJob *pJob);
+static void vReleaseWorker(const char *psIP, const char *psPort);
+static void vIdleWorker(const char *psIP, const char *psPort, Connection *pMux);
+static void *vRunJob(void *pvArg);
+static void *vRunBatch(void *pvArg);
+static void *vRunChunks(void *pvArg);
+static void *vRunLane(void *pvArg);
+static void *vRunLaneFiles(void *pvArg);
+static Connection *pLaneConnection(FleckLane *pLane);
+static void vLoseLane(FleckLane *pLane);
+static void *vRunQueued(void *pvArg);
+static void vHandleBatch(const char *psSelection, const char *psFactor);
+static void vJobMessage(const FleckJob *pJob, const char *psMessage);
+static void vFinishPack(FleckPack *pPack, int nResult);
+static int nAwaitAnswered(struct GothamRequest **ppRequests, int nCount);
+static GothamRequest *pSubmitRequest(uint8_t nType, const char *psData);
+static Frame *pAwaitRequest(GothamRequest *pRequest, const char *psWaitNotice);
+static void vStopGothamReader(void);
 void vHandleSigInt(int nSigNum);
 
 /*************************************************
@@ -58,6 +239,9 @@ int main(int nArgc, char *psArgv[]) {
     }
 
     signal(SIGINT, vHandleSigInt);
+    signal(SIGPIPE, SIG_IGN);   // A dead worker shows up as a failed send, then a resume
+    vInitCpuDispatch();
+    vInitIoBackend();
     load_fleck_config(psArgv[1], &gConfig);
     verify_directory(gConfig.sFolderPath);
 
@@ -123,13 +307,29 @@ void vHandleCommand(char *psCommand) {
             printF(ERROR_MSG_COMMAND);
         }
     } else if (strcmp(psToken, "DISTORT") == 0) {
-        char *psFile = strtok(NULL, " \n");
-        char *psFactor = strtok(NULL, " \n");
+        /* Arguments keep their original case: file names are case sensitive */
+        char *psArgs = strdup(psCommand);
+        char *psFile = psArgs ? strtok(psArgs, " \n") : NULL;
+        psFile = psFile ? strtok(NULL, " \n") : NULL;
+        char *psFactor = psFile ? strtok(NULL, " \n") : NULL;
         if (!psFile || !psFactor) {
             printF(ERROR_MSG_DISTORT_USAGE);
         } else {
             vHandleDistort(psFile, psFactor);
         }
+        free(psArgs);
+    } else if (strcmp(psToken, "STATUS") == 0) {
+        vHandleStatus();
+    } else if (strcmp(psToken, "WAIT") == 0 || strcmp(psToken, "CANCEL") == 0) {
+        int nIsWait = strcmp(psToken, "WAIT") == 0;
+        psToken = strtok(NULL, " \n");
+        if (!psToken) {
+            printF(ERROR_MSG_COMMAND);
+        } else if (nIsWait) {
+            vHandleWait(atoi(psToken));
+        } else {
+            vHandleCancel(atoi(psToken));
+        }
     } else {
         printF(ERROR_MSG_COMMAND);
     }
@@ -175,7 +375,9 @@ void vListFiles(const char *psType) {
         printF("Text files available:\n");
         while ((psEntry = readdir(pDir)) != NULL) {
             char *psExt = strrchr(psEntry->d_name, '.');
-            if (psExt != NULL && strcmp(psExt, ".txt") == 0) {
+            // Containers of a batch in flight are not the user's files
+            if (psExt != NULL && strcmp(psExt, ".txt") == 0 &&
+                strncmp(psEntry->d_name, PACK_PREFIX, strlen(PACK_PREFIX)) != 0) {
                 nCount++;
                 asprintf(&psMessage, "%d. %s\n", nCount, psEntry->d_name);
                 printF(psMessage);
@@ -225,7 +427,7 @@ void vHandleConnect(void) {
 
     // Send type 0x01 (FRAME_CONNECT_REQ)
     Frame* frame = create_frame(FRAME_CONNECT_REQ, sData, strlen(sData));
-    if (send_frame(gpGothamConn, frame) != 0) {
+    if (!send_frame(gpGothamConn, frame)) {
         free_frame(frame);
         close_connection(gpGothamConn);
         return;
@@ -248,6 +450,16 @@ void vHandleConnect(void) {
     }
     free_frame(response);
 
+    // From here one thread reads Gotham's answers, so requests can overlap
+    gnIsGothamLost = 0;
+    if (pthread_create(&gGothamReader, NULL, vMonitorGotham, NULL) != 0) {
+        printF("Failed to connect to Gotham\n");
+        close_connection(gpGothamConn);
+        gpGothamConn = NULL;
+        return;
+    }
+    gnHasReader = 1;
+
     gnIsConnected = 1;
     printF("Connected successfully\n");
 
@@ -264,38 +476,67 @@ void vHandleConnect(void) {
 *************************************************/
 void vHandleLogout(void) {
     if (gnIsConnected) {
+        // Distortions in progress are finished first, as they may still need
+        // Gotham; CTRL+C stops them instead, with a disconnect to their workers
+        gnIsLoggingOut = 1;
+        pthread_mutex_lock(&gJobsMutex);
+        int nIsNoticed = 0;
+        while (1) {
+            int nActive = 0;
+            for (FleckJob *pJob = gpJobs; pJob; pJob = pJob->pNext) {
+                if (pJob->nState < JOB_DONE) nActive++;
+            }
+            if (nActive == 0 || gnIsAborting) break;
+            if (!nIsNoticed) {
+                char sMsg[128];
+                snprintf(sMsg, sizeof(sMsg), "Waiting for %d distortion(s) to finish, CTRL+C stops them\n", nActive);
+                printF(sMsg);
+                nIsNoticed = 1;
+            }
+            // Woken by each finished job; the timeout notices CTRL+C
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&gJobsCond, &gJobsMutex, &deadline);
+        }
+        for (FleckJob *pJob = gpJobs; gnIsAborting && pJob; pJob = pJob->pNext) {
+            // Packed files stop their container, the first of them reaching it
+            FleckJob *pRun = pJob->pPack ? &pJob->pPack->job : pJob;
+            if (pJob->nState >= JOB_DONE || (!pRun->pMux && !pRun->pConn)) continue;
+            pJob->nIsCancelled = 1;
+            if (pRun->nIsCancelled) continue;
+            pRun->nIsCancelled = 1;
+            if (!pRun->pMux) {
+                // A stream of a lane's connection, which its lane closes
+                reset_stream(pRun->pConn);
+                continue;
+            }
+            Frame* frame = create_frame(FRAME_DISCONNECT, gConfig.sUsername, strlen(gConfig.sUsername));
+            if (send_frame(pRun->pMux, frame)) {
+                vWriteLog("Sent disconnect frame to worker\n");
+            }
+            free_frame(frame);
+            shutdown(pRun->pMux->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&gJobsMutex);
+
         // Create proper disconnect frame
         Frame* frame = create_frame(FRAME_DISCONNECT, gConfig.sUsername, strlen(gConfig.sUsername));
-        if (send_frame(gpGothamConn, frame) == 0) {
+        if (send_frame(gpGothamConn, frame)) {
             vWriteLog("Sent disconnect frame to Gotham\n");
         }
         free_frame(frame);
 
-        // If connected to a worker, send disconnect there too
-        if (gpWorkerConn) {
-            frame = create_frame(FRAME_DISCONNECT, gConfig.sUsername, strlen(gConfig.sUsername));
-            if (send_frame(gpWorkerConn, frame) == 0) {
-                vWriteLog("Sent disconnect frame to worker\n");
-            }
-            free_frame(frame);
-            close_connection(gpWorkerConn);
-            gpWorkerConn = NULL;
-        }
+        // Pooled workers get a disconnect too
+        vDrainPool();
 
+        vStopGothamReader();
         close_connection(gpGothamConn);
         gpGothamConn = NULL;
         gnIsConnected = 0;
     }
     printF("Thanks for using Mr. J System, see you soon, chaos lover :)\n");
     exit(0);
-
-    // Free distortion parameters
-    free(psCurrentMediaType);
-    free(psCurrentFile);
-    free(psCurrentFactor);
-    psCurrentMediaType = NULL;
-    psCurrentFile = NULL;
-    psCurrentFactor = NULL;
 }
 
 /*************************************************
@@ -306,7 +547,9 @@ void vHandleLogout(void) {
 *************************************************/
 void vHandleSigInt(int nSigNum) {
     (void)nSigNum;
-    vHandleLogout();
+    gnIsAborting = 1;
+    // A LOGOUT waiting for its jobs sees the flag and stops them itself
+    if (!gnIsLoggingOut) vHandleLogout();
 }
 
 /*************************************************
@@ -321,15 +564,139 @@ int nIsValidFactor(const char *psFactor) {
     return *psEndptr == '\0' && dValue > 0 && dValue <= 10;
 }
 
+/*************************************************
+* @Name: vRememberMd5
+* @Def: Remembers the MD5 of an input file in the state it was taken at
+* @Arg: In: pSt = file state
+*       In: psMD5 = MD5
+* @Ret: None
+*************************************************/
+static void vRememberMd5(const struct stat *pSt, const char *psMD5) {
+    pthread_mutex_lock(&gMemoMutex);
+    Md5Memo *pMemo = &gMd5Memo[gnNextMemo];
+    for (int i = 0; i < MD5_MEMO_SIZE; i++) {
+        if (gMd5Memo[i].nIno == pSt->st_ino && gMd5Memo[i].nDev == pSt->st_dev) pMemo = &gMd5Memo[i];
+    }
+    if (pMemo == &gMd5Memo[gnNextMemo]) gnNextMemo = (gnNextMemo + 1) % MD5_MEMO_SIZE;
+    pMemo->nDev = pSt->st_dev;
+    pMemo->nIno = pSt->st_ino;
+    pMemo->nSize = pSt->st_size;
+    pMemo->tChanged = pSt->st_ctim;
+    snprintf(pMemo->sMD5, MD5_HEX_SIZE, "%s", psMD5);
+    pthread_mutex_unlock(&gMemoMutex);
+}
+
+/*************************************************
+* @Name: vInputMd5
+* @Def: MD5 of an input file, announced with the request so a worker
+*       holding its result can be found. Repeated requests for an
+*       unchanged file reuse the MD5 taken the first time, or hashed by
+*       its upload. A new file above MD5_AHEAD_MAX is not read ahead but
+*       hashed while it is uploaded; one seen before in another version
+*       still is, since a worker may continue or patch that version
+* @Arg: In: psPath = input file
+*       Out: sMD5 = MD5, or MD5_DEFERRED if it is hashed on the way
+* @Ret: None
+*************************************************/
+static void vInputMd5(const char *psPath, char sMD5[MD5_HEX_SIZE]) {
+    snprintf(sMD5, MD5_HEX_SIZE, "%s", MD5_DEFERRED);
+    int fd = open(psPath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    int nIsSeen = 0;
+    pthread_mutex_lock(&gMemoMutex);
+    for (int i = 0; i < MD5_MEMO_SIZE; i++) {
+        Md5Memo *pMemo = &gMd5Memo[i];
+        if (pMemo->nIno != st.st_ino || pMemo->nDev != st.st_dev) continue;
+        nIsSeen = 1;
+        if (pMemo->nSize == st.st_size && pMemo->tChanged.tv_sec == st.st_ctim.tv_sec &&
+            pMemo->tChanged.tv_nsec == st.st_ctim.tv_nsec) {
+            snprintf(sMD5, MD5_HEX_SIZE, "%s", pMemo->sMD5);
+            pthread_mutex_unlock(&gMemoMutex);
+            close(fd);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&gMemoMutex);
+
+    MappedFile input;
+    if ((nIsSeen || (unsigned long)st.st_size <= MD5_AHEAD_MAX) && nMapInput(&input, fd) == 0) {
+        Md5Context md5;
+        vMd5Init(&md5);
+        vMd5Update(&md5, input.pData, input.nMapped);
+        vMd5FinalHex(&md5, sMD5);
+        vUnmapFile(&input);
+        vRememberMd5(&st, sMD5);
+    }
+    close(fd);
+}
+
+/*************************************************
+* @Name: psMediaTypeOf
+* @Def: Tells the media type of a file from its extension
+* @Arg: In: psFile = file name
+* @Ret: "Text" or "Media", NULL if the format is not supported
+*************************************************/
+static const char *psMediaTypeOf(const char *psFile) {
+    const char *psExt = strrchr(psFile, '.');
+    if (!psExt) return NULL;
+    if (strcasecmp(psExt, ".txt") == 0) return "Text";
+    if (strcasecmp(psExt, ".wav") == 0 || strcasecmp(psExt, ".jpg") == 0 || strcasecmp(psExt, ".png") == 0) {
+        return "Media";
+    }
+    return NULL;
+}
+
+/*************************************************
+* @Name: nIsDistorting
+* @Def: Whether a job on the file is still going. Two would write the
+*       same distorted_ file. Caller holds gJobsMutex
+* @Arg: In: psFile = file name
+* @Ret: 1 if one is, 0 otherwise
+*************************************************/
+static int nIsDistorting(const char *psFile) {
+    for (FleckJob *pJob = gpJobs; pJob; pJob = pJob->pNext) {
+        if (pJob->nState < JOB_DONE && strcmp(pJob->sFile, psFile) == 0) return 1;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nSpawn
+* @Def: Starts a detached thread for job work. CTRL+C is left to the
+*       main thread, which is never inside the job table for long; the
+*       thread and its helper threads inherit the mask
+* @Arg: In: pfRun = thread function
+*       In: pvArg = its argument
+* @Ret: 0 on success, -1 otherwise
+*************************************************/
+static int nSpawn(void *(*pfRun)(void *), void *pvArg) {
+    sigset_t sigint, saved;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, &saved);
+    pthread_t thread;
+    int nFailed = pthread_create(&thread, NULL, pfRun, pvArg) != 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (nFailed) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
 /*************************************************
 * @Name: vHandleDistort
-* @Def: Handles distortion request
+* @Def: Handles distortion request: checks it and starts it as a job in
+*       the background, so the prompt returns at once
 * @Arg: In: psFile = file to distort
 *       In: psFactor = distortion factor
 * @Ret: None
 *************************************************/
 void vHandleDistort(const char *psFile, const char *psFactor) {
-    char sMsg[256];
+    char sMsg[512];
     snprintf(sMsg, sizeof(sMsg), "\n=== Starting Distortion Request ===\n");
     vWriteLog(sMsg);
 
@@ -342,424 +709,2380 @@ void vHandleDistort(const char *psFile, const char *psFactor) {
         return;
     }
 
-    // Convert filename to lowercase for extension check
-    char sLowerFile[256];
-    strncpy(sLowerFile, psFile, sizeof(sLowerFile)-1);
-    sLowerFile[sizeof(sLowerFile)-1] = '\0';
-    for(int i = 0; sLowerFile[i]; i++) {
-        sLowerFile[i] = tolower(sLowerFile[i]);
+    // A glob or a LIST type picks several files at once
+    if (strpbrk(psFile, "*?[") || strcasecmp(psFile, "TEXT") == 0 || strcasecmp(psFile, "MEDIA") == 0) {
+        vHandleBatch(psFile, psFactor);
+        return;
     }
 
     // Determine media type from extension
-    char *psExt = strrchr(sLowerFile, '.');
-    if (!psExt) {
+    if (!strrchr(psFile, '.')) {
         printF("Invalid file format\n");
         return;
     }
-
-    char *psMediaType;
-    if (strcmp(psExt, ".txt") == 0) {
-        psMediaType = "Text";
-    } else if (strcmp(psExt, ".wav") == 0 ||
-               strcmp(psExt, ".jpg") == 0 ||
-               strcmp(psExt, ".png") == 0) {
-        psMediaType = "Media";
-    } else {
+    const char *psMediaType = psMediaTypeOf(psFile);
+    if (!psMediaType) {
         printF("Unsupported file format\n");
         return;
     }
 
-    // Send distortion request to Gotham
-    char data[DATA_SIZE];
-    snprintf(data, sizeof(data), "%s&%s", psMediaType, psFile);
-    Frame* frame = create_frame(FRAME_DISTORT_REQ, data, strlen(data));
-
-    vWriteLog("Sending distortion request to Gotham\n");
-
-    if (send_frame(gpGothamConn, frame) != 0) {
-        vWriteLog("Failed to send distortion request\n");
-        free_frame(frame);
-        vHandleGothamCrash();
+    FleckJob *pJob = calloc(1, sizeof(FleckJob));
+    if (!pJob) {
+        printF("Memory allocation failed\n");
         return;
     }
-    free_frame(frame);
-
-    vWriteLog("Waiting for worker info from Gotham\n");
-
-    // Wait for worker info from Gotham with increased timeout
-    struct timeval tv;
-    tv.tv_sec = SOCKET_TIMEOUT_SEC;
-    tv.tv_usec = 0;
-
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(gpGothamConn->fd, &readfds);
-
-    int ready = select(gpGothamConn->fd + 1, &readfds, NULL, NULL, &tv);
-    if (ready <= 0) {
-        vWriteLog("Timeout/error waiting for Gotham response\n");
-        vHandleGothamCrash();
+    snprintf(pJob->sFile, sizeof(pJob->sFile), "%s", psFile);
+    snprintf(pJob->sFactor, sizeof(pJob->sFactor), "%s", psFactor);
+    snprintf(pJob->sMD5, sizeof(pJob->sMD5), "%s", MD5_DEFERRED);
+    pJob->psMediaType = psMediaType;
+    pJob->nState = JOB_WAITING;
+
+    pthread_mutex_lock(&gJobsMutex);
+    if (nIsDistorting(pJob->sFile)) {
+        pthread_mutex_unlock(&gJobsMutex);
+        free(pJob);
+        printF("Error: This file is already being distorted\n");
         return;
     }
-
-    Frame* response = receive_frame(gpGothamConn);
-    if (!response) {
-        vWriteLog("Failed to receive response from Gotham\n");
-        vHandleGothamCrash();
+    pJob->nId = ++gnNextJobId;
+    if (nSpawn(vRunJob, pJob) != 0) {
+        pthread_mutex_unlock(&gJobsMutex);
+        free(pJob);
+        printF("Failed to start the distortion\n");
         return;
     }
+    pJob->pNext = gpJobs;
+    gpJobs = pJob;
+    pthread_mutex_unlock(&gJobsMutex);
 
-    vWriteLog("Received response from Gotham\n");
+    snprintf(sMsg, sizeof(sMsg), "Distortion %d started: %s with factor %s\n", pJob->nId, psFile, psFactor);
+    printF(sMsg);
+}
 
-    if (response->type != FRAME_DISTORT_REQ) {
-        vWriteLog("Received unexpected frame type\n");
-        free_frame(response);
-        vHandleGothamCrash();
-        return;
-    }
+/*************************************************
+* @Name: nByName
+* @Def: qsort comparator ordering batch jobs by file name
+* @Arg: In: pvA, pvB = FleckJob pointers
+* @Ret: Comparison result
+*************************************************/
+static int nByName(const void *pvA, const void *pvB) {
+    return strcmp((*(FleckJob * const *)pvA)->sFile, (*(FleckJob * const *)pvB)->sFile);
+}
 
-    // Check for error responses
-    if (response->data_length == 9 && strcmp(response->data, "DISTORT_KO") == 0) {
-        vWriteLog("No available worker for this media type\n");
-        printF("Error: No available worker of this type is currently connected\n");
-        free_frame(response);
+/*************************************************
+* @Name: vHandleBatch
+* @Def: Starts a job for every file of the folder a glob matches, or
+*       that LIST TEXT or LIST MEDIA shows, earlier distorted_ results
+*       aside. Gotham assigns the whole batch at once, or each
+*       DISTORT_BATCH_MAX files of a larger one
+* @Arg: In: psSelection = glob, or "TEXT" or "MEDIA"
+*       In: psFactor = distortion factor
+* @Ret: None
+*************************************************/
+static void vHandleBatch(const char *psSelection, const char *psFactor) {
+    char sMsg[512];
+    const char *psType = strcasecmp(psSelection, "TEXT") == 0 ? "Text" :
+                         strcasecmp(psSelection, "MEDIA") == 0 ? "Media" : NULL;
+
+    DIR *pDir = opendir(gConfig.sFolderPath);
+    if (!pDir) {
+        snprintf(sMsg, sizeof(sMsg), "Error opening directory %s\n", gConfig.sFolderPath);
+        printF(sMsg);
         return;
     }
 
-    if (response->data_length == 8 && strcmp(response->data, "MEDIA_KO") == 0) {
-        vWriteLog("Invalid media type for request\n");
-        printF("Error: Invalid media type\n");
-        free_frame(response);
-        return;
+    FleckJob **ppJobs = NULL;
+    int nJobs = 0, nCapacity = 0;
+    struct dirent *psEntry;
+    while ((psEntry = readdir(pDir)) != NULL) {
+        const char *psName = psEntry->d_name;
+        const char *psMediaType = psMediaTypeOf(psName);
+        if (psName[0] == '.' || strncmp(psName, "distorted_", 10) == 0 || !psMediaType ||
+            strlen(psName) >= sizeof(ppJobs[0]->sFile)) {
+            continue;
+        }
+        if (psType ? strcmp(psMediaType, psType) != 0 : fnmatch(psSelection, psName, 0) != 0) continue;
+
+        char sPath[1024];
+        struct stat st;
+        snprintf(sPath, sizeof(sPath), "%s/%s", gConfig.sFolderPath, psName);
+        if (stat(sPath, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        if (nJobs == nCapacity) {
+            nCapacity = nCapacity ? nCapacity * 2 : 16;
+            FleckJob **ppGrown = realloc(ppJobs, nCapacity * sizeof(FleckJob *));
+            if (!ppGrown) break;
+            ppJobs = ppGrown;
+        }
+        FleckJob *pJob = calloc(1, sizeof(FleckJob));
+        if (!pJob) break;
+        snprintf(pJob->sFile, sizeof(pJob->sFile), "%s", psName);
+        snprintf(pJob->sFactor, sizeof(pJob->sFactor), "%s", psFactor);
+        snprintf(pJob->sMD5, sizeof(pJob->sMD5), "%s", MD5_DEFERRED);
+        pJob->psMediaType = psMediaType;
+        pJob->nSize = st.st_size;
+        pJob->nState = JOB_WAITING;
+        ppJobs[nJobs++] = pJob;
     }
+    closedir(pDir);
 
-    // Parse worker IP and port
-    char sWorkerIP[MAX_IP_LENGTH];
-    char sWorkerPort[MAX_PORT_LENGTH];
-    if (sscanf(response->data, "%[^&]&%s", sWorkerIP, sWorkerPort) != 2) {
-        vWriteLog("Failed to parse worker info\n");
-        printF("Error: Invalid worker info received\n");
-        free_frame(response);
+    if (nJobs > 0) qsort(ppJobs, nJobs, sizeof(FleckJob *), nByName);
+
+    // Files being distorted already are left out
+    pthread_mutex_lock(&gJobsMutex);
+    int nKept = 0;
+    for (int i = 0; i < nJobs; i++) {
+        if (nIsDistorting(ppJobs[i]->sFile)) {
+            snprintf(sMsg, sizeof(sMsg), "Error: %s is already being distorted\n", ppJobs[i]->sFile);
+            printF(sMsg);
+            free(ppJobs[i]);
+            continue;
+        }
+        ppJobs[nKept++] = ppJobs[i];
+    }
+    nJobs = nKept;
+
+    // Linked before the batch thread starts, which rearranges ppJobs. A
+    // selection Gotham does not take as one batch goes in several
+    FleckJob *pHead = gpJobs;
+    FleckBatch *pBatch = nJobs > 0 ? malloc(sizeof(FleckBatch)) : NULL;
+    if (pBatch) {
+        pBatch->ppJobs = ppJobs;
+        pBatch->nJobs = nJobs;
+        pBatch->nBatch = nJobs <= DISTORT_BATCH_MAX ? ++gnNextBatch : 0;
+        for (int i = 0; i < nJobs; i++) {
+            ppJobs[i]->nId = gnNextJobId + 1 + i;
+            ppJobs[i]->pNext = gpJobs;
+            gpJobs = ppJobs[i];
+        }
+    }
+    if (!pBatch || nSpawn(pBatch->nBatch ? vRunBatch : vRunChunks, pBatch) != 0) {
+        gpJobs = pHead;
+        pthread_mutex_unlock(&gJobsMutex);
+        for (int i = 0; i < nJobs; i++) free(ppJobs[i]);
+        free(ppJobs);
+        free(pBatch);
+        printF(nJobs > 0 ? "Failed to start the distortion\n" : "No files match the selection\n");
         return;
     }
+    gnNextJobId += nJobs;
+    pthread_mutex_unlock(&gJobsMutex);
 
-    // Log the worker info we received
-    snprintf(sMsg, sizeof(sMsg), "Received worker info - IP: %s, Port: %s\n",
-             sWorkerIP, sWorkerPort);
-    vWriteLog(sMsg);
+    snprintf(sMsg, sizeof(sMsg), "Distortions %d to %d started: %d files with factor %s\n",
+             gnNextJobId - nJobs + 1, gnNextJobId, nJobs, psFactor);
+    printF(sMsg);
+}
 
-    // Store current distortion parameters for crash recovery
-    free(psCurrentMediaType);  // Free previous values if any
-    free(psCurrentFile);
-    free(psCurrentFactor);
-    psCurrentMediaType = strdup(psMediaType);
-    psCurrentFile = strdup(psFile);
-    psCurrentFactor = strdup(psFactor);
+/*************************************************
+* @Name: nIsPackJob
+* @Def: Whether a job is the transfer of a container, not a file
+* @Arg: In: pJob = job
+* @Ret: 1 if it is, 0 otherwise
+*************************************************/
+static int nIsPackJob(const FleckJob *pJob) {
+    return pJob->pPack && &pJob->pPack->job == pJob;
+}
 
-    // Connect to worker and handle distortion
-    vConnectToWorker(sWorkerIP, sWorkerPort, psFile, psFactor);
+/*************************************************
+* @Name: vJobMessage
+* @Def: Shows a message about a job, which may end long after the
+*       command that started it
+* @Arg: In: pJob = job
+*       In: psMessage = message, ending in a newline
+* @Ret: None
+*************************************************/
+static void vJobMessage(const FleckJob *pJob, const char *psMessage) {
+    char sMsg[512];
+    if (nIsPackJob(pJob)) {
+        snprintf(sMsg, sizeof(sMsg), "[%d packed files] %s", pJob->pPack->nMembers, psMessage);
+    } else {
+        snprintf(sMsg, sizeof(sMsg), "[%d %s] %s", pJob->nId, pJob->sFile, psMessage);
+    }
+    printF(sMsg);
+}
 
-    free_frame(response);
+/*************************************************
+* @Name: vPartPath
+* @Def: Path a job's output is received at until it is checked
+* @Arg: Out: psPath = path
+*       In: nSize = size of psPath
+*       In: psFile = file distorted
+* @Ret: None
+*************************************************/
+static void vPartPath(char *psPath, size_t nSize, const char *psFile) {
+    snprintf(psPath, nSize, "%s/" PART_PREFIX "%s" PART_SUFFIX, gConfig.sFolderPath, psFile);
 }
 
 /*************************************************
-* @Name: vHandleGothamCrash
-* @Def: Handles Gotham server crash
-* @Arg: None
+* @Name: vFinishJob
+* @Def: Records how a job ended and wakes WAIT and LOGOUT. A container
+*       ends the jobs of its files
+* @Arg: In: pJob = finished job
+*       In: nResult = 0 if the distorted file is in place
 * @Ret: None
 *************************************************/
-void vHandleGothamCrash(void) {
-    printF("Lost connection to Gotham. Shutting down...\n");
-    if (gpWorkerConn) {
-        close_connection(gpWorkerConn);
-        gpWorkerConn = NULL;
+static void vFinishJob(FleckJob *pJob, int nResult) {
+    /* What a failed or cancelled job received is no result */
+    if (nResult != 0) {
+        char sPartPath[1024];
+        vPartPath(sPartPath, sizeof(sPartPath), pJob->sFile);
+        unlink(sPartPath);
     }
-    if (gpGothamConn) {
-        close_connection(gpGothamConn);
-        gpGothamConn = NULL;
+    if (nIsPackJob(pJob)) {
+        vFinishPack(pJob->pPack, nResult);
+        return;
     }
-    gnIsConnected = 0;
-    exit(1);
+
+    pthread_mutex_lock(&gJobsMutex);
+    pJob->nState = nResult == 0 ? JOB_DONE : pJob->nIsCancelled ? JOB_CANCELLED : JOB_FAILED;
+    pJob->sWorker[0] = '\0';
+    pJob->pPack = NULL;
+
+    // Told before WAIT or LOGOUT carry on
+    if (pJob->nState == JOB_DONE) {
+        char sMsg[512];
+        snprintf(sMsg, sizeof(sMsg), "Distorted into distorted_%s\n", pJob->sFile);
+        vJobMessage(pJob, sMsg);
+    } else if (pJob->nState == JOB_CANCELLED) {
+        vJobMessage(pJob, "Distortion cancelled\n");
+    }
+    pthread_cond_broadcast(&gJobsCond);
+    pthread_mutex_unlock(&gJobsMutex);
 }
 
 /*************************************************
-* @Name: vHandleWorkerCrash
-* @Def: Handles worker crash during distortion
-* @Arg: None
+* @Name: nUnpackMember
+* @Def: Takes the next file out of a distorted container and writes it
+*       into its distorted_ file, unless its job was cancelled
+* @Arg: In: pMember = job of the file expected next
+*       In/Out: ppData = rest of the container
+*       In/Out: pnLeft = bytes left in it
+*       Out: pnResult = 0 if the distorted file is in place, -1 otherwise
+* @Ret: 0 if the container held the file, -1 if it is not valid
+*************************************************/
+static int nUnpackMember(FleckJob *pMember, const char **ppData, size_t *pnLeft, int *pnResult) {
+    *pnResult = -1;
+    const char *pEnd = memchr(*ppData, '\n', *pnLeft < PACK_LINE_SIZE ? *pnLeft : PACK_LINE_SIZE);
+    if (!pEnd) return -1;
+
+    char sLine[PACK_LINE_SIZE];
+    size_t nLine = pEnd - *ppData + 1;
+    memcpy(sLine, *ppData, nLine - 1);
+    sLine[nLine - 1] = '\0';
+    char *psName = NULL;
+    unsigned long nSize = strtoul(sLine, &psName, 10);
+    if (psName == sLine || *psName != ' ' || strcmp(psName + 1, pMember->sFile) != 0 || nSize > *pnLeft - nLine) {
+        return -1;
+    }
+    const char *pBody = *ppData + nLine;
+    *ppData = pBody + nSize;
+    *pnLeft -= nLine + nSize;
+
+    pthread_mutex_lock(&gJobsMutex);
+    int nIsCancelled = pMember->nIsCancelled;
+    pthread_mutex_unlock(&gJobsMutex);
+    if (nIsCancelled) return 0;
+
+    char sPath[1024];
+    snprintf(sPath, sizeof(sPath), "%s/distorted_%s", gConfig.sFolderPath, pMember->sFile);
+    int fd = open(sPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        vJobMessage(pMember, "Error: Could not write the distorted file\n");
+        return 0;
+    }
+    if (nSize == 0 || write(fd, pBody, nSize) == (ssize_t)nSize) *pnResult = 0;
+    close(fd);
+    return 0;
+}
+
+/*************************************************
+* @Name: vFinishPack
+* @Def: Ends the jobs of the files of a container once it is back,
+*       unpacking the distorted container into their distorted_ files,
+*       then removes both containers
+* @Arg: In: pPack = container, freed here
+*       In: nResult = 0 if the distorted container is in place
 * @Ret: None
 *************************************************/
-void vHandleWorkerCrash(void) {
-    printF("Lost connection to worker. Attempting to resume distortion...\n");
+static void vFinishPack(FleckPack *pPack, int nResult) {
+    char sPath[1024];
+    char sResultPath[1024];
+    snprintf(sPath, sizeof(sPath), "%s/%s", gConfig.sFolderPath, pPack->job.sFile);
+    snprintf(sResultPath, sizeof(sResultPath), "%s/distorted_%s", gConfig.sFolderPath, pPack->job.sFile);
+
+    MappedFile result = { -1, NULL, 0 };
+    int fd = nResult == 0 ? open(sResultPath, O_RDONLY) : -1;
+    int nIsMapped = fd >= 0 && nMapInput(&result, fd) == 0;
+    const char *pData = result.pData;
+    size_t nLeft = nIsMapped ? result.nMapped : 0;
+    int nIsValid = nLeft >= strlen(PACK_MAGIC) && memcmp(pData, PACK_MAGIC, strlen(PACK_MAGIC)) == 0;
+    if (nIsValid) {
+        pData += strlen(PACK_MAGIC);
+        nLeft -= strlen(PACK_MAGIC);
+    } else if (nResult == 0) {
+        vJobMessage(&pPack->job, "Error: Invalid distorted container\n");
+    }
 
-    if (gpWorkerConn) {
-        close_connection(gpWorkerConn);
-        gpWorkerConn = NULL;
+    for (int i = 0; i < pPack->nMembers; i++) {
+        int nMemberResult = -1;
+        if (nIsValid && nUnpackMember(pPack->ppMembers[i], &pData, &nLeft, &nMemberResult) != 0) {
+            vJobMessage(&pPack->job, "Error: Invalid distorted container\n");
+            nIsValid = 0;
+        }
+        vFinishJob(pPack->ppMembers[i], nMemberResult);
     }
 
-    // Send resume request to Gotham
+    if (nIsMapped) vUnmapFile(&result);
+    if (fd >= 0) close(fd);
+    unlink(sPath);
+    unlink(sResultPath);
+    free(pPack->ppMembers);
+    free(pPack);
+}
+
+/*************************************************
+* @Name: pRequestWorker
+* @Def: Asks Gotham for a worker for a job, tagged, so other jobs'
+*       requests are in flight next to it: "type&file&md5&factor&size",
+*       the MD5 and factor letting Gotham pick a worker that holds the
+*       result, the size whether one can keep it
+* @Arg: In: pJob = job, its MD5 taken
+* @Ret: Request to await, NULL if it could not be made
+*************************************************/
+static GothamRequest *pRequestWorker(FleckJob *pJob) {
     char data[DATA_SIZE];
-    snprintf(data, sizeof(data), "%s&%s", psCurrentMediaType, psCurrentFile);
-    Frame* frame = create_frame(FRAME_RESUME_REQ, data, strlen(data));
+    if (snprintf(data, sizeof(data), "%s&%s&%s&%s&%lu", pJob->psMediaType, pJob->sFile,
+                 pJob->sMD5, pJob->sFactor, pJob->nSize) >= (int)sizeof(data)) {
+        vJobMessage(pJob, "Error: File name too long\n");
+        return NULL;
+    }
 
-    if (send_frame(gpGothamConn, frame) != 0) {
-        vWriteLog("Failed to send resume request\n");
-        free_frame(frame);
+    vWriteLog("Sending distortion request to Gotham\n");
+
+    GothamRequest* pRequest = pSubmitRequest(FRAME_DISTORT_REQ, data);
+    if (!pRequest) {
+        vWriteLog("Failed to send distortion request\n");
         vHandleGothamCrash();
-        return;
     }
-    free_frame(frame);
+    return pRequest;
+}
 
-    // Wait for new worker info
-    Frame* response = receive_frame(gpGothamConn);
-    if (!response) {
-        vWriteLog("Failed to receive resume response\n");
-        vHandleGothamCrash();
-        return;
+/*************************************************
+* @Name: nParseAnswer
+* @Def: Reads Gotham's answer to a DISTORT_REQ, telling the user why a
+*       job gets no worker
+* @Arg: In: pJob = job asked for, takes the job id
+*       In: response = answer with the tag stripped
+*       Out: psIP = worker IP, MAX_IP_LENGTH bytes
+*       Out: psPort = worker port, MAX_PORT_LENGTH bytes
+* @Ret: 0 if a worker was named, -1 otherwise
+*************************************************/
+static int nParseAnswer(FleckJob *pJob, const Frame *response, char *psIP, char *psPort) {
+    char sMsg[512];
+    char sJobId[JOB_ID_LENGTH];
+    char sLocalIP[MAX_IP_LENGTH] = "";
+
+    if (response->type != FRAME_DISTORT_REQ) {
+        vWriteLog("Received unexpected frame type\n");
+        vJobMessage(pJob, "Error: Unexpected answer from Gotham\n");
+        return -1;
+    }
+    if (response->data_length == 10 && strcmp(response->data, "DISTORT_KO") == 0) {
+        vWriteLog("No available worker for this media type\n");
+        vJobMessage(pJob, "Error: No available worker of this type is currently connected\n");
+        return -1;
+    }
+    if (response->data_length == 8 && strcmp(response->data, "MEDIA_KO") == 0) {
+        vWriteLog("Invalid media type for request\n");
+        vJobMessage(pJob, "Error: Invalid media type\n");
+        return -1;
+    }
+    // Parse worker IP, port, the job id used to resume on another worker
+    // and the worker's unix socket, if it has one
+    if (sscanf(response->data, "%127[^&]&%5[^&]&%23[^&]&%127s", psIP, psPort, sJobId, sLocalIP) < 3) {
+        vWriteLog("Failed to parse worker info\n");
+        vJobMessage(pJob, "Error: Invalid worker info received\n");
+        return -1;
     }
 
-    if (response->type != FRAME_RESUME_REQ) {
-        vWriteLog("Received unexpected frame type for resume\n");
-        free_frame(response);
+    // Log the worker info we received
+    snprintf(sMsg, sizeof(sMsg), "Received worker info - IP: %s, Port: %s\n", psIP, psPort);
+    vWriteLog(sMsg);
+
+    pthread_mutex_lock(&gJobsMutex);
+    snprintf(pJob->sJobId, sizeof(pJob->sJobId), "%s", sJobId);
+    snprintf(pJob->sLocalIP, sizeof(pJob->sLocalIP), "%s", sLocalIP);
+    pthread_mutex_unlock(&gJobsMutex);
+    return 0;
+}
+
+/*************************************************
+* @Name: nAwaitWorker
+* @Def: Waits for the worker Gotham names for a job and transfers with
+*       it. A job cancelled before it got the worker hands the worker back
+* @Arg: In: pJob = job
+*       In: pRequest = its request to Gotham
+* @Ret: 0 once the distorted file is in place, -1 otherwise
+*************************************************/
+static int nAwaitWorker(FleckJob *pJob, GothamRequest *pRequest) {
+    char sMsg[512];
+
+    vWriteLog("Waiting for worker info from Gotham\n");
+
+    // A request Gotham cannot serve yet, because every worker is busy or
+    // another user runs the same job, is answered once that changes
+    snprintf(sMsg, sizeof(sMsg), "[%d %s] Workers are busy or running the same distortion, waiting for one\n",
+             pJob->nId, pJob->sFile);
+    Frame* response = pAwaitRequest(pRequest, sMsg);
+    if (!response) {
+        vWriteLog("Timeout/error waiting for Gotham response\n");
         vHandleGothamCrash();
-        return;
+        return -1;
     }
 
-    // Check for error responses
-    if (strcmp(response->data, "DISTORT_KO") == 0) {
-        vWriteLog("No available worker to resume distortion\n");
-        printF("Error: No available worker to resume distortion\n");
-        free_frame(response);
-        return;
-    }
+    vWriteLog("Received response from Gotham\n");
 
-    // Parse new worker info and reconnect
+    int nResult = -1;
     char sWorkerIP[MAX_IP_LENGTH];
     char sWorkerPort[MAX_PORT_LENGTH];
-    if (sscanf(response->data, "%[^&]&%s", sWorkerIP, sWorkerPort) != 2) {
-        vWriteLog("Failed to parse new worker info\n");
-        free_frame(response);
-        return;
+    if (nParseAnswer(pJob, response, sWorkerIP, sWorkerPort) == 0) {
+        pthread_mutex_lock(&gJobsMutex);
+        int nIsCancelled = pJob->nIsCancelled;
+        if (!nIsCancelled) pJob->nState = JOB_RUNNING;
+        pthread_mutex_unlock(&gJobsMutex);
+
+        // Connect to worker and handle distortion
+        if (nIsCancelled) {
+            vReleaseWorker(sWorkerIP, sWorkerPort);
+        } else {
+            nResult = nConnectToWorker(pJob, sWorkerIP, sWorkerPort, 0);
+        }
     }
-
     free_frame(response);
-
-    // Connect to new worker
-    vConnectToWorker(sWorkerIP, sWorkerPort, psCurrentFile, psCurrentFactor);
+    return nResult;
 }
 
 /*************************************************
-* @Name: vMonitorGotham
-* @Def: Monitors Gotham connection for crashes
-* @Arg: In: pvArg = thread argument (unused)
+* @Name: vRunJob
+* @Def: Runs a job: hashes the input, asks Gotham for a worker and
+*       transfers with it
+* @Arg: In: pvArg = FleckJob pointer, kept in the job table
 * @Ret: NULL
 *************************************************/
-void *vMonitorGotham(void *pvArg) {
-    (void)pvArg;
+static void *vRunJob(void *pvArg) {
+    FleckJob *pJob = (FleckJob *)pvArg;
 
-    while (gnIsConnected) {
-        // Use timeout to avoid blocking forever
-        Frame* frame = receive_frame(gpGothamConn);
-        if (!frame) {
-            // Only handle crash if we're still connected
-            if (gnIsConnected) {
-                vHandleGothamCrash();
-            }
-            break;
-        }
-        sleep(1);
-    }
+    char sFilePath[1024];
+    snprintf(sFilePath, sizeof(sFilePath), "%s/%s", gConfig.sFolderPath, pJob->sFile);
+    struct stat st;
+    if (stat(sFilePath, &st) == 0) pJob->nSize = st.st_size;
+    vInputMd5(sFilePath, pJob->sMD5);
+
+    GothamRequest *pRequest = pRequestWorker(pJob);
+    vFinishJob(pJob, pRequest ? nAwaitWorker(pJob, pRequest) : -1);
     return NULL;
 }
 
 /*************************************************
-* @Name: vMonitorWorker
-* @Def: Monitors worker connection for crashes
-* @Arg: In: pvArg = thread argument (unused)
-* @Ret: NULL
+* @Name: nReadSmall
+* @Def: Reads a file of the folder to be packed
+* @Arg: In: psFile = file name
+*       Out: pData = contents, PACK_MEMBER_MAX bytes
+* @Ret: Bytes read, -1 if it cannot be read or has grown too large
 *************************************************/
-void *vMonitorWorker(void *pvArg) {
-    (void)pvArg;
-    char sBuffer[2];
-
-    while (gpWorkerConn) {
-        if (receive_data(gpWorkerConn, sBuffer, 1) <= 0) {
-            vHandleWorkerCrash();
-            break;
-        }
-        sleep(1);
+static ssize_t nReadSmall(const char *psFile, char *pData) {
+    char sPath[1024];
+    snprintf(sPath, sizeof(sPath), "%s/%s", gConfig.sFolderPath, psFile);
+    int fd = open(sPath, O_RDONLY);
+    if (fd < 0) return -1;
+
+    size_t nRead = 0;
+    ssize_t nBytes = 1;
+    while (nBytes > 0 && nRead < PACK_MEMBER_MAX) {
+        nBytes = read(fd, pData + nRead, PACK_MEMBER_MAX - nRead);
+        if (nBytes > 0) nRead += nBytes;
     }
-    return NULL;
+    char cExtra;
+    int nIsWhole = nBytes >= 0 && read(fd, &cExtra, 1) == 0;
+    close(fd);
+    return nIsWhole ? (ssize_t)nRead : -1;
 }
 
 /*************************************************
-* @Name: vConnectToWorker
-* @Def: Connects to worker and handles distortion
-* @Arg: In: psIP = worker IP
-*       In: psPort = worker port
-*       In: psFile = file to distort
-*       In: psFactor = distortion factor
+* @Name: pWritePack
+* @Def: Writes a container into the folder as a hidden file, and makes
+*       the job that sends it in place of its files' jobs
+* @Arg: In: nBatch = batch number
+*       In: nPack = container number within the batch
+*       In: ppMembers = jobs of its files
+*       In: nMembers = number of them
+*       In: pData = container
+*       In: nSize = its size
+* @Ret: Container job, NULL if it could not be written
+*************************************************/
+static FleckJob *pWritePack(unsigned int nBatch, int nPack, FleckJob **ppMembers, int nMembers,
+                            const char *pData, size_t nSize) {
+    FleckPack *pPack = calloc(1, sizeof(FleckPack));
+    FleckJob **ppCopy = malloc(nMembers * sizeof(FleckJob *));
+    if (!pPack || !ppCopy) {
+        free(pPack);
+        free(ppCopy);
+        return NULL;
+    }
+
+    FleckJob *pJob = &pPack->job;
+    char sPath[1024];
+    snprintf(pJob->sFile, sizeof(pJob->sFile), PACK_PREFIX "%d_%u_%d.txt", (int)getpid(), nBatch, nPack);
+    snprintf(sPath, sizeof(sPath), "%s/%s", gConfig.sFolderPath, pJob->sFile);
+    int fd = open(sPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ssize_t nWritten = fd >= 0 ? write(fd, pData, nSize) : -1;
+    if (fd >= 0) close(fd);
+    if (nWritten != (ssize_t)nSize) {
+        if (fd >= 0) unlink(sPath);
+        free(pPack);
+        free(ppCopy);
+        return NULL;
+    }
+
+    memcpy(ppCopy, ppMembers, nMembers * sizeof(FleckJob *));
+    snprintf(pJob->sFactor, sizeof(pJob->sFactor), "%s", ppMembers[0]->sFactor);
+    snprintf(pJob->sMD5, sizeof(pJob->sMD5), "%s", MD5_DEFERRED);
+    pJob->psMediaType = "Text";
+    pJob->nSize = nSize;
+    pJob->nState = JOB_WAITING;
+    pJob->pPack = pPack;
+    pPack->ppMembers = ppCopy;
+    pPack->nMembers = nMembers;
+
+    pthread_mutex_lock(&gJobsMutex);
+    for (int i = 0; i < nMembers; i++) ppMembers[i]->pPack = pPack;
+    pthread_mutex_unlock(&gJobsMutex);
+
+    char sMsg[512];
+    snprintf(sMsg, sizeof(sMsg), "Packed %d files into %s\n", nMembers, pJob->sFile);
+    vWriteLog(sMsg);
+    return pJob;
+}
+
+/*************************************************
+* @Name: nPlacePack
+* @Def: Puts the job of a container into the batch, or its files' own
+*       jobs if there are too few of them or it cannot be written
+* @Arg: In: ppJobs = jobs of the batch
+*       In: nKept = jobs in it so far
+*       In: nBatch = batch number
+*       In: nPack = container number within the batch
+*       In: ppMembers = jobs of its files
+*       In: nMembers = number of them
+*       In: pData = container
+*       In: nSize = its size
+* @Ret: Jobs in the batch now
+*************************************************/
+static int nPlacePack(FleckJob **ppJobs, int nKept, unsigned int nBatch, int nPack, FleckJob **ppMembers,
+                      int nMembers, const char *pData, size_t nSize) {
+    FleckJob *pPackJob = nMembers >= PACK_MIN_MEMBERS ? pWritePack(nBatch, nPack, ppMembers, nMembers, pData, nSize)
+                                                      : NULL;
+    if (pPackJob) {
+        ppJobs[nKept++] = pPackJob;
+        return nKept;
+    }
+    for (int i = 0; i < nMembers; i++) ppJobs[nKept++] = ppMembers[i];
+    return nKept;
+}
+
+/*************************************************
+* @Name: nPackBatch
+* @Def: Packs the small text files of a batch into containers of up to
+*       PACK_MAX_SIZE bytes, each sent as one job: for thousands of tiny
+*       files the requests and handshakes of a job each would cost more
+*       than their bytes. Larger files and media keep their own jobs
+* @Arg: In/Out: ppJobs = jobs of the batch, the containers' replacing their files'
+*       In: nJobs = number of them
+*       In: nBatch = batch number
+* @Ret: Jobs in the batch now
+*************************************************/
+static int nPackBatch(FleckJob **ppJobs, int nJobs, unsigned int nBatch) {
+    const char *psPack = getenv(PACK_ENV);
+    if (psPack && strcmp(psPack, "0") == 0) return nJobs;
+
+    FleckJob **ppSmall = malloc(nJobs * sizeof(FleckJob *));
+    char *pBuffer = malloc(PACK_MAX_SIZE);
+    char *pData = malloc(PACK_MEMBER_MAX);
+    if (!ppSmall || !pBuffer || !pData) {
+        free(ppSmall);
+        free(pBuffer);
+        free(pData);
+        return nJobs;
+    }
+
+    int nKept = 0, nSmall = 0;
+    for (int i = 0; i < nJobs; i++) {
+        FleckJob *pJob = ppJobs[i];
+        if (strcmp(pJob->psMediaType, "Text") == 0 && pJob->nSize <= PACK_MEMBER_MAX && !strchr(pJob->sFile, '\n')) {
+            ppSmall[nSmall++] = pJob;
+        } else {
+            ppJobs[nKept++] = pJob;
+        }
+    }
+    if (nSmall < PACK_MIN_MEMBERS) {
+        memcpy(ppJobs + nKept, ppSmall, nSmall * sizeof(FleckJob *));
+        nKept += nSmall;
+        nSmall = 0;
+    }
+
+    // The files of the container being filled are moved to ppSmall[nFirst...]
+    int nFirst = 0, nMembers = 0, nPacks = 0;
+    size_t nUsed = 0;
+    for (int i = 0; i < nSmall; i++) {
+        FleckJob *pJob = ppSmall[i];
+        ssize_t nRead = nReadSmall(pJob->sFile, pData);
+        if (nRead < 0) {
+            ppJobs[nKept++] = pJob;
+            continue;
+        }
+        char sIndex[PACK_LINE_SIZE];
+        size_t nIndex = snprintf(sIndex, sizeof(sIndex), PACK_MEMBER_FORMAT, (unsigned long)nRead, pJob->sFile);
+        if (nMembers > 0 && nUsed + nIndex + nRead > PACK_MAX_SIZE) {
+            nKept = nPlacePack(ppJobs, nKept, nBatch, ++nPacks, ppSmall + nFirst, nMembers, pBuffer, nUsed);
+            nMembers = 0;
+        }
+        if (nMembers == 0) {
+            nFirst = i;
+            nUsed = strlen(PACK_MAGIC);
+            memcpy(pBuffer, PACK_MAGIC, nUsed);
+        }
+        memcpy(pBuffer + nUsed, sIndex, nIndex);
+        memcpy(pBuffer + nUsed + nIndex, pData, nRead);
+        nUsed += nIndex + nRead;
+        ppSmall[nFirst + nMembers++] = pJob;
+    }
+    if (nMembers > 0) {
+        nKept = nPlacePack(ppJobs, nKept, nBatch, ++nPacks, ppSmall + nFirst, nMembers, pBuffer, nUsed);
+    }
+
+    free(ppSmall);
+    free(pBuffer);
+    free(pData);
+    return nKept;
+}
+
+/*************************************************
+* @Name: vRunBatch
+* @Def: Runs a batch: packs its small text files, hashes every input,
+*       sends Gotham one DISTORT_BATCH request per file or container and
+*       waits until all are answered at once. The files given the same
+*       worker share one connection to it, several at a time, each
+*       worker's from a thread of its own; files Gotham queued, as no
+*       worker of their type was free, run like single jobs
+* @Arg: In: pvArg = FleckBatch pointer, freed here
+* @Ret: NULL
+*************************************************/
+static void *vRunBatch(void *pvArg) {
+    FleckBatch *pBatch = (FleckBatch *)pvArg;
+    FleckJob **ppJobs = pBatch->ppJobs;
+    int nJobs = nPackBatch(ppJobs, pBatch->nJobs, pBatch->nBatch);
+    GothamRequest **ppRequests = calloc(nJobs, sizeof(GothamRequest *));
+    char data[DATA_SIZE];
+
+    int nCount = 0;
+    for (int i = 0; i < nJobs; i++) {
+        char sFilePath[1024];
+        snprintf(sFilePath, sizeof(sFilePath), "%s/%s", gConfig.sFolderPath, ppJobs[i]->sFile);
+        vInputMd5(sFilePath, ppJobs[i]->sMD5);
+        // Counted with the largest count the batch may have
+        if (!ppRequests ||
+            snprintf(data, sizeof(data), DISTORT_BATCH "&%u&%d&%s&%s&%s&%s&%lu", pBatch->nBatch, nJobs,
+                     ppJobs[i]->psMediaType, ppJobs[i]->sFile, ppJobs[i]->sMD5, ppJobs[i]->sFactor,
+                     ppJobs[i]->nSize) >= (int)sizeof(data) - REQUEST_TAG_LENGTH) {
+            vJobMessage(ppJobs[i], ppRequests ? "Error: File name too long\n" : "Memory allocation failed\n");
+            vFinishJob(ppJobs[i], -1);
+            ppJobs[i] = NULL;
+            continue;
+        }
+        nCount++;
+    }
+
+    for (int i = 0; i < nJobs; i++) {
+        if (!ppJobs[i] ||
+            snprintf(data, sizeof(data), DISTORT_BATCH "&%u&%d&%s&%s&%s&%s&%lu", pBatch->nBatch, nCount,
+                     ppJobs[i]->psMediaType, ppJobs[i]->sFile, ppJobs[i]->sMD5, ppJobs[i]->sFactor,
+                     ppJobs[i]->nSize) >= (int)sizeof(data)) {
+            continue;
+        }
+        ppRequests[i] = pSubmitRequest(FRAME_DISTORT_REQ, data);
+        if (!ppRequests[i]) {
+            vWriteLog("Failed to send distortion request\n");
+            vHandleGothamCrash();
+        }
+    }
+    if (nCount > 0 && nAwaitAnswered(ppRequests, nJobs) != 0) {
+        vWriteLog("Timeout/error waiting for Gotham response\n");
+        vHandleGothamCrash();
+    }
+
+    FleckLane *pLanes = NULL;
+    for (int i = 0; i < nJobs; i++) {
+        FleckJob *pJob = ppJobs[i];
+        if (!pJob) continue;
+        if (!ppRequests[i]->pResponse) {
+            pJob->pRequest = ppRequests[i];
+            if (nSpawn(vRunQueued, pJob) != 0) vRunQueued(pJob);
+            continue;
+        }
+
+        // Answered already, this returns at once
+        Frame *response = pAwaitRequest(ppRequests[i], NULL);
+        char sWorkerIP[MAX_IP_LENGTH];
+        char sWorkerPort[MAX_PORT_LENGTH];
+        int nIsNamed = response && nParseAnswer(pJob, response, sWorkerIP, sWorkerPort) == 0;
+        if (response) free_frame(response);
+        if (!nIsNamed) {
+            vFinishJob(pJob, -1);
+            continue;
+        }
+
+        FleckLane *pLane = pLanes;
+        while (pLane && (strcmp(pLane->sIP, sWorkerIP) != 0 || strcmp(pLane->sPort, sWorkerPort) != 0)) {
+            pLane = pLane->pNext;
+        }
+        if (!pLane && (pLane = calloc(1, sizeof(FleckLane))) != NULL) {
+            snprintf(pLane->sIP, sizeof(pLane->sIP), "%s", sWorkerIP);
+            snprintf(pLane->sPort, sizeof(pLane->sPort), "%s", sWorkerPort);
+            snprintf(pLane->sLocalIP, sizeof(pLane->sLocalIP), "%s", pJob->sLocalIP);
+            pLane->ppJobs = malloc(nJobs * sizeof(FleckJob *));
+            pLane->pNext = pLanes;
+            pLanes = pLane;
+        }
+        if (!pLane || !pLane->ppJobs) {
+            vJobMessage(pJob, "Memory allocation failed\n");
+            vFinishJob(pJob, -1);
+            continue;
+        }
+        pLane->ppJobs[pLane->nJobs++] = pJob;
+    }
+
+    while (pLanes) {
+        FleckLane *pLane = pLanes;
+        pLanes = pLane->pNext;
+        if (!pLane->ppJobs) {
+            free(pLane);
+            continue;
+        }
+        if (nSpawn(vRunLane, pLane) != 0) vRunLane(pLane);
+    }
+
+    free(ppRequests);
+    free(ppJobs);
+    free(pBatch);
+    return NULL;
+}
+
+/*************************************************
+* @Name: vRunChunks
+* @Def: Runs a selection larger than DISTORT_BATCH_MAX as consecutive
+*       batches. Each starts once the files of the one before ended, so
+*       Gotham's job history still holds every file that may be resumed
+* @Arg: In: pvArg = FleckBatch pointer with the whole selection, freed here
+* @Ret: NULL
+*************************************************/
+static void *vRunChunks(void *pvArg) {
+    FleckBatch *pAll = (FleckBatch *)pvArg;
+
+    for (int nFirst = 0; nFirst < pAll->nJobs; nFirst += DISTORT_BATCH_MAX) {
+        int nChunk = pAll->nJobs - nFirst < DISTORT_BATCH_MAX ? pAll->nJobs - nFirst : DISTORT_BATCH_MAX;
+        FleckBatch *pBatch = malloc(sizeof(FleckBatch));
+        FleckJob **ppChunk = malloc(nChunk * sizeof(FleckJob *));
+        if (!pBatch || !ppChunk) {
+            free(pBatch);
+            free(ppChunk);
+            for (int i = nFirst; i < nFirst + nChunk; i++) {
+                vJobMessage(pAll->ppJobs[i], "Memory allocation failed\n");
+                vFinishJob(pAll->ppJobs[i], -1);
+            }
+            continue;
+        }
+        memcpy(ppChunk, pAll->ppJobs + nFirst, nChunk * sizeof(FleckJob *));
+        pBatch->ppJobs = ppChunk;
+        pBatch->nJobs = nChunk;
+        pthread_mutex_lock(&gJobsMutex);
+        pBatch->nBatch = ++gnNextBatch;
+        pthread_mutex_unlock(&gJobsMutex);
+        vRunBatch(pBatch);
+
+        pthread_mutex_lock(&gJobsMutex);
+        for (int i = nFirst; i < nFirst + nChunk; i++) {
+            while (pAll->ppJobs[i]->nState < JOB_DONE) pthread_cond_wait(&gJobsCond, &gJobsMutex);
+        }
+        pthread_mutex_unlock(&gJobsMutex);
+    }
+
+    free(pAll->ppJobs);
+    free(pAll);
+    return NULL;
+}
+
+/*************************************************
+* @Name: nBySizeDesc
+* @Def: qsort comparator putting the largest jobs first
+* @Arg: In: pvA, pvB = FleckJob pointers
+* @Ret: Comparison result
+*************************************************/
+static int nBySizeDesc(const void *pvA, const void *pvB) {
+    const FleckJob *pA = *(FleckJob * const *)pvA;
+    const FleckJob *pB = *(FleckJob * const *)pvB;
+    return (pA->nSize < pB->nSize) - (pA->nSize > pB->nSize);
+}
+
+/*************************************************
+* @Name: vRunLane
+* @Def: Runs the files of a batch Gotham gave one worker, largest first,
+*       up to LANE_STREAMS at once on one connection, then frees the
+*       worker. Once that connection is lost the worker may serve someone
+*       else, so the remaining files ask Gotham for a worker each
+* @Arg: In: pvArg = FleckLane pointer, freed here
+* @Ret: NULL
+*************************************************/
+static void *vRunLane(void *pvArg) {
+    FleckLane *pLane = (FleckLane *)pvArg;
+    qsort(pLane->ppJobs, pLane->nJobs, sizeof(FleckJob *), nBySizeDesc);
+    pthread_mutex_init(&pLane->mutex, NULL);
+
+    // This thread is one of the streams; the others join it
+    pthread_t pThreads[LANE_STREAMS - 1];
+    int nThreads = 0;
+    while (nThreads < LANE_STREAMS - 1 && nThreads < pLane->nJobs - 1 &&
+           pthread_create(&pThreads[nThreads], NULL, vRunLaneFiles, pLane) == 0) {
+        nThreads++;
+    }
+    vRunLaneFiles(pLane);
+    for (int i = 0; i < nThreads; i++) pthread_join(pThreads[i], NULL);
+
+    if (pLane->pMux && pLane->nIsLost) {
+        close_connection(pLane->pMux);
+    } else if (pLane->pMux) {
+        vIdleWorker(pLane->sIP, pLane->sPort, pLane->pMux);
+    } else if (!pLane->nIsUsed) {
+        vReleaseWorker(pLane->sIP, pLane->sPort);
+    }
+    pthread_mutex_destroy(&pLane->mutex);
+    free(pLane->ppJobs);
+    free(pLane);
+    return NULL;
+}
+
+/*************************************************
+* @Name: vRunLaneFiles
+* @Def: One stream of a lane: runs the lane's next file until none is left
+* @Arg: In: pvArg = FleckLane pointer
+* @Ret: NULL
+*************************************************/
+static void *vRunLaneFiles(void *pvArg) {
+    FleckLane *pLane = (FleckLane *)pvArg;
+
+    for (;;) {
+        pthread_mutex_lock(&pLane->mutex);
+        FleckJob *pJob = pLane->nNext < pLane->nJobs ? pLane->ppJobs[pLane->nNext++] : NULL;
+        int nIsLost = pLane->nIsLost;
+        pthread_mutex_unlock(&pLane->mutex);
+        if (!pJob) break;
+
+        pthread_mutex_lock(&gJobsMutex);
+        int nIsCancelled = pJob->nIsCancelled;
+        if (!nIsCancelled && !nIsLost) pJob->nState = JOB_RUNNING;
+        pthread_mutex_unlock(&gJobsMutex);
+
+        int nResult = -1;
+        if (nIsCancelled) {
+            // Nothing was sent for it
+        } else if (nIsLost) {
+            GothamRequest *pRequest = pRequestWorker(pJob);
+            if (pRequest) nResult = nAwaitWorker(pJob, pRequest);
+        } else {
+            pJob->pLane = pLane;
+            nResult = nConnectToWorker(pJob, pLane->sIP, pLane->sPort, 0);
+            pJob->pLane = NULL;
+        }
+        vFinishJob(pJob, nResult);
+    }
+    return NULL;
+}
+
+/*************************************************
+* @Name: pConnectWorker
+* @Def: Connects to a worker, over its unix socket when that is on this
+*       host. The socket's name carries a token the worker drew at start,
+*       so finding and reaching it proves the worker local; Gotham cannot
+*       tell from addresses, which NAT makes alike. Otherwise, or when
+*       that connect fails, the worker is reached over TCP
+* @Arg: In: psIP = worker IP
+*       In: psPort = worker port
+*       In: psLocalIP = worker's "unix:/path", "" if none
+* @Ret: Connection, or NULL on failure
+*************************************************/
+static Connection *pConnectWorker(const char *psIP, const char *psPort, const char *psLocalIP) {
+    struct stat st;
+    Connection *pConn = NULL;
+
+    if (is_unix_endpoint(psLocalIP) && stat(psLocalIP + strlen(UNIX_ENDPOINT), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        pConn = connect_to_server(psLocalIP, atoi(psPort));
+        if (!pConn) vWriteLog("Worker's unix socket unreachable, connecting over TCP\n");
+    }
+    return pConn ? pConn : connect_to_server(psIP, atoi(psPort));
+}
+
+/*************************************************
+* @Name: pLaneConnection
+* @Def: Connection a lane's files open their streams on; the first file
+*       reuses a pooled one or connects
+* @Arg: In: pLane = lane
+* @Ret: Connection, or NULL once it is lost
+*************************************************/
+static Connection *pLaneConnection(FleckLane *pLane) {
+    pthread_mutex_lock(&pLane->mutex);
+    if (!pLane->pMux && !pLane->nIsLost) {
+        Connection *pMux = pTakePooled(pLane->sIP, pLane->sPort);
+        if (pMux) {
+            vWriteLog("Reusing the pooled connection to the worker\n");
+        } else {
+            pMux = pConnectWorker(pLane->sIP, pLane->sPort, pLane->sLocalIP);
+            if (pMux && !enable_mux(pMux, NULL, NULL, 0)) {
+                close_connection(pMux);
+                pMux = NULL;
+            }
+        }
+        pLane->pMux = pMux;
+        pLane->nIsUsed = 1;
+        pLane->nIsLost = pMux == NULL;
+    }
+    Connection *pMux = pLane->nIsLost ? NULL : pLane->pMux;
+    pthread_mutex_unlock(&pLane->mutex);
+    return pMux;
+}
+
+/*************************************************
+* @Name: vLoseLane
+* @Def: Gives up a lane's connection after one of its files failed on it.
+*       The worker stays reserved while the connection is open, so it is
+*       cut before that file, or any other of the lane, asks Gotham for a
+*       worker; the streams still on it fail and do the same
+* @Arg: In: pLane = lane
+* @Ret: None
+*************************************************/
+static void vLoseLane(FleckLane *pLane) {
+    pthread_mutex_lock(&pLane->mutex);
+    pLane->nIsLost = 1;
+    if (pLane->pMux) shutdown(pLane->pMux->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&pLane->mutex);
+}
+
+/*************************************************
+* @Name: vRunQueued
+* @Def: Runs a file of a batch Gotham queued until a worker frees up
+* @Arg: In: pvArg = FleckJob pointer, its request in pRequest
+* @Ret: NULL
+*************************************************/
+static void *vRunQueued(void *pvArg) {
+    FleckJob *pJob = (FleckJob *)pvArg;
+    GothamRequest *pRequest = pJob->pRequest;
+    pJob->pRequest = NULL;
+    vFinishJob(pJob, nAwaitWorker(pJob, pRequest));
+    return NULL;
+}
+
+/*************************************************
+* @Name: vHandleStatus
+* @Def: Lists the jobs of the session and their state
+* @Arg: None
+* @Ret: None
+*************************************************/
+void vHandleStatus(void) {
+    static const char *psStates[] = { "waiting for a worker", "running", "done", "failed", "cancelled" };
+
+    pthread_mutex_lock(&gJobsMutex);
+    if (!gpJobs) printF("No distortions yet\n");
+    for (FleckJob *pJob = gpJobs; pJob; pJob = pJob->pNext) {
+        // A packed file goes as far as its container
+        const FleckJob *pRun = pJob->pPack ? &pJob->pPack->job : pJob;
+        char sMsg[512];
+        int nLen = snprintf(sMsg, sizeof(sMsg), "%d: %s factor %s - %s", pJob->nId, pJob->sFile,
+                            pJob->sFactor, pJob->nIsCancelled && pJob->nState < JOB_DONE ? "cancelling"
+                                                                                          : psStates[pRun->nState]);
+        if (pRun->nState == JOB_RUNNING && pRun->sWorker[0] != '\0') {
+            nLen += snprintf(sMsg + nLen, sizeof(sMsg) - nLen, " on %s%s", pRun->sWorker,
+                             pRun != pJob ? ", packed" : "");
+        }
+        snprintf(sMsg + nLen, sizeof(sMsg) - nLen, "\n");
+        printF(sMsg);
+    }
+    pthread_mutex_unlock(&gJobsMutex);
+}
+
+/*************************************************
+* @Name: pFindJob
+* @Def: Looks a job up by the number shown for it. Caller holds gJobsMutex
+* @Arg: In: nId = job number
+* @Ret: Job, or NULL if there is none
+*************************************************/
+static FleckJob *pFindJob(int nId) {
+    for (FleckJob *pJob = gpJobs; pJob; pJob = pJob->pNext) {
+        if (pJob->nId == nId) return pJob;
+    }
+    return NULL;
+}
+
+/*************************************************
+* @Name: vHandleWait
+* @Def: Blocks the prompt until a job is over
+* @Arg: In: nId = job number
+* @Ret: None
+*************************************************/
+void vHandleWait(int nId) {
+    pthread_mutex_lock(&gJobsMutex);
+    FleckJob *pJob = pFindJob(nId);
+    while (pJob && pJob->nState < JOB_DONE) pthread_cond_wait(&gJobsCond, &gJobsMutex);
+    int nState = pJob ? pJob->nState : -1;
+    pthread_mutex_unlock(&gJobsMutex);
+
+    if (nState < 0) {
+        printF(ERROR_MSG_NO_JOB);
+    } else if (nState != JOB_DONE) {
+        printF(nState == JOB_CANCELLED ? "Distortion was cancelled\n" : "Distortion failed\n");
+    }
+}
+
+/*************************************************
+* @Name: vHandleCancel
+* @Def: Stops a job. One that has a worker has its connection cut, or its
+*       stream of a lane's connection reset, which the worker takes as the
+*       end of the job; one still waiting for a
+*       worker gives it back as soon as Gotham names it. A packed file is
+*       left out when its container comes back, which is stopped only
+*       once all its files are
+* @Arg: In: nId = job number
+* @Ret: None
+*************************************************/
+void vHandleCancel(int nId) {
+    pthread_mutex_lock(&gJobsMutex);
+    FleckJob *pJob = pFindJob(nId);
+    int nIsOver = pJob && pJob->nState >= JOB_DONE;
+    if (pJob && !nIsOver) {
+        pJob->nIsCancelled = 1;
+        FleckJob *pRun = pJob->pPack ? &pJob->pPack->job : pJob;
+        for (int i = 0; pJob->pPack && i < pJob->pPack->nMembers; i++) {
+            if (!pJob->pPack->ppMembers[i]->nIsCancelled) pRun = NULL;
+        }
+        if (pRun) pRun->nIsCancelled = 1;
+        if (pRun && pRun->pMux) shutdown(pRun->pMux->fd, SHUT_RDWR);
+        else if (pRun && pRun->pConn) reset_stream(pRun->pConn);
+    }
+    pthread_mutex_unlock(&gJobsMutex);
+
+    if (!pJob) {
+        printF(ERROR_MSG_NO_JOB);
+    } else if (nIsOver) {
+        printF("Distortion is already over\n");
+    } else {
+        vWriteLog("Distortion cancelled by the user\n");
+    }
+}
+
+/*************************************************
+* @Name: vHandleGothamCrash
+* @Def: Handles Gotham server crash
+* @Arg: None
+* @Ret: None
+*************************************************/
+void vHandleGothamCrash(void) {
+    /* Every job notices; the first one shuts down, the others wait for it */
+    static pthread_mutex_t crashMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&crashMutex);
+
+    printF("Lost connection to Gotham. Shutting down...\n");
+    if (gpGothamConn) {
+        vStopGothamReader();
+        close_connection(gpGothamConn);
+        gpGothamConn = NULL;
+    }
+    gnIsConnected = 0;
+    exit(1);
+}
+
+/*************************************************
+* @Name: nHandleWorkerCrash
+* @Def: Handles worker crash during distortion. Gotham reassigns the job
+*       to another worker, which continues from what it already holds
+* @Arg: In: pJob = job whose worker was lost
+* @Ret: 0 if the job completed elsewhere, -1 otherwise
+*************************************************/
+int nHandleWorkerCrash(FleckJob *pJob) {
+    vCloseWorker(pJob);
+
+    pthread_mutex_lock(&gJobsMutex);
+    int nIsCancelled = pJob->nIsCancelled;
+    pthread_mutex_unlock(&gJobsMutex);
+    // A cancelled file of a lane only ended its own stream
+    if (pJob->pLane && !nIsCancelled) vLoseLane(pJob->pLane);
+    pJob->pLane = NULL;     // The new worker is the job's own
+    if (nIsCancelled) return -1;
+
+    vJobMessage(pJob, "Lost connection to worker. Attempting to resume distortion...\n");
+
+    // Send resume request to Gotham
+    char data[DATA_SIZE];
+    if (snprintf(data, sizeof(data), "%s&%s&%s", pJob->psMediaType, pJob->sFile,
+                 pJob->sJobId) >= (int)sizeof(data)) {
+        vCloseWorker(pJob);
+        return -1;
+    }
+    GothamRequest* pRequest = pSubmitRequest(FRAME_RESUME_REQ, data);
+    if (!pRequest) {
+        vWriteLog("Failed to send resume request\n");
+        vHandleGothamCrash();
+        return -1;
+    }
+
+    // Wait for new worker info
+    char sNotice[512];
+    snprintf(sNotice, sizeof(sNotice), "[%d %s] Workers are busy, waiting for one to resume on\n",
+             pJob->nId, pJob->sFile);
+    Frame* response = pAwaitRequest(pRequest, sNotice);
+    if (!response) {
+        vWriteLog("Failed to receive resume response\n");
+        vHandleGothamCrash();
+        return -1;
+    }
+
+    if (response->type != FRAME_RESUME_REQ) {
+        vWriteLog("Received unexpected frame type for resume\n");
+        free_frame(response);
+        vHandleGothamCrash();
+        return -1;
+    }
+
+    // Check for error responses
+    if (strcmp(response->data, "DISTORT_KO") == 0) {
+        vWriteLog("No available worker to resume distortion\n");
+        vJobMessage(pJob, "Error: No available worker to resume distortion\n");
+        free_frame(response);
+        return -1;
+    }
+
+    // Parse new worker info and reconnect
+    char sWorkerIP[MAX_IP_LENGTH];
+    char sWorkerPort[MAX_PORT_LENGTH];
+    char sJobId[JOB_ID_LENGTH];
+    char sLocalIP[MAX_IP_LENGTH] = "";
+    if (sscanf(response->data, "%127[^&]&%5[^&]&%23[^&]&%127s", sWorkerIP, sWorkerPort, sJobId, sLocalIP) < 3 ||
+        strcmp(sJobId, pJob->sJobId) != 0) {
+        vWriteLog("Failed to parse new worker info\n");
+        free_frame(response);
+        return -1;
+    }
+    snprintf(pJob->sLocalIP, sizeof(pJob->sLocalIP), "%s", sLocalIP);
+
+    free_frame(response);
+
+    // A job cancelled meanwhile gives the new worker back
+    pthread_mutex_lock(&gJobsMutex);
+    nIsCancelled = pJob->nIsCancelled;
+    pthread_mutex_unlock(&gJobsMutex);
+    if (nIsCancelled) {
+        vReleaseWorker(sWorkerIP, sWorkerPort);
+        return -1;
+    }
+
+    // Connect to new worker
+    return nConnectToWorker(pJob, sWorkerIP, sWorkerPort, 1);
+}
+
+/*************************************************
+* @Name: vUnlinkRequest
+* @Def: Removes a request from those in flight. Caller holds gRequestMutex
+* @Arg: In: pRequest = request
+* @Ret: None
+*************************************************/
+static void vUnlinkRequest(GothamRequest *pRequest) {
+    GothamRequest **ppRequest = &gpRequests;
+    while (*ppRequest && *ppRequest != pRequest) ppRequest = &(*ppRequest)->pNext;
+    if (*ppRequest) *ppRequest = pRequest->pNext;
+}
+
+/*************************************************
+* @Name: pSubmitRequest
+* @Def: Sends a DISTORT_REQ or RESUME_REQ to Gotham tagged "#id&", so
+*       its answer is matched to it whatever else is in flight
+* @Arg: In: nType = FRAME_DISTORT_REQ or FRAME_RESUME_REQ
+*       In: psData = request text
+* @Ret: Request to wait on with pAwaitRequest, NULL if it was not sent
+*************************************************/
+static GothamRequest *pSubmitRequest(uint8_t nType, const char *psData) {
+    GothamRequest *pRequest = calloc(1, sizeof(GothamRequest));
+    if (!pRequest) return NULL;
+
+    // Registered before it is sent, as the answer may come at once
+    pthread_mutex_lock(&gRequestMutex);
+    pRequest->nId = ++gnNextRequest;
+    pRequest->pNext = gpRequests;
+    gpRequests = pRequest;
+    pthread_mutex_unlock(&gRequestMutex);
+
+    char sData[DATA_SIZE + 1];
+    int nLength = snprintf(sData, sizeof(sData), "%c%u&%s", REQUEST_TAG, pRequest->nId, psData);
+    Frame *frame = nLength > 0 && nLength <= DATA_SIZE ? create_frame(nType, sData, nLength) : NULL;
+    if (frame && send_frame(gpGothamConn, frame)) {
+        free_frame(frame);
+        return pRequest;
+    }
+    if (frame) free_frame(frame);
+
+    pthread_mutex_lock(&gRequestMutex);
+    vUnlinkRequest(pRequest);
+    pthread_mutex_unlock(&gRequestMutex);
+    free(pRequest);
+    return NULL;
+}
+
+/*************************************************
+* @Name: pAwaitRequest
+* @Def: Waits for the answer to a request and forgets the request.
+*       Gotham answers or queues a request at once, so only a queued one
+*       is waited for without a timeout
+* @Arg: In: pRequest = request from pSubmitRequest, freed here
+*       In: psWaitNotice = shown when Gotham queues it, may be NULL
+* @Ret: Answer with the tag stripped, NULL on timeout or a lost Gotham
+*************************************************/
+static Frame *pAwaitRequest(GothamRequest *pRequest, const char *psWaitNotice) {
+    struct timespec tDeadline;
+    clock_gettime(CLOCK_REALTIME, &tDeadline);
+    tDeadline.tv_sec += SOCKET_TIMEOUT_SEC;
+
+    pthread_mutex_lock(&gRequestMutex);
+    int nIsNoticed = 0;
+    while (!pRequest->pResponse && !gnIsGothamLost) {
+        if (pRequest->nIsWaiting) {
+            if (!nIsNoticed) {
+                vWriteLog("Request queued by Gotham, waiting for a worker\n");
+                if (psWaitNotice) printF(psWaitNotice);
+                nIsNoticed = 1;
+            }
+            pthread_cond_wait(&gRequestCond, &gRequestMutex);
+        } else if (pthread_cond_timedwait(&gRequestCond, &gRequestMutex, &tDeadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    vUnlinkRequest(pRequest);
+    pthread_mutex_unlock(&gRequestMutex);
+
+    Frame *pResponse = pRequest->pResponse;
+    free(pRequest);
+    return pResponse;
+}
+
+/*************************************************
+* @Name: nAwaitAnswered
+* @Def: Waits until Gotham answered every request of a batch or queued
+*       it, which it does for the whole batch at once
+* @Arg: In: ppRequests = requests, NULL entries skipped
+*       In: nCount = number of entries
+* @Ret: 0 once all are, -1 on timeout or if Gotham was lost
+*************************************************/
+static int nAwaitAnswered(GothamRequest **ppRequests, int nCount) {
+    struct timespec tDeadline;
+    clock_gettime(CLOCK_REALTIME, &tDeadline);
+    tDeadline.tv_sec += SOCKET_TIMEOUT_SEC;
+
+    pthread_mutex_lock(&gRequestMutex);
+    int i = 0;
+    while (i < nCount) {
+        if (!ppRequests[i] || ppRequests[i]->pResponse || ppRequests[i]->nIsWaiting) {
+            i++;
+        } else if (gnIsGothamLost ||
+                   pthread_cond_timedwait(&gRequestCond, &gRequestMutex, &tDeadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gRequestMutex);
+    return i < nCount ? -1 : 0;
+}
+
+/*************************************************
+* @Name: vMonitorGotham
+* @Def: The only reader of the Gotham connection. Hands each answer to
+*       the request whose tag it carries, until the connection ends
+* @Arg: In: pvArg = thread argument (unused)
+* @Ret: NULL
+*************************************************/
+void *vMonitorGotham(void *pvArg) {
+    (void)pvArg;
+
+    for (;;) {
+        // The socket times out reads, so a quiet Gotham is waited for here
+        struct pollfd pfd = { gpGothamConn->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        char cNext;
+        ssize_t nPeek = recv(gpGothamConn->fd, &cNext, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (nPeek < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (nPeek <= 0) break;
+
+        Frame *frame = receive_frame(gpGothamConn);
+        if (!frame) break;
+
+        unsigned int nId = 0;
+        int nTag = 0;
+        if (frame->data_length < 3 || frame->data[0] != REQUEST_TAG ||
+            sscanf(frame->data + 1, "%u&%n", &nId, &nTag) != 1 || nTag == 0) {
+            vWriteLog("Ignoring untagged frame from Gotham\n");
+            free_frame(frame);
+            continue;
+        }
+        size_t nSkip = (size_t)nTag + 1;
+        frame->data_length -= nSkip;
+        memmove(frame->data, frame->data + nSkip, frame->data_length);
+        memset(frame->data + frame->data_length, 0, nSkip);
+
+        pthread_mutex_lock(&gRequestMutex);
+        GothamRequest *pRequest = gpRequests;
+        while (pRequest && pRequest->nId != nId) pRequest = pRequest->pNext;
+        if (pRequest && frame->data_length == strlen(DISTORT_WAIT) &&
+            memcmp(frame->data, DISTORT_WAIT, frame->data_length) == 0) {
+            pRequest->nIsWaiting = 1;
+            free_frame(frame);
+        } else if (pRequest && !pRequest->pResponse) {
+            pRequest->pResponse = frame;
+        } else {
+            free_frame(frame);
+        }
+        pthread_cond_broadcast(&gRequestCond);
+        pthread_mutex_unlock(&gRequestMutex);
+    }
+
+    pthread_mutex_lock(&gRequestMutex);
+    gnIsGothamLost = 1;
+    pthread_cond_broadcast(&gRequestCond);
+    pthread_mutex_unlock(&gRequestMutex);
+    return NULL;
+}
+
+/*************************************************
+* @Name: vStopGothamReader
+* @Def: Ends vMonitorGotham before the Gotham connection is closed
+* @Arg: None
+* @Ret: None
+*************************************************/
+static void vStopGothamReader(void) {
+    if (!gnHasReader) return;
+    shutdown(gpGothamConn->fd, SHUT_RDWR);
+    if (!pthread_equal(pthread_self(), gGothamReader)) pthread_join(gGothamReader, NULL);
+    gnHasReader = 0;
+}
+
+/*************************************************
+* @Name: vMonitorWorker
+* @Def: Monitors worker connection for crashes
+* @Arg: In: pvArg = FleckJob pointer
+* @Ret: NULL
+*************************************************/
+void *vMonitorWorker(void *pvArg) {
+    FleckJob *pJob = (FleckJob *)pvArg;
+    char sBuffer[2];
+
+    while (pJob->pConn) {
+        if (receive_data(pJob->pConn, sBuffer, 1) <= 0) {
+            nHandleWorkerCrash(pJob);
+            break;
+        }
+        sleep(1);
+    }
+    return NULL;
+}
+
+/*************************************************
+* @Name: nReserveOutput
+* @Def: Makes sure the mapped download can take nEnd bytes, doubling it
+*       so a larger than expected output is remapped only a few times
+* @Arg: In: pOut = download mapping
+*       In: nEnd = bytes the mapping must hold
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nReserveOutput(MappedFile *pOut, unsigned long nEnd) {
+    if (nEnd <= pOut->nMapped) return 0;
+    size_t nCapacity = pOut->nMapped * 2 > nEnd ? pOut->nMapped * 2 : nEnd;
+    return nGrowOutput(pOut, nCapacity);
+}
+
+/*************************************************
+* @Name: vAwaitHandoff
+* @Def: Download side of a handed-off job. The worker writes the output
+*       file itself, so only its "size&md5" FILE_INFO or an error comes
+*       back; the file is then checked in place
+* @Arg: In: pState = download state
 * @Ret: None
 *************************************************/
-void vConnectToWorker(const char* psIP, const char* psPort, const char* psFile, const char* psFactor) {
-    // Connect to worker
-    gpWorkerConn = connect_to_server(psIP, atoi(psPort));
-    if (!gpWorkerConn) {
-        vWriteLog("Failed to connect to worker\n");
-        return;
+static void vAwaitHandoff(DownloadState *pState) {
+    Frame *response = receive_frame(pState->pConn);
+    unsigned long nExpected = 0;
+    char sDistortedMD5[MD5_HEX_SIZE] = "";
+    if (response && response->type == FRAME_FILE_INFO &&
+        sscanf(response->data, "%lu&%32s", &nExpected, sDistortedMD5) == 2) {
+        MappedFile out;
+        int fd = open(pState->psPath, O_RDONLY);
+        if (fd >= 0 && nMapInput(&out, fd) == 0) {
+            Md5Context md5;
+            char sActualMD5[MD5_HEX_SIZE];
+            vMd5Init(&md5);
+            vMd5Update(&md5, out.pData, out.nMapped);
+            vMd5FinalHex(&md5, sActualMD5);
+            pState->nIsIntact = out.nMapped == nExpected && strcmp(sActualMD5, sDistortedMD5) == 0;
+            pState->nResult = 0;
+            vUnmapFile(&out);
+        }
+        if (fd >= 0) close(fd);
+    } else if (response && response->type == FRAME_ERROR) {
+        pState->nResult = strncmp(response->data, "CHECK_KO", 8) == 0 ? DOWNLOAD_UPLOAD_KO
+                                                                       : DOWNLOAD_DISTORT_KO;
     }
+    if (response) free_frame(response);
 
-    // Calculate real file size and MD5
-    char sFilePath[512];
-    snprintf(sFilePath, sizeof(sFilePath), "%s/%s", gConfig.sFolderPath, psFile);
+    pthread_mutex_lock(&pState->pUpload->mutex);
+    pState->nIsDone = 1;
+    pthread_cond_broadcast(&pState->pUpload->cond);
+    pthread_mutex_unlock(&pState->pUpload->mutex);
+}
 
-    // Get file size
-    struct stat st;
-    if (stat(sFilePath, &st) != 0) {
-        vWriteLog("Failed to get file stats\n");
-        vHandleWorkerCrash();
-        return;
+/*************************************************
+* @Name: vReceiveDistorted
+* @Def: Download side of a job, run next to the upload. Writes FILE_DATA
+*       to the output file, hashing it on the way, until the FILE_INFO size
+*       is reached; FILE_INFO may come first or as a trailer. The file is
+*       preallocated and mapped, so frames are received straight into it,
+*       and BULK_DATA segments spliced into it are hashed in place. A
+*       resumed job keeps the first nOffset bytes and only hashes them
+* @Arg: In: pvArg = DownloadState pointer
+* @Ret: NULL
+*************************************************/
+static void *vReceiveDistorted(void *pvArg) {
+    DownloadState *pState = (DownloadState *)pvArg;
+    if (pState->pUpload->nIsHandoff) {
+        vAwaitHandoff(pState);
+        return NULL;
     }
-    unsigned long nFileSize = st.st_size;
 
-    // Calculate MD5 (simulated for now)
-    char sMD5[33] = "d41d8cd98f00b204e9800998ecf8427e";
-
-    // Send connection frame
-    char sData[DATA_SIZE];
-    snprintf(sData, sizeof(sData), "%s&%s&%lu&%s&%s",
-             gConfig.sUsername, psFile, nFileSize, sMD5, psFactor);
+    Md5Context md5;
+    vMd5Init(&md5);
+
+    /* Text only shrinks and media keeps its size, so the input size is a
+     * good first capacity */
+    MappedFile out;
+    unsigned long nCapacity = pState->nSizeHint > pState->nOffset ? pState->nSizeHint : pState->nOffset;
+    int fd = open(pState->psPath, pState->nOffset > 0 ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && (ftruncate(fd, (off_t)pState->nOffset) != 0 || nMapOutput(&out, fd, nCapacity) != 0)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        vMd5Update(&md5, out.pData, pState->nOffset);
+    }
+    if (fd < 0) {
+        vWriteLog("Failed to create output file\n");
+        pthread_mutex_lock(&pState->pUpload->mutex);
+        pState->nIsDone = 1;
+        pthread_cond_broadcast(&pState->pUpload->cond);
+        pthread_mutex_unlock(&pState->pUpload->mutex);
+        return NULL;
+    }
 
-    Frame* frame = create_frame(FRAME_WORKER_CONNECT, sData, strlen(sData));
-    if (send_frame(gpWorkerConn, frame) != 0) {
-        free_frame(frame);
-        vHandleWorkerCrash();
-        return;
+    unsigned long nReceived = pState->nOffset;
+    unsigned long nExpected = 0;
+    char sDistortedMD5[MD5_HEX_SIZE] = "";
+    int nHaveInfo = 0;
+    while (!nHaveInfo || nReceived < nExpected) {
+        Frame *response = receive_frame(pState->pConn);
+        if (!response) break;
+
+        if (response->type == FRAME_FILE_DATA && response->data_length <= DATA_SIZE) {
+            if (nReserveOutput(&out, nReceived + response->data_length) != 0) {
+                free_frame(response);
+                break;
+            }
+            memcpy(out.pData + nReceived, response->data, response->data_length);
+            vMd5Update(&md5, response->data, response->data_length);
+            nReceived += response->data_length;
+        } else if (response->type == FRAME_BULK_DATA) {
+            size_t nBulk = bulk_length(response);
+            if (nBulk == 0 || nReserveOutput(&out, nReceived + nBulk) != 0 ||
+                !receive_bulk_to_file(pState->pConn, response, fd, (off_t)nReceived)) {
+                free_frame(response);
+                break;
+            }
+            vMd5Update(&md5, out.pData + nReceived, nBulk);
+            nReceived += nBulk;
+        } else if (response->type == FRAME_FILE_INFO) {
+            if (sscanf(response->data, "%lu&%32s", &nExpected, sDistortedMD5) != 2 ||
+                nGrowOutput(&out, nExpected) != 0) {
+                free_frame(response);
+                break;
+            }
+            nHaveInfo = 1;
+        } else if (response->type == FRAME_NACK && pState->pUpload->pResend) {
+            UploadControl *pUpload = pState->pUpload;
+            pthread_mutex_lock(&pUpload->mutex);
+            int nMarked = nParseChunkRanges(response->data, pUpload->pResend, pUpload->nChunks);
+            if (nMarked > 0) pUpload->nResend += nMarked;
+            pthread_cond_broadcast(&pUpload->cond);
+            pthread_mutex_unlock(&pUpload->mutex);
+            if (nMarked < 0) {
+                free_frame(response);
+                break;
+            }
+        } else if (response->type == FRAME_MD5_CHECK && pState->pUpload->pResend) {
+            pthread_mutex_lock(&pState->pUpload->mutex);
+            pState->pUpload->nIsVerified = 1;
+            pthread_cond_broadcast(&pState->pUpload->cond);
+            pthread_mutex_unlock(&pState->pUpload->mutex);
+        } else if (response->type == FRAME_ERROR) {
+            pState->nResult = strncmp(response->data, "CHECK_KO", 8) == 0 ? DOWNLOAD_UPLOAD_KO
+                                                                           : DOWNLOAD_DISTORT_KO;
+            free_frame(response);
+            break;
+        } else {
+            free_frame(response);
+            break;
+        }
+        free_frame(response);
     }
-    free_frame(frame);
+    /* The file size is what a resume continues from */
+    int nIsSaved = nFinishOutput(&out, nReceived) == 0;
+    close(fd);
 
-    // Wait for worker acknowledgment
-    Frame* response = receive_frame(gpWorkerConn);
-    if (!response || response->type != FRAME_WORKER_CONNECT) {
-        if (response) free_frame(response);
-        vHandleWorkerCrash();
-        return;
+    if (nIsSaved && nHaveInfo && nReceived == nExpected) {
+        char sActualMD5[MD5_HEX_SIZE];
+        vMd5FinalHex(&md5, sActualMD5);
+        pState->nIsIntact = strcmp(sActualMD5, sDistortedMD5) == 0;
+        pState->nResult = 0;
     }
-    free_frame(response);
 
-    // Send file data in chunks
-    int fd = open(sFilePath, O_RDONLY);
-    if (fd < 0) {
-        vWriteLog("Failed to open file\n");
-        vHandleWorkerCrash();
-        return;
+    pthread_mutex_lock(&pState->pUpload->mutex);
+    pState->nIsDone = 1;
+    pthread_cond_broadcast(&pState->pUpload->cond);
+    pthread_mutex_unlock(&pState->pUpload->mutex);
+    return NULL;
+}
+
+/*************************************************
+* @Name: nUploadBulk
+* @Def: Bulk mode body of the upload. Each segment is hashed from the
+*       mapping, then handed to the kernel with sendfile() instead of
+*       being copied into frames
+* @Arg: In: pFile = mapped file to send
+*       In/Out: pnSent = bytes sent or held by the worker
+*       In: pMd5 = upload MD5, NULL when it was announced
+*       In: pDownload = download side, checked to stop early
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nUploadBulk(const MappedFile *pFile, unsigned long *pnSent, Md5Context *pMd5,
+                       DownloadState *pDownload) {
+    while (!pDownload->nIsDone && *pnSent < pFile->nMapped) {
+        unsigned long nLeft = pFile->nMapped - *pnSent;
+        unsigned long nSegment = nLeft < BULK_SEGMENT_SIZE ? nLeft : BULK_SEGMENT_SIZE;
+        if (pMd5) vMd5Update(pMd5, pFile->pData + *pnSent, nSegment);
+        if (!send_bulk_file(pDownload->pConn, pFile->fd, (off_t)*pnSent, nSegment)) return -1;
+        *pnSent += nSegment;
     }
+    return 0;
+}
 
-    char buffer[DATA_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = read(fd, buffer, DATA_SIZE)) > 0) {
-        frame = create_frame(FRAME_FILE_DATA, buffer, bytes_read);
-        if (send_frame(gpWorkerConn, frame) != 0) {
-            free_frame(frame);
-            close(fd);
-            vHandleWorkerCrash();
-            return;
+/*************************************************
+* @Name: nUploadFile
+* @Def: Sends the file as FILE_DATA frames, or BULK_DATA segments in bulk
+*       mode. Unless its MD5 was announced with the request, it is hashed
+*       on the way and a "size&md5" FILE_INFO trailer follows. Frames are
+*       built straight from the mapping. A handed-off file is only hashed,
+*       for the worker to check its read
+* @Arg: In: pFile = mapped file to send
+*       In: nOffset = bytes the worker already holds, hashed but not sent
+*       In: pDownload = download side, checked to stop early
+* @Ret: 0 on success, 1 on failure
+*************************************************/
+static int nUploadFile(const MappedFile *pFile, unsigned long nOffset, DownloadState *pDownload) {
+    Md5Context md5;
+    Md5Context *pMd5 = pDownload->pUpload->nIsAnnounced ? NULL : &md5;
+    vMd5Init(&md5);
+    if (nOffset > pFile->nMapped) return 1;
+    if (pMd5) vMd5Update(pMd5, pFile->pData, nOffset);
+    unsigned long nSent = nOffset;
+
+    if (pDownload->pUpload->nIsHandoff) {
+        if (pMd5) vMd5Update(pMd5, pFile->pData + nSent, pFile->nMapped - nSent);
+        nSent = pFile->nMapped;
+    } else if (pDownload->pUpload->nIsBulk) {
+        if (nUploadBulk(pFile, &nSent, pMd5, pDownload) != 0) return 1;
+    } else {
+        while (!pDownload->nIsDone && nSent < pFile->nMapped) {
+            unsigned long nPart = pFile->nMapped - nSent < FRAME_BATCH * DATA_SIZE ?
+                                  pFile->nMapped - nSent : FRAME_BATCH * DATA_SIZE;
+            if (pMd5) vMd5Update(pMd5, pFile->pData + nSent, nPart);
+            if (!send_frames(pDownload->pConn, FRAME_FILE_DATA, pFile->pData + nSent, nPart)) return 1;
+            nSent += nPart;
         }
+    }
+    if (pDownload->nIsDone || !pMd5) return 0;
+
+    char sMD5[MD5_HEX_SIZE];
+    char sInfo[DATA_SIZE];
+    vMd5FinalHex(&md5, sMD5);
+    snprintf(sInfo, sizeof(sInfo), "%lu&%s", nSent, sMD5);
+    Frame *frame = create_frame(FRAME_FILE_INFO, sInfo, strlen(sInfo));
+    int nFailed = !send_frame(pDownload->pConn, frame);
+    free_frame(frame);
+    if (!nFailed) snprintf(pDownload->pUpload->sMD5, MD5_HEX_SIZE, "%s", sMD5);
+    return nFailed;
+}
+
+/*************************************************
+* @Name: nEmitDelta
+* @Def: Sends one piece of a delta upload: a DELTA_COPY "block&count"
+*       for a run of blocks the worker holds, or the bytes of a literal
+*       range as FILE_DATA frames or, in bulk mode, BULK_DATA segments
+* @Arg: In: pvArg = DeltaUpload pointer
+*       In: nBlock = first block of the run, -1 for a literal range
+*       In: nCount = blocks in the run
+*       In: nFrom = first byte of the literal range
+*       In: nLength = bytes in the literal range
+* @Ret: 0 to go on, 1 to stop
+*************************************************/
+static int nEmitDelta(void *pvArg, int nBlock, int nCount, unsigned long nFrom, unsigned long nLength) {
+    DeltaUpload *pUpload = (DeltaUpload *)pvArg;
+    DownloadState *pDownload = pUpload->pDownload;
+    if (pDownload->nIsDone) return 1;
+
+    if (nBlock >= 0) {
+        char sCopy[DATA_SIZE];
+        snprintf(sCopy, sizeof(sCopy), "%d&%d", nBlock, nCount);
+        Frame *frame = create_frame(FRAME_DELTA_COPY, sCopy, strlen(sCopy));
+        int nFailed = !send_frame(pDownload->pConn, frame);
         free_frame(frame);
+        return nFailed;
     }
-    close(fd);
 
-    // Wait for distorted file info
-    response = receive_frame(gpWorkerConn);
-    if (!response || response->type != FRAME_FILE_INFO) {
-        if (response) free_frame(response);
-        vHandleWorkerCrash();
-        return;
+    pUpload->nLiteral += nLength;
+    unsigned long nEnd = nFrom + nLength;
+    while (!pDownload->nIsDone && nFrom < nEnd) {
+        unsigned long nLimit = pDownload->pUpload->nIsBulk ? BULK_SEGMENT_SIZE : FRAME_BATCH * DATA_SIZE;
+        unsigned long nPart = nEnd - nFrom < nLimit ? nEnd - nFrom : nLimit;
+        int nOk = pDownload->pUpload->nIsBulk ?
+            send_bulk_file(pDownload->pConn, pUpload->pFile->fd, (off_t)nFrom, nPart) :
+            send_frames(pDownload->pConn, FRAME_FILE_DATA, pUpload->pFile->pData + nFrom, nPart);
+        if (!nOk) return 1;
+        nFrom += nPart;
     }
+    return 0;
+}
 
-    // Parse file info
-    unsigned long nDistortedSize;
-    char sDistortedMD5[33];
-    if (sscanf(response->data, "%lu&%s", &nDistortedSize, sDistortedMD5) != 2) {
-        free_frame(response);
-        vHandleWorkerCrash();
-        return;
+/*************************************************
+* @Name: nUploadDelta
+* @Def: Sends the file as a delta against the previous version the
+*       worker holds, whose block signatures came with the ack. Only
+*       delta uploads of files with an announced MD5 are offered, so no
+*       trailer follows
+* @Arg: In: pFile = mapped file to send
+*       In: pDelta = signatures of the worker's version
+*       In: pDownload = download side, checked to stop early
+* @Ret: 0 on success, 1 on failure
+*************************************************/
+static int nUploadDelta(const MappedFile *pFile, const DeltaIndex *pDelta, DownloadState *pDownload) {
+    DeltaUpload upload = { pFile, pDownload, 0 };
+    int nFailed = nDeltaEncode(pDelta, pFile->pData, pFile->nMapped, nEmitDelta, &upload) != 0;
+    if (pDownload->nIsDone) return 0;
+    if (nFailed) return 1;
+
+    char sMsg[256];
+    snprintf(sMsg, sizeof(sMsg), "Delta upload: %lu bytes sent, %lu taken from the worker's copy\n",
+             upload.nLiteral, (unsigned long)pFile->nMapped - upload.nLiteral);
+    vWriteLog(sMsg);
+    return 0;
+}
+
+/*************************************************
+* @Name: nSendChunk
+* @Def: Sends one Merkle chunk: CHUNK_HASH "index&md5" then its FILE_DATA.
+*       A chunk the worker already holds is only announced, as
+*       "index&md5&H", and the worker verifies its own copy. In bulk mode
+*       the data goes out as one BULK_DATA segment straight from the
+*       mapped page cache
+* @Arg: In: pDownload = worker side of the job
+*       In: pFile = mapped file to send
+*       In: nChunk = chunk index
+*       In: nIsHeld = worker holds the chunk from an earlier attempt
+*       Out: pLeaf = chunk digest
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nSendChunk(DownloadState *pDownload, const MappedFile *pFile, int nChunk, int nIsHeld,
+                      MerkleLeaf pLeaf) {
+    Connection *pConn = pDownload->pConn;
+    const char *pChunk = pFile->pData + (size_t)nChunk * MERKLE_CHUNK_SIZE;
+    unsigned long nLen = nMerkleChunkLength(pFile->nMapped, nChunk);
+
+    Md5Context md5;
+    char sHash[DATA_SIZE];
+    char sHex[MD5_HEX_SIZE];
+    vMd5Init(&md5);
+    vMd5Update(&md5, pChunk, nLen);
+    vMd5Final(&md5, pLeaf);
+    for (int i = 0; i < MD5_DIGEST_SIZE; i++) {
+        snprintf(sHex + i * 2, 3, "%02x", pLeaf[i]);
     }
-    free_frame(response);
+    snprintf(sHash, sizeof(sHash), nIsHeld ? "%d&%s&" MERKLE_HELD : "%d&%s", nChunk, sHex);
 
-    // Receive distorted file data
-    char sDistortedPath[512];
-    snprintf(sDistortedPath, sizeof(sDistortedPath), "%s/distorted_%s",
-             gConfig.sFolderPath, psFile);
+    Frame *frame = create_frame(FRAME_CHUNK_HASH, sHash, strlen(sHash));
+    int nOk = send_frame(pConn, frame);
+    free_frame(frame);
 
-    fd = open(sDistortedPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        vWriteLog("Failed to create output file\n");
-        vHandleWorkerCrash();
-        return;
+    if (pDownload->pUpload->nIsBulk) {
+        return nOk && (nIsHeld || nLen == 0 || send_bulk(pConn, pChunk, nLen)) ? 0 : -1;
     }
+    if (nOk && !nIsHeld) nOk = send_frames(pConn, FRAME_FILE_DATA, pChunk, nLen);
+    return nOk ? 0 : -1;
+}
 
-    unsigned long nReceived = 0;
-    while (nReceived < nDistortedSize) {
-        response = receive_frame(gpWorkerConn);
-        if (!response || response->type != FRAME_FILE_DATA) {
-            if (response) free_frame(response);
-            close(fd);
-            vHandleWorkerCrash();
-            return;
+/*************************************************
+* @Name: nResendChunks
+* @Def: Resends every chunk the worker has NACKed so far
+* @Arg: In: pFile = mapped file to send
+*       In: pDownload = download side holding the NACK marks
+*       In: pLeaves = chunk digests
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nResendChunks(const MappedFile *pFile, DownloadState *pDownload, MerkleLeaf *pLeaves) {
+    UploadControl *pUpload = pDownload->pUpload;
+    for (int i = 0; i < pUpload->nChunks; i++) {
+        pthread_mutex_lock(&pUpload->mutex);
+        int nMarked = pUpload->pResend[i];
+        if (nMarked) {
+            pUpload->pResend[i] = 0;
+            pUpload->nResend--;
         }
+        pthread_mutex_unlock(&pUpload->mutex);
 
-        write(fd, response->data, response->data_length);
-        nReceived += response->data_length;
-        free_frame(response);
+        if (nMarked && nSendChunk(pDownload, pFile, i, 0, pLeaves[i]) != 0) {
+            return -1;
+        }
     }
-    close(fd);
+    return 0;
+}
 
-    // Send MD5 check
-    frame = create_frame(FRAME_MD5_CHECK, "CHECK_OK", 8);
-    send_frame(gpWorkerConn, frame);
-    free_frame(frame);
+/*************************************************
+* @Name: nUploadMerkle
+* @Def: Sends the file in chunked Merkle mode. After the "size&root"
+*       trailer it keeps resending NACKed chunks until the worker
+*       confirms the upload. Unless announced, the file MD5 is taken on
+*       the way for the next request of the file
+* @Arg: In: pFile = mapped file to send
+*       In: nHeldChunks = leading chunks the worker already holds
+*       In: pDownload = download side, relays NACK and MD5_CHECK frames
+* @Ret: 0 on success, 1 on failure
+*************************************************/
+static int nUploadMerkle(const MappedFile *pFile, int nHeldChunks, DownloadState *pDownload) {
+    UploadControl *pUpload = pDownload->pUpload;
+    MerkleLeaf *pLeaves = calloc(pUpload->nChunks, sizeof(MerkleLeaf));
+    int nFailed = 1;
+    Md5Context md5;
+    vMd5Init(&md5);
+    if (!pLeaves) goto done;
+
+    for (int i = 0; i < pUpload->nChunks && !pDownload->nIsDone; i++) {
+        if (nSendChunk(pDownload, pFile, i, i < nHeldChunks, pLeaves[i]) != 0 ||
+            nResendChunks(pFile, pDownload, pLeaves) != 0) {
+            goto done;
+        }
+        if (!pUpload->nIsAnnounced) {
+            vMd5Update(&md5, pFile->pData + (size_t)i * MERKLE_CHUNK_SIZE, nMerkleChunkLength(pFile->nMapped, i));
+        }
+    }
+    if (pDownload->nIsDone) {
+        nFailed = 0;
+        goto done;
+    }
 
-    // Disconnect
-    frame = create_frame(FRAME_DISCONNECT, gConfig.sUsername, strlen(gConfig.sUsername));
-    send_frame(gpWorkerConn, frame);
+    char sRoot[MD5_HEX_SIZE];
+    char sInfo[DATA_SIZE];
+    vMerkleRoot(pLeaves, pUpload->nChunks, sRoot);
+    snprintf(sInfo, sizeof(sInfo), "%lu&%s", (unsigned long)pFile->nMapped, sRoot);
+    Frame *frame = create_frame(FRAME_FILE_INFO, sInfo, strlen(sInfo));
+    int nOk = send_frame(pDownload->pConn, frame);
     free_frame(frame);
+    if (!nOk) goto done;
+
+    for (;;) {
+        pthread_mutex_lock(&pUpload->mutex);
+        while (!pUpload->nResend && !pUpload->nIsVerified && !pDownload->nIsDone) {
+            pthread_cond_wait(&pUpload->cond, &pUpload->mutex);
+        }
+        int nFinished = pUpload->nIsVerified || pDownload->nIsDone;
+        pthread_mutex_unlock(&pUpload->mutex);
+        if (nFinished) break;
+
+        if (nResendChunks(pFile, pDownload, pLeaves) != 0) goto done;
+    }
+    if (pUpload->nIsVerified && !pUpload->nIsAnnounced) vMd5FinalHex(&md5, pUpload->sMD5);
+    nFailed = 0;
+
+done:
+    free(pLeaves);
+    return nFailed;
+}
+
+/*************************************************
+* @Name: vClosePooled
+* @Def: Ends the session on a pooled connection and closes it
+* @Arg: In: pConn = pooled connection
+* @Ret: None
+*************************************************/
+static void vClosePooled(Connection *pConn) {
+    /* A worker that hung up already needs no goodbye */
+    if (is_connected(pConn)) {
+        Frame *frame = create_frame(FRAME_DISCONNECT, gConfig.sUsername, strlen(gConfig.sUsername));
+        send_frame(pConn, frame);
+        free_frame(frame);
+    }
+    close_connection(pConn);
+}
+
+/*************************************************
+* @Name: pTakePooled
+* @Def: Takes the idle connection to a worker endpoint out of the pool.
+*       One idle for POOL_IDLE_SEC, or that the worker hung up, is closed
+*       instead
+* @Arg: In: psIP = worker IP
+*       In: psPort = worker port
+* @Ret: Connection, or NULL to connect afresh
+*************************************************/
+static Connection *pTakePooled(const char *psIP, const char *psPort) {
+    char sEndpoint[sizeof(gPool[0].sEndpoint)];
+    snprintf(sEndpoint, sizeof(sEndpoint), "%s&%s", psIP, psPort);
+    Connection *pConn = NULL;
+    pthread_mutex_lock(&gPoolMutex);
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if (!gPool[i].pConn || strcmp(gPool[i].sEndpoint, sEndpoint) != 0) continue;
+
+        pConn = gPool[i].pConn;
+        gPool[i].pConn = NULL;
+        if (time(NULL) - gPool[i].tIdleSince >= POOL_IDLE_SEC || !is_connected(pConn)) {
+            vClosePooled(pConn);
+            pConn = NULL;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&gPoolMutex);
+    return pConn;
+}
 
-    close_connection(gpWorkerConn);
-    gpWorkerConn = NULL;
+/*************************************************
+* @Name: vReturnPooled
+* @Def: Keeps a connection the worker agreed to pool for the next request
+*       to the same endpoint, closing the longest idle one if full
+* @Arg: In: psIP = worker IP
+*       In: psPort = worker port
+*       In: pConn = connection, idle
+* @Ret: None
+*************************************************/
+static void vReturnPooled(const char *psIP, const char *psPort, Connection *pConn) {
+    pthread_mutex_lock(&gPoolMutex);
+    int nSlot = 0;
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if (!gPool[i].pConn) {
+            nSlot = i;
+            break;
+        }
+        if (gPool[i].tIdleSince < gPool[nSlot].tIdleSince) nSlot = i;
+    }
+    if (gPool[nSlot].pConn) vClosePooled(gPool[nSlot].pConn);
+    snprintf(gPool[nSlot].sEndpoint, sizeof(gPool[nSlot].sEndpoint), "%s&%s", psIP, psPort);
+    gPool[nSlot].pConn = pConn;
+    gPool[nSlot].tIdleSince = time(NULL);
+    pthread_mutex_unlock(&gPoolMutex);
 }
 
 /*************************************************
-* @Name: vSimulateFileTransfer
-* @Def: Simulates file transfer for Phase 1
+* @Name: vDrainPool
+* @Def: Closes every pooled connection, e.g. at logout
 * @Arg: None
 * @Ret: None
 *************************************************/
-void vSimulateFileTransfer(void) {
-    // Simulate sending file data
-    Frame* dataFrame = create_frame(FRAME_FILE_DATA, "SIMULATED_FILE_DATA", 17);
-    send_frame(gpWorkerConn, dataFrame);
-    free_frame(dataFrame);
+static void vDrainPool(void) {
+    pthread_mutex_lock(&gPoolMutex);
+    for (int i = 0; i < POOL_SIZE; i++) {
+        if (gPool[i].pConn) vClosePooled(gPool[i].pConn);
+        gPool[i].pConn = NULL;
+    }
+    pthread_mutex_unlock(&gPoolMutex);
+}
 
-    // Wait for distortion completion
-    Frame* response = receive_frame(gpWorkerConn);
-    if (!response || response->type != FRAME_FILE_INFO) {
-        if (response) free_frame(response);
-        vHandleWorkerCrash();
-        return;
+/*************************************************
+* @Name: vIdleWorker
+* @Def: Ends a session with a worker but keeps the connection for the
+*       next request: the worker answers once it has told Gotham it is
+*       free, so a next request can be sent to it again
+* @Arg: In: psIP = worker endpoint
+*       In: psPort = worker port
+*       In: pMux = connection, pooled or closed here
+* @Ret: None
+*************************************************/
+static void vIdleWorker(const char *psIP, const char *psPort, Connection *pMux) {
+    Frame *frame = create_frame(FRAME_WORKER_IDLE, NULL, 0);
+    Frame *idle = send_frame(pMux, frame) ? receive_frame_timeout(pMux, SOCKET_TIMEOUT_SEC) : NULL;
+    free_frame(frame);
+    if (idle && idle->type == FRAME_WORKER_IDLE) {
+        vReturnPooled(psIP, psPort, pMux);
+    } else {
+        close_connection(pMux);
+    }
+    if (idle) free_frame(idle);
+}
+
+/*************************************************
+* @Name: vReleaseWorker
+* @Def: Gives back a worker Gotham assigned to a job that was cancelled
+*       meanwhile. A fresh session closed at once makes the worker tell
+*       Gotham it is free; a pooled one would not, so it is dropped
+* @Arg: In: psIP = worker IP
+*       In: psPort = worker port
+* @Ret: None
+*************************************************/
+static void vReleaseWorker(const char *psIP, const char *psPort) {
+    Connection *pConn = pTakePooled(psIP, psPort);
+    if (pConn) vClosePooled(pConn);
+
+    pConn = connect_to_server(psIP, atoi(psPort));
+    if (!pConn) return;
+    Frame *frame = create_frame(FRAME_DISCONNECT, gConfig.sUsername, strlen(gConfig.sUsername));
+    send_frame(pConn, frame);
+    free_frame(frame);
+    close_connection(pConn);
+}
+
+/*************************************************
+* @Name: vCloseWorker
+* @Def: Closes a job's stream, then its worker connection
+* @Arg: In: pJob = job
+* @Ret: None
+*************************************************/
+static void vCloseWorker(FleckJob *pJob) {
+    pthread_mutex_lock(&gJobsMutex);
+    if (pJob->pConn) {
+        close_connection(pJob->pConn);
+        pJob->pConn = NULL;
+    }
+    if (pJob->pMux) {
+        close_connection(pJob->pMux);
+        pJob->pMux = NULL;
+    }
+    pthread_mutex_unlock(&gJobsMutex);
+}
+
+/*************************************************
+* @Name: nHasPrefix
+* @Def: Tells whether a file starts with the bytes of a given MD5
+* @Arg: In: psPath = file
+*       In: nLength = bytes of the prefix
+*       In: psMD5 = their MD5
+* @Ret: 1 if it does, 0 otherwise
+*************************************************/
+static int nHasPrefix(const char *psPath, unsigned long nLength, const char *psMD5) {
+    int fd = open(psPath, O_RDONLY);
+    if (fd < 0) return 0;
+
+    MappedFile file;
+    int nMatches = 0;
+    if (nMapInput(&file, fd) == 0 && file.nMapped >= nLength) {
+        char sMD5[MD5_HEX_SIZE];
+        Md5Context md5;
+        vMd5Init(&md5);
+        vMd5Update(&md5, file.pData, nLength);
+        vMd5FinalHex(&md5, sMD5);
+        nMatches = strcmp(sMD5, psMD5) == 0;
+    }
+    vUnmapFile(&file);
+    close(fd);
+    return nMatches;
+}
+
+/*************************************************
+* @Name: nCopyPrefix
+* @Def: Copies the start of a file into another, replacing its content
+* @Arg: In: psFrom = file to copy from
+*       In: psTo = file to copy into
+*       In: nLength = bytes to copy
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nCopyPrefix(const char *psFrom, const char *psTo, unsigned long nLength) {
+    int fdFrom = open(psFrom, O_RDONLY);
+    int fdTo = fdFrom < 0 ? -1 : open(psTo, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    unsigned long nCopied = 0;
+    while (fdTo >= 0 && nCopied < nLength) {
+        ssize_t nChunk = copy_file_range(fdFrom, NULL, fdTo, NULL, nLength - nCopied, 0);
+        if (nChunk <= 0) break;
+        nCopied += (unsigned long)nChunk;
+    }
+    if (fdFrom >= 0) close(fdFrom);
+    if (fdTo >= 0) close(fdTo);
+    return nCopied == nLength ? 0 : -1;
+}
+
+/*************************************************
+* @Name: nCheckAppend
+* @Def: The worker holds its last job on the file and sends the size and
+*       MD5 of that input and output. If the file starts with that input,
+*       only the bytes after it are uploaded; the distorted file is kept
+*       too if it starts with that output. The answer is "CHECK_OK&outHeld"
+*       or "CHECK_KO", after which the file is uploaded whole. The kept
+*       output is copied to the part file before the answer, so a worker
+*       writing that file itself finds it there
+* @Arg: In: pConn = worker connection
+*       In: psPath = file to distort
+*       In: psDistortedPath = distorted file of an earlier request
+*       In: psPartPath = part file the new output is written to
+*       Out: pnInOffset = upload bytes the worker holds
+*       Out: pnOutOffset = output bytes kept here
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nCheckAppend(Connection *pConn, const char *psPath, const char *psDistortedPath,
+                        const char *psPartPath, unsigned long *pnInOffset, unsigned long *pnOutOffset) {
+    Frame *info = receive_frame(pConn);
+    unsigned long nInSize = 0, nOutSize = 0;
+    char sInMD5[MD5_HEX_SIZE], sOutMD5[MD5_HEX_SIZE];
+    if (!info || info->type != FRAME_FILE_INFO ||
+        sscanf(info->data, "%lu&%32[^&]&%lu&%32s", &nInSize, sInMD5, &nOutSize, sOutMD5) != 4) {
+        if (info) free_frame(info);
+        return -1;
+    }
+    free_frame(info);
+
+    char sReply[DATA_SIZE] = "CHECK_KO";
+    if (nHasPrefix(psPath, nInSize, sInMD5)) {
+        *pnInOffset = nInSize;
+        *pnOutOffset = nHasPrefix(psDistortedPath, nOutSize, sOutMD5) ? nOutSize : 0;
+        if (*pnOutOffset > 0 && nCopyPrefix(psDistortedPath, psPartPath, nOutSize) != 0) {
+            *pnOutOffset = 0;
+        }
+        snprintf(sReply, sizeof(sReply), "CHECK_OK&%lu", *pnOutOffset);
+
+        char sMsg[256];
+        snprintf(sMsg, sizeof(sMsg), "Worker holds the first %lu bytes and their distortion, "
+                 "%lu distorted bytes are kept here\n", nInSize, *pnOutOffset);
+        vWriteLog(sMsg);
+    } else {
+        vWriteLog("File changed beyond appended bytes, it is uploaded whole\n");
+    }
+    Frame *reply = create_frame(FRAME_MD5_CHECK, sReply, strlen(sReply));
+    int nOk = send_frame(pConn, reply);
+    free_frame(reply);
+    return nOk ? 0 : -1;
+}
+
+/*************************************************
+* @Name: nConnectToWorker
+* @Def: Connects to worker and handles distortion
+* @Arg: In: pJob = job to run
+*       In: psIP = worker IP
+*       In: psPort = worker port
+*       In: nIsResume = continue the job after a worker crash
+* @Ret: 0 once the distorted file is in place, -1 otherwise
+*************************************************/
+int nConnectToWorker(FleckJob *pJob, const char* psIP, const char* psPort, int nIsResume) {
+    const char *psFile = pJob->sFile;
+    const char *psFactor = pJob->sFactor;
+
+    // Share the connection of the batch's files on this worker, reuse a
+    // pooled one, or connect. Either way the job runs on a stream of its
+    // own, flow-controlled apart from the connection's other streams
+    Connection *pMux = pJob->pLane ? pLaneConnection(pJob->pLane) : pTakePooled(psIP, psPort);
+    int nIsPooled = pMux != NULL && !pJob->pLane;
+    if (pJob->pLane) {
+        // The lane closes its connection once all its files are through
+    } else if (nIsPooled) {
+        vWriteLog("Reusing the pooled connection to the worker\n");
+    } else {
+        pMux = pConnectWorker(psIP, psPort, pJob->sLocalIP);
+        if (pMux && !enable_mux(pMux, NULL, NULL, 0)) {
+            close_connection(pMux);
+            pMux = NULL;
+        }
+    }
+
+    // From here CANCEL cuts the connection, or resets the stream of a
+    // lane's, which ends the job on both sides
+    pthread_mutex_lock(&gJobsMutex);
+    pJob->pMux = pJob->pLane ? NULL : pMux;
+    pJob->pConn = pMux ? open_stream(pMux) : NULL;
+    snprintf(pJob->sWorker, sizeof(pJob->sWorker), "%s:%s", psIP, psPort);
+    int nIsCancelled = pJob->nIsCancelled;
+    pthread_mutex_unlock(&gJobsMutex);
+    if (nIsCancelled) {
+        /* A parked pooled session would leave the worker reserved */
+        vCloseWorker(pJob);
+        if (nIsPooled) vReleaseWorker(psIP, psPort);
+        return -1;
+    }
+    if (!pJob->pConn && nIsPooled) {
+        vWriteLog("Pooled connection was closed by the worker, connecting again\n");
+        vCloseWorker(pJob);
+        return nConnectToWorker(pJob, psIP, psPort, nIsResume);
+    }
+    if (!pJob->pConn && pJob->pLane) {
+        /* Gotham moves the batch's file to another worker, as after a crash */
+        vWriteLog("Lost the batch's worker\n");
+        return nHandleWorkerCrash(pJob);
+    }
+    if (!pJob->pConn) {
+        vWriteLog("Failed to connect to worker\n");
+        vJobMessage(pJob, "Error: Failed to connect to the worker\n");
+        vCloseWorker(pJob);
+        return -1;
+    }
+
+    // The MD5 taken with the request goes with it; without one it is
+    // computed while sending and follows the data as a trailer
+    char sFilePath[1024];
+    snprintf(sFilePath, sizeof(sFilePath), "%s/%s", gConfig.sFolderPath, psFile);
+    char sDistortedPath[1024];
+    snprintf(sDistortedPath, sizeof(sDistortedPath), "%s/distorted_%s",
+             gConfig.sFolderPath, psFile);
+    char sPartPath[1024];
+    vPartPath(sPartPath, sizeof(sPartPath), psFile);
+
+    // Get file size
+    struct stat st;
+    if (stat(sFilePath, &st) != 0) {
+        vWriteLog("Failed to get file stats\n");
+        return nHandleWorkerCrash(pJob);
+    }
+    unsigned long nFileSize = st.st_size;
+
+    // The output goes to a part file, renamed into place once checked, so
+    // an earlier result stays until then. A resumed job keeps the bytes
+    // already there
+    unsigned long nOutHave = 0;
+    if (nIsResume && stat(sPartPath, &st) == 0) {
+        nOutHave = st.st_size;
+    }
+
+    // A worker on this host can be handed the input and output files
+    // instead of having them sent. The part file it gets is empty, so a
+    // resume only counts bytes the worker wrote; the bytes an append
+    // continues from are copied there once agreed on
+    int pHandoff[2] = { -1, -1 };
+    int nIsLocal = is_local_socket(pJob->pConn);
+    if (nIsLocal && !nIsResume) {
+        pHandoff[0] = open(sFilePath, O_RDONLY | O_CLOEXEC);
+        pHandoff[1] = pHandoff[0] < 0 ? -1 : open(sPartPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    int nHandoffFds = pHandoff[1] >= 0 ? 2 : 0;
+
+    // Send connection frame: "user&file&size&md5&factor&mode&jobId", plus
+    // "&outOffset" when asking the worker to resume the job. The mode also
+    // offers the bulk transfer option, and over a unix socket the shared
+    // rings for the bulk bytes and the file handoff, or zlib packing over
+    // a network link. A new job with a known MD5 offers a delta upload, or
+    // to continue the worker's last job on the file if it only grew
+    char sData[DATA_SIZE];
+    int nIsKnown = !nIsResume && strcmp(pJob->sMD5, MD5_DEFERRED) != 0;
+    int nLen = snprintf(sData, sizeof(sData), "%s&%s&%lu&%s&%s&%s+%s%s%s%s%s&%s",
+                        gConfig.sUsername, psFile, nFileSize, pJob->sMD5, psFactor,
+                        nFileSize > MERKLE_CHUNK_SIZE ? MERKLE_MODE : PLAIN_MODE, BULK_MODE,
+                        nIsLocal ? "+" SHM_MODE : "+" ZLIB_MODE, nHandoffFds ? "+" HANDOFF_MODE : "",
+                        nIsKnown ? "+" DELTA_MODE : "", nIsKnown ? "+" APPEND_MODE : "",
+                        pJob->sJobId);
+    if (nIsResume) {
+        snprintf(sData + nLen, sizeof(sData) - nLen, "&%lu", nOutHave);
     }
-    free_frame(response);
 
-    // Simulate receiving distorted data
-    response = receive_frame(gpWorkerConn);
-    if (!response || response->type != FRAME_FILE_DATA) {
+    uint8_t nType = nIsResume ? FRAME_RESUME_REQ : FRAME_WORKER_CONNECT;
+    Frame* frame = create_frame(nType, sData, strlen(sData));
+    int nSent = nHandoffFds ? send_frame_fds(pJob->pConn, frame, pHandoff, nHandoffFds)
+                            : send_frame(pJob->pConn, frame);
+    free_frame(frame);
+    /* The worker has its own copies now */
+    for (int i = 0; i < 2; i++) {
+        if (pHandoff[i] >= 0) close(pHandoff[i]);
+    }
+
+    // Wait for worker acknowledgment; "MERKLE" confirms the chunked mode and
+    // "+BULK" and "+SHM" suffixes the options, the latter with the ring
+    // descriptors attached, and "+CACHED" a result served without upload;
+    // "+APPEND" is followed by the sizes and MD5s of the last job on the file.
+    // A resume is answered with "mode&inOffset&outOffset"
+    int pShmFds[SHM_LINK_FDS];
+    int nShmFds = 0;
+    Frame* response = nSent ? receive_frame_fds(pJob->pConn, pShmFds, SHM_LINK_FDS, &nShmFds) : NULL;
+    if (!response && nIsPooled && !pJob->nIsCancelled) {
+        /* The worker let the pooled connection go meanwhile */
+        vWriteLog("Pooled connection was closed by the worker, connecting again\n");
+        vCloseWorker(pJob);
+        return nConnectToWorker(pJob, psIP, psPort, nIsResume);
+    }
+    if (!response || response->type != nType) {
         if (response) free_frame(response);
-        vHandleWorkerCrash();
-        return;
+        for (int i = 0; i < nShmFds; i++) close(pShmFds[i]);
+        return nHandleWorkerCrash(pJob);
+    }
+    char sMode[32] = "";
+    unsigned long nInOffset = 0, nOutOffset = 0;
+    if (nIsResume) {
+        if (sscanf(response->data, "%31[^&]&%lu&%lu", sMode, &nInOffset, &nOutOffset) != 3 ||
+            nInOffset > nFileSize || nOutOffset > nOutHave) {
+            vWriteLog("Worker refused to resume the job\n");
+            vJobMessage(pJob, "Error: Worker could not resume the distortion\n");
+            free_frame(response);
+            for (int i = 0; i < nShmFds; i++) close(pShmFds[i]);
+            vCloseWorker(pJob);
+            return -1;
+        }
+        char sMsg[256];
+        snprintf(sMsg, sizeof(sMsg), "Resuming upload at byte %lu and download at byte %lu\n",
+                 nInOffset, nOutOffset);
+        vWriteLog(sMsg);
+    } else if (response->data_length < sizeof(sMode)) {
+        memcpy(sMode, response->data, response->data_length);
+        sMode[response->data_length] = '\0';
+    }
+    UploadControl upload;
+    memset(&upload, 0, sizeof(upload));
+    upload.nIsBulk = mode_has_option(sMode, BULK_MODE);
+    upload.nIsHandoff = nHandoffFds > 0 && mode_has_option(sMode, HANDOFF_MODE);
+    upload.nIsAnnounced = strcmp(pJob->sMD5, MD5_DEFERRED) != 0;
+    upload.nIsCached = !nIsResume && mode_has_option(sMode, CACHED_MODE);
+    if (upload.nIsCached) vWriteLog("Worker holds the result, nothing is uploaded\n");
+    if (!nIsResume && !upload.nIsCached && mode_has_option(sMode, HELD_MODE)) {
+        vWriteLog("Worker holds the original, nothing is uploaded\n");
+        upload.nIsCached = 1;
+    }
+    if (upload.nIsBulk && mode_has_option(sMode, ZLIB_MODE)) enable_bulk_compression(pJob->pConn);
+    if (upload.nIsHandoff) vWriteLog("Worker reads and writes the files directly\n");
+    if (upload.nIsBulk && mode_has_option(sMode, SHM_MODE) && nShmFds == SHM_LINK_FDS &&
+        (pJob->pConn->shm = pAttachShmLink(pShmFds)) != NULL) {
+        vWriteLog("Bulk data moves through a shared-memory ring\n");
+    } else {
+        for (int i = 0; i < nShmFds; i++) close(pShmFds[i]);
+        if (mode_has_option(sMode, SHM_MODE)) {
+            vWriteLog("Could not map the worker's shared-memory ring\n");
+            free_frame(response);
+            return nHandleWorkerCrash(pJob);
+        }
+    }
+    /* The block signatures of a delta upload follow the ack */
+    DeltaIndex *pDelta = NULL;
+    if (!nIsResume && !upload.nIsCached && mode_has_option(sMode, DELTA_MODE)) {
+        pDelta = pDeltaReceiveSignatures(pJob->pConn);
+        if (!pDelta) {
+            vWriteLog("Failed to receive the block signatures\n");
+            free_frame(response);
+            return nHandleWorkerCrash(pJob);
+        }
+        vWriteLog("Worker holds a previous version, only the changes are uploaded\n");
+    }
+    /* So does the end state of its last job on the file, if it only grew */
+    if (!nIsResume && !upload.nIsCached && mode_has_option(sMode, APPEND_MODE)) {
+        if (nCheckAppend(pJob->pConn, sFilePath, sDistortedPath, sPartPath, &nInOffset, &nOutOffset) != 0) {
+            vWriteLog("Failed to agree on the worker's earlier version\n");
+            free_frame(response);
+            return nHandleWorkerCrash(pJob);
+        }
+    }
+    sMode[strcspn(sMode, "+")] = '\0';
+    if (strcmp(sMode, MERKLE_MODE) == 0) {
+        upload.nChunks = nMerkleChunkCount(nFileSize);
+        upload.pResend = calloc(upload.nChunks, 1);
     }
     free_frame(response);
+    pthread_mutex_init(&upload.mutex, NULL);
+    pthread_cond_init(&upload.cond, NULL);
+
+    // Receive the distorted file while the upload is still in progress
+    DownloadState download = { pJob->pConn, sPartPath, &upload, nOutOffset, nFileSize, 0, -1, 0 };
+    pthread_t download_thread;
+    if (pthread_create(&download_thread, NULL, vReceiveDistorted, &download) != 0) {
+        free(upload.pResend);
+        vDeltaFreeIndex(pDelta);
+        return nHandleWorkerCrash(pJob);
+    }
+
+    // Send the file from a read-only mapping; both paths stop early if the
+    // download side gives up
+    int nSendFailed = 1;
+    MappedFile input;
+    struct stat stIn, stNow;
+    int fd = upload.nIsCached ? -1 : open(sFilePath, O_RDONLY);
+    if (upload.nIsCached) {
+        nSendFailed = 0;
+    } else if (fd < 0 || nMapInput(&input, fd) != 0 || input.nMapped != nFileSize ||
+               fstat(fd, &stIn) != 0) {
+        vWriteLog("Failed to open file\n");
+    } else {
+        nSendFailed = pDelta ? nUploadDelta(&input, pDelta, &download) :
+            upload.pResend ? nUploadMerkle(&input, (int)(nInOffset / MERKLE_CHUNK_SIZE), &download) :
+            nUploadFile(&input, nInOffset, &download);
+    }
+    // An MD5 hashed on the way goes with the next request of the file,
+    // unless the file changed while it was sent
+    if (!nSendFailed && upload.sMD5[0] != '\0' && fstat(fd, &stNow) == 0 && stNow.st_size == stIn.st_size &&
+        stNow.st_ctim.tv_sec == stIn.st_ctim.tv_sec && stNow.st_ctim.tv_nsec == stIn.st_ctim.tv_nsec) {
+        vRememberMd5(&stIn, upload.sMD5);
+    }
+    if (fd >= 0) {
+        vUnmapFile(&input);
+        close(fd);
+    }
+    vDeltaFreeIndex(pDelta);
+
+    if (nSendFailed && pJob->pLane) {
+        reset_stream(pJob->pConn);
+    } else if (nSendFailed) {
+        shutdown(pJob->pConn->fd, SHUT_RDWR);
+    }
+    pthread_join(download_thread, NULL);
+    pthread_mutex_destroy(&upload.mutex);
+    pthread_cond_destroy(&upload.cond);
+    free(upload.pResend);
+
+    if (download.nResult == DOWNLOAD_DISTORT_KO || download.nResult == DOWNLOAD_UPLOAD_KO) {
+        vJobMessage(pJob, download.nResult == DOWNLOAD_UPLOAD_KO ?
+                    "Error: File was corrupted on its way to the worker\n" :
+                    "Error: Worker could not distort the file\n");
+        vCloseWorker(pJob);
+        return -1;
+    }
+    if (nSendFailed || download.nResult != 0) {
+        return nHandleWorkerCrash(pJob);
+    }
+
+    // A checked result takes the place of the earlier one; the part file
+    // of a job that failed goes when the job ends
+    if (download.nIsIntact && rename(sPartPath, sDistortedPath) != 0) {
+        vWriteLog("Failed to move the distorted file into place\n");
+        download.nIsIntact = 0;
+    }
+
+    // Report the result of the MD5 check
+    if (!download.nIsIntact) {
+        vJobMessage(pJob, "Error: Distorted file MD5 mismatch\n");
+    }
+    frame = create_frame(FRAME_MD5_CHECK, download.nIsIntact ? "CHECK_OK" : "CHECK_KO", 8);
+    send_frame(pJob->pConn, frame);
+    free_frame(frame);
 
-    // Send MD5 check acknowledgment
-    Frame* ack = create_frame(FRAME_MD5_CHECK, "CHECK_OK", 8);
-    send_frame(gpWorkerConn, ack);
-    free_frame(ack);
+    // The job is over; CANCEL has nothing left to cut
+    pthread_mutex_lock(&gJobsMutex);
+    close_connection(pJob->pConn);
+    pJob->pConn = NULL;
+    pMux = pJob->pMux;
+    pJob->pMux = NULL;
+    pthread_mutex_unlock(&gJobsMutex);
+
+    // A lane's connection stays with it, the worker still reserved;
+    // otherwise it is kept for the next request
+    if (pMux) vIdleWorker(psIP, psPort, pMux);
+    return download.nIsIntact ? 0 : -1;
 }
@@ -13,6 +13,8 @@
 #include "logging.h"
 
 #include "shared.h"
+#include "cpu.h"
+#include "md5.h"
 #include <pthread.h>
 #include <arpa/inet.h>
 
@@ -27,14 +29,48 @@ typedef struct {
     char* psType;        // "Media" or "Text"
     int nIsMain;         // Is this the main worker of its type
     int nIsBusy;        // Currently processing a request
+    char sIP[MAX_IP_LENGTH];     // Address advertised for Fleck connections
+    char sPort[MAX_PORT_LENGTH];
+    char sLocalIP[MAX_IP_LENGTH]; // "unix:/path" for Flecks on the worker's host, empty if none
+    char sCacheKeys[CACHE_REPORT_KEYS][CACHE_KEY_LENGTH]; // Results it reported holding, "" if free
+    int nNextKey;                // Slot the next reported result replaces when all are used
+    char sJobKey[CACHE_KEY_LENGTH]; // Cache key of the job it was given, "" if none or unknown
+    unsigned long nCacheBytes;   // Budget of its result cache, 0 if none or not reported yet
 } Worker;
 
+#define JOB_HISTORY 1024   // Jobs per client remembered for RESUME_REQ, enough for a pipelined burst;
+                           // a batch grows it by its own size
+
+typedef struct {
+    char sJobId[JOB_ID_LENGTH];      // "" marks a free entry
+    char sIP[MAX_IP_LENGTH];         // Worker endpoint the job was last given
+    char sPort[MAX_PORT_LENGTH];
+} JobRecord;
+
 typedef struct {
     Connection* pConn;
     char* psUsername;
     Worker* pCurrentWorker;
+    JobRecord* pJobs;                // Last nJobSlots jobs handed out, oldest overwritten first
+    int nJobSlots;                   // Entries of pJobs, at least JOB_HISTORY
+    int nNextJob;                    // Entry the next job takes
+    struct PendingRequest* pBatch;   // Files of batches not complete yet
 } FleckClient;
 
+/* A DISTORT_REQ or RESUME_REQ not answered yet. Tagged requests wait for
+ * a free worker; untagged ones only for the same job run by someone else */
+typedef struct PendingRequest {
+    FleckClient* pClient;
+    uint8_t nType;                   // FRAME_DISTORT_REQ or FRAME_RESUME_REQ
+    char sTag[REQUEST_TAG_LENGTH];   // "#id&" its answers start with, "" if untagged
+    char sData[DATA_SIZE + 1];       // Request without its tag
+    Worker* pLeader;                 // Worker running the same job it waits on, NULL if none
+    int nIsReleased;                 // Its leader ended without a cached result, so it runs on its own
+    unsigned int nBatch;             // Batch of a DISTORT_BATCH file and the file's size
+    unsigned long nSize;
+    struct PendingRequest* pNext;
+} PendingRequest;
+
 /* Thread management */
 typedef struct {
     Worker* pWorker;
@@ -50,7 +86,10 @@ static size_t gnClientCount = 0;
 static pthread_mutex_t gWorkersMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t gClientsMutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t gShutdownMutex = PTHREAD_MUTEX_INITIALIZER;
+static PendingRequest* gpPending = NULL;     // Waiting requests, oldest first
+static pthread_mutex_t gPendingMutex = PTHREAD_MUTEX_INITIALIZER;  // Taken before the workers mutex
 static volatile int gnShutdownInProgress = 0;
+static unsigned int gnNextJob = 0;
 
 /* Function declarations */
 void vHandleWorkerRegistration(Connection* pConn, Frame* pFrame);
@@ -64,8 +103,12 @@ void vHandleFleckDisconnection(Connection* pConn);
 void vHandleWorkerCrash(Worker* pWorker);
 void vCompactWorkerArray();
 void vCheckMainWorkers();
-void vHandleDistortRequest(FleckClient* pClient, Frame* pFrame);
+void vSubmitRequest(FleckClient* pClient, Frame* pFrame, uint8_t nType);
 void vHandleFrame(Connection* pConn, Frame* pFrame);
+void vHandleWorkerFrame(Worker* pWorker, Frame* pFrame);
+static void vDispatchPending(Worker* pFreed);
+static void vDropPending(FleckClient* pClient);
+static void vCollectBatch(PendingRequest* pReq);
 
 /*************************************************
 * @Name: main
@@ -88,6 +131,8 @@ int main(int nArgc, char* psArgv[]) {
     sigaction(SIGINT, &sa, NULL);
 
     /* Initialize */
+    vInitCpuDispatch();
+    vInitIoBackend();
     vWriteLog("Reading configuration file\n");
     load_gotham_config(psArgv[1], &gConfig);
 
@@ -139,6 +184,18 @@ int main(int nArgc, char* psArgv[]) {
         }
         pthread_mutex_unlock(&gClientsMutex);
 
+        // Add all worker connections, for their cache and idle reports
+        pthread_mutex_lock(&gWorkersMutex);
+        for (size_t i = 0; i < gnWorkerCount; i++) {
+            if (gpWorkers[i] && gpWorkers[i]->pConn) {
+                FD_SET(gpWorkers[i]->pConn->fd, &readfds);
+                if (gpWorkers[i]->pConn->fd > max_fd) {
+                    max_fd = gpWorkers[i]->pConn->fd;
+                }
+            }
+        }
+        pthread_mutex_unlock(&gWorkersMutex);
+
         tv.tv_sec = SOCKET_TIMEOUT_SEC;
         tv.tv_usec = 0;
 
@@ -151,9 +208,8 @@ int main(int nArgc, char* psArgv[]) {
         if (FD_ISSET(gpServerConn->fd, &readfds)) {
             int nClientFd = accept_connection(gpServerConn);
             if (nClientFd >= 0) {
-                Connection* pConn = malloc(sizeof(Connection));
+                Connection* pConn = create_connection(nClientFd);
                 if (pConn) {
-                    pConn->fd = nClientFd;
                     Frame* frame = receive_frame(pConn);
                     if (frame) {
                         vHandleFrame(pConn, frame);
@@ -163,22 +219,60 @@ int main(int nArgc, char* psArgv[]) {
             }
         }
 
-        // Check existing client connections
-        pthread_mutex_lock(&gClientsMutex);
-        for (size_t i = 0; i < gnClientCount; i++) {
+        // Check worker connections first, so a worker reporting itself idle
+        // is free again for a request that arrived in the same round.
+        // Workers are only removed by this thread, so the one found stays
+        // valid once the mutex is dropped
+        for (size_t i = 0; ; i++) {
+            Worker* pReady = NULL;
+            pthread_mutex_lock(&gWorkersMutex);
+            if (i >= gnWorkerCount) {
+                pthread_mutex_unlock(&gWorkersMutex);
+                break;
+            }
+            if (gpWorkers[i] && gpWorkers[i]->pConn &&
+                FD_ISSET(gpWorkers[i]->pConn->fd, &readfds)) {
+                pReady = gpWorkers[i];
+            }
+            pthread_mutex_unlock(&gWorkersMutex);
+
+            if (!pReady) continue;
+
+            Frame* frame = receive_frame(pReady->pConn);
+            if (frame) {
+                vHandleWorkerFrame(pReady, frame);
+                free_frame(frame);
+            } else {
+                vHandleWorkerCrash(pReady);
+            }
+        }
+
+        // Check existing client connections. The handlers take the clients
+        // mutex themselves, so it is only held while looking the client up.
+        for (size_t i = 0; ; i++) {
+            Connection* pReady = NULL;
+            pthread_mutex_lock(&gClientsMutex);
+            if (i >= gnClientCount) {
+                pthread_mutex_unlock(&gClientsMutex);
+                break;
+            }
             if (gpClients[i] && gpClients[i]->pConn &&
                 FD_ISSET(gpClients[i]->pConn->fd, &readfds)) {
-                Frame* frame = receive_frame(gpClients[i]->pConn);
-                if (frame) {
-                    vHandleFrame(gpClients[i]->pConn, frame);
-                    free_frame(frame);
-                } else {
-                    // Connection lost
-                    vHandleFleckDisconnection(gpClients[i]->pConn);
-                }
+                pReady = gpClients[i]->pConn;
+            }
+            pthread_mutex_unlock(&gClientsMutex);
+
+            if (!pReady) continue;
+
+            Frame* frame = receive_frame(pReady);
+            if (frame) {
+                vHandleFrame(pReady, frame);
+                free_frame(frame);
+            } else {
+                // Connection lost
+                vHandleFleckDisconnection(pReady);
             }
         }
-        pthread_mutex_unlock(&gClientsMutex);
     }
 
     /* Cleanup */
@@ -202,12 +296,14 @@ int main(int nArgc, char* psArgv[]) {
 void vHandleWorkerRegistration(Connection* pConn, Frame* pFrame) {
     vWriteLog("Starting worker registration process...\n");
 
-    // Parse <workerType>&<IP>&<Port>
+    // Parse <workerType>&<IP>&<Port>[&unix:<path>]
     char sType[MAX_TYPE_LENGTH] = {0};
     char sIP[MAX_IP_LENGTH] = {0};
     char sPort[MAX_PORT_LENGTH] = {0};
+    char sLocalIP[MAX_IP_LENGTH] = {0};
 
-    if (sscanf(pFrame->data, "%[^&]&%[^&]&%s", sType, sIP, sPort) != 3) {
+    if (sscanf(pFrame->data, "%15[^&]&%127[^&]&%5[^&]&%127s", sType, sIP, sPort, sLocalIP) < 3 ||
+        (sLocalIP[0] != '\0' && !is_unix_endpoint(sLocalIP))) {
         Frame* error = create_frame(FRAME_ERROR, NULL, 0);
         send_frame(pConn, error);
         free_frame(error);
@@ -235,10 +331,19 @@ void vHandleWorkerRegistration(Connection* pConn, Frame* pFrame) {
 
     // Store worker's address info
     pWorker->pConn = pConn;
-    memcpy(&pWorker->pConn->addr, &pConn->addr, sizeof(struct sockaddr_in));
+    memcpy(&pWorker->pConn->addr, &pConn->addr, sizeof(pConn->addr));
     pWorker->psType = strdup(sType);
     pWorker->nIsMain = 0;
     pWorker->nIsBusy = 0;
+    strncpy(pWorker->sIP, sIP, MAX_IP_LENGTH - 1);
+    pWorker->sIP[MAX_IP_LENGTH - 1] = '\0';
+    strncpy(pWorker->sPort, sPort, MAX_PORT_LENGTH - 1);
+    pWorker->sPort[MAX_PORT_LENGTH - 1] = '\0';
+    snprintf(pWorker->sLocalIP, sizeof(pWorker->sLocalIP), "%s", sLocalIP);
+    memset(pWorker->sCacheKeys, 0, sizeof(pWorker->sCacheKeys));
+    pWorker->nNextKey = 0;
+    pWorker->sJobKey[0] = '\0';
+    pWorker->nCacheBytes = 0;
 
     pthread_mutex_lock(&gWorkersMutex);
 
@@ -267,7 +372,7 @@ void vHandleWorkerRegistration(Connection* pConn, Frame* pFrame) {
         response = create_frame(FRAME_WORKER_REG, NULL, 0); // 0x02
     }
 
-    if (send_frame(pConn, response) != 0) {
+    if (!send_frame(pConn, response)) {
         vWriteLog("Failed to send registration response\n");
         free_frame(response);
         // Cleanup...
@@ -282,6 +387,9 @@ void vHandleWorkerRegistration(Connection* pConn, Frame* pFrame) {
     } else {
         vWriteLog("New Harley worker connected - ready to distort!\n");
     }
+
+    /* Requests queued for a free worker may take it */
+    vDispatchPending(NULL);
 }
 
 /*************************************************
@@ -314,6 +422,19 @@ void vHandleFleckConnection(Connection* pConn, Frame* pFrame) {
     pClient->pConn = pConn;
     pClient->psUsername = strdup(sUsername);
     pClient->pCurrentWorker = NULL;
+    pClient->pJobs = calloc(JOB_HISTORY, sizeof(JobRecord));
+    pClient->nJobSlots = JOB_HISTORY;
+    pClient->nNextJob = 0;
+    pClient->pBatch = NULL;
+    if (!pClient->pJobs) {
+        free(pClient->psUsername);
+        free(pClient);
+        Frame* error = create_frame(FRAME_ERROR, "Internal error", 13);
+        send_frame(pConn, error);
+        free_frame(error);
+        close_connection(pConn);
+        return;
+    }
 
     // Add to clients array
     pthread_mutex_lock(&gClientsMutex);
@@ -323,7 +444,7 @@ void vHandleFleckConnection(Connection* pConn, Frame* pFrame) {
 
     // Send connection acknowledgment frame
     Frame* response = create_frame(FRAME_CONNECT_REQ, NULL, 0);  // Empty data means success
-    if (send_frame(pConn, response) != 0) {
+    if (!send_frame(pConn, response)) {
         free_frame(response);
         vHandleFleckDisconnection(pConn);
         return;
@@ -402,8 +523,10 @@ void vHandleShutdown(void) {
     pthread_mutex_lock(&gClientsMutex);
     for (size_t i = 0; i < gnClientCount; i++) {
         if (gpClients[i]) {
+            vDropPending(gpClients[i]);
             close_connection(gpClients[i]->pConn);
             free(gpClients[i]->psUsername);
+            free(gpClients[i]->pJobs);
             free(gpClients[i]);
         }
     }
@@ -434,72 +557,653 @@ void vHandleShutdown(void) {
 }
 
 /*************************************************
-* @Name: vHandleDistortRequest
-* @Def: Handles FRAME_DISTORT_REQ (0x10) frames
-* @Arg: In: pClient = Requesting client
-*       In: pFrame = Received frame
+* @Name: nHoldsResult
+* @Def: Whether a worker reported holding a cached result. Caller holds
+*       gWorkersMutex
+* @Arg: In: pWorker = worker
+*       In: psCacheKey = cache key, or NULL
+* @Ret: 1 if it does, 0 otherwise
+*************************************************/
+static int nHoldsResult(const Worker* pWorker, const char* psCacheKey) {
+    if (!psCacheKey || psCacheKey[0] == '\0') return 0;
+    for (int i = 0; i < CACHE_REPORT_KEYS; i++) {
+        if (strcmp(pWorker->sCacheKeys[i], psCacheKey) == 0) return 1;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nHoldsInput
+* @Def: Whether a worker reported holding the input of a request, which
+*       is reported under its MD5 alone, the first field of the cache
+*       key. Caller holds gWorkersMutex
+* @Arg: In: pWorker = worker
+*       In: psCacheKey = cache key, or NULL
+* @Ret: 1 if it does, 0 otherwise
+*************************************************/
+static int nHoldsInput(const Worker* pWorker, const char* psCacheKey) {
+    if (!psCacheKey || psCacheKey[0] == '\0') return 0;
+    size_t nLen = strcspn(psCacheKey, "&");
+    for (int i = 0; i < CACHE_REPORT_KEYS; i++) {
+        if (strlen(pWorker->sCacheKeys[i]) == nLen && strncmp(pWorker->sCacheKeys[i], psCacheKey, nLen) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: pSelectWorker
+* @Def: Picks a free worker of the given type and marks it busy. One
+*       holding the cached result of the request is preferred, then one
+*       holding its input, which is not uploaded again. Workers
+*       listening on the avoided endpoint are only used as a last resort
+* @Arg: In: psType = "Media" or "Text"
+*       In: psCacheKey = cache key of the request, or NULL
+*       In: psAvoidIP = endpoint to avoid, or NULL
+*       In: psAvoidPort = endpoint to avoid, or NULL
+*       Out: pnIsCached = set if the selected worker holds the result, may be NULL
+* @Ret: Selected worker or NULL if none is free
+*************************************************/
+static Worker* pSelectWorker(const char* psType, const char* psCacheKey, const char* psAvoidIP,
+                             const char* psAvoidPort, int* pnIsCached) {
+    Worker* pSelectedWorker = NULL;
+    Worker* pHolder = NULL;
+    Worker* pFallback = NULL;
+
+    pthread_mutex_lock(&gWorkersMutex);
+    for(size_t i = 0; i < gnWorkerCount; i++) {
+        if(!gpWorkers[i] || gpWorkers[i]->nIsBusy ||
+           strcasecmp(gpWorkers[i]->psType, psType) != 0) {
+            continue;
+        }
+        if(psAvoidIP && strcmp(gpWorkers[i]->sIP, psAvoidIP) == 0 &&
+           strcmp(gpWorkers[i]->sPort, psAvoidPort) == 0) {
+            if(!pFallback) pFallback = gpWorkers[i];
+            continue;
+        }
+        if(nHoldsResult(gpWorkers[i], psCacheKey)) {
+            pSelectedWorker = gpWorkers[i];
+            pHolder = NULL;
+            break;
+        }
+        if(!pHolder && nHoldsInput(gpWorkers[i], psCacheKey)) pHolder = gpWorkers[i];
+        if(!pSelectedWorker) pSelectedWorker = gpWorkers[i];
+    }
+    if(pHolder) pSelectedWorker = pHolder;
+    if(!pSelectedWorker) pSelectedWorker = pFallback;
+    if(pnIsCached) *pnIsCached = pSelectedWorker && nHoldsResult(pSelectedWorker, psCacheKey);
+    if(pSelectedWorker) {
+        pSelectedWorker->nIsBusy = 1;
+        snprintf(pSelectedWorker->sJobKey, sizeof(pSelectedWorker->sJobKey), "%s", psCacheKey ? psCacheKey : "");
+    }
+    pthread_mutex_unlock(&gWorkersMutex);
+
+    return pSelectedWorker;
+}
+
+/*************************************************
+* @Name: pFindLeader
+* @Def: Finds a busy worker already given a job with the same cache key,
+*       i.e. the same input, type and factor, whose result a wait gets.
+*       That is one serving it from its cache or, unless the request was
+*       released by an uncached leader, one whose cache can keep it.
+*       None is returned when a free worker holds the result, since it
+*       can serve it at once
+* @Arg: In: pReq = request
+*       In: psType = "Media" or "Text"
+*       In: psCacheKey = cache key of the request, or NULL
+*       In: nSize = input size, the guess at the result size, 0 if unknown
+* @Ret: Worker running the job, or NULL
+*************************************************/
+static Worker* pFindLeader(const PendingRequest* pReq, const char* psType, const char* psCacheKey,
+                           unsigned long nSize) {
+    Worker* pLeader = NULL;
+    if(!psCacheKey || psCacheKey[0] == '\0') return NULL;
+
+    pthread_mutex_lock(&gWorkersMutex);
+    for(size_t i = 0; i < gnWorkerCount; i++) {
+        if(!gpWorkers[i] || strcasecmp(gpWorkers[i]->psType, psType) != 0) continue;
+        int nHolds = nHoldsResult(gpWorkers[i], psCacheKey);
+        if(!gpWorkers[i]->nIsBusy && nHolds) {
+            pLeader = NULL;
+            break;
+        }
+        int nCanKeep = nHolds || (!pReq->nIsReleased && gpWorkers[i]->nCacheBytes >= nSize &&
+                                  gpWorkers[i]->nCacheBytes > 0);
+        if(!pLeader && nCanKeep && gpWorkers[i]->nIsBusy && strcmp(gpWorkers[i]->sJobKey, psCacheKey) == 0) {
+            pLeader = gpWorkers[i];
+        }
+    }
+    pthread_mutex_unlock(&gWorkersMutex);
+
+    return pLeader;
+}
+
+/*************************************************
+* @Name: nHasWorker
+* @Def: Whether any worker of a type is registered, busy or not
+* @Arg: In: psType = "Media" or "Text"
+* @Ret: 1 if one is, 0 otherwise
+*************************************************/
+static int nHasWorker(const char* psType) {
+    int nHas = 0;
+    pthread_mutex_lock(&gWorkersMutex);
+    for(size_t i = 0; i < gnWorkerCount && !nHas; i++) {
+        nHas = gpWorkers[i] && strcasecmp(gpWorkers[i]->psType, psType) == 0;
+    }
+    pthread_mutex_unlock(&gWorkersMutex);
+    return nHas;
+}
+
+/*************************************************
+* @Name: pFindJob
+* @Def: Looks up a job recently handed out to a client
+* @Arg: In: pClient = client
+*       In: psJobId = job id
+* @Ret: Its record, or NULL if unknown or forgotten
+*************************************************/
+static JobRecord* pFindJob(FleckClient* pClient, const char* psJobId) {
+    for (int i = 0; i < pClient->nJobSlots; i++) {
+        if (pClient->pJobs[i].sJobId[0] != '\0' && strcmp(pClient->pJobs[i].sJobId, psJobId) == 0) {
+            return &pClient->pJobs[i];
+        }
+    }
+    return NULL;
+}
+
+/*************************************************
+* @Name: vAnswer
+* @Def: Sends the answer to a request, behind the request's tag
+* @Arg: In: pReq = request
+*       In: nType = frame type of the answer
+*       In: psAnswer = answer text
+* @Ret: None
+*************************************************/
+static void vAnswer(PendingRequest* pReq, uint8_t nType, const char* psAnswer) {
+    char sData[DATA_SIZE + 1];
+    int nLength = snprintf(sData, sizeof(sData), "%s%s", pReq->sTag, psAnswer);
+    if (nLength < 0 || nLength > DATA_SIZE) nLength = DATA_SIZE;
+
+    Frame* response = create_frame(nType, sData, nLength);
+    send_frame(pReq->pClient->pConn, response);
+    free_frame(response);
+}
+
+/*************************************************
+* @Name: vAnswerWorker
+* @Def: Answers a request with a worker: its TCP endpoint, and its unix
+*       socket when it has one. Only the client can tell whether that
+*       socket is on its host, so it picks which one to use
+* @Arg: In: pReq = request
+*       In: nType = answer frame type
+*       In: pWorker = selected worker
+*       In: psJobId = job id
 * @Ret: None
 *************************************************/
-void vHandleDistortRequest(FleckClient* pClient, Frame* pFrame) {
+static void vAnswerWorker(PendingRequest* pReq, uint8_t nType, Worker* pWorker, const char* psJobId) {
+    char sResponseData[DATA_SIZE + 1];
+    int nLength = snprintf(sResponseData, sizeof(sResponseData), "%s&%s&%s&%s",
+                           pWorker->sIP, pWorker->sPort, psJobId, pWorker->sLocalIP);
+
+    /* A socket path cut short by the frame is worse than none */
+    if (pWorker->sLocalIP[0] == '\0' || nLength < 0 ||
+        strlen(pReq->sTag) + (size_t)nLength > DATA_SIZE) {
+        snprintf(sResponseData, sizeof(sResponseData), "%s&%s&%s", pWorker->sIP, pWorker->sPort, psJobId);
+    }
+    vAnswer(pReq, nType, sResponseData);
+}
+
+/*************************************************
+* @Name: nParseDistort
+* @Def: Splits a DISTORT_REQ, "type&file" or "type&file&md5&factor"
+*       from a client that hashed the file first, which lets a worker
+*       holding the result serve it. A client may add "&size"
+* @Arg: In: psData = request without its tag
+*       Out: psMediaType = media type, 16 bytes
+*       Out: psFileName = file name, 256 bytes
+*       Out: psCacheKey = cache key, "" without MD5 and factor
+*       Out: pnSize = input size, 0 if not given, may be NULL
+* @Ret: 1 if well formed, 0 otherwise
+*************************************************/
+static int nParseDistort(const char* psData, char* psMediaType, char* psFileName, char* psCacheKey,
+                         unsigned long* pnSize) {
+    char sMD5[MD5_HEX_SIZE], sFactor[32];
+    unsigned long nSize = 0;
+
+    psCacheKey[0] = '\0';
+    int nFields = sscanf(psData, "%15[^&]&%255[^&]&%32[^&]&%31[^&]&%lu", psMediaType, psFileName, sMD5,
+                         sFactor, &nSize);
+    if(nFields >= 4 && !make_cache_key(psCacheKey, sMD5, sFactor, psFileName)) {
+        psCacheKey[0] = '\0';
+    }
+    if(pnSize) *pnSize = nFields == 5 ? nSize : 0;
+    return nFields >= 2;
+}
+
+/*************************************************
+* @Name: vAssignWorker
+* @Def: Answers a DISTORT_REQ with the worker picked for it, under a new
+*       job id that lets a replacement worker find what was already
+*       transferred
+* @Arg: In: pReq = request
+*       In: pWorker = worker, already marked busy
+*       In: psMediaType = media type of the request
+*       In: psFileName = file name of the request
+*       In: nIsCached = whether the worker holds the result
+* @Ret: None
+*************************************************/
+static void vAssignWorker(PendingRequest* pReq, Worker* pWorker, const char* psMediaType,
+                          const char* psFileName, int nIsCached) {
+    char sLogMsg[512];
+    FleckClient* pClient = pReq->pClient;
+
+    /* Hand out the endpoints the worker listens on, not its Gotham socket */
+    const char* sPort = pWorker->sPort;
+
+    JobRecord* pJob = &pClient->pJobs[pClient->nNextJob];
+    pClient->nNextJob = (pClient->nNextJob + 1) % pClient->nJobSlots;
+    pClient->pCurrentWorker = pWorker;
+    snprintf(pJob->sJobId, sizeof(pJob->sJobId), "%lx%04x",
+             (unsigned long)time(NULL), gnNextJob++ & 0xFFFF);
+    snprintf(pJob->sIP, sizeof(pJob->sIP), "%s", pWorker->sIP);
+    snprintf(pJob->sPort, sizeof(pJob->sPort), "%s", sPort);
+
+    vAnswerWorker(pReq, FRAME_DISTORT_REQ, pWorker, pJob->sJobId);
+
+    snprintf(sLogMsg, sizeof(sLogMsg), "Assigned %s worker %s:%s for %s (job %s)%s\n",
+            psMediaType, pWorker->sIP, sPort, psFileName, pJob->sJobId,
+            nIsCached ? ", which holds the result" : "");
+    vWriteLog(sLogMsg);
+}
+
+/*************************************************
+* @Name: nServeDistort
+* @Def: Tries to answer a DISTORT_REQ with a worker. The same job already
+*       running for someone else is not started again if its worker can
+*       keep the result: the request waits for it, saving a worker for
+*       the burst. Caller holds gPendingMutex
+* @Arg: In: pReq = request, as nParseDistort takes it
+* @Ret: 1 if answered, 0 if it has to wait
+*************************************************/
+static int nServeDistort(PendingRequest* pReq) {
     char sMediaType[16], sFileName[256];
+    char sCacheKey[CACHE_KEY_LENGTH];
     char sLogMsg[512];
+    unsigned long nSize = 0;
 
-    // Parse request data
-    if(sscanf(pFrame->data, "%15[^&]&%255s", sMediaType, sFileName) != 2) {
+    if(!nParseDistort(pReq->sData, sMediaType, sFileName, sCacheKey, &nSize)) {
         vWriteLog("Invalid distort request format\n");
-        Frame* error = create_frame(FRAME_ERROR, "INVALID_FORMAT", 14);
-        send_frame(pClient->pConn, error);
-        free_frame(error);
-        return;
+        vAnswer(pReq, FRAME_ERROR, "INVALID_FORMAT");
+        return 1;
     }
 
     // Validate media type
     if(strcasecmp(sMediaType, "media") != 0 && strcasecmp(sMediaType, "text") != 0) {
         vWriteLog("Invalid media type received\n");
-        Frame* response = create_frame(FRAME_DISTORT_REQ, "MEDIA_KO", 8);
-        send_frame(pClient->pConn, response);
-        free_frame(response);
+        vAnswer(pReq, FRAME_DISTORT_REQ, "MEDIA_KO");
+        return 1;
+    }
+
+    Worker* pLeader = pFindLeader(pReq, sMediaType, sCacheKey, nSize ? nSize : pReq->nSize);
+    if(pLeader) {
+        pReq->pLeader = pLeader;
+        snprintf(sLogMsg, sizeof(sLogMsg), "%s of %s is already running on %s:%s, waiting for its result\n",
+                 sMediaType, sFileName, pLeader->sIP, pLeader->sPort);
+        vWriteLog(sLogMsg);
+        return 0;
+    }
+
+    int nIsCached = 0;
+    Worker* pSelectedWorker = pSelectWorker(sMediaType, sCacheKey, NULL, NULL, &nIsCached);
+    if(!pSelectedWorker) {
+        if(pReq->sTag[0] != '\0' && nHasWorker(sMediaType)) return 0;
+        vAnswer(pReq, FRAME_DISTORT_REQ, "DISTORT_KO");
+        vWriteLog("No available workers for request\n");
+        return 1;
+    }
+
+    vAssignWorker(pReq, pSelectedWorker, sMediaType, sFileName, nIsCached);
+    return 1;
+}
+
+/*************************************************
+* @Name: nServeResume
+* @Def: Tries to answer a RESUME_REQ sent by a Fleck whose worker died
+*       mid-job. The job keeps its id and is reassigned to another worker
+*       of the same type, which then reports how much of it it already
+*       holds. Caller holds gPendingMutex
+* @Arg: In: pReq = request, "type&file&jobId"
+* @Ret: 1 if answered, 0 if it has to wait
+*************************************************/
+static int nServeResume(PendingRequest* pReq) {
+    char sMediaType[16], sFileName[256], sJobId[JOB_ID_LENGTH];
+    char sLogMsg[512];
+    FleckClient* pClient = pReq->pClient;
+
+    JobRecord* pJob = NULL;
+    if (sscanf(pReq->sData, "%15[^&]&%255[^&]&%23s", sMediaType, sFileName, sJobId) == 3) {
+        pJob = pFindJob(pClient, sJobId);
+    }
+    if (!pJob) {
+        vWriteLog("Resume request for an unknown job\n");
+        vAnswer(pReq, FRAME_RESUME_REQ, "DISTORT_KO");
+        return 1;
+    }
+
+    Worker* pSelectedWorker = pSelectWorker(sMediaType, NULL, pJob->sIP, pJob->sPort, NULL);
+    if (!pSelectedWorker) {
+        if (pReq->sTag[0] != '\0' && nHasWorker(sMediaType)) return 0;
+        vAnswer(pReq, FRAME_RESUME_REQ, "DISTORT_KO");
+        vWriteLog("No available workers to resume the job\n");
+        return 1;
+    }
+
+    pClient->pCurrentWorker = pSelectedWorker;
+    snprintf(pJob->sIP, sizeof(pJob->sIP), "%s", pSelectedWorker->sIP);
+    snprintf(pJob->sPort, sizeof(pJob->sPort), "%s", pSelectedWorker->sPort);
+
+    vAnswerWorker(pReq, FRAME_RESUME_REQ, pSelectedWorker, pJob->sJobId);
+
+    snprintf(sLogMsg, sizeof(sLogMsg), "Reassigned job %s (%s) to %s worker %s:%s\n",
+             pJob->sJobId, sFileName, sMediaType, pSelectedWorker->sIP, pSelectedWorker->sPort);
+    vWriteLog(sLogMsg);
+    return 1;
+}
+
+/*************************************************
+* @Name: vServeOrQueue
+* @Def: Answers a request, or queues it behind the others and tells the
+*       client DISTORT_WAIT. Caller holds gPendingMutex
+* @Arg: In: pReq = request, freed once answered
+* @Ret: None
+*************************************************/
+static void vServeOrQueue(PendingRequest* pReq) {
+    if ((pReq->nType == FRAME_DISTORT_REQ ? nServeDistort(pReq) : nServeResume(pReq))) {
+        free(pReq);
         return;
     }
+    PendingRequest** ppLast = &gpPending;
+    while (*ppLast) ppLast = &(*ppLast)->pNext;
+    *ppLast = pReq;
+    vAnswer(pReq, pReq->nType, DISTORT_WAIT);
+    if (!pReq->pLeader) vWriteLog("No free worker for request, queued until one frees up\n");
+}
 
-    // Worker selection logic
-    Worker* pSelectedWorker = NULL;
-    pthread_mutex_lock(&gWorkersMutex);
-    for(size_t i = 0; i < gnWorkerCount; i++) {
-        if(gpWorkers[i] && !gpWorkers[i]->nIsBusy &&
-           strcasecmp(gpWorkers[i]->psType, sMediaType) == 0) {
-            pSelectedWorker = gpWorkers[i];
-            pSelectedWorker->nIsBusy = 1;
-            break;
+/*************************************************
+* @Name: vSubmitRequest
+* @Def: Handles FRAME_DISTORT_REQ (0x10) and FRAME_RESUME_REQ (0x11)
+*       frames. A request tagged "#id&" gets answers carrying the tag, so
+*       a client may pipeline many and match them out of order; one that
+*       cannot be served yet is queued and told DISTORT_WAIT, and answered
+*       once a worker frees up. Tagged DISTORT_BATCH files are answered
+*       together, once the whole batch came
+* @Arg: In: pClient = requesting client
+*       In: pFrame = received frame
+*       In: nType = FRAME_DISTORT_REQ or FRAME_RESUME_REQ
+* @Ret: None
+*************************************************/
+void vSubmitRequest(FleckClient* pClient, Frame* pFrame, uint8_t nType) {
+    PendingRequest* pReq = calloc(1, sizeof(PendingRequest));
+    if (!pReq) {
+        Frame* error = create_frame(FRAME_ERROR, "Internal error", 13);
+        send_frame(pClient->pConn, error);
+        free_frame(error);
+        return;
+    }
+    pReq->pClient = pClient;
+    pReq->nType = nType;
+
+    const char* psData = pFrame->data;
+    size_t nLength = pFrame->data_length;
+    if (nLength > 0 && psData[0] == REQUEST_TAG) {
+        size_t nTag = 1;
+        while (nTag < nLength && isdigit((unsigned char)psData[nTag])) nTag++;
+        if (nTag > 1 && nTag < nLength && psData[nTag] == '&' && nTag + 1 < REQUEST_TAG_LENGTH) {
+            memcpy(pReq->sTag, psData, nTag + 1);
+            psData += nTag + 1;
+            nLength -= nTag + 1;
         }
     }
-    pthread_mutex_unlock(&gWorkersMutex);
+    snprintf(pReq->sData, sizeof(pReq->sData), "%.*s", (int)nLength, psData);
 
-    // Prepare response
-    if(pSelectedWorker) {
-        struct sockaddr_in* pAddr = &pSelectedWorker->pConn->addr;
-        char sIP[INET_ADDRSTRLEN];
-        char sPort[8];
+    pthread_mutex_lock(&gPendingMutex);
+    if (nType == FRAME_DISTORT_REQ && pReq->sTag[0] != '\0' &&
+        strncmp(pReq->sData, DISTORT_BATCH "&", strlen(DISTORT_BATCH) + 1) == 0) {
+        vCollectBatch(pReq);
+    } else {
+        vServeOrQueue(pReq);
+    }
+    pthread_mutex_unlock(&gPendingMutex);
+}
+
+/*************************************************
+* @Name: nBySizeDesc
+* @Def: qsort comparator putting the largest batch files first
+* @Arg: In: pvA, pvB = PendingRequest pointers
+* @Ret: Comparison result
+*************************************************/
+static int nBySizeDesc(const void* pvA, const void* pvB) {
+    const PendingRequest* pA = *(PendingRequest* const*)pvA;
+    const PendingRequest* pB = *(PendingRequest* const*)pvB;
+    return (pA->nSize < pB->nSize) - (pA->nSize > pB->nSize);
+}
+
+/*************************************************
+* @Name: vServeBatch
+* @Def: Spreads the files of a complete batch over the free workers of
+*       their type at once. Largest first, each file goes to the worker
+*       with the fewest bytes so far, a worker is reserved for each file
+*       as long as one is free, and every worker ends up with about the
+*       same share. Files of a type no worker is free for are queued one
+*       by one. Caller holds gPendingMutex
+* @Arg: In: pClient = client of the batch
+*       In: nBatch = batch number
+*       In: nCount = files in the batch
+* @Ret: None
+*************************************************/
+static void vServeBatch(FleckClient* pClient, unsigned int nBatch, int nCount) {
+    PendingRequest** ppFiles = malloc(nCount * sizeof(PendingRequest*));
+    Worker** ppWorkers = malloc(nCount * sizeof(Worker*));
+    unsigned long* pnLoad = malloc(nCount * sizeof(unsigned long));
+
+    int nFiles = 0;
+    PendingRequest** ppReq = &pClient->pBatch;
+    while (*ppReq) {
+        PendingRequest* pReq = *ppReq;
+        if (pReq->nBatch == nBatch) {
+            *ppReq = pReq->pNext;
+            pReq->pNext = NULL;
+            if (ppFiles) ppFiles[nFiles++] = pReq;
+            else free(pReq);
+            continue;
+        }
+        ppReq = &pReq->pNext;
+    }
+    if (!ppFiles || !ppWorkers || !pnLoad) {
+        /* Served one by one instead */
+        for (int i = 0; i < nFiles; i++) vServeOrQueue(ppFiles[i]);
+        free(ppFiles);
+        free(ppWorkers);
+        free(pnLoad);
+        return;
+    }
+    qsort(ppFiles, nFiles, sizeof(PendingRequest*), nBySizeDesc);
+
+    static const char* psTypes[] = { "Text", "Media" };
+    char sMediaType[16], sFileName[256], sCacheKey[CACHE_KEY_LENGTH];
+    char sLogMsg[256];
+    for (int t = 0; t < 2; t++) {
+        int nWorkers = 0, nAssigned = 0, nIsFull = 0;
+        for (int i = 0; i < nFiles; i++) {
+            if (!ppFiles[i] || !nParseDistort(ppFiles[i]->sData, sMediaType, sFileName, sCacheKey, NULL) ||
+                strcasecmp(sMediaType, psTypes[t]) != 0) {
+                continue;
+            }
+            if (!nIsFull) {
+                Worker* pWorker = pSelectWorker(sMediaType, sCacheKey, NULL, NULL, NULL);
+                if (pWorker) {
+                    /* The file it was picked for goes to it, the emptiest */
+                    ppWorkers[nWorkers] = pWorker;
+                    pnLoad[nWorkers++] = 0;
+                } else {
+                    nIsFull = 1;
+                }
+            }
+            if (nWorkers == 0) continue;
 
-        inet_ntop(AF_INET, &pAddr->sin_addr, sIP, INET_ADDRSTRLEN);
-        snprintf(sPort, sizeof(sPort), "%d", ntohs(pAddr->sin_port));
+            int nLeast = 0;
+            for (int w = 1; w < nWorkers; w++) {
+                if (pnLoad[w] < pnLoad[nLeast]) nLeast = w;
+            }
+            pnLoad[nLeast] += ppFiles[i]->nSize;
+            pthread_mutex_lock(&gWorkersMutex);
+            int nIsCached = nHoldsResult(ppWorkers[nLeast], sCacheKey);
+            pthread_mutex_unlock(&gWorkersMutex);
+            vAssignWorker(ppFiles[i], ppWorkers[nLeast], sMediaType, sFileName, nIsCached);
+            free(ppFiles[i]);
+            ppFiles[i] = NULL;
+            nAssigned++;
+        }
+        if (nAssigned > 0) {
+            snprintf(sLogMsg, sizeof(sLogMsg), "Batch of %d %s files spread over %d workers\n",
+                     nAssigned, psTypes[t], nWorkers);
+            vWriteLog(sLogMsg);
+        }
+    }
 
-        char sResponseData[256];
-        snprintf(sResponseData, sizeof(sResponseData), "%s&%s", sIP, sPort);
+    /* No worker of their type was free, or the type is unknown */
+    for (int i = 0; i < nFiles; i++) {
+        if (ppFiles[i]) vServeOrQueue(ppFiles[i]);
+    }
+    free(ppFiles);
+    free(ppWorkers);
+    free(pnLoad);
+}
 
-        Frame* response = create_frame(FRAME_DISTORT_REQ, sResponseData, strlen(sResponseData));
-        send_frame(pClient->pConn, response);
-        free_frame(response);
+/*************************************************
+* @Name: nGrowHistory
+* @Def: Makes room in a client's job history for a whole batch besides
+*       the JOB_HISTORY jobs before it, so a file of the batch can still
+*       be resumed once the last one was handed out. The entries are laid
+*       out oldest first again. Caller holds gPendingMutex
+* @Arg: In: pClient = client
+*       In: nCount = files of the batch
+* @Ret: 0 on success, -1 if memory ran out
+*************************************************/
+static int nGrowHistory(FleckClient* pClient, int nCount) {
+    int nSlots = JOB_HISTORY + nCount;
+    if (pClient->nJobSlots >= nSlots) return 0;
+
+    JobRecord* pJobs = calloc(nSlots, sizeof(JobRecord));
+    if (!pJobs) return -1;
+    int nOld = pClient->nJobSlots - pClient->nNextJob;
+    memcpy(pJobs, pClient->pJobs + pClient->nNextJob, nOld * sizeof(JobRecord));
+    memcpy(pJobs + nOld, pClient->pJobs, pClient->nNextJob * sizeof(JobRecord));
+    free(pClient->pJobs);
+    pClient->pJobs = pJobs;
+    pClient->nNextJob = pClient->nJobSlots;
+    pClient->nJobSlots = nSlots;
+    return 0;
+}
 
-        snprintf(sLogMsg, sizeof(sLogMsg), "Assigned %s worker %s:%s for %s\n",
-                sMediaType, sIP, sPort, sFileName);
-        vWriteLog(sLogMsg);
-    } else {
-        Frame* response = create_frame(FRAME_DISTORT_REQ, "DISTORT_KO", 10);
-        send_frame(pClient->pConn, response);
-        free_frame(response);
-        vWriteLog("No available workers for request\n");
+/*************************************************
+* @Name: vCollectBatch
+* @Def: Keeps a DISTORT_BATCH file until every file of its batch came,
+*       then has the batch served. The file is kept as a plain request
+*       "type&file&md5&factor" and its size. Caller holds gPendingMutex
+* @Arg: In: pReq = tagged request "BATCH&batch&count&type&file&md5&factor&size"
+* @Ret: None
+*************************************************/
+static void vCollectBatch(PendingRequest* pReq) {
+    FleckClient* pClient = pReq->pClient;
+    int nCount = 0, nOffset = 0;
+    char* psSize = strrchr(pReq->sData, '&');
+
+    if (sscanf(pReq->sData, DISTORT_BATCH "&%u&%d&%n", &pReq->nBatch, &nCount, &nOffset) != 2 ||
+        nOffset == 0 || nCount <= 0 || nCount > DISTORT_BATCH_MAX || !psSize || psSize < pReq->sData + nOffset) {
+        vWriteLog("Invalid batch request format\n");
+        vAnswer(pReq, FRAME_ERROR, "INVALID_FORMAT");
+        free(pReq);
+        return;
     }
+    if (nGrowHistory(pClient, nCount) != 0) {
+        vWriteLog("Failed to grow the job history for a batch\n");
+        vAnswer(pReq, FRAME_ERROR, "Internal error");
+        free(pReq);
+        return;
+    }
+    pReq->nSize = strtoul(psSize + 1, NULL, 10);
+    *psSize = '\0';
+    memmove(pReq->sData, pReq->sData + nOffset, strlen(pReq->sData + nOffset) + 1);
+
+    int nCollected = 1;
+    PendingRequest** ppLast = &pClient->pBatch;
+    while (*ppLast) {
+        if ((*ppLast)->nBatch == pReq->nBatch) nCollected++;
+        ppLast = &(*ppLast)->pNext;
+    }
+    *ppLast = pReq;
+    if (nCollected >= nCount) vServeBatch(pClient, pReq->nBatch, nCollected);
+}
+
+/*************************************************
+* @Name: vDispatchPending
+* @Def: Serves again, oldest first, the queued requests a worker may now
+*       take. Requests parked on a freed worker's job go to the worker
+*       holding its result or park behind it again, so each is served
+*       from its cache. If no worker holds it, e.g. it did not fit the
+*       cache or the worker died, they are released to run at once on
+*       any free workers; tagged requests of a type no worker is left
+*       for are refused
+* @Arg: In: pFreed = worker that went idle or away, NULL for a new worker
+* @Ret: None
+*************************************************/
+static void vDispatchPending(Worker* pFreed) {
+    pthread_mutex_lock(&gPendingMutex);
+    PendingRequest** ppReq = &gpPending;
+    while (*ppReq) {
+        PendingRequest* pReq = *ppReq;
+        if (pFreed && pReq->pLeader == pFreed) {
+            pReq->pLeader = NULL;
+            pReq->nIsReleased = 1;
+        }
+        if (!pReq->pLeader &&
+            (pReq->nType == FRAME_DISTORT_REQ ? nServeDistort(pReq) : nServeResume(pReq))) {
+            *ppReq = pReq->pNext;
+            free(pReq);
+            continue;
+        }
+        ppReq = &pReq->pNext;
+    }
+    pthread_mutex_unlock(&gPendingMutex);
+}
+
+/*************************************************
+* @Name: vDropPending
+* @Def: Forgets the queued requests and the incomplete batches of a
+*       client that went away
+* @Arg: In: pClient = client
+* @Ret: None
+*************************************************/
+static void vDropPending(FleckClient* pClient) {
+    pthread_mutex_lock(&gPendingMutex);
+    PendingRequest** ppReq = &gpPending;
+    while (*ppReq) {
+        PendingRequest* pReq = *ppReq;
+        if (pReq->pClient == pClient) {
+            *ppReq = pReq->pNext;
+            free(pReq);
+            continue;
+        }
+        ppReq = &pReq->pNext;
+    }
+    while (pClient->pBatch) {
+        PendingRequest* pReq = pClient->pBatch;
+        pClient->pBatch = pReq->pNext;
+        free(pReq);
+    }
+    pthread_mutex_unlock(&gPendingMutex);
 }
 
 /*************************************************
@@ -520,7 +1224,9 @@ void vHandleFleckDisconnection(Connection* pConn) {
             vWriteLog(psMsg);
             free(psMsg);
 
+            vDropPending(gpClients[i]);
             free(gpClients[i]->psUsername);
+            free(gpClients[i]->pJobs);
             free(gpClients[i]);
             gpClients[i] = NULL;
             break;
@@ -561,11 +1267,6 @@ void vHandleWorkerCrash(Worker* pWorker) {
         vWriteLog("Harley worker disconnected from the system\n");
     }
 
-    // Clean up worker resources
-    close_connection(pWorker->pConn);
-    free(pWorker->psType);
-    free(pWorker);
-
     // Compact array and check for remaining workers
     vCompactWorkerArray();
 
@@ -585,6 +1286,14 @@ void vHandleWorkerCrash(Worker* pWorker) {
 
     pthread_mutex_unlock(&gWorkersMutex);
     free(psWorkerType);
+
+    /* Requests waiting on its job start over, elsewhere */
+    vDispatchPending(pWorker);
+
+    // Clean up worker resources
+    close_connection(pWorker->pConn);
+    free(pWorker->psType);
+    free(pWorker);
 }
 
 /*************************************************
@@ -607,7 +1316,7 @@ void* vMonitorWorker(void* pvArg) {
 
         // Send heartbeat
         Frame* heartbeat = create_frame(FRAME_HEARTBEAT, "PING", 4);
-        if (send_frame(pWorker->pConn, heartbeat) < 0) {
+        if (!send_frame(pWorker->pConn, heartbeat)) {
             free_frame(heartbeat);
             vHandleWorkerCrash(pWorker);
             break;
@@ -631,13 +1340,11 @@ void* vMonitorWorker(void* pvArg) {
 
 /*************************************************
 * @Name: vCompactWorkerArray
-* @Def: Compacts and manages workers array
+* @Def: Compacts and manages workers array. Caller holds gWorkersMutex
 * @Arg: None
 * @Ret: None
 *************************************************/
 void vCompactWorkerArray() {
-    pthread_mutex_lock(&gWorkersMutex);
-
     size_t nNewCount = 0;
     Worker** pNewWorkers = malloc(sizeof(Worker*) * gnWorkerCount);
 
@@ -652,8 +1359,6 @@ void vCompactWorkerArray() {
     free(gpWorkers);
     gpWorkers = pNewWorkers;
     gnWorkerCount = nNewCount;
-
-    pthread_mutex_unlock(&gWorkersMutex);
 }
 
 /*************************************************
@@ -754,12 +1459,32 @@ void vHandleFrame(Connection* pConn, Frame* pFrame) {
             pthread_mutex_unlock(&gClientsMutex);
 
             if (pClient) {
-                vHandleDistortRequest(pClient, pFrame);
+                vSubmitRequest(pClient, pFrame, FRAME_DISTORT_REQ);
             } else {
                 vWriteLog("Error: Distortion request from unregistered client\n");
             }
             break;
 
+        case FRAME_RESUME_REQ: {
+            vWriteLog("Received resume request\n");
+            FleckClient* pResumeClient = NULL;
+            pthread_mutex_lock(&gClientsMutex);
+            for (size_t i = 0; i < gnClientCount; i++) {
+                if (gpClients[i] && gpClients[i]->pConn == pConn) {
+                    pResumeClient = gpClients[i];
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&gClientsMutex);
+
+            if (pResumeClient) {
+                vSubmitRequest(pResumeClient, pFrame, FRAME_RESUME_REQ);
+            } else {
+                vWriteLog("Error: Resume request from unregistered client\n");
+            }
+            break;
+        }
+
         case FRAME_HEARTBEAT:
             pthread_mutex_lock(&gWorkersMutex);
             for (size_t i = 0; i < gnWorkerCount; i++) {
@@ -786,3 +1511,85 @@ void vHandleFrame(Connection* pConn, Frame* pFrame) {
             break;
     }
 }
+
+/*************************************************
+* @Name: vUpdateWorkerCache
+* @Def: Applies a "+key" or "-key" CACHE_UPDATE to the results a worker
+*       is known to hold. When all slots are used the oldest report is
+*       forgotten, which only costs a cache miss. "=bytes" records the
+*       budget of its result cache
+* @Arg: In: pWorker = reporting worker
+*       In: psUpdate = update text
+* @Ret: None
+*************************************************/
+static void vUpdateWorkerCache(Worker* pWorker, const char* psUpdate) {
+    const char* psKey = psUpdate + 1;
+    if (psUpdate[0] == '=') {
+        pthread_mutex_lock(&gWorkersMutex);
+        pWorker->nCacheBytes = strtoul(psKey, NULL, 10);
+        pthread_mutex_unlock(&gWorkersMutex);
+        return;
+    }
+    if ((psUpdate[0] != '+' && psUpdate[0] != '-') || strlen(psKey) >= CACHE_KEY_LENGTH) return;
+
+    pthread_mutex_lock(&gWorkersMutex);
+    int nSlot = -1;
+    for (int i = 0; i < CACHE_REPORT_KEYS && nSlot < 0; i++) {
+        if (strcmp(pWorker->sCacheKeys[i], psKey) == 0) nSlot = i;
+    }
+    if (psUpdate[0] == '-' && nSlot >= 0) {
+        pWorker->sCacheKeys[nSlot][0] = '\0';
+    } else if (psUpdate[0] == '+' && nSlot < 0) {
+        for (int i = 0; i < CACHE_REPORT_KEYS && nSlot < 0; i++) {
+            if (pWorker->sCacheKeys[i][0] == '\0') nSlot = i;
+        }
+        if (nSlot < 0) {
+            nSlot = pWorker->nNextKey;
+            pWorker->nNextKey = (pWorker->nNextKey + 1) % CACHE_REPORT_KEYS;
+        }
+        snprintf(pWorker->sCacheKeys[nSlot], CACHE_KEY_LENGTH, "%s", psKey);
+    }
+    pthread_mutex_unlock(&gWorkersMutex);
+}
+
+/*************************************************
+* @Name: vHandleWorkerFrame
+* @Def: Handles frames a registered worker sends on its own: cache
+*       reports, the end of a client session and its disconnection
+* @Arg: In: pWorker = sending worker
+*       In: pFrame = received frame
+* @Ret: None
+*************************************************/
+void vHandleWorkerFrame(Worker* pWorker, Frame* pFrame) {
+    char sData[DATA_SIZE + 1];
+    snprintf(sData, sizeof(sData), "%.*s", (int)pFrame->data_length, pFrame->data);
+
+    switch (pFrame->type) {
+        case FRAME_CACHE_UPDATE:
+            vUpdateWorkerCache(pWorker, sData);
+            break;
+
+        case FRAME_WORKER_IDLE:
+            pthread_mutex_lock(&gWorkersMutex);
+            pWorker->nIsBusy = 0;
+            pWorker->sJobKey[0] = '\0';
+            pthread_mutex_unlock(&gWorkersMutex);
+            vDispatchPending(pWorker);
+            break;
+
+        case FRAME_HEARTBEAT:
+            // Workers ping to notice a dead link; there is nothing to answer
+            break;
+
+        case FRAME_DISCONNECT:
+            vHandleWorkerCrash(pWorker);
+            break;
+
+        default: {
+            char sLogMsg[128];
+            snprintf(sLogMsg, sizeof(sLogMsg), "Unhandled worker frame type: 0x%02X\n", pFrame->type);
+            vWriteLog(sLogMsg);
+            break;
+        }
+    }
+}
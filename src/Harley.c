@@ -9,6 +9,75 @@
 
 #include "worker.h"
 #include "utils.h"
+#include "jpeg.h"
+#include "cpu.h"
+
+#define ENGINE_VERSION "harley/1"   // Bump when the output of the media engines changes
+
+/*************************************************
+* @Name: nScaleDenomForFactor
+* @Def: Maps a distortion factor to a JPEG DCT scaling denominator
+* @Arg: In: psFactor = distortion factor
+* @Ret: 1, 2, 4 or 8
+*************************************************/
+static int nScaleDenomForFactor(const char* psFactor) {
+    double dFactor = atof(psFactor);
+    if (dFactor >= 8) return 8;
+    if (dFactor >= 4) return 4;
+    if (dFactor >= 2) return 2;
+    return 1;
+}
+
+/*************************************************
+* @Name: nDistortMedia
+* @Def: Media distortion engine. Baseline JPEGs are downscaled in the DCT
+*       domain and re-encoded; other formats are passed through unchanged
+* @Arg: In: psInPath = original file
+*       In: psOutPath = distorted file
+*       In: psFactor = distortion factor
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nDistortMedia(const char* psInPath, const char* psOutPath, const char* psFactor) {
+    const char* psExt = strrchr(psInPath, '.');
+    if (psExt && (strcasecmp(psExt, ".jpg") == 0 || strcasecmp(psExt, ".jpeg") == 0)) {
+        if (nJpegScaleFile(psInPath, psOutPath, nScaleDenomForFactor(psFactor),
+                           JPEG_DEFAULT_QUALITY) == 0) {
+            return 0;
+        }
+        /* Progressive, CMYK or corrupt input: return it untouched */
+        vWriteLog("JPEG not baseline-decodable, sending original\n");
+    }
+    return nCopyFile(psInPath, psOutPath);
+}
+
+/*************************************************
+* @Name: nDistortMediaStream
+* @Def: Streaming entry point. JPEGs need the whole file and are handed
+*       to nDistortMedia; everything else passes through as it arrives
+* @Arg: In: psFileName = file being distorted
+*       In: psFactor = distortion factor
+*       In: pIn = input ring
+*       In: pOut = output ring
+*       In: pCheckpoint = checkpoint handle; pass-through has no state
+* @Ret: 0 on success, -1 on failure, DISTORT_NOT_STREAMABLE for JPEGs
+*************************************************/
+static int nDistortMediaStream(const char* psFileName, const char* psFactor, Ring* pIn, Ring* pOut,
+                               JobCheckpoint* pCheckpoint) {
+    (void)psFactor;
+
+    const char* psExt = strrchr(psFileName, '.');
+    if (psExt && (strcasecmp(psExt, ".jpg") == 0 || strcasecmp(psExt, ".jpeg") == 0)) {
+        return DISTORT_NOT_STREAMABLE;
+    }
+
+    char buffer[4096];
+    ssize_t nBytes;
+    while ((nBytes = ring_read(pIn, buffer, sizeof(buffer))) > 0) {
+        if (ring_write(pOut, buffer, nBytes) < 0) return -1;
+        vSaveCheckpoint(pCheckpoint, NULL, 0);
+    }
+    return nBytes < 0 ? -1 : 0;
+}
 
 int main(int nArgc, char* psArgv[]) {
     if (nArgc != 2) {
@@ -16,12 +85,18 @@ int main(int nArgc, char* psArgv[]) {
         return 1;
     }
 
+    vInitCpuDispatch();
+    vInitIoBackend();
+
     /* Create and initialize worker */
     Worker* pWorker = create_worker(psArgv[1]);
     if (!pWorker) {
         vWriteLog("Failed to create worker\n");
         return 1;
     }
+    pWorker->pfDistort = nDistortMedia;
+    pWorker->pfDistortStream = nDistortMediaStream;
+    pWorker->psEngine = ENGINE_VERSION;
 
     /* Run worker */
     int nResult = run_worker(pWorker);
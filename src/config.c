@@ -46,7 +46,7 @@ void load_gotham_config(const char *filename, GothamConfig *config) {
     close(fd);
 
     // Debug log
-    char debug[256];
+    char debug[512];
     snprintf(debug, sizeof(debug),
              "Loaded config:\nFleck IP: %s\nFleck Port: %s\nWorker IP: %s\nWorker Port: %s\n",
              config->sFleckIP, config->sFleckPort,
@@ -0,0 +1,297 @@
+/*********************************
+*
+* @File: cpu.c
+* @Purpose: Detects SSE4.2/AVX2/AVX-512 at startup and binds the
+*           checksum and image kernels to the best implementation. MD5
+*           and the text engine have no variants: each MD5 block needs
+*           the one before, and text words are too short for a vector
+*           scan to beat the byte loop
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "cpu.h"
+#include "common.h"
+#include "shared.h"
+#include <math.h>
+#include <strings.h>
+#include <immintrin.h>
+
+static uint32_t nByteSumScalar(const uint8_t* pData, size_t nLen);
+
+CpuKernels gKernels = { nByteSumScalar, NULL, "scalar", "none" };
+
+static CpuLevel geLevel = CPU_LEVEL_SCALAR;
+
+/* gfBasis[x][u] = C(u)/2 * cos((2x+1)u*pi/16), gfBasisT is its transpose */
+static float gfBasis[8][8];
+static float gfBasisT[8][8];
+
+/*************************************************
+* @Name: vInitBasis
+* @Def: Precomputes the 8-point IDCT basis shared by all IDCT variants
+* @Arg: None
+* @Ret: None
+*************************************************/
+static void vInitBasis(void) {
+    for (int x = 0; x < 8; x++) {
+        for (int u = 0; u < 8; u++) {
+            double dC = (u == 0) ? M_SQRT1_2 : 1.0;
+            gfBasis[x][u] = (float)(0.5 * dC * cos((2 * x + 1) * u * M_PI / 16.0));
+            gfBasisT[u][x] = gfBasis[x][u];
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Byte sum                                                                */
+/* ---------------------------------------------------------------------- */
+
+static uint32_t nByteSumScalar(const uint8_t* pData, size_t nLen) {
+    uint32_t nSum = 0;
+    for (size_t i = 0; i < nLen; i++) {
+        nSum += pData[i];
+    }
+    return nSum;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t nByteSumSse42(const uint8_t* pData, size_t nLen) {
+    __m128i vZero = _mm_setzero_si128();
+    __m128i vAcc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= nLen; i += 16) {
+        __m128i vData = _mm_loadu_si128((const __m128i*)(pData + i));
+        vAcc = _mm_add_epi64(vAcc, _mm_sad_epu8(vData, vZero));
+    }
+    uint32_t nSum = (uint32_t)(_mm_cvtsi128_si64(vAcc) + _mm_extract_epi64(vAcc, 1));
+    return nSum + nByteSumScalar(pData + i, nLen - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t nByteSumAvx2(const uint8_t* pData, size_t nLen) {
+    __m256i vZero = _mm256_setzero_si256();
+    __m256i vAcc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= nLen; i += 32) {
+        __m256i vData = _mm256_loadu_si256((const __m256i*)(pData + i));
+        vAcc = _mm256_add_epi64(vAcc, _mm256_sad_epu8(vData, vZero));
+    }
+    __m128i vHalf = _mm_add_epi64(_mm256_castsi256_si128(vAcc), _mm256_extracti128_si256(vAcc, 1));
+    uint32_t nSum = (uint32_t)(_mm_cvtsi128_si64(vHalf) + _mm_extract_epi64(vHalf, 1));
+    return nSum + nByteSumScalar(pData + i, nLen - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static uint32_t nByteSumAvx512(const uint8_t* pData, size_t nLen) {
+    __m512i vZero = _mm512_setzero_si512();
+    __m512i vAcc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 64 <= nLen; i += 64) {
+        __m512i vData = _mm512_loadu_si512((const void*)(pData + i));
+        vAcc = _mm512_add_epi64(vAcc, _mm512_sad_epu8(vData, vZero));
+    }
+    uint32_t nSum = (uint32_t)_mm512_reduce_add_epi64(vAcc);
+    return nSum + nByteSumScalar(pData + i, nLen - i);
+}
+
+/* ---------------------------------------------------------------------- */
+/* 8x8 IDCT                                                                */
+/*   rows:    tmp[v][:] = sum_u F[v][u] * basisT[u][:]                     */
+/*   columns: out[y][:] = sum_v basis[y][v] * tmp[v][:]                    */
+/* ---------------------------------------------------------------------- */
+
+static void vIdct8x8Scalar(const float* pfCoef, uint8_t* pOut, int nStride) {
+    float fTmp[8][8];
+    for (int v = 0; v < 8; v++) {
+        for (int x = 0; x < 8; x++) {
+            float fSum = 0.0f;
+            for (int u = 0; u < 8; u++) {
+                fSum += pfCoef[v * 8 + u] * gfBasis[x][u];
+            }
+            fTmp[v][x] = fSum;
+        }
+    }
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            float fSum = 0.0f;
+            for (int v = 0; v < 8; v++) {
+                fSum += gfBasis[y][v] * fTmp[v][x];
+            }
+            int nValue = (int)lrintf(fSum + 128.0f);
+            pOut[y * nStride + x] = (uint8_t)(nValue < 0 ? 0 : (nValue > 255 ? 255 : nValue));
+        }
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void vIdct8x8Sse42(const float* pfCoef, uint8_t* pOut, int nStride) {
+    __m128 vTmpLo[8], vTmpHi[8];
+    for (int v = 0; v < 8; v++) {
+        __m128 vLo = _mm_setzero_ps(), vHi = _mm_setzero_ps();
+        for (int u = 0; u < 8; u++) {
+            __m128 vF = _mm_set1_ps(pfCoef[v * 8 + u]);
+            vLo = _mm_add_ps(vLo, _mm_mul_ps(vF, _mm_loadu_ps(&gfBasisT[u][0])));
+            vHi = _mm_add_ps(vHi, _mm_mul_ps(vF, _mm_loadu_ps(&gfBasisT[u][4])));
+        }
+        vTmpLo[v] = vLo;
+        vTmpHi[v] = vHi;
+    }
+
+    const __m128 vShift = _mm_set1_ps(128.0f);
+    for (int y = 0; y < 8; y++) {
+        __m128 vLo = vShift, vHi = vShift;
+        for (int v = 0; v < 8; v++) {
+            __m128 vB = _mm_set1_ps(gfBasis[y][v]);
+            vLo = _mm_add_ps(vLo, _mm_mul_ps(vB, vTmpLo[v]));
+            vHi = _mm_add_ps(vHi, _mm_mul_ps(vB, vTmpHi[v]));
+        }
+        __m128i vWords = _mm_packs_epi32(_mm_cvtps_epi32(vLo), _mm_cvtps_epi32(vHi));
+        _mm_storel_epi64((__m128i*)(pOut + y * nStride), _mm_packus_epi16(vWords, vWords));
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void vIdct8x8Avx2(const float* pfCoef, uint8_t* pOut, int nStride) {
+    __m256 vTmp[8];
+    for (int v = 0; v < 8; v++) {
+        __m256 vAcc = _mm256_setzero_ps();
+        for (int u = 0; u < 8; u++) {
+            vAcc = _mm256_fmadd_ps(_mm256_set1_ps(pfCoef[v * 8 + u]),
+                                   _mm256_loadu_ps(&gfBasisT[u][0]), vAcc);
+        }
+        vTmp[v] = vAcc;
+    }
+
+    const __m256 vShift = _mm256_set1_ps(128.0f);
+    for (int y = 0; y < 8; y++) {
+        __m256 vAcc = vShift;
+        for (int v = 0; v < 8; v++) {
+            vAcc = _mm256_fmadd_ps(_mm256_set1_ps(gfBasis[y][v]), vTmp[v], vAcc);
+        }
+        __m256i vInts = _mm256_cvtps_epi32(vAcc);
+        __m128i vWords = _mm_packs_epi32(_mm256_castsi256_si128(vInts),
+                                         _mm256_extracti128_si256(vInts, 1));
+        _mm_storel_epi64((__m128i*)(pOut + y * nStride), _mm_packus_epi16(vWords, vWords));
+    }
+}
+
+/* AVX-512 works on two rows per 512-bit register */
+__attribute__((target("avx512f")))
+static void vIdct8x8Avx512(const float* pfCoef, uint8_t* pOut, int nStride) {
+    __m512 vBasisT[8];
+    for (int u = 0; u < 8; u++) {
+        __m256 vRow = _mm256_loadu_ps(&gfBasisT[u][0]);
+        vBasisT[u] = _mm512_castpd_ps(_mm512_insertf64x4(
+            _mm512_castps_pd(_mm512_castps256_ps512(vRow)), _mm256_castps_pd(vRow), 1));
+    }
+
+    __m512 vTmp[4];   // Rows (2k, 2k+1)
+    for (int k = 0; k < 4; k++) {
+        __m512 vAcc = _mm512_setzero_ps();
+        for (int u = 0; u < 8; u++) {
+            __m512 vF = _mm512_mask_mov_ps(_mm512_set1_ps(pfCoef[(2 * k) * 8 + u]), 0xFF00,
+                                           _mm512_set1_ps(pfCoef[(2 * k + 1) * 8 + u]));
+            vAcc = _mm512_fmadd_ps(vF, vBasisT[u], vAcc);
+        }
+        vTmp[k] = vAcc;
+    }
+
+    /* Duplicate each intermediate row into both halves for the column pass */
+    __m512 vRows[8];
+    for (int k = 0; k < 4; k++) {
+        __m512d vPair = _mm512_castps_pd(vTmp[k]);
+        vRows[2 * k] = _mm512_castpd_ps(_mm512_shuffle_f64x2(vPair, vPair, 0x44));
+        vRows[2 * k + 1] = _mm512_castpd_ps(_mm512_shuffle_f64x2(vPair, vPair, 0xEE));
+    }
+
+    const __m512i vZero = _mm512_setzero_si512();
+    for (int y = 0; y < 8; y += 2) {
+        __m512 vAcc = _mm512_set1_ps(128.0f);
+        for (int v = 0; v < 8; v++) {
+            __m512 vB = _mm512_mask_mov_ps(_mm512_set1_ps(gfBasis[y][v]), 0xFF00,
+                                           _mm512_set1_ps(gfBasis[y + 1][v]));
+            vAcc = _mm512_fmadd_ps(vB, vRows[v], vAcc);
+        }
+        __m512i vInts = _mm512_max_epi32(_mm512_cvtps_epi32(vAcc), vZero);
+        __m128i vBytes = _mm512_cvtusepi32_epi8(vInts);
+        _mm_storel_epi64((__m128i*)(pOut + y * nStride), vBytes);
+        _mm_storel_epi64((__m128i*)(pOut + (y + 1) * nStride), _mm_srli_si128(vBytes, 8));
+    }
+}
+
+/*************************************************
+* @Name: eLevelFromName
+* @Def: Parses a level name as accepted in MRJ_CPU_LEVEL
+* @Arg: In: psName = level name
+* @Ret: Parsed level, CPU_LEVEL_AVX512 when unknown
+*************************************************/
+static CpuLevel eLevelFromName(const char* psName) {
+    if (strcasecmp(psName, "scalar") == 0) return CPU_LEVEL_SCALAR;
+    if (strcasecmp(psName, "sse4.2") == 0) return CPU_LEVEL_SSE42;
+    if (strcasecmp(psName, "avx2") == 0) return CPU_LEVEL_AVX2;
+    return CPU_LEVEL_AVX512;
+}
+
+const char* psCpuLevelName(CpuLevel eLevel) {
+    switch (eLevel) {
+        case CPU_LEVEL_SSE42: return "sse4.2";
+        case CPU_LEVEL_AVX2: return "avx2";
+        case CPU_LEVEL_AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+CpuLevel eGetCpuLevel(void) {
+    return geLevel;
+}
+
+/*************************************************
+* @Name: vInitCpuDispatch
+* @Def: Detects the CPU features of this host, binds every dispatched
+*       kernel to its best variant and logs the choice
+* @Arg: None
+* @Ret: None
+*************************************************/
+void vInitCpuDispatch(void) {
+    __builtin_cpu_init();
+
+    CpuLevel eLevel = CPU_LEVEL_SCALAR;
+    if (__builtin_cpu_supports("sse4.2")) eLevel = CPU_LEVEL_SSE42;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) eLevel = CPU_LEVEL_AVX2;
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) eLevel = CPU_LEVEL_AVX512;
+
+    const char* psCap = getenv(CPU_LEVEL_ENV);
+    if (psCap && eLevelFromName(psCap) < eLevel) {
+        eLevel = eLevelFromName(psCap);
+    }
+    geLevel = eLevel;
+
+    vInitBasis();
+
+    switch (eLevel) {
+        case CPU_LEVEL_AVX512:
+            gKernels.pfByteSum = nByteSumAvx512;
+            gKernels.pfIdct8x8 = vIdct8x8Avx512;
+            break;
+        case CPU_LEVEL_AVX2:
+            gKernels.pfByteSum = nByteSumAvx2;
+            gKernels.pfIdct8x8 = vIdct8x8Avx2;
+            break;
+        case CPU_LEVEL_SSE42:
+            gKernels.pfByteSum = nByteSumSse42;
+            gKernels.pfIdct8x8 = vIdct8x8Sse42;
+            break;
+        default:
+            gKernels.pfByteSum = nByteSumScalar;
+            gKernels.pfIdct8x8 = vIdct8x8Scalar;
+            break;
+    }
+    gKernels.psByteSum = psCpuLevelName(eLevel);
+    gKernels.psIdct8x8 = psCpuLevelName(eLevel);
+
+    char sMsg[128];
+    snprintf(sMsg, sizeof(sMsg), "CPU dispatch: checksum=%s idct8x8=%s\n",
+             gKernels.psByteSum, gKernels.psIdct8x8);
+    vWriteLog(sMsg);
+}
@@ -0,0 +1,334 @@
+/*********************************
+*
+* @File: delta.c
+* @Purpose: rsync-style delta uploads. The basis is cut into fixed-size
+*           blocks, each signed with a rolling weak checksum and a short
+*           MD5. The sender rolls the weak checksum over its file one
+*           byte at a time and, where a block of the basis matches,
+*           sends a DELTA_COPY reference instead of the bytes
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "delta.h"
+#include "common.h"
+#include <arpa/inet.h>
+
+struct DeltaIndex {
+    unsigned long nBlockSize;
+    int nBlocks;
+    uint32_t* pWeak;                        // Weak checksum per block
+    uint8_t (*pStrong)[DELTA_STRONG_SIZE];  // Leading MD5 bytes per block
+    int* pHeads;                            // First block per hash bucket, -1 if none
+    int* pNext;                             // Next block in the same bucket
+    int nBits;                              // log2 of the bucket count
+};
+
+typedef struct {
+    DeltaEmitFunc pfEmit;
+    void* pvArg;
+    int nRunStart;                          // Pending run of matching blocks, -1 if none
+    int nRunCount;
+} DeltaEncoder;
+
+/*************************************************
+* @Name: nDeltaBlockSize
+* @Def: Block size for a basis: DELTA_MIN_BLOCK, doubled until the basis
+*       fits in DELTA_MAX_BLOCKS blocks, which bounds the signatures sent
+* @Arg: In: nBasisSize = size of the basis
+* @Ret: Block size in bytes
+*************************************************/
+unsigned long nDeltaBlockSize(unsigned long nBasisSize) {
+    unsigned long nBlockSize = DELTA_MIN_BLOCK;
+    while (nBasisSize / nBlockSize > DELTA_MAX_BLOCKS) nBlockSize *= 2;
+    return nBlockSize;
+}
+
+/*************************************************
+* @Name: nWeakSum
+* @Def: rsync weak checksum of a block: the byte sum and the sum of the
+*       running sums, 16 bits each
+* @Arg: In: pData = block
+*       In: nLength = block size
+* @Ret: Checksum
+*************************************************/
+static uint32_t nWeakSum(const unsigned char* pData, unsigned long nLength) {
+    uint32_t a = 0, b = 0;
+    for (unsigned long i = 0; i < nLength; i++) {
+        a += pData[i];
+        b += (uint32_t)(nLength - i) * pData[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+/*************************************************
+* @Name: nRollWeakSum
+* @Def: Moves the weak checksum one byte forward
+* @Arg: In: nWeak = checksum of the block at the current position
+*       In: cOut = byte leaving the block
+*       In: cIn = byte entering it
+*       In: nLength = block size
+* @Ret: Checksum of the block one byte further
+*************************************************/
+static uint32_t nRollWeakSum(uint32_t nWeak, unsigned char cOut, unsigned char cIn, unsigned long nLength) {
+    uint32_t a = nWeak & 0xFFFF;
+    uint32_t b = nWeak >> 16;
+    a = (a - cOut + cIn) & 0xFFFF;
+    b = (b - (uint32_t)nLength * cOut + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+/*************************************************
+* @Name: vStrongSum
+* @Def: Leading DELTA_STRONG_SIZE bytes of the MD5 of a block
+* @Arg: In: pData = block
+*       In: nLength = block size
+*       Out: pStrong = digest prefix
+* @Ret: None
+*************************************************/
+static void vStrongSum(const unsigned char* pData, unsigned long nLength, uint8_t pStrong[DELTA_STRONG_SIZE]) {
+    Md5Context md5;
+    uint8_t pDigest[MD5_DIGEST_SIZE];
+    vMd5Init(&md5);
+    vMd5Update(&md5, pData, nLength);
+    vMd5Final(&md5, pDigest);
+    memcpy(pStrong, pDigest, DELTA_STRONG_SIZE);
+}
+
+/*************************************************
+* @Name: nDeltaSendSignatures
+* @Def: Sends the signatures of a basis: a DELTA_SIG "blockSize&blocks"
+*       header, then the packed signatures, a big-endian weak checksum
+*       and the strong prefix per block, as further DELTA_SIG frames.
+*       Only whole blocks are signed; the tail is always sent literally
+* @Arg: In: pConn = client connection
+*       In: pBasis = mapped basis
+*       In: nBasisSize = its size
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nDeltaSendSignatures(Connection* pConn, const char* pBasis, unsigned long nBasisSize) {
+    unsigned long nBlockSize = nDeltaBlockSize(nBasisSize);
+    int nBlocks = (int)(nBasisSize / nBlockSize);
+    char sHeader[DATA_SIZE];
+    snprintf(sHeader, sizeof(sHeader), "%lu&%d", nBlockSize, nBlocks);
+    Frame* header = create_frame(FRAME_DELTA_SIG, sHeader, strlen(sHeader));
+    int nOk = send_frame(pConn, header);
+    free_frame(header);
+    if (!nOk || nBlocks == 0) return nOk ? 0 : -1;
+
+    unsigned char* pSigs = malloc((size_t)nBlocks * DELTA_SIG_SIZE);
+    if (!pSigs) return -1;
+    for (int i = 0; i < nBlocks; i++) {
+        const unsigned char* pBlock = (const unsigned char*)pBasis + (unsigned long)i * nBlockSize;
+        unsigned char* pSig = pSigs + (size_t)i * DELTA_SIG_SIZE;
+        uint32_t nWeak = htonl(nWeakSum(pBlock, nBlockSize));
+        memcpy(pSig, &nWeak, sizeof(nWeak));
+        vStrongSum(pBlock, nBlockSize, pSig + sizeof(nWeak));
+    }
+    nOk = send_frames(pConn, FRAME_DELTA_SIG, (const char*)pSigs, (size_t)nBlocks * DELTA_SIG_SIZE);
+    free(pSigs);
+    return nOk ? 0 : -1;
+}
+
+/*************************************************
+* @Name: nBucket
+* @Def: Hash bucket of a weak checksum; the byte sum alone clusters
+* @Arg: In: pIndex = signature index
+*       In: nWeak = weak checksum
+* @Ret: Bucket
+*************************************************/
+static int nBucket(const DeltaIndex* pIndex, uint32_t nWeak) {
+    return (int)((nWeak * 2654435761u) >> (32 - pIndex->nBits));
+}
+
+/*************************************************
+* @Name: pDeltaReceiveSignatures
+* @Def: Receives the signatures nDeltaSendSignatures sent and indexes
+*       them by weak checksum
+* @Arg: In: pConn = worker connection
+* @Ret: Index to be freed with vDeltaFreeIndex, NULL on failure
+*************************************************/
+DeltaIndex* pDeltaReceiveSignatures(Connection* pConn) {
+    unsigned long nBlockSize = 0;
+    int nBlocks = -1;
+    Frame* frame = receive_frame(pConn);
+    if (!frame || frame->type != FRAME_DELTA_SIG ||
+        sscanf(frame->data, "%lu&%d", &nBlockSize, &nBlocks) != 2 ||
+        nBlockSize < DELTA_MIN_BLOCK || nBlocks < 0 || nBlocks > DELTA_MAX_BLOCKS) {
+        if (frame) free_frame(frame);
+        return NULL;
+    }
+    free_frame(frame);
+
+    DeltaIndex* pIndex = calloc(1, sizeof(DeltaIndex));
+    if (!pIndex) return NULL;
+    pIndex->nBlockSize = nBlockSize;
+    pIndex->nBlocks = nBlocks;
+    pIndex->nBits = 4;
+    while ((1 << pIndex->nBits) < nBlocks * 2) pIndex->nBits++;
+    pIndex->pWeak = malloc(sizeof(uint32_t) * (nBlocks + 1));
+    pIndex->pStrong = malloc(DELTA_STRONG_SIZE * (size_t)(nBlocks + 1));
+    pIndex->pHeads = malloc(sizeof(int) << pIndex->nBits);
+    pIndex->pNext = malloc(sizeof(int) * (nBlocks + 1));
+    unsigned char* pSigs = malloc((size_t)nBlocks * DELTA_SIG_SIZE + DATA_SIZE);
+    if (!pIndex->pWeak || !pIndex->pStrong || !pIndex->pHeads || !pIndex->pNext || !pSigs) {
+        free(pSigs);
+        vDeltaFreeIndex(pIndex);
+        return NULL;
+    }
+
+    size_t nWanted = (size_t)nBlocks * DELTA_SIG_SIZE;
+    size_t nHave = 0;
+    while (nHave < nWanted) {
+        frame = receive_frame(pConn);
+        if (!frame || frame->type != FRAME_DELTA_SIG || nHave + frame->data_length > nWanted) {
+            if (frame) free_frame(frame);
+            free(pSigs);
+            vDeltaFreeIndex(pIndex);
+            return NULL;
+        }
+        memcpy(pSigs + nHave, frame->data, frame->data_length);
+        nHave += frame->data_length;
+        free_frame(frame);
+    }
+
+    memset(pIndex->pHeads, 0xFF, sizeof(int) << pIndex->nBits);
+    for (int i = nBlocks - 1; i >= 0; i--) {
+        uint32_t nWeak;
+        memcpy(&nWeak, pSigs + (size_t)i * DELTA_SIG_SIZE, sizeof(nWeak));
+        pIndex->pWeak[i] = ntohl(nWeak);
+        memcpy(pIndex->pStrong[i], pSigs + (size_t)i * DELTA_SIG_SIZE + sizeof(nWeak), DELTA_STRONG_SIZE);
+        int nSlot = nBucket(pIndex, pIndex->pWeak[i]);
+        pIndex->pNext[i] = pIndex->pHeads[nSlot];
+        pIndex->pHeads[nSlot] = i;
+    }
+    free(pSigs);
+    return pIndex;
+}
+
+void vDeltaFreeIndex(DeltaIndex* pIndex) {
+    if (!pIndex) return;
+    free(pIndex->pWeak);
+    free(pIndex->pStrong);
+    free(pIndex->pHeads);
+    free(pIndex->pNext);
+    free(pIndex);
+}
+
+/*************************************************
+* @Name: nFindBlock
+* @Def: Looks a block of the file up in the basis. The strong sum is only
+*       computed when the weak one matches; the block following the last
+*       match wins ties, so runs stay contiguous
+* @Arg: In: pIndex = signature index
+*       In: nWeak = weak checksum of pData
+*       In: pData = block of the file
+*       In: nPreferred = block to prefer, -1 if none
+* @Ret: Matching block, -1 if none
+*************************************************/
+static int nFindBlock(const DeltaIndex* pIndex, uint32_t nWeak, const unsigned char* pData, int nPreferred) {
+    uint8_t pStrong[DELTA_STRONG_SIZE];
+    int nIsHashed = 0;
+    int nFound = -1;
+    for (int i = pIndex->pHeads[nBucket(pIndex, nWeak)]; i >= 0; i = pIndex->pNext[i]) {
+        if (pIndex->pWeak[i] != nWeak) continue;
+        if (!nIsHashed) {
+            vStrongSum(pData, pIndex->nBlockSize, pStrong);
+            nIsHashed = 1;
+        }
+        if (memcmp(pIndex->pStrong[i], pStrong, DELTA_STRONG_SIZE) != 0) continue;
+        if (i == nPreferred) return i;
+        if (nFound < 0) nFound = i;
+    }
+    return nFound;
+}
+
+/*************************************************
+* @Name: nFlushRun
+* @Def: Emits the pending run of matching blocks, if any
+* @Arg: In/Out: pEncoder = encoder state
+* @Ret: 0 to go on, nonzero to stop
+*************************************************/
+static int nFlushRun(DeltaEncoder* pEncoder) {
+    if (pEncoder->nRunCount == 0) return 0;
+    int nResult = pEncoder->pfEmit(pEncoder->pvArg, pEncoder->nRunStart, pEncoder->nRunCount, 0, 0);
+    pEncoder->nRunStart = -1;
+    pEncoder->nRunCount = 0;
+    return nResult;
+}
+
+/*************************************************
+* @Name: nDeltaEncode
+* @Def: Splits a file into literal ranges and runs of basis blocks, in
+*       file order
+* @Arg: In: pIndex = signatures of the basis
+*       In: pData = file
+*       In: nSize = its size
+*       In: pfEmit = told about each literal range and block run
+*       In: pvArg = passed to pfEmit
+* @Ret: 0 on success, the nonzero pfEmit result that stopped it otherwise
+*************************************************/
+int nDeltaEncode(const DeltaIndex* pIndex, const char* pData, unsigned long nSize,
+                 DeltaEmitFunc pfEmit, void* pvArg) {
+    const unsigned char* p = (const unsigned char*)pData;
+    unsigned long nBlockSize = pIndex->nBlockSize;
+    unsigned long nPos = 0, nLiteral = 0;
+    uint32_t nWeak = 0;
+    int nHasWeak = 0, nResult = 0;
+    DeltaEncoder encoder = { pfEmit, pvArg, -1, 0 };
+
+    while (pIndex->nBlocks > 0 && nPos + nBlockSize <= nSize) {
+        if (!nHasWeak) {
+            nWeak = nWeakSum(p + nPos, nBlockSize);
+            nHasWeak = 1;
+        }
+        int nPreferred = encoder.nRunCount > 0 ? encoder.nRunStart + encoder.nRunCount : -1;
+        int nBlock = nFindBlock(pIndex, nWeak, p + nPos, nPreferred);
+        if (nBlock < 0) {
+            if (nPos + nBlockSize < nSize) nWeak = nRollWeakSum(nWeak, p[nPos], p[nPos + nBlockSize], nBlockSize);
+            nPos++;
+            continue;
+        }
+
+        if (nPos > nLiteral) {
+            if ((nResult = nFlushRun(&encoder)) != 0) return nResult;
+            if ((nResult = pfEmit(pvArg, -1, 0, nLiteral, nPos - nLiteral)) != 0) return nResult;
+        }
+        if (encoder.nRunCount > 0 && nBlock != nPreferred && (nResult = nFlushRun(&encoder)) != 0) {
+            return nResult;
+        }
+        if (encoder.nRunCount == 0) encoder.nRunStart = nBlock;
+        encoder.nRunCount++;
+        nPos += nBlockSize;
+        nLiteral = nPos;
+        nHasWeak = 0;
+    }
+
+    if ((nResult = nFlushRun(&encoder)) != 0) return nResult;
+    if (nSize > nLiteral) nResult = pfEmit(pvArg, -1, 0, nLiteral, nSize - nLiteral);
+    return nResult;
+}
+
+/*************************************************
+* @Name: nDeltaCopyRange
+* @Def: Parses a DELTA_COPY "block&count" frame into the basis bytes it
+*       refers to
+* @Arg: In: pFrame = received frame
+*       In: nBasisSize = size of the basis the signatures came from
+*       Out: pnFrom = first basis byte
+*       Out: pnLength = bytes to copy
+* @Ret: 0 on success, -1 if the frame is malformed or out of range
+*************************************************/
+int nDeltaCopyRange(const Frame* pFrame, unsigned long nBasisSize, unsigned long* pnFrom, unsigned long* pnLength) {
+    char sData[DATA_SIZE + 1];
+    int nBlock, nCount;
+    unsigned long nBlockSize = nDeltaBlockSize(nBasisSize);
+    snprintf(sData, sizeof(sData), "%.*s", (int)pFrame->data_length, pFrame->data);
+    if (pFrame->type != FRAME_DELTA_COPY || sscanf(sData, "%d&%d", &nBlock, &nCount) != 2 ||
+        nBlock < 0 || nCount <= 0 || (unsigned long)nBlock + nCount > nBasisSize / nBlockSize) {
+        return -1;
+    }
+    *pnFrom = (unsigned long)nBlock * nBlockSize;
+    *pnLength = (unsigned long)nCount * nBlockSize;
+    return 0;
+}
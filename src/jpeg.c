@@ -0,0 +1,1143 @@
+/*********************************
+*
+* @File: jpeg.c
+* @Purpose: Baseline JPEG decoder with reduced-size IDCTs and a fast
+*           baseline re-encoder used by Harley
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "jpeg.h"
+#include "common.h"
+#include "cpu.h"
+#include "shared.h"
+#include <math.h>
+#include <pthread.h>
+
+#define JPEG_MAX_COMPONENTS 3
+#define JPEG_LOOKAHEAD 9
+#define JPEG_MAX_DIMENSION 16384                // Larger frames are refused, not allocated
+#define JPEG_MAX_PIXELS (64UL * 1024 * 1024)
+
+#define MARKER_SOF0 0xC0
+#define MARKER_SOF1 0xC1
+#define MARKER_DHT  0xC4
+#define MARKER_SOI  0xD8
+#define MARKER_EOI  0xD9
+#define MARKER_SOS  0xDA
+#define MARKER_DQT  0xDB
+#define MARKER_DRI  0xDD
+#define MARKER_APP14 0xEE
+
+/* Zigzag position -> natural (row-major) index */
+static const uint8_t gnNaturalOrder[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+typedef struct {
+    uint8_t nFastLen[1 << JPEG_LOOKAHEAD];   // 0 when the code is longer than the lookahead
+    uint8_t nFastVal[1 << JPEG_LOOKAHEAD];
+    int32_t nMaxCode[18];
+    int32_t nValOffset[17];
+    uint8_t nValues[256];
+    int nDefined;
+} HuffTable;
+
+typedef struct {
+    int nId;
+    int nH, nV;             // Sampling factors
+    int nTq;                // Quantization table index
+    int nTd, nTa;           // DC/AC Huffman table indices of the current scan
+    int nBlocksW, nBlocksH; // Blocks covered by the padded MCU grid
+    int nPred;              // DC predictor
+    uint8_t* pPlane;        // Scaled sample plane
+    int nStride;
+} JpegComponent;
+
+typedef struct {
+    const uint8_t* pData;
+    size_t nSize;
+    size_t nPos;
+    uint32_t nBits;         // Left-aligned bit buffer
+    int nCount;
+    int nMarkerHit;
+} BitReader;
+
+typedef struct {
+    uint16_t nQuant[4][64]; // Natural order
+    int nQuantDefined[4];
+    HuffTable dc[4];
+    HuffTable ac[4];
+    JpegComponent comps[JPEG_MAX_COMPONENTS];
+    int nComponents;
+    int nWidth, nHeight;
+    int nHMax, nVMax;
+    int nMcusX, nMcusY;
+    int nRestartInterval;
+    int nScale;             // Output block size: 8 / scale denominator
+    int nFrameSeen;
+    int nAdobeTransform;    // -1 when no Adobe APP14 segment was seen
+} JpegDecoder;
+
+/* Per output size N: gfIdct[N][x][u] = C(u)/2 * cos((2x+1)u*pi/2N) */
+static float gfIdct[9][8][8];
+static pthread_once_t gIdctOnce = PTHREAD_ONCE_INIT;  // Jobs may decode concurrently
+
+/*************************************************
+* @Name: vInitIdctTables
+* @Def: Precomputes the cosine tables for the 1, 2, 4 and 8 point IDCTs
+* @Arg: None
+* @Ret: None
+*************************************************/
+static void vInitIdctTables(void) {
+    for (int nN = 1; nN <= 8; nN <<= 1) {
+        for (int x = 0; x < nN; x++) {
+            for (int u = 0; u < nN; u++) {
+                double dC = (u == 0) ? M_SQRT1_2 : 1.0;
+                gfIdct[nN][x][u] = (float)(0.5 * dC * cos((2 * x + 1) * u * M_PI / (2.0 * nN)));
+            }
+        }
+    }
+}
+
+static inline uint8_t nClampSample(float fValue) {
+    int nValue = (int)lrintf(fValue + 128.0f);
+    if (nValue < 0) return 0;
+    if (nValue > 255) return 255;
+    return (uint8_t)nValue;
+}
+
+/*************************************************
+* @Name: vIdctScaled
+* @Def: Reduced-size IDCT. Only the top-left N x N coefficients are used,
+*       producing an N x N block whose mean matches the full 8 x 8 block
+* @Arg: In: pfCoef = dequantized coefficients, natural order
+*       In: nN = output block size (1, 2, 4 or 8)
+*       Out: pOut = destination samples
+*       In: nStride = destination stride
+* @Ret: None
+*************************************************/
+static void vIdctScaled(const float* pfCoef, int nN, uint8_t* pOut, int nStride) {
+    if (nN == 1) {
+        pOut[0] = nClampSample(pfCoef[0] / 8.0f);
+        return;
+    }
+    if (nN == 8 && gKernels.pfIdct8x8) {
+        gKernels.pfIdct8x8(pfCoef, pOut, nStride);
+        return;
+    }
+
+    float fTmp[8][8];
+    float (*pfT)[8] = gfIdct[nN];
+
+    /* Rows: tmp[v][x] = sum_u F[v][u] * T[x][u] */
+    for (int v = 0; v < nN; v++) {
+        const float* pfRow = pfCoef + v * 8;
+        for (int x = 0; x < nN; x++) {
+            float fSum = 0.0f;
+            for (int u = 0; u < nN; u++) {
+                fSum += pfRow[u] * pfT[x][u];
+            }
+            fTmp[v][x] = fSum;
+        }
+    }
+
+    /* Columns: out[y][x] = sum_v T[y][v] * tmp[v][x] */
+    for (int y = 0; y < nN; y++) {
+        for (int x = 0; x < nN; x++) {
+            float fSum = 0.0f;
+            for (int v = 0; v < nN; v++) {
+                fSum += pfT[y][v] * fTmp[v][x];
+            }
+            pOut[y * nStride + x] = nClampSample(fSum);
+        }
+    }
+}
+
+/*************************************************
+* @Name: nBuildHuffTable
+* @Def: Builds canonical decoding tables from a DHT segment
+* @Arg: In: pnBits = code counts for lengths 1..16
+*       In: pnVals = symbol values
+*       Out: pTable = table to fill
+* @Ret: 0 on success, -1 on malformed table
+*************************************************/
+static int nBuildHuffTable(const uint8_t* pnBits, const uint8_t* pnVals, HuffTable* pTable) {
+    int nTotal = 0;
+    for (int i = 0; i < 16; i++) nTotal += pnBits[i];
+    if (nTotal > 256) return -1;
+
+    memcpy(pTable->nValues, pnVals, nTotal);
+    memset(pTable->nFastLen, 0, sizeof(pTable->nFastLen));
+
+    int32_t nCode = 0;
+    int k = 0;
+    for (int nLen = 1; nLen <= 16; nLen++) {
+        int nCount = pnBits[nLen - 1];
+        pTable->nValOffset[nLen] = k - nCode;
+        /* More codes than the length allows would run past the fast tables */
+        if (nCode + nCount > (1 << nLen)) return -1;
+        if (nCount) {
+            for (int i = 0; i < nCount; i++) {
+                if (nLen <= JPEG_LOOKAHEAD) {
+                    int nShift = JPEG_LOOKAHEAD - nLen;
+                    int nFirst = (nCode + i) << nShift;
+                    for (int j = 0; j < (1 << nShift); j++) {
+                        pTable->nFastLen[nFirst + j] = (uint8_t)nLen;
+                        pTable->nFastVal[nFirst + j] = pnVals[k + i];
+                    }
+                }
+            }
+            nCode += nCount;
+            k += nCount;
+            pTable->nMaxCode[nLen] = nCode - 1;
+        } else {
+            pTable->nMaxCode[nLen] = -1;
+        }
+        nCode <<= 1;
+    }
+    pTable->nMaxCode[17] = INT32_MAX;
+    pTable->nDefined = 1;
+    return 0;
+}
+
+static void vFillBits(BitReader* pReader) {
+    while (pReader->nCount <= 24) {
+        uint32_t nByte = 0;
+        if (!pReader->nMarkerHit && pReader->nPos < pReader->nSize) {
+            nByte = pReader->pData[pReader->nPos];
+            if (nByte == 0xFF) {
+                uint8_t nNext = (pReader->nPos + 1 < pReader->nSize) ?
+                                pReader->pData[pReader->nPos + 1] : 0xD9;
+                if (nNext == 0x00) {
+                    pReader->nPos += 2;
+                } else {
+                    pReader->nMarkerHit = 1;
+                    nByte = 0;
+                }
+            } else {
+                pReader->nPos++;
+            }
+        }
+        pReader->nBits |= nByte << (24 - pReader->nCount);
+        pReader->nCount += 8;
+    }
+}
+
+static inline uint32_t nGetBits(BitReader* pReader, int nBits) {
+    if (nBits == 0) return 0;
+    if (pReader->nCount < nBits) vFillBits(pReader);
+    uint32_t nValue = pReader->nBits >> (32 - nBits);
+    pReader->nBits <<= nBits;
+    pReader->nCount -= nBits;
+    return nValue;
+}
+
+static inline int nExtend(uint32_t nValue, int nBits) {
+    if (nBits == 0) return 0;
+    if (nValue < (1u << (nBits - 1))) {
+        return (int)nValue - (1 << nBits) + 1;
+    }
+    return (int)nValue;
+}
+
+/*************************************************
+* @Name: nDecodeHuff
+* @Def: Decodes one Huffman symbol
+* @Arg: In: pReader = bit reader
+*       In: pTable = Huffman table
+* @Ret: Symbol value or -1 on corrupt data
+*************************************************/
+static int nDecodeHuff(BitReader* pReader, const HuffTable* pTable) {
+    if (pReader->nCount < 16) vFillBits(pReader);
+
+    int nPeek = pReader->nBits >> (32 - JPEG_LOOKAHEAD);
+    int nLen = pTable->nFastLen[nPeek];
+    if (nLen) {
+        pReader->nBits <<= nLen;
+        pReader->nCount -= nLen;
+        return pTable->nFastVal[nPeek];
+    }
+
+    int32_t nCode = (int32_t)(pReader->nBits >> (32 - (JPEG_LOOKAHEAD + 1)));
+    for (nLen = JPEG_LOOKAHEAD + 1; nLen <= 16; nLen++) {
+        if (nCode <= pTable->nMaxCode[nLen]) {
+            pReader->nBits <<= nLen;
+            pReader->nCount -= nLen;
+            return pTable->nValues[(nCode + pTable->nValOffset[nLen]) & 0xFF];
+        }
+        nCode = (int32_t)(pReader->nBits >> (31 - nLen));
+    }
+    return -1;
+}
+
+/*************************************************
+* @Name: nDecodeBlock
+* @Def: Entropy-decodes and dequantizes one 8x8 block, then writes its
+*       scaled reconstruction into the component plane
+* @Arg: In: pDec = decoder state
+*       In: pReader = bit reader
+*       In: pComp = component the block belongs to
+*       In: nBlockX, nBlockY = block position within the component
+* @Ret: 0 on success, -1 on corrupt data
+*************************************************/
+static int nDecodeBlock(JpegDecoder* pDec, BitReader* pReader, JpegComponent* pComp,
+                        int nBlockX, int nBlockY) {
+    float fCoef[64];
+    const uint16_t* pnQuant = pDec->nQuant[pComp->nTq];
+    const int nN = pDec->nScale;
+
+    memset(fCoef, 0, sizeof(fCoef));
+
+    int nSize = nDecodeHuff(pReader, &pDec->dc[pComp->nTd]);
+    if (nSize < 0 || nSize > 11) return -1;
+    pComp->nPred += nExtend(nGetBits(pReader, nSize), nSize);
+    fCoef[0] = (float)(pComp->nPred * pnQuant[0]);
+
+    for (int k = 1; k < 64; k++) {
+        int nSymbol = nDecodeHuff(pReader, &pDec->ac[pComp->nTa]);
+        if (nSymbol < 0) return -1;
+        int nRun = nSymbol >> 4;
+        nSize = nSymbol & 0x0F;
+        if (nSize == 0) {
+            if (nRun != 15) break;   // EOB
+            k += 15;                 // ZRL
+            continue;
+        }
+        k += nRun;
+        if (k > 63) return -1;
+        int nValue = nExtend(nGetBits(pReader, nSize), nSize);
+
+        /* Coefficients outside the retained N x N corner only cost entropy decoding */
+        int nNatural = gnNaturalOrder[k];
+        if ((nNatural & 7) < nN && (nNatural >> 3) < nN) {
+            fCoef[nNatural] = (float)(nValue * pnQuant[nNatural]);
+        }
+    }
+
+    uint8_t* pOut = pComp->pPlane + (nBlockY * nN) * pComp->nStride + nBlockX * nN;
+    vIdctScaled(fCoef, nN, pOut, pComp->nStride);
+    return 0;
+}
+
+static int nParseDqt(JpegDecoder* pDec, const uint8_t* pSeg, int nLen) {
+    int nPos = 0;
+    while (nPos < nLen) {
+        int nPq = pSeg[nPos] >> 4;
+        int nTq = pSeg[nPos] & 0x0F;
+        nPos++;
+        if (nTq > 3) return -1;
+        int nNeeded = nPq ? 128 : 64;
+        if (nPos + nNeeded > nLen) return -1;
+        for (int k = 0; k < 64; k++) {
+            uint16_t nValue = nPq ? (uint16_t)((pSeg[nPos + 2 * k] << 8) | pSeg[nPos + 2 * k + 1])
+                                  : pSeg[nPos + k];
+            pDec->nQuant[nTq][gnNaturalOrder[k]] = nValue;
+        }
+        pDec->nQuantDefined[nTq] = 1;
+        nPos += nNeeded;
+    }
+    return 0;
+}
+
+static int nParseDht(JpegDecoder* pDec, const uint8_t* pSeg, int nLen) {
+    int nPos = 0;
+    while (nPos + 17 <= nLen) {
+        int nClass = pSeg[nPos] >> 4;
+        int nIndex = pSeg[nPos] & 0x0F;
+        if (nClass > 1 || nIndex > 3) return -1;
+
+        const uint8_t* pnBits = pSeg + nPos + 1;
+        int nTotal = 0;
+        for (int i = 0; i < 16; i++) nTotal += pnBits[i];
+        if (nPos + 17 + nTotal > nLen) return -1;
+
+        HuffTable* pTable = nClass ? &pDec->ac[nIndex] : &pDec->dc[nIndex];
+        if (nBuildHuffTable(pnBits, pSeg + nPos + 17, pTable) < 0) return -1;
+        nPos += 17 + nTotal;
+    }
+    return 0;
+}
+
+static int nParseSof(JpegDecoder* pDec, const uint8_t* pSeg, int nLen) {
+    if (nLen < 6 || pSeg[0] != 8) return -1;   // Baseline: 8-bit precision only
+
+    pDec->nHeight = (pSeg[1] << 8) | pSeg[2];
+    pDec->nWidth = (pSeg[3] << 8) | pSeg[4];
+    pDec->nComponents = pSeg[5];
+    if (pDec->nWidth == 0 || pDec->nHeight == 0) return -1;
+    if (pDec->nWidth > JPEG_MAX_DIMENSION || pDec->nHeight > JPEG_MAX_DIMENSION ||
+        (unsigned long)pDec->nWidth * pDec->nHeight > JPEG_MAX_PIXELS) {
+        return -1;
+    }
+    if (pDec->nComponents != 1 && pDec->nComponents != 3) return -1;
+    if (nLen < 6 + 3 * pDec->nComponents) return -1;
+
+    pDec->nHMax = 1;
+    pDec->nVMax = 1;
+    for (int i = 0; i < pDec->nComponents; i++) {
+        JpegComponent* pComp = &pDec->comps[i];
+        pComp->nId = pSeg[6 + 3 * i];
+        pComp->nH = pSeg[7 + 3 * i] >> 4;
+        pComp->nV = pSeg[7 + 3 * i] & 0x0F;
+        pComp->nTq = pSeg[8 + 3 * i] & 0x03;
+        if (pComp->nH < 1 || pComp->nH > 4 || pComp->nV < 1 || pComp->nV > 4) return -1;
+        if (pComp->nH > pDec->nHMax) pDec->nHMax = pComp->nH;
+        if (pComp->nV > pDec->nVMax) pDec->nVMax = pComp->nV;
+    }
+
+    pDec->nMcusX = (pDec->nWidth + 8 * pDec->nHMax - 1) / (8 * pDec->nHMax);
+    pDec->nMcusY = (pDec->nHeight + 8 * pDec->nVMax - 1) / (8 * pDec->nVMax);
+
+    for (int i = 0; i < pDec->nComponents; i++) {
+        JpegComponent* pComp = &pDec->comps[i];
+        pComp->nBlocksW = pDec->nMcusX * pComp->nH;
+        pComp->nBlocksH = pDec->nMcusY * pComp->nV;
+        pComp->nStride = pComp->nBlocksW * pDec->nScale;
+        pComp->pPlane = calloc((size_t)pComp->nStride * pComp->nBlocksH * pDec->nScale, 1);
+        if (!pComp->pPlane) return -1;
+    }
+    pDec->nFrameSeen = 1;
+    return 0;
+}
+
+/*************************************************
+* @Name: vRestart
+* @Def: Consumes an RSTn marker and resets entropy decoder state
+* @Arg: In: pDec = decoder state
+*       In: pReader = bit reader
+* @Ret: None
+*************************************************/
+static void vRestart(JpegDecoder* pDec, BitReader* pReader) {
+    while (pReader->nPos + 1 < pReader->nSize &&
+           !(pReader->pData[pReader->nPos] == 0xFF &&
+             pReader->pData[pReader->nPos + 1] >= 0xD0 &&
+             pReader->pData[pReader->nPos + 1] <= 0xD7)) {
+        pReader->nPos++;
+    }
+    if (pReader->nPos + 1 < pReader->nSize) pReader->nPos += 2;
+
+    pReader->nBits = 0;
+    pReader->nCount = 0;
+    pReader->nMarkerHit = 0;
+    for (int i = 0; i < pDec->nComponents; i++) {
+        pDec->comps[i].nPred = 0;
+    }
+}
+
+/*************************************************
+* @Name: nDecodeScan
+* @Def: Parses an SOS header and decodes the entropy-coded segment
+* @Arg: In: pDec = decoder state
+*       In: pData = whole file
+*       In: nSize = file size
+*       In/Out: pnPos = offset of the SOS payload, updated to the next marker
+* @Ret: 0 on success, -1 on error
+*************************************************/
+static int nDecodeScan(JpegDecoder* pDec, const uint8_t* pData, size_t nSize, size_t* pnPos) {
+    size_t nPos = *pnPos;
+    int nLen = (pData[nPos] << 8) | pData[nPos + 1];
+    const uint8_t* pSeg = pData + nPos + 2;
+    if (!pDec->nFrameSeen || nLen < 3) return -1;
+
+    int nScanComps = pSeg[0];
+    if (nScanComps < 1 || nScanComps > pDec->nComponents || nLen < 6 + 2 * nScanComps) return -1;
+    if (pSeg[1 + 2 * nScanComps] != 0 || pSeg[2 + 2 * nScanComps] != 63) return -1;   // Not sequential
+
+    JpegComponent* pScan[JPEG_MAX_COMPONENTS];
+    for (int i = 0; i < nScanComps; i++) {
+        int nId = pSeg[1 + 2 * i];
+        pScan[i] = NULL;
+        for (int j = 0; j < pDec->nComponents; j++) {
+            if (pDec->comps[j].nId == nId) pScan[i] = &pDec->comps[j];
+        }
+        if (!pScan[i]) return -1;
+        pScan[i]->nTd = pSeg[2 + 2 * i] >> 4;
+        pScan[i]->nTa = pSeg[2 + 2 * i] & 0x0F;
+        if (pScan[i]->nTd > 3 || pScan[i]->nTa > 3 ||
+            !pDec->dc[pScan[i]->nTd].nDefined || !pDec->ac[pScan[i]->nTa].nDefined ||
+            !pDec->nQuantDefined[pScan[i]->nTq]) {
+            return -1;
+        }
+        pScan[i]->nPred = 0;
+    }
+
+    BitReader reader = { pData, nSize, nPos + nLen, 0, 0, 0 };
+    int nRestartLeft = pDec->nRestartInterval;
+
+    if (nScanComps == 1) {
+        /* Non-interleaved: one block per MCU over the component's own extent */
+        JpegComponent* pComp = pScan[0];
+        int nCompW = (pDec->nWidth * pComp->nH + pDec->nHMax - 1) / pDec->nHMax;
+        int nCompH = (pDec->nHeight * pComp->nV + pDec->nVMax - 1) / pDec->nVMax;
+        int nBlocksX = (nCompW + 7) / 8;
+        int nBlocksY = (nCompH + 7) / 8;
+        for (int by = 0; by < nBlocksY; by++) {
+            for (int bx = 0; bx < nBlocksX; bx++) {
+                if (pDec->nRestartInterval) {
+                    if (nRestartLeft == 0) {
+                        vRestart(pDec, &reader);
+                        nRestartLeft = pDec->nRestartInterval;
+                    }
+                    nRestartLeft--;
+                }
+                if (nDecodeBlock(pDec, &reader, pComp, bx, by) < 0) return -1;
+            }
+        }
+    } else {
+        for (int my = 0; my < pDec->nMcusY; my++) {
+            for (int mx = 0; mx < pDec->nMcusX; mx++) {
+                if (pDec->nRestartInterval) {
+                    if (nRestartLeft == 0) {
+                        vRestart(pDec, &reader);
+                        nRestartLeft = pDec->nRestartInterval;
+                    }
+                    nRestartLeft--;
+                }
+                for (int i = 0; i < nScanComps; i++) {
+                    JpegComponent* pComp = pScan[i];
+                    for (int v = 0; v < pComp->nV; v++) {
+                        for (int h = 0; h < pComp->nH; h++) {
+                            if (nDecodeBlock(pDec, &reader, pComp,
+                                             mx * pComp->nH + h, my * pComp->nV + v) < 0) {
+                                return -1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* Skip to the next marker that is not a restart marker */
+    nPos = reader.nPos;
+    while (nPos + 1 < nSize) {
+        if (pData[nPos] == 0xFF && pData[nPos + 1] != 0x00 && pData[nPos + 1] != 0xFF &&
+            !(pData[nPos + 1] >= 0xD0 && pData[nPos + 1] <= 0xD7)) {
+            break;
+        }
+        nPos++;
+    }
+    *pnPos = nPos;
+    return 0;
+}
+
+/*************************************************
+* @Name: nAssembleImage
+* @Def: Upsamples the scaled component planes and converts to RGB/gray
+* @Arg: In: pDec = decoder state
+*       In: nScaleDenom = scale denominator
+*       Out: pImage = output image
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nAssembleImage(JpegDecoder* pDec, int nScaleDenom, JpegImage* pImage) {
+    int nW = (pDec->nWidth + nScaleDenom - 1) / nScaleDenom;
+    int nH = (pDec->nHeight + nScaleDenom - 1) / nScaleDenom;
+    int nComps = pDec->nComponents;
+
+    /* Planes are stored as RGB when the encoder says so (Adobe) or names them R, G, B */
+    int nConvert = 1;
+    if (nComps == 3) {
+        if (pDec->nAdobeTransform == 0 ||
+            (pDec->nAdobeTransform < 0 && pDec->comps[0].nId == 'R' &&
+             pDec->comps[1].nId == 'G' && pDec->comps[2].nId == 'B')) {
+            nConvert = 0;
+        }
+    }
+
+    pImage->pPixels = malloc((size_t)nW * nH * nComps);
+    if (!pImage->pPixels) return -1;
+    pImage->nWidth = nW;
+    pImage->nHeight = nH;
+    pImage->nComponents = nComps;
+
+    for (int y = 0; y < nH; y++) {
+        uint8_t* pRow = pImage->pPixels + (size_t)y * nW * nComps;
+        if (nComps == 1) {
+            memcpy(pRow, pDec->comps[0].pPlane + (size_t)y * pDec->comps[0].nStride, nW);
+            continue;
+        }
+
+        const JpegComponent* pY = &pDec->comps[0];
+        const JpegComponent* pCb = &pDec->comps[1];
+        const JpegComponent* pCr = &pDec->comps[2];
+        if (!nConvert) {
+            for (int x = 0; x < nW; x++) {
+                for (int c = 0; c < 3; c++) {
+                    const JpegComponent* pComp = &pDec->comps[c];
+                    pRow[3 * x + c] = pComp->pPlane[(size_t)(y * pComp->nV / pDec->nVMax) * pComp->nStride +
+                                                    x * pComp->nH / pDec->nHMax];
+                }
+            }
+            continue;
+        }
+
+        const uint8_t* pYRow = pY->pPlane + (size_t)(y * pY->nV / pDec->nVMax) * pY->nStride;
+        const uint8_t* pCbRow = pCb->pPlane + (size_t)(y * pCb->nV / pDec->nVMax) * pCb->nStride;
+        const uint8_t* pCrRow = pCr->pPlane + (size_t)(y * pCr->nV / pDec->nVMax) * pCr->nStride;
+
+        for (int x = 0; x < nW; x++) {
+            int nLuma = pYRow[x * pY->nH / pDec->nHMax];
+            int nCb = pCbRow[x * pCb->nH / pDec->nHMax] - 128;
+            int nCr = pCrRow[x * pCr->nH / pDec->nHMax] - 128;
+
+            /* 16.16 fixed point JFIF conversion */
+            int nR = nLuma + ((91881 * nCr + 32768) >> 16);
+            int nG = nLuma - ((22554 * nCb + 46802 * nCr - 32768) >> 16);
+            int nB = nLuma + ((116130 * nCb + 32768) >> 16);
+
+            pRow[3 * x]     = (uint8_t)(nR < 0 ? 0 : (nR > 255 ? 255 : nR));
+            pRow[3 * x + 1] = (uint8_t)(nG < 0 ? 0 : (nG > 255 ? 255 : nG));
+            pRow[3 * x + 2] = (uint8_t)(nB < 0 ? 0 : (nB > 255 ? 255 : nB));
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nJpegDecodeScaled
+* @Def: Decodes a baseline JPEG, scaling by 1/nScaleDenom in the DCT domain
+* @Arg: In: pData = compressed data
+*       In: nSize = size of compressed data
+*       In: nScaleDenom = 1, 2, 4 or 8
+*       Out: pImage = decoded image (free with vJpegFreeImage)
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nJpegDecodeScaled(const uint8_t* pData, size_t nSize, int nScaleDenom, JpegImage* pImage) {
+    if (!pData || !pImage || nSize < 4 || pData[0] != 0xFF || pData[1] != MARKER_SOI) return -1;
+    if (nScaleDenom != 1 && nScaleDenom != 2 && nScaleDenom != 4 && nScaleDenom != 8) return -1;
+
+    pthread_once(&gIdctOnce, vInitIdctTables);
+    memset(pImage, 0, sizeof(*pImage));
+
+    JpegDecoder* pDec = calloc(1, sizeof(JpegDecoder));
+    if (!pDec) return -1;
+    pDec->nScale = 8 / nScaleDenom;
+    pDec->nAdobeTransform = -1;
+
+    int nResult = -1;
+    int nScanDone = 0;
+    size_t nPos = 2;
+
+    while (nPos + 1 < nSize) {
+        if (pData[nPos] != 0xFF) {
+            nPos++;
+            continue;
+        }
+        uint8_t nMarker = pData[nPos + 1];
+        nPos += 2;
+        if (nMarker == 0xFF || nMarker == 0x01 || (nMarker >= 0xD0 && nMarker <= 0xD7)) {
+            if (nMarker == 0xFF) nPos--;
+            continue;
+        }
+        if (nMarker == MARKER_EOI) break;
+        if (nPos + 2 > nSize) break;
+
+        int nLen = (pData[nPos] << 8) | pData[nPos + 1];
+        if (nLen < 2 || nPos + nLen > nSize) break;
+        const uint8_t* pSeg = pData + nPos + 2;
+        int nSegLen = nLen - 2;
+
+        if (nMarker == MARKER_DQT) {
+            if (nParseDqt(pDec, pSeg, nSegLen) < 0) goto cleanup;
+        } else if (nMarker == MARKER_DHT) {
+            if (nParseDht(pDec, pSeg, nSegLen) < 0) goto cleanup;
+        } else if (nMarker == MARKER_SOF0 || nMarker == MARKER_SOF1) {
+            if (pDec->nFrameSeen || nParseSof(pDec, pSeg, nSegLen) < 0) goto cleanup;
+        } else if (nMarker >= 0xC2 && nMarker <= 0xCF &&
+                   nMarker != MARKER_DHT && nMarker != 0xC8 && nMarker != 0xCC) {
+            goto cleanup;   // Progressive, lossless and arithmetic coding are not handled
+        } else if (nMarker == MARKER_DRI) {
+            if (nSegLen < 2) goto cleanup;
+            pDec->nRestartInterval = (pSeg[0] << 8) | pSeg[1];
+        } else if (nMarker == MARKER_APP14) {
+            if (nSegLen >= 12 && memcmp(pSeg, "Adobe", 5) == 0) {
+                pDec->nAdobeTransform = pSeg[11];
+            }
+        } else if (nMarker == MARKER_SOS) {
+            if (nDecodeScan(pDec, pData, nSize, &nPos) < 0) goto cleanup;
+            nScanDone = 1;
+            continue;
+        }
+        nPos += nLen;
+    }
+
+    if (nScanDone) {
+        nResult = nAssembleImage(pDec, nScaleDenom, pImage);
+    }
+
+cleanup:
+    for (int i = 0; i < JPEG_MAX_COMPONENTS; i++) {
+        free(pDec->comps[i].pPlane);
+    }
+    free(pDec);
+    return nResult;
+}
+
+/*************************************************
+* @Name: vJpegFreeImage
+* @Def: Releases an image returned by the decoder
+* @Arg: In: pImage = image to release
+* @Ret: None
+*************************************************/
+void vJpegFreeImage(JpegImage* pImage) {
+    if (pImage) {
+        free(pImage->pPixels);
+        pImage->pPixels = NULL;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Encoder                                                                 */
+/* ---------------------------------------------------------------------- */
+
+static const uint8_t gnStdLumQuant[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99
+};
+
+static const uint8_t gnStdChromQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+/* Annex K standard Huffman tables */
+static const uint8_t gnDcLumBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t gnDcChromBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t gnDcVals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t gnAcLumBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t gnAcLumVals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const uint8_t gnAcChromBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t gnAcChromVals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+/* AAN scale factors for the float forward DCT */
+static const float gfAanScale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+    1.0f, 0.785694958f, 0.541196100f, 0.275899379f
+};
+
+typedef struct {
+    uint16_t nCode[256];
+    uint8_t nSize[256];
+} HuffEncTable;
+
+typedef struct {
+    uint8_t* pBuffer;
+    size_t nSize;
+    size_t nCapacity;
+    uint32_t nBitBuf;
+    int nBitCount;
+    int nFailed;
+} JpegWriter;
+
+static void vPutByte(JpegWriter* pWriter, uint8_t nByte) {
+    if (pWriter->nSize == pWriter->nCapacity) {
+        size_t nNewCap = pWriter->nCapacity ? pWriter->nCapacity * 2 : 65536;
+        uint8_t* pNew = realloc(pWriter->pBuffer, nNewCap);
+        if (!pNew) {
+            pWriter->nFailed = 1;
+            return;
+        }
+        pWriter->pBuffer = pNew;
+        pWriter->nCapacity = nNewCap;
+    }
+    pWriter->pBuffer[pWriter->nSize++] = nByte;
+}
+
+static void vPutWord(JpegWriter* pWriter, uint16_t nWord) {
+    vPutByte(pWriter, (uint8_t)(nWord >> 8));
+    vPutByte(pWriter, (uint8_t)(nWord & 0xFF));
+}
+
+static void vPutBits(JpegWriter* pWriter, uint32_t nCode, int nSize) {
+    uint32_t nBuf = nCode & ((1u << nSize) - 1);
+    int nCount = pWriter->nBitCount + nSize;
+    nBuf <<= 24 - nCount;
+    nBuf |= pWriter->nBitBuf;
+    while (nCount >= 8) {
+        uint8_t nByte = (uint8_t)((nBuf >> 16) & 0xFF);
+        vPutByte(pWriter, nByte);
+        if (nByte == 0xFF) vPutByte(pWriter, 0);
+        nBuf <<= 8;
+        nCount -= 8;
+    }
+    pWriter->nBitBuf = nBuf & 0xFFFFFF;
+    pWriter->nBitCount = nCount;
+}
+
+static void vFlushBits(JpegWriter* pWriter) {
+    vPutBits(pWriter, 0x7F, 7);
+    pWriter->nBitBuf = 0;
+    pWriter->nBitCount = 0;
+}
+
+static void vBuildEncTable(const uint8_t* pnBits, const uint8_t* pnVals, HuffEncTable* pTable) {
+    uint16_t nCode = 0;
+    int k = 0;
+    for (int nLen = 1; nLen <= 16; nLen++) {
+        for (int i = 0; i < pnBits[nLen - 1]; i++) {
+            pTable->nCode[pnVals[k]] = nCode++;
+            pTable->nSize[pnVals[k]] = (uint8_t)nLen;
+            k++;
+        }
+        nCode <<= 1;
+    }
+}
+
+static void vWriteDht(JpegWriter* pWriter, int nClassIndex, const uint8_t* pnBits,
+                      const uint8_t* pnVals, int nCount) {
+    vPutWord(pWriter, 0xFF00 | MARKER_DHT);
+    vPutWord(pWriter, (uint16_t)(2 + 1 + 16 + nCount));
+    vPutByte(pWriter, (uint8_t)nClassIndex);
+    for (int i = 0; i < 16; i++) vPutByte(pWriter, pnBits[i]);
+    for (int i = 0; i < nCount; i++) vPutByte(pWriter, pnVals[i]);
+}
+
+/*************************************************
+* @Name: vForwardDct
+* @Def: AAN float forward DCT, in place; output is scaled by the AAN
+*       factors, which are folded into the quantization divisors
+* @Arg: In/Out: pfData = 64 samples, natural order
+* @Ret: None
+*************************************************/
+static void vForwardDct(float* pfData) {
+    for (int nPass = 0; nPass < 2; nPass++) {
+        for (int i = 0; i < 8; i++) {
+            float* p = nPass == 0 ? pfData + i * 8 : pfData + i;
+            int s = nPass == 0 ? 1 : 8;
+
+            float fTmp0 = p[0 * s] + p[7 * s], fTmp7 = p[0 * s] - p[7 * s];
+            float fTmp1 = p[1 * s] + p[6 * s], fTmp6 = p[1 * s] - p[6 * s];
+            float fTmp2 = p[2 * s] + p[5 * s], fTmp5 = p[2 * s] - p[5 * s];
+            float fTmp3 = p[3 * s] + p[4 * s], fTmp4 = p[3 * s] - p[4 * s];
+
+            float fTmp10 = fTmp0 + fTmp3, fTmp13 = fTmp0 - fTmp3;
+            float fTmp11 = fTmp1 + fTmp2, fTmp12 = fTmp1 - fTmp2;
+            p[0 * s] = fTmp10 + fTmp11;
+            p[4 * s] = fTmp10 - fTmp11;
+            float fZ1 = (fTmp12 + fTmp13) * 0.707106781f;
+            p[2 * s] = fTmp13 + fZ1;
+            p[6 * s] = fTmp13 - fZ1;
+
+            fTmp10 = fTmp4 + fTmp5;
+            fTmp11 = fTmp5 + fTmp6;
+            fTmp12 = fTmp6 + fTmp7;
+            float fZ5 = (fTmp10 - fTmp12) * 0.382683433f;
+            float fZ2 = 0.541196100f * fTmp10 + fZ5;
+            float fZ4 = 1.306562965f * fTmp12 + fZ5;
+            float fZ3 = fTmp11 * 0.707106781f;
+            float fZ11 = fTmp7 + fZ3;
+            float fZ13 = fTmp7 - fZ3;
+            p[5 * s] = fZ13 + fZ2;
+            p[3 * s] = fZ13 - fZ2;
+            p[1 * s] = fZ11 + fZ4;
+            p[7 * s] = fZ11 - fZ4;
+        }
+    }
+}
+
+static int nBitLength(int nValue) {
+    int nBits = 0;
+    if (nValue < 0) nValue = -nValue;
+    while (nValue) {
+        nBits++;
+        nValue >>= 1;
+    }
+    return nBits;
+}
+
+/*************************************************
+* @Name: vEncodeBlock
+* @Def: Transforms, quantizes and Huffman-codes one 8x8 block
+* @Arg: In: pWriter = output writer
+*       In: pfBlock = level-shifted samples, natural order
+*       In: pfDivisors = AAN-scaled quantization divisors
+*       In/Out: pnPred = DC predictor
+*       In: pDc, pAc = Huffman tables
+* @Ret: None
+*************************************************/
+static void vEncodeBlock(JpegWriter* pWriter, float* pfBlock, const float* pfDivisors, int* pnPred,
+                         const HuffEncTable* pDc, const HuffEncTable* pAc) {
+    int nQuant[64];
+
+    vForwardDct(pfBlock);
+    for (int k = 0; k < 64; k++) {
+        int nNatural = gnNaturalOrder[k];
+        nQuant[k] = (int)lrintf(pfBlock[nNatural] / pfDivisors[nNatural]);
+    }
+
+    int nDiff = nQuant[0] - *pnPred;
+    *pnPred = nQuant[0];
+    int nSize = nBitLength(nDiff);
+    vPutBits(pWriter, pDc->nCode[nSize], pDc->nSize[nSize]);
+    if (nSize) vPutBits(pWriter, (uint32_t)(nDiff < 0 ? nDiff - 1 : nDiff), nSize);
+
+    int nRun = 0;
+    for (int k = 1; k < 64; k++) {
+        int nValue = nQuant[k];
+        if (nValue == 0) {
+            nRun++;
+            continue;
+        }
+        while (nRun > 15) {
+            vPutBits(pWriter, pAc->nCode[0xF0], pAc->nSize[0xF0]);
+            nRun -= 16;
+        }
+        nSize = nBitLength(nValue);
+        int nSymbol = (nRun << 4) | nSize;
+        vPutBits(pWriter, pAc->nCode[nSymbol], pAc->nSize[nSymbol]);
+        vPutBits(pWriter, (uint32_t)(nValue < 0 ? nValue - 1 : nValue), nSize);
+        nRun = 0;
+    }
+    if (nRun > 0) {
+        vPutBits(pWriter, pAc->nCode[0x00], pAc->nSize[0x00]);
+    }
+}
+
+static void vScaleQuant(const uint8_t* pnBase, int nQuality, uint8_t* pnOut, float* pfDivisors) {
+    int nScale = nQuality < 50 ? 5000 / nQuality : 200 - 2 * nQuality;
+    for (int i = 0; i < 64; i++) {
+        int nValue = (pnBase[i] * nScale + 50) / 100;
+        if (nValue < 1) nValue = 1;
+        if (nValue > 255) nValue = 255;
+        pnOut[i] = (uint8_t)nValue;
+        pfDivisors[i] = nValue * gfAanScale[i >> 3] * gfAanScale[i & 7] * 8.0f;
+    }
+}
+
+static inline const uint8_t* pPixelAt(const JpegImage* pImage, int x, int y) {
+    if (x >= pImage->nWidth) x = pImage->nWidth - 1;
+    if (y >= pImage->nHeight) y = pImage->nHeight - 1;
+    return pImage->pPixels + ((size_t)y * pImage->nWidth + x) * pImage->nComponents;
+}
+
+/*************************************************
+* @Name: nJpegEncode
+* @Def: Encodes an image as baseline JPEG (4:2:0 for colour input)
+*       using the standard Huffman tables
+* @Arg: In: pImage = image to encode
+*       In: nQuality = IJG quality, 1..100
+*       Out: ppOut = malloc'ed JPEG stream
+*       Out: pnOutSize = stream size
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nJpegEncode(const JpegImage* pImage, int nQuality, uint8_t** ppOut, size_t* pnOutSize) {
+    if (!pImage || !pImage->pPixels || !ppOut || !pnOutSize) return -1;
+    if (pImage->nComponents != 1 && pImage->nComponents != 3) return -1;
+    if (pImage->nWidth <= 0 || pImage->nHeight <= 0 ||
+        pImage->nWidth > 65535 || pImage->nHeight > 65535) return -1;
+    if (nQuality < 1) nQuality = 1;
+    if (nQuality > 100) nQuality = 100;
+
+    uint8_t nLumQuant[64], nChromQuant[64];
+    float fLumDiv[64], fChromDiv[64];
+    vScaleQuant(gnStdLumQuant, nQuality, nLumQuant, fLumDiv);
+    vScaleQuant(gnStdChromQuant, nQuality, nChromQuant, fChromDiv);
+
+    HuffEncTable dcLum, acLum, dcChrom, acChrom;
+    vBuildEncTable(gnDcLumBits, gnDcVals, &dcLum);
+    vBuildEncTable(gnAcLumBits, gnAcLumVals, &acLum);
+    vBuildEncTable(gnDcChromBits, gnDcVals, &dcChrom);
+    vBuildEncTable(gnAcChromBits, gnAcChromVals, &acChrom);
+
+    int nColour = pImage->nComponents == 3;
+    JpegWriter writer = { NULL, 0, 0, 0, 0, 0 };
+
+    /* SOI + JFIF APP0 */
+    static const uint8_t nJfif[] = { 0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+                                     0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00 };
+    vPutWord(&writer, 0xFF00 | MARKER_SOI);
+    for (size_t i = 0; i < sizeof(nJfif); i++) vPutByte(&writer, nJfif[i]);
+
+    /* DQT */
+    vPutWord(&writer, 0xFF00 | MARKER_DQT);
+    vPutWord(&writer, (uint16_t)(2 + 65 * (nColour ? 2 : 1)));
+    vPutByte(&writer, 0);
+    for (int k = 0; k < 64; k++) vPutByte(&writer, nLumQuant[gnNaturalOrder[k]]);
+    if (nColour) {
+        vPutByte(&writer, 1);
+        for (int k = 0; k < 64; k++) vPutByte(&writer, nChromQuant[gnNaturalOrder[k]]);
+    }
+
+    /* SOF0 */
+    vPutWord(&writer, 0xFF00 | MARKER_SOF0);
+    vPutWord(&writer, (uint16_t)(8 + 3 * pImage->nComponents));
+    vPutByte(&writer, 8);
+    vPutWord(&writer, (uint16_t)pImage->nHeight);
+    vPutWord(&writer, (uint16_t)pImage->nWidth);
+    vPutByte(&writer, (uint8_t)pImage->nComponents);
+    vPutByte(&writer, 1);
+    vPutByte(&writer, nColour ? 0x22 : 0x11);
+    vPutByte(&writer, 0);
+    if (nColour) {
+        vPutByte(&writer, 2); vPutByte(&writer, 0x11); vPutByte(&writer, 1);
+        vPutByte(&writer, 3); vPutByte(&writer, 0x11); vPutByte(&writer, 1);
+    }
+
+    /* DHT */
+    vWriteDht(&writer, 0x00, gnDcLumBits, gnDcVals, 12);
+    vWriteDht(&writer, 0x10, gnAcLumBits, gnAcLumVals, 162);
+    if (nColour) {
+        vWriteDht(&writer, 0x01, gnDcChromBits, gnDcVals, 12);
+        vWriteDht(&writer, 0x11, gnAcChromBits, gnAcChromVals, 162);
+    }
+
+    /* SOS */
+    vPutWord(&writer, 0xFF00 | MARKER_SOS);
+    vPutWord(&writer, (uint16_t)(6 + 2 * pImage->nComponents));
+    vPutByte(&writer, (uint8_t)pImage->nComponents);
+    vPutByte(&writer, 1); vPutByte(&writer, 0x00);
+    if (nColour) {
+        vPutByte(&writer, 2); vPutByte(&writer, 0x11);
+        vPutByte(&writer, 3); vPutByte(&writer, 0x11);
+    }
+    vPutByte(&writer, 0);
+    vPutByte(&writer, 63);
+    vPutByte(&writer, 0);
+
+    int nPredY = 0, nPredCb = 0, nPredCr = 0;
+    float fBlock[64];
+
+    if (!nColour) {
+        for (int by = 0; by < pImage->nHeight; by += 8) {
+            for (int bx = 0; bx < pImage->nWidth; bx += 8) {
+                for (int y = 0; y < 8; y++) {
+                    for (int x = 0; x < 8; x++) {
+                        fBlock[y * 8 + x] = (float)pPixelAt(pImage, bx + x, by + y)[0] - 128.0f;
+                    }
+                }
+                vEncodeBlock(&writer, fBlock, fLumDiv, &nPredY, &dcLum, &acLum);
+            }
+        }
+    } else {
+        float fCb[64], fCr[64];
+        for (int my = 0; my < pImage->nHeight; my += 16) {
+            for (int mx = 0; mx < pImage->nWidth; mx += 16) {
+                memset(fCb, 0, sizeof(fCb));
+                memset(fCr, 0, sizeof(fCr));
+
+                for (int nSub = 0; nSub < 4; nSub++) {
+                    int nOffX = (nSub & 1) * 8;
+                    int nOffY = (nSub >> 1) * 8;
+                    for (int y = 0; y < 8; y++) {
+                        for (int x = 0; x < 8; x++) {
+                            const uint8_t* pPix = pPixelAt(pImage, mx + nOffX + x, my + nOffY + y);
+                            float fR = pPix[0], fG = pPix[1], fB = pPix[2];
+                            fBlock[y * 8 + x] = 0.299f * fR + 0.587f * fG + 0.114f * fB - 128.0f;
+
+                            int nC = ((nOffY + y) >> 1) * 8 + ((nOffX + x) >> 1);
+                            fCb[nC] += (-0.168736f * fR - 0.331264f * fG + 0.5f * fB) * 0.25f;
+                            fCr[nC] += (0.5f * fR - 0.418688f * fG - 0.081312f * fB) * 0.25f;
+                        }
+                    }
+                    vEncodeBlock(&writer, fBlock, fLumDiv, &nPredY, &dcLum, &acLum);
+                }
+                vEncodeBlock(&writer, fCb, fChromDiv, &nPredCb, &dcChrom, &acChrom);
+                vEncodeBlock(&writer, fCr, fChromDiv, &nPredCr, &dcChrom, &acChrom);
+            }
+        }
+    }
+
+    vFlushBits(&writer);
+    vPutWord(&writer, 0xFF00 | MARKER_EOI);
+
+    if (writer.nFailed) {
+        free(writer.pBuffer);
+        return -1;
+    }
+    *ppOut = writer.pBuffer;
+    *pnOutSize = writer.nSize;
+    return 0;
+}
+
+/*************************************************
+* @Name: nJpegScaleFile
+* @Def: Decodes a JPEG file at 1/nScaleDenom and writes the re-encoded result
+* @Arg: In: psInPath = source JPEG
+*       In: psOutPath = destination JPEG
+*       In: nScaleDenom = 1, 2, 4 or 8
+*       In: nQuality = encoder quality
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nJpegScaleFile(const char* psInPath, const char* psOutPath, int nScaleDenom, int nQuality) {
+    /* Decode straight from the page cache */
+    int fd = open(psInPath, O_RDONLY);
+    if (fd < 0) return -1;
+
+    MappedFile in;
+    if (nMapInput(&in, fd) != 0 || in.nMapped == 0) {
+        vUnmapFile(&in);
+        close(fd);
+        return -1;
+    }
+
+    JpegImage image;
+    int nResult = nJpegDecodeScaled((const uint8_t*)in.pData, in.nMapped, nScaleDenom, &image);
+    vUnmapFile(&in);
+    close(fd);
+    if (nResult != 0) return -1;
+
+    uint8_t* pOut = NULL;
+    size_t nOutSize = 0;
+    nResult = nJpegEncode(&image, nQuality, &pOut, &nOutSize);
+    vJpegFreeImage(&image);
+    if (nResult != 0) return -1;
+
+    fd = open(psOutPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(pOut);
+        return -1;
+    }
+
+    size_t nWritten = 0;
+    while (nWritten < nOutSize) {
+        ssize_t nBytes = write(fd, pOut + nWritten, nOutSize - nWritten);
+        if (nBytes <= 0) break;
+        nWritten += (size_t)nBytes;
+    }
+    close(fd);
+    free(pOut);
+
+    return nWritten == nOutSize ? 0 : -1;
+}
@@ -0,0 +1,151 @@
+/*********************************
+*
+* @File: md5.c
+* @Purpose: Incremental MD5 (RFC 1321), updated inside the transfer loops
+*           so no second pass over the file is needed
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "md5.h"
+#include "common.h"
+
+static const uint32_t gnK[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const uint8_t gnShift[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+/*************************************************
+* @Name: vMd5Block
+* @Def: Compresses one 64-byte block into the state
+* @Arg: In: pState = MD5 state
+*       In: pBlock = 64 input bytes
+* @Ret: None
+*************************************************/
+static void vMd5Block(uint32_t pState[4], const uint8_t* pBlock) {
+    uint32_t nM[16];
+    for (int i = 0; i < 16; i++) {
+        nM[i] = (uint32_t)pBlock[i * 4] | ((uint32_t)pBlock[i * 4 + 1] << 8) |
+                ((uint32_t)pBlock[i * 4 + 2] << 16) | ((uint32_t)pBlock[i * 4 + 3] << 24);
+    }
+
+    uint32_t a = pState[0], b = pState[1], c = pState[2], d = pState[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) & 15;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        uint32_t nTemp = d;
+        d = c;
+        c = b;
+        uint32_t x = a + f + gnK[i] + nM[g];
+        b = b + ((x << gnShift[i]) | (x >> (32 - gnShift[i])));
+        a = nTemp;
+    }
+
+    pState[0] += a;
+    pState[1] += b;
+    pState[2] += c;
+    pState[3] += d;
+}
+
+void vMd5Init(Md5Context* pCtx) {
+    pCtx->nState[0] = 0x67452301;
+    pCtx->nState[1] = 0xefcdab89;
+    pCtx->nState[2] = 0x98badcfe;
+    pCtx->nState[3] = 0x10325476;
+    pCtx->nLength = 0;
+}
+
+/*************************************************
+* @Name: vMd5Update
+* @Def: Hashes the next nLen bytes of the stream
+* @Arg: In: pCtx = context
+*       In: pData = bytes
+*       In: nLen = number of bytes
+* @Ret: None
+*************************************************/
+void vMd5Update(Md5Context* pCtx, const void* pData, size_t nLen) {
+    const uint8_t* pIn = pData;
+    size_t nUsed = pCtx->nLength & 63;
+    pCtx->nLength += nLen;
+
+    if (nUsed) {
+        size_t nFill = 64 - nUsed;
+        if (nLen < nFill) {
+            memcpy(pCtx->pBuffer + nUsed, pIn, nLen);
+            return;
+        }
+        memcpy(pCtx->pBuffer + nUsed, pIn, nFill);
+        vMd5Block(pCtx->nState, pCtx->pBuffer);
+        pIn += nFill;
+        nLen -= nFill;
+    }
+    while (nLen >= 64) {
+        vMd5Block(pCtx->nState, pIn);
+        pIn += 64;
+        nLen -= 64;
+    }
+    memcpy(pCtx->pBuffer, pIn, nLen);
+}
+
+/*************************************************
+* @Name: vMd5Final
+* @Def: Pads the stream and produces the digest
+* @Arg: In: pCtx = context, unusable afterwards until vMd5Init
+*       Out: pDigest = 16-byte digest
+* @Ret: None
+*************************************************/
+void vMd5Final(Md5Context* pCtx, uint8_t pDigest[MD5_DIGEST_SIZE]) {
+    uint64_t nBits = pCtx->nLength * 8;
+    uint8_t pPad[72] = { 0x80 };
+    size_t nUsed = pCtx->nLength & 63;
+    size_t nPad = (nUsed < 56) ? 56 - nUsed : 120 - nUsed;
+
+    for (int i = 0; i < 8; i++) {
+        pPad[nPad + i] = (uint8_t)(nBits >> (8 * i));
+    }
+    vMd5Update(pCtx, pPad, nPad + 8);
+
+    for (int i = 0; i < 4; i++) {
+        pDigest[i * 4] = (uint8_t)pCtx->nState[i];
+        pDigest[i * 4 + 1] = (uint8_t)(pCtx->nState[i] >> 8);
+        pDigest[i * 4 + 2] = (uint8_t)(pCtx->nState[i] >> 16);
+        pDigest[i * 4 + 3] = (uint8_t)(pCtx->nState[i] >> 24);
+    }
+}
+
+void vMd5FinalHex(Md5Context* pCtx, char sHex[MD5_HEX_SIZE]) {
+    static const char sDigits[] = "0123456789abcdef";
+    uint8_t pDigest[MD5_DIGEST_SIZE];
+    vMd5Final(pCtx, pDigest);
+    for (int i = 0; i < MD5_DIGEST_SIZE; i++) {
+        sHex[i * 2] = sDigits[pDigest[i] >> 4];
+        sHex[i * 2 + 1] = sDigits[pDigest[i] & 0x0F];
+    }
+    sHex[MD5_HEX_SIZE - 1] = '\0';
+}
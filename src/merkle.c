@@ -0,0 +1,493 @@
+/*********************************
+*
+* @File: merkle.c
+* @Purpose: Chunked Merkle transfer mode. Every MERKLE_CHUNK_SIZE bytes of
+*           FILE_DATA are preceded by a CHUNK_HASH frame; the receiver
+*           verifies chunks on a thread pool, NACKs only the bad ones and
+*           checks the Merkle root sent in the FILE_INFO trailer
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "merkle.h"
+#include "common.h"
+#include <pthread.h>
+
+enum {
+    CHUNK_PENDING,      // Not (fully) received yet
+    CHUNK_QUEUED,       // Received, waiting for or being verified
+    CHUNK_OK,           // Verified
+    CHUNK_BAD           // NACKed, waiting for the resend
+};
+
+typedef struct {
+    Connection* pConn;
+    int fd;                     // Spool file, written with pwrite, verified with pread
+    unsigned long nSize;
+    int nChunks;
+    int nHeldChunks;            // Leading chunks already in the spool from an earlier attempt
+    unsigned long nFeedFrom;    // First byte the pipeline still needs
+    Ring* pRing;
+    MerkleLeaf* pExpected;      // Leaves announced by the sender
+    int* pnState;               // CHUNK_* per chunk
+    int* pnRetries;             // Resends requested per chunk
+    int* pnQueue;               // Chunks waiting for a verifier, circular
+    int nQueueHead;
+    int nQueueCount;
+    int nOk;                    // Chunks in CHUNK_OK
+    int nBad;                   // Chunks in CHUNK_BAD
+    int nFailed;                // Verification gave up or transport failed
+    int nStop;                  // Verifiers exit once the queue is empty
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} MerkleReceiver;
+
+/*************************************************
+* @Name: nMerkleChunkCount
+* @Def: Number of leaves for a file
+* @Arg: In: nSize = file size
+* @Ret: Chunk count
+*************************************************/
+int nMerkleChunkCount(unsigned long nSize) {
+    return (int)((nSize + MERKLE_CHUNK_SIZE - 1) / MERKLE_CHUNK_SIZE);
+}
+
+/*************************************************
+* @Name: nMerkleChunkLength
+* @Def: Size of one chunk; only the last one can be short
+* @Arg: In: nSize = file size
+*       In: nChunk = chunk index
+* @Ret: Chunk length in bytes
+*************************************************/
+unsigned long nMerkleChunkLength(unsigned long nSize, int nChunk) {
+    unsigned long nOffset = (unsigned long)nChunk * MERKLE_CHUNK_SIZE;
+    unsigned long nLeft = nSize - nOffset;
+    return nLeft < MERKLE_CHUNK_SIZE ? nLeft : MERKLE_CHUNK_SIZE;
+}
+
+/*************************************************
+* @Name: vMerkleRoot
+* @Def: Folds the leaves pairwise with MD5(left || right); an odd node
+*       is carried up unchanged
+* @Arg: In: pLeaves = leaf digests
+*       In: nChunks = number of leaves
+*       Out: sHex = root as hex
+* @Ret: None
+*************************************************/
+void vMerkleRoot(MerkleLeaf* pLeaves, int nChunks, char sHex[MD5_HEX_SIZE]) {
+    Md5Context ctx;
+    if (nChunks == 0) {
+        vMd5Init(&ctx);
+        vMd5FinalHex(&ctx, sHex);
+        return;
+    }
+
+    MerkleLeaf* pLevel = malloc(sizeof(MerkleLeaf) * nChunks);
+    if (!pLevel) {
+        sHex[0] = '\0';
+        return;
+    }
+    memcpy(pLevel, pLeaves, sizeof(MerkleLeaf) * nChunks);
+
+    int nCount = nChunks;
+    while (nCount > 1) {
+        int nNext = 0;
+        for (int i = 0; i < nCount; i += 2) {
+            if (i + 1 < nCount) {
+                vMd5Init(&ctx);
+                vMd5Update(&ctx, pLevel[i], MD5_DIGEST_SIZE);
+                vMd5Update(&ctx, pLevel[i + 1], MD5_DIGEST_SIZE);
+                vMd5Final(&ctx, pLevel[nNext]);
+            } else {
+                memmove(pLevel[nNext], pLevel[i], MD5_DIGEST_SIZE);
+            }
+            nNext++;
+        }
+        nCount = nNext;
+    }
+
+    static const char sDigits[] = "0123456789abcdef";
+    for (int i = 0; i < MD5_DIGEST_SIZE; i++) {
+        sHex[i * 2] = sDigits[pLevel[0][i] >> 4];
+        sHex[i * 2 + 1] = sDigits[pLevel[0][i] & 0x0F];
+    }
+    sHex[MD5_HEX_SIZE - 1] = '\0';
+    free(pLevel);
+}
+
+/*************************************************
+* @Name: nParseChunkRanges
+* @Def: Parses a NACK payload such as "3-5,9-9" into per-chunk marks
+* @Arg: In: psRanges = NACK payload
+*       Out: pMarks = set to 1 for every chunk named
+*       In: nChunks = number of chunks in the file
+* @Ret: Number of chunks newly marked, -1 on malformed input
+*************************************************/
+int nParseChunkRanges(const char* psRanges, char* pMarks, int nChunks) {
+    int nMarked = 0;
+    const char* psCursor = psRanges;
+
+    while (*psCursor) {
+        int nFirst, nLast, nUsed;
+        if (sscanf(psCursor, "%d-%d%n", &nFirst, &nLast, &nUsed) != 2 ||
+            nFirst < 0 || nLast < nFirst || nLast >= nChunks) {
+            return -1;
+        }
+        for (int i = nFirst; i <= nLast; i++) {
+            if (!pMarks[i]) {
+                pMarks[i] = 1;
+                nMarked++;
+            }
+        }
+        psCursor += nUsed;
+        if (*psCursor == ',') psCursor++;
+    }
+    return nMarked;
+}
+
+/*************************************************
+* @Name: nHexToDigest
+* @Def: Decodes a 32-character hex MD5
+* @Arg: In: psHex = hex string
+*       Out: pDigest = raw digest
+* @Ret: 0 on success, -1 on malformed input
+*************************************************/
+static int nHexToDigest(const char* psHex, uint8_t* pDigest) {
+    if (strlen(psHex) != MD5_HEX_SIZE - 1) return -1;
+    for (int i = 0; i < MD5_DIGEST_SIZE; i++) {
+        unsigned int nByte;
+        if (sscanf(psHex + i * 2, "%2x", &nByte) != 1) return -1;
+        pDigest[i] = (uint8_t)nByte;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: vSendNack
+* @Def: Asks the sender to resend one chunk range
+* @Arg: In: pConn = connection to the sender
+*       In: nFirst = first chunk
+*       In: nLast = last chunk
+* @Ret: None
+*************************************************/
+static void vSendNack(Connection* pConn, int nFirst, int nLast) {
+    char sRanges[32];
+    snprintf(sRanges, sizeof(sRanges), "%d-%d", nFirst, nLast);
+    Frame* frame = create_frame(FRAME_NACK, sRanges, strlen(sRanges));
+    send_frame(pConn, frame);
+    free_frame(frame);
+}
+
+/*************************************************
+* @Name: vVerifyChunks
+* @Def: Verifier pool thread. Hashes queued chunks from the spool file
+*       and NACKs the ones that do not match
+* @Arg: In: pvArg = MerkleReceiver pointer
+* @Ret: NULL
+*************************************************/
+static void* vVerifyChunks(void* pvArg) {
+    MerkleReceiver* pRecv = (MerkleReceiver*)pvArg;
+    char* pBuffer = malloc(MERKLE_CHUNK_SIZE);
+
+    pthread_mutex_lock(&pRecv->mutex);
+    for (;;) {
+        while (!pRecv->nStop && pRecv->nQueueCount == 0) {
+            pthread_cond_wait(&pRecv->cond, &pRecv->mutex);
+        }
+        if (pRecv->nQueueCount == 0) break;
+
+        int nChunk = pRecv->pnQueue[pRecv->nQueueHead];
+        pRecv->nQueueHead = (pRecv->nQueueHead + 1) % pRecv->nChunks;
+        pRecv->nQueueCount--;
+        pthread_mutex_unlock(&pRecv->mutex);
+
+        unsigned long nLen = nMerkleChunkLength(pRecv->nSize, nChunk);
+        int nMatch = 0;
+        if (pBuffer && pread(pRecv->fd, pBuffer, nLen,
+                             (off_t)nChunk * MERKLE_CHUNK_SIZE) == (ssize_t)nLen) {
+            Md5Context ctx;
+            uint8_t pDigest[MD5_DIGEST_SIZE];
+            vMd5Init(&ctx);
+            vMd5Update(&ctx, pBuffer, nLen);
+            vMd5Final(&ctx, pDigest);
+            nMatch = memcmp(pDigest, pRecv->pExpected[nChunk], MD5_DIGEST_SIZE) == 0;
+        }
+
+        int nNack = 0;
+        pthread_mutex_lock(&pRecv->mutex);
+        if (nMatch) {
+            pRecv->pnState[nChunk] = CHUNK_OK;
+            pRecv->nOk++;
+        } else if (++pRecv->pnRetries[nChunk] > MERKLE_MAX_RETRIES) {
+            pRecv->nFailed = 1;
+        } else {
+            pRecv->pnState[nChunk] = CHUNK_BAD;
+            pRecv->nBad++;
+            nNack = 1;
+        }
+        pthread_cond_broadcast(&pRecv->cond);
+
+        if (nNack) {
+            pthread_mutex_unlock(&pRecv->mutex);
+            vSendNack(pRecv->pConn, nChunk, nChunk);
+            pthread_mutex_lock(&pRecv->mutex);
+        }
+    }
+    pthread_mutex_unlock(&pRecv->mutex);
+
+    free(pBuffer);
+    return NULL;
+}
+
+/*************************************************
+* @Name: vForwardChunks
+* @Def: Feeds verified chunks to the pipeline in file order, so the
+*       engine never sees bytes that failed verification
+* @Arg: In: pvArg = MerkleReceiver pointer
+* @Ret: NULL
+*************************************************/
+static void* vForwardChunks(void* pvArg) {
+    MerkleReceiver* pRecv = (MerkleReceiver*)pvArg;
+    char* pBuffer = malloc(MERKLE_CHUNK_SIZE);
+    if (!pBuffer) return NULL;
+
+    for (int nChunk = (int)(pRecv->nFeedFrom / MERKLE_CHUNK_SIZE); nChunk < pRecv->nChunks; nChunk++) {
+        pthread_mutex_lock(&pRecv->mutex);
+        while (!pRecv->nFailed && pRecv->pnState[nChunk] != CHUNK_OK) {
+            pthread_cond_wait(&pRecv->cond, &pRecv->mutex);
+        }
+        int nFailed = pRecv->nFailed;
+        pthread_mutex_unlock(&pRecv->mutex);
+        if (nFailed) break;
+
+        unsigned long nLen = nMerkleChunkLength(pRecv->nSize, nChunk);
+        unsigned long nStart = (unsigned long)nChunk * MERKLE_CHUNK_SIZE;
+        unsigned long nSkip = pRecv->nFeedFrom > nStart ? pRecv->nFeedFrom - nStart : 0;
+        if (pread(pRecv->fd, pBuffer, nLen, (off_t)nStart) != (ssize_t)nLen ||
+            ring_write(pRecv->pRing, pBuffer + nSkip, nLen - nSkip) < 0) {
+            break;
+        }
+    }
+
+    free(pBuffer);
+    return NULL;
+}
+
+/*************************************************
+* @Name: vQueueChunk
+* @Def: Hands a complete chunk to the verifier pool
+* @Arg: In: pRecv = receiver state
+*       In: nChunk = chunk index
+* @Ret: None
+*************************************************/
+static void vQueueChunk(MerkleReceiver* pRecv, int nChunk) {
+    pthread_mutex_lock(&pRecv->mutex);
+    int nSlot = (pRecv->nQueueHead + pRecv->nQueueCount) % pRecv->nChunks;
+    pRecv->pnQueue[nSlot] = nChunk;
+    pRecv->nQueueCount++;
+    pRecv->pnState[nChunk] = CHUNK_QUEUED;
+    pthread_cond_broadcast(&pRecv->cond);
+    pthread_mutex_unlock(&pRecv->mutex);
+}
+
+/*************************************************
+* @Name: nReceiveChunks
+* @Def: Socket side of the receiver. Reads CHUNK_HASH, chunk data as
+*       FILE_DATA or BULK_DATA, and FILE_INFO until every chunk is
+*       verified, reading past the trailer only while resends are owed
+* @Arg: In: pRecv = receiver state
+*       Out: sRoot = root announced in the trailer
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nReceiveChunks(MerkleReceiver* pRecv, char sRoot[MD5_HEX_SIZE]) {
+    int nCurrent = -1;
+    unsigned long nFill = 0, nLen = 0;
+    int nHaveTrailer = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pRecv->mutex);
+        while (!pRecv->nFailed && nHaveTrailer && nCurrent < 0 &&
+               pRecv->nBad == 0 && pRecv->nOk < pRecv->nChunks) {
+            pthread_cond_wait(&pRecv->cond, &pRecv->mutex);
+        }
+        int nFailed = pRecv->nFailed;
+        int nDone = nHaveTrailer && pRecv->nOk == pRecv->nChunks;
+        pthread_mutex_unlock(&pRecv->mutex);
+        if (nFailed) return -1;
+        if (nDone) return 0;
+
+        Frame* frame = receive_frame(pRecv->pConn);
+        if (!frame) return -1;
+
+        int nResult = 0;
+        switch (frame->type) {
+            case FRAME_CHUNK_HASH: {
+                int nChunk;
+                char sHex[MD5_HEX_SIZE];
+                char sFlag[2] = "";
+                if (nCurrent >= 0 ||
+                    sscanf(frame->data, "%d&%32[0-9a-fA-F]&%1s", &nChunk, sHex, sFlag) < 2 ||
+                    nChunk < 0 || nChunk >= pRecv->nChunks) {
+                    nResult = -1;
+                    break;
+                }
+                int nIsHeld = strcmp(sFlag, MERKLE_HELD) == 0;
+                pthread_mutex_lock(&pRecv->mutex);
+                int nState = pRecv->pnState[nChunk];
+                if (nState == CHUNK_BAD) {
+                    pRecv->nBad--;
+                    pRecv->pnState[nChunk] = CHUNK_PENDING;
+                }
+                pthread_mutex_unlock(&pRecv->mutex);
+                if ((nState != CHUNK_PENDING && nState != CHUNK_BAD) ||
+                    (nIsHeld && (nState != CHUNK_PENDING || nChunk >= pRecv->nHeldChunks)) ||
+                    nHexToDigest(sHex, pRecv->pExpected[nChunk]) != 0) {
+                    nResult = -1;
+                    break;
+                }
+                if (nIsHeld) {
+                    /* The bytes are already spooled: verify them as they are */
+                    vQueueChunk(pRecv, nChunk);
+                    break;
+                }
+                nCurrent = nChunk;
+                nFill = 0;
+                nLen = nMerkleChunkLength(pRecv->nSize, nChunk);
+                break;
+            }
+            case FRAME_FILE_DATA:
+                if (nCurrent < 0 || frame->data_length > DATA_SIZE ||
+                    nFill + frame->data_length > nLen ||
+                    pwrite(pRecv->fd, frame->data, frame->data_length,
+                           (off_t)nCurrent * MERKLE_CHUNK_SIZE + nFill) != frame->data_length) {
+                    nResult = -1;
+                    break;
+                }
+                nFill += frame->data_length;
+                if (nFill == nLen) {
+                    vQueueChunk(pRecv, nCurrent);
+                    nCurrent = -1;
+                }
+                break;
+            case FRAME_BULK_DATA: {
+                size_t nBulk = bulk_length(frame);
+                if (nCurrent < 0 || nBulk == 0 || nFill + nBulk > nLen ||
+                    !receive_bulk_to_file(pRecv->pConn, frame, pRecv->fd,
+                                          (off_t)nCurrent * MERKLE_CHUNK_SIZE + nFill)) {
+                    nResult = -1;
+                    break;
+                }
+                nFill += nBulk;
+                if (nFill == nLen) {
+                    vQueueChunk(pRecv, nCurrent);
+                    nCurrent = -1;
+                }
+                break;
+            }
+            case FRAME_FILE_INFO: {
+                unsigned long nSize;
+                if (nCurrent >= 0 || sscanf(frame->data, "%lu&%32s", &nSize, sRoot) != 2 ||
+                    nSize != pRecv->nSize) {
+                    nResult = -1;
+                    break;
+                }
+                nHaveTrailer = 1;
+                break;
+            }
+            default:
+                nResult = -1;
+                break;
+        }
+        free_frame(frame);
+        if (nResult != 0) return -1;
+    }
+}
+
+/*************************************************
+* @Name: nMerkleReceive
+* @Def: Receives an upload in Merkle mode into fd and streams the verified
+*       bytes into pRing. Sends MD5_CHECK CHECK_OK once the root matches
+* @Arg: In: pConn = connection to the sender
+*       In: fd = spool file opened for reading and writing
+*       In: nSize = announced file size
+*       In: nHeldChunks = leading chunks fd already holds; the sender may
+*           announce these with a held CHUNK_HASH instead of resending them
+*       In: nFeedFrom = first byte to stream into pRing
+*       In: pRing = pipeline input, not closed here
+* @Ret: 0 on success, -1 on transport failure, MERKLE_CHECK_KO if the
+*       upload could not be verified
+*************************************************/
+int nMerkleReceive(Connection* pConn, int fd, unsigned long nSize, int nHeldChunks,
+                   unsigned long nFeedFrom, Ring* pRing) {
+    MerkleReceiver recv;
+    memset(&recv, 0, sizeof(recv));
+    recv.pConn = pConn;
+    recv.fd = fd;
+    recv.nSize = nSize;
+    recv.nChunks = nMerkleChunkCount(nSize);
+    recv.nHeldChunks = nHeldChunks;
+    recv.nFeedFrom = nFeedFrom;
+    recv.pRing = pRing;
+
+    int nAlloc = recv.nChunks > 0 ? recv.nChunks : 1;
+    recv.pExpected = calloc(nAlloc, sizeof(MerkleLeaf));
+    recv.pnState = calloc(nAlloc, sizeof(int));
+    recv.pnRetries = calloc(nAlloc, sizeof(int));
+    recv.pnQueue = calloc(nAlloc, sizeof(int));
+    if (!recv.pExpected || !recv.pnState || !recv.pnRetries || !recv.pnQueue) {
+        free(recv.pExpected);
+        free(recv.pnState);
+        free(recv.pnRetries);
+        free(recv.pnQueue);
+        return -1;
+    }
+    pthread_mutex_init(&recv.mutex, NULL);
+    pthread_cond_init(&recv.cond, NULL);
+
+    long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nThreads = nCpus < 1 ? 1 : (nCpus > MERKLE_MAX_THREADS ? MERKLE_MAX_THREADS : (int)nCpus);
+    pthread_t verifiers[MERKLE_MAX_THREADS];
+    int nStarted = 0;
+    for (int i = 0; i < nThreads; i++) {
+        if (pthread_create(&verifiers[nStarted], NULL, vVerifyChunks, &recv) == 0) nStarted++;
+    }
+    pthread_t forwarder;
+    int nForwarding = nStarted > 0 &&
+                      pthread_create(&forwarder, NULL, vForwardChunks, &recv) == 0;
+
+    char sRoot[MD5_HEX_SIZE] = "";
+    int nResult = -1;
+    if (nForwarding && nReceiveChunks(&recv, sRoot) == 0) {
+        char sActual[MD5_HEX_SIZE];
+        vMerkleRoot(recv.pExpected, recv.nChunks, sActual);
+        nResult = strcmp(sActual, sRoot) == 0 ? 0 : MERKLE_CHECK_KO;
+    } else if (recv.nFailed) {
+        nResult = MERKLE_CHECK_KO;
+    }
+
+    /* Release the sender before the forwarder has drained into the pipeline */
+    if (nResult == 0) {
+        Frame* frame = create_frame(FRAME_MD5_CHECK, "CHECK_OK", 8);
+        if (!send_frame(pConn, frame)) nResult = -1;
+        free_frame(frame);
+    }
+
+    pthread_mutex_lock(&recv.mutex);
+    if (nResult != 0) recv.nFailed = 1;
+    recv.nStop = 1;
+    pthread_cond_broadcast(&recv.cond);
+    pthread_mutex_unlock(&recv.mutex);
+
+    if (nForwarding) pthread_join(forwarder, NULL);
+    for (int i = 0; i < nStarted; i++) {
+        pthread_join(verifiers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&recv.mutex);
+    pthread_cond_destroy(&recv.cond);
+    free(recv.pExpected);
+    free(recv.pnState);
+    free(recv.pnRetries);
+    free(recv.pnQueue);
+    return nResult;
+}
@@ -1,5 +1,7 @@
 #include "../include/network.h"
 #include "../include/logging.h"
+#include "../include/cpu.h"
+#include "../include/shared.h"
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -11,12 +13,69 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <arpa/inet.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+#include <zlib.h>
 
 #define DEBUG 1
 
 static char last_error[256] = {0};
 static pthread_t heartbeat_thread;
 static volatile bool heartbeat_running = false;
+static IoBackend geIoBackend = IO_BACKEND_POSIX;
+
+/* A frame received on a multiplexed socket, queued for its stream with
+ * what came along with it */
+typedef struct StreamItem {
+    Frame* frame;
+    size_t len;                 // BULK_DATA: raw bytes of the segment
+    size_t packed;              // BULK_DATA: zlib bytes in payload, 0 if raw
+    bool is_ring;               // BULK_DATA: the bytes wait in the stream's shared ring
+    char* payload;              // BULK_DATA: bytes read off the socket, NULL if none
+    int fds[MAX_FRAME_FDS];
+    int nfds;
+    struct StreamItem* next;
+} StreamItem;
+
+typedef struct MuxStream {
+    uint16_t id;
+    StreamItem* head;           // Frames received, not yet taken
+    StreamItem* tail;
+    StreamItem* bulk;           // BULK_DATA taken whose bytes are not yet
+    size_t credit;              // Bytes this end may still send on the stream
+    size_t consumed;            // Bytes taken since the peer was last given credit
+    bool is_accepted;           // Opened here, or handed out by accept_stream
+    bool is_reset;              // Peer closed the stream
+    struct MuxStream* next;
+} MuxStream;
+
+struct StreamMux {
+    Connection* root;           // Connection owning the socket
+    pthread_t reader;           // Only reader of the socket
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // Frames queued, credit given, streams opened or over
+    MuxStream* streams;         // Open streams, stream 0 standing for the socket itself
+    uint16_t last_id;           // Highest stream id in use; the peer's higher ones are new
+    bool is_over;               // Socket closed or failed
+};
+
+static Frame* read_frame_fds(Connection* conn, int* fds, int max_fds, int* nfds);
+static Frame* take_frame(Connection* conn, int timeout_ms, int* fds, int max_fds, int* nfds);
+static bool take_credit(Connection* conn, size_t bytes);
+static bool receive_stream_bulk(Connection* conn, int fd, off_t offset);
+static void close_stream(Connection* conn);
+static void stop_mux(StreamMux* mux);
+
+/*************************************************
+* @Name: wire_of
+* @Def: Connection owning the socket a connection sends on, itself
+*       unless it is a stream
+* @Arg: In: conn = connection or stream
+* @Ret: Socket owner, whose send_lock serializes writes
+*************************************************/
+static Connection* wire_of(Connection* conn) {
+    return conn->mux ? conn->mux->root : conn;
+}
 
 static void set_last_error(const char* msg) {
     strncpy(last_error, msg, sizeof(last_error) - 1);
@@ -31,6 +90,81 @@ void clear_last_error(void) {
     last_error[0] = '\0';
 }
 
+/*************************************************
+* @Name: vInitIoBackend
+* @Def: Picks the I/O backend for this process: io_uring when the kernel
+*       supports every operation it needs, blocking read/write otherwise.
+*       MRJ_IO_BACKEND=posix forces the blocking path. Must run before
+*       the first connection is opened
+* @Arg: None
+* @Ret: None
+*************************************************/
+void vInitIoBackend(void) {
+    const char* psChoice = getenv(IO_BACKEND_ENV);
+    int nWantsUring = !psChoice || strcmp(psChoice, "posix") != 0;
+
+    geIoBackend = nWantsUring && nUringProbe() ? IO_BACKEND_URING : IO_BACKEND_POSIX;
+
+    char sMsg[128];
+    snprintf(sMsg, sizeof(sMsg), "I/O backend: %s\n",
+             geIoBackend == IO_BACKEND_URING ? "io_uring" : "posix");
+    vWriteLog(sMsg);
+}
+
+IoBackend eGetIoBackend(void) {
+    return geIoBackend;
+}
+
+/*************************************************
+* @Name: read_full
+* @Def: Reads exactly nLen bytes, retrying on short reads
+* @Arg: In: nFd = descriptor to read from
+*       Out: pvBuffer = destination buffer
+*       In: nLen = number of bytes to read
+*       In: nTimeoutMs = io_uring limit on each read; the blocking path
+*           relies on SO_RCVTIMEO instead
+* @Ret: Number of bytes read (less than nLen on EOF/error)
+*************************************************/
+static ssize_t read_full(int nFd, void *pvBuffer, size_t nLen, int nTimeoutMs) {
+    if (geIoBackend == IO_BACKEND_URING) return nUringRead(nFd, pvBuffer, nLen, nTimeoutMs);
+
+    size_t nTotal = 0;
+    char *psBuffer = (char*)pvBuffer;
+
+    while (nTotal < nLen) {
+        ssize_t nBytes = read(nFd, psBuffer + nTotal, nLen - nTotal);
+        if (nBytes < 0 && errno == EINTR) continue;
+        if (nBytes <= 0) break;
+        nTotal += (size_t)nBytes;
+    }
+    return (ssize_t)nTotal;
+}
+
+/*************************************************
+* @Name: write_full
+* @Def: Writes exactly nLen bytes, retrying on short writes
+* @Arg: In: nFd = descriptor to write to
+*       In: pvData = data to write
+*       In: nLen = number of bytes to write
+*       In: nTimeoutMs = io_uring limit on each write; the blocking path
+*           relies on SO_SNDTIMEO instead
+* @Ret: Number of bytes written (less than nLen on error)
+*************************************************/
+static ssize_t write_full(int nFd, const void *pvData, size_t nLen, int nTimeoutMs) {
+    if (geIoBackend == IO_BACKEND_URING) return nUringWrite(nFd, pvData, nLen, nTimeoutMs);
+
+    size_t nTotal = 0;
+    const char *psData = (const char*)pvData;
+
+    while (nTotal < nLen) {
+        ssize_t nBytes = write(nFd, psData + nTotal, nLen - nTotal);
+        if (nBytes < 0 && errno == EINTR) continue;
+        if (nBytes <= 0) break;
+        nTotal += (size_t)nBytes;
+    }
+    return (ssize_t)nTotal;
+}
+
 /*************************************************
 * @Name: vLogNetwork
 * @Def: Logs network events for debugging
@@ -51,7 +185,9 @@ void vLogNetwork(const char* psEvent, const char* psDetails, int nResult) {
 
 /*************************************************
 * @Name: nSetSocketTimeout
-* @Def: Sets socket timeout options
+* @Def: Sets socket timeout options. Under io_uring receives are bounded
+*       by linked timeouts, and only the send timeout is left to the
+*       socket for sendfile()
 * @Arg: In: nSockfd = socket file descriptor
 *       In: nSeconds = timeout in seconds
 * @Ret: 0 on success, -1 on failure
@@ -61,7 +197,8 @@ int nSetSocketTimeout(int nSockfd, int nSeconds) {
     tTimeout.tv_sec = nSeconds;
     tTimeout.tv_usec = 0;
 
-    if (setsockopt(nSockfd, SOL_SOCKET, SO_RCVTIMEO, &tTimeout, sizeof(tTimeout)) < 0) {
+    if (geIoBackend == IO_BACKEND_POSIX &&
+        setsockopt(nSockfd, SOL_SOCKET, SO_RCVTIMEO, &tTimeout, sizeof(tTimeout)) < 0) {
         return -1;
     }
     if (setsockopt(nSockfd, SOL_SOCKET, SO_SNDTIMEO, &tTimeout, sizeof(tTimeout)) < 0) {
@@ -70,22 +207,68 @@ int nSetSocketTimeout(int nSockfd, int nSeconds) {
     return 0;
 }
 
+/*************************************************
+* @Name: is_unix_endpoint
+* @Def: Whether a configured IP field names a unix socket
+* @Arg: In: ip = IP field, "unix:/path" for an AF_UNIX endpoint
+* @Ret: true for a unix socket endpoint
+*************************************************/
+bool is_unix_endpoint(const char* ip) {
+    return ip && strncmp(ip, UNIX_ENDPOINT, strlen(UNIX_ENDPOINT)) == 0;
+}
+
+/*************************************************
+* @Name: nSetEndpoint
+* @Def: Fills the address of a connection from a configured endpoint
+* @Arg: Out: pConn = connection whose addr is set
+*       In: psIP = dotted IPv4 address or "unix:/path"
+*       In: nPort = TCP port, ignored for unix sockets
+* @Ret: Address length, 0 if a unix path does not fit sun_path
+*************************************************/
+static socklen_t nSetEndpoint(Connection* pConn, const char* psIP, int nPort) {
+    memset(&pConn->addr, 0, sizeof(pConn->addr));
+    if (is_unix_endpoint(psIP)) {
+        struct sockaddr_un* pUnix = (struct sockaddr_un*)&pConn->addr;
+        const char* psPath = psIP + strlen(UNIX_ENDPOINT);
+        if (psPath[0] == '\0' || strlen(psPath) >= sizeof(pUnix->sun_path)) return 0;
+        pUnix->sun_family = AF_UNIX;
+        strcpy(pUnix->sun_path, psPath);
+        return sizeof(struct sockaddr_un);
+    }
+
+    struct sockaddr_in* pInet = (struct sockaddr_in*)&pConn->addr;
+    pInet->sin_family = AF_INET;
+    pInet->sin_port = htons(nPort);
+    pInet->sin_addr.s_addr = inet_addr(psIP);
+    return sizeof(struct sockaddr_in);
+}
+
 /*************************************************
 * @Name: create_server
-* @Def: Creates a server socket
+* @Def: Creates a server socket. A "unix:/path" endpoint listens on a
+*       unix socket instead, replacing a stale socket file left there
 * @Arg: In: psIP = IP address to bind to
 *       In: nPort = port to bind to
 * @Ret: Connection pointer or NULL on failure
 *************************************************/
 Connection* create_server(const char *psIP, int nPort) {
-    Connection *pConn = malloc(sizeof(Connection));
+    Connection *pConn = calloc(1, sizeof(Connection));
     if (!pConn) {
         vLogNetwork("CREATE_SERVER", "Memory allocation failed", -1);
         return NULL;
     }
+    pthread_mutex_init(&pConn->send_lock, NULL);
+    pConn->is_server = true;
+
+    socklen_t nAddrLen = nSetEndpoint(pConn, psIP, nPort);
+    if (nAddrLen == 0) {
+        vLogNetwork("CREATE_SERVER", "Unix socket path too long", -1);
+        free(pConn);
+        return NULL;
+    }
 
     // Create socket
-    pConn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    pConn->fd = socket(pConn->addr.ss_family, SOCK_STREAM, 0);
     if (pConn->fd < 0) {
         vLogNetwork("CREATE_SERVER", "Socket creation failed", pConn->fd);
         free(pConn);
@@ -101,17 +284,15 @@ Connection* create_server(const char *psIP, int nPort) {
         return NULL;
     }
 
-    // Configure address
-    pConn->addr.sin_family = AF_INET;
-    pConn->addr.sin_port = htons(nPort);
-    pConn->addr.sin_addr.s_addr = inet_addr(psIP);
-
-    char sDebug[100];
+    char sDebug[200];
     snprintf(sDebug, sizeof(sDebug), "Configuring server on %s:%d", psIP, nPort);
     vLogNetwork("CREATE_SERVER", sDebug, 0);
 
     // Bind socket
-    if (bind(pConn->fd, (struct sockaddr*)&pConn->addr, sizeof(pConn->addr)) < 0) {
+    if (pConn->addr.ss_family == AF_UNIX) {
+        unlink(((struct sockaddr_un*)&pConn->addr)->sun_path);
+    }
+    if (bind(pConn->fd, (struct sockaddr*)&pConn->addr, nAddrLen) < 0) {
         vLogNetwork("CREATE_SERVER", "Bind failed", -1);
         close(pConn->fd);
         free(pConn);
@@ -131,20 +312,28 @@ Connection* create_server(const char *psIP, int nPort) {
 
 /*************************************************
 * @Name: connect_to_server
-* @Def: Connects to a server
+* @Def: Connects to a server, over a unix socket for "unix:/path"
 * @Arg: In: psIP = server IP address
 *       In: nPort = server port
 * @Ret: Connection pointer or NULL on failure
 *************************************************/
 Connection* connect_to_server(const char *psIP, int nPort) {
-    Connection *pConn = malloc(sizeof(Connection));
+    Connection *pConn = calloc(1, sizeof(Connection));
     if (!pConn) {
         vLogNetwork("CONNECT", "Memory allocation failed", -1);
         return NULL;
     }
+    pthread_mutex_init(&pConn->send_lock, NULL);
+
+    socklen_t nAddrLen = nSetEndpoint(pConn, psIP, nPort);
+    if (nAddrLen == 0) {
+        vLogNetwork("CONNECT", "Unix socket path too long", -1);
+        free(pConn);
+        return NULL;
+    }
 
     // Create socket
-    pConn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    pConn->fd = socket(pConn->addr.ss_family, SOCK_STREAM, 0);
     if (pConn->fd < 0) {
         vLogNetwork("CONNECT", "Socket creation failed", pConn->fd);
         free(pConn);
@@ -158,16 +347,12 @@ Connection* connect_to_server(const char *psIP, int nPort) {
         free(pConn);
         return NULL;
     }
-
-    // Configure address
-    pConn->addr.sin_family = AF_INET;
-    pConn->addr.sin_port = htons(nPort);
-    pConn->addr.sin_addr.s_addr = inet_addr(psIP);
+    pConn->timeout_ms = SOCKET_TIMEOUT_SEC * 1000;
 
     // Connect to server
-    char sDebug[100];
+    char sDebug[200];
     snprintf(sDebug, sizeof(sDebug), "Connecting to %s:%d", psIP, nPort);
-    if (connect(pConn->fd, (struct sockaddr*)&pConn->addr, sizeof(pConn->addr)) < 0) {
+    if (connect(pConn->fd, (struct sockaddr*)&pConn->addr, nAddrLen) < 0) {
         vLogNetwork("CONNECT", sDebug, -1);
         close(pConn->fd);
         free(pConn);
@@ -178,6 +363,25 @@ Connection* connect_to_server(const char *psIP, int nPort) {
     return pConn;
 }
 
+/*************************************************
+* @Name: create_connection
+* @Def: Wraps a socket from accept_connection in a Connection, with the
+*       same timeout accept_connection gave the socket
+* @Arg: In: fd = connected socket
+* @Ret: Connection pointer or NULL on failure
+*************************************************/
+Connection* create_connection(int fd) {
+    Connection *pConn = calloc(1, sizeof(Connection));
+    if (!pConn) {
+        vLogNetwork("CREATE", "Memory allocation failed", -1);
+        return NULL;
+    }
+    pConn->fd = fd;
+    pConn->timeout_ms = SOCKET_TIMEOUT_SEC * 1000;
+    pthread_mutex_init(&pConn->send_lock, NULL);
+    return pConn;
+}
+
 /*************************************************
 * @Name: accept_connection
 * @Def: Accepts a new connection
@@ -185,13 +389,15 @@ Connection* connect_to_server(const char *psIP, int nPort) {
 * @Ret: New socket file descriptor or -1 on failure
 *************************************************/
 int accept_connection(Connection *pServer) {
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;
     socklen_t addr_len = sizeof(client_addr);
+    memset(&client_addr, 0, sizeof(client_addr));
 
     int nClientFd = accept(pServer->fd, (struct sockaddr*)&client_addr, &addr_len);
 
     char sDebug[100];
-    snprintf(sDebug, sizeof(sDebug), "Client IP: %s", inet_ntoa(client_addr.sin_addr));
+    snprintf(sDebug, sizeof(sDebug), "Client IP: %s", client_addr.ss_family == AF_INET ?
+             inet_ntoa(((struct sockaddr_in*)&client_addr)->sin_addr) : "local");
     vLogNetwork("ACCEPT", sDebug, nClientFd);
 
     if (nClientFd >= 0) {
@@ -286,14 +492,27 @@ ssize_t receive_data_timeout(Connection *pConn, void *pvBuffer, size_t nLen, int
 
 /*************************************************
 * @Name: close_connection
-* @Def: Closes a connection
+* @Def: Closes a connection. Closing a stream leaves the socket open; the
+*       streams of a socket are closed before the socket itself
 * @Arg: In: pConn = connection to close
 * @Ret: None
 *************************************************/
 void close_connection(Connection *pConn) {
+    if (pConn && pConn->mux && pConn->stream != 0) {
+        close_stream(pConn);
+        return;
+    }
     if (pConn) {
         vLogNetwork("CLOSE", "Closing connection", pConn->fd);
+        if (pConn->mux) stop_mux(pConn->mux);
+        vDestroyShmLink(pConn->shm);
+        free(pConn->zlib_send);
+        free(pConn->zlib_recv);
         close(pConn->fd);
+        if (pConn->is_server && pConn->addr.ss_family == AF_UNIX) {
+            unlink(((struct sockaddr_un*)&pConn->addr)->sun_path);
+        }
+        pthread_mutex_destroy(&pConn->send_lock);
         free(pConn);
     }
 }
@@ -348,10 +567,13 @@ uint16_t calculate_checksum(const Frame* frame) {
     sum += (frame->data_length & 0xFF);
     sum += ((frame->data_length >> 8) & 0xFF);
 
+    // Add stream
+    sum += (frame->stream & 0xFF);
+    sum += ((frame->stream >> 8) & 0xFF);
+
     // Add data
-    for (size_t i = 0; i < frame->data_length; i++) {
-        sum += (uint8_t)frame->data[i];
-    }
+    size_t data_len = frame->data_length < DATA_SIZE ? frame->data_length : DATA_SIZE;
+    sum += gKernels.pfByteSum((const uint8_t*)frame->data, data_len);
 
     // Add timestamp
     const uint8_t* ts = (const uint8_t*)&frame->timestamp;
@@ -362,6 +584,71 @@ uint16_t calculate_checksum(const Frame* frame) {
     return (uint16_t)(sum % 65536);
 }
 
+/*************************************************
+* @Name: vFillFrame
+* @Def: Builds a frame in place, stamped and checksummed, without the
+*       allocation and debug log of create_frame
+* @Arg: Out: frame = frame to fill
+*       In: type = frame type
+*       In: stream = stream the frame belongs to
+*       In: data = frame data, may be NULL
+*       In: data_length = length of data, at most DATA_SIZE
+* @Ret: None
+*************************************************/
+static void vFillFrame(Frame* frame, uint8_t type, uint16_t stream, const char* data, uint16_t data_length) {
+    memset(frame, 0, sizeof(Frame));
+    frame->type = type;
+    frame->data_length = data_length;
+    frame->stream = stream;
+    frame->timestamp = time(NULL);
+    if (data && data_length > 0) memcpy(frame->data, data, data_length);
+    frame->checksum = calculate_checksum(frame);
+}
+
+/*************************************************
+* @Name: send_frames
+* @Def: Sends a payload as consecutive frames of one type, DATA_SIZE bytes
+*       each, writing up to FRAME_BATCH frames with a single call. Under
+*       io_uring the frames are built in the registered pool
+* @Arg: In: conn = connection to send through
+*       In: type = frame type, usually FRAME_FILE_DATA
+*       In: data = payload
+*       In: len = payload size
+* @Ret: true on success, false on failure
+*************************************************/
+bool send_frames(Connection* conn, uint8_t type, const char* data, size_t len) {
+    if (!conn || (!data && len > 0)) {
+        set_last_error("Invalid parameters");
+        return false;
+    }
+
+    Frame local[FRAME_BATCH];
+    Frame* batch = geIoBackend == IO_BACKEND_URING ? pUringFramePool() : NULL;
+    if (!batch) batch = local;
+
+    bool ok = true;
+    size_t offset = 0;
+    while (ok && offset < len) {
+        int count = 0;
+        for (; count < FRAME_BATCH && offset < len; count++) {
+            size_t part = len - offset < DATA_SIZE ? len - offset : DATA_SIZE;
+            vFillFrame(&batch[count], type, conn->stream, data + offset, (uint16_t)part);
+            offset += part;
+        }
+
+        size_t size = (size_t)count * sizeof(Frame);
+        Connection* wire = wire_of(conn);
+        ok = take_credit(conn, size);
+        if (!ok) break;
+        pthread_mutex_lock(&wire->send_lock);
+        ok = write_full(conn->fd, batch, size, conn->timeout_ms) == (ssize_t)size;
+        pthread_mutex_unlock(&wire->send_lock);
+    }
+
+    if (!ok) set_last_error("Failed to send frames");
+    return ok;
+}
+
 /*************************************************
 * @Name: send_frame
 * @Def: Sends a frame
@@ -375,11 +662,20 @@ bool send_frame(Connection* conn, const Frame* frame) {
         return false;
     }
 
-    Frame temp = *frame;
-    temp.timestamp = time(NULL);
-    temp.checksum = calculate_checksum(&temp);
-
-    ssize_t sent = write(conn->fd, &temp, sizeof(Frame));
+    /* The registered pool spares io_uring pinning the page on every send */
+    Frame local;
+    Frame* temp = pUringFramePool();
+    if (geIoBackend != IO_BACKEND_URING || !temp) temp = &local;
+    *temp = *frame;
+    temp->stream = conn->stream;
+    temp->timestamp = time(NULL);
+    temp->checksum = calculate_checksum(temp);
+
+    Connection* wire = wire_of(conn);
+    if (!take_credit(conn, sizeof(Frame))) return false;
+    pthread_mutex_lock(&wire->send_lock);
+    ssize_t sent = write_full(conn->fd, temp, sizeof(Frame), conn->timeout_ms);
+    pthread_mutex_unlock(&wire->send_lock);
     if (sent != sizeof(Frame)) {
         set_last_error("Failed to send complete frame");
         return false;
@@ -389,28 +685,25 @@ bool send_frame(Connection* conn, const Frame* frame) {
 }
 
 /*************************************************
-* @Name: receive_frame
-* @Def: Receives a frame
-* @Arg: In: conn = connection to receive from
+* @Name: read_frame
+* @Def: Reads the next frame off the socket
+* @Arg: In: conn = connection to read from
 * @Ret: Received frame or NULL on failure
 *************************************************/
-Frame* receive_frame(Connection* conn) {
-    if (!conn) {
-        set_last_error("Invalid connection");
-        return NULL;
-    }
-
+static Frame* read_frame(Connection* conn) {
     Frame* frame = malloc(sizeof(Frame));
     if (!frame) {
         set_last_error("Memory allocation failed");
         return NULL;
     }
 
-    if (receive_data(conn, frame, sizeof(Frame)) != sizeof(Frame)) {
+    Frame* slot = geIoBackend == IO_BACKEND_URING ? pUringFramePool() : NULL;
+    if (read_full(conn->fd, slot ? slot : frame, sizeof(Frame), conn->timeout_ms) != sizeof(Frame)) {
         set_last_error("Failed to receive complete frame");
         free(frame);
         return NULL;
     }
+    if (slot) *frame = *slot;
 
     if (!validate_frame(frame)) {
         set_last_error("Frame validation failed");
@@ -421,6 +714,21 @@ Frame* receive_frame(Connection* conn) {
     return frame;
 }
 
+/*************************************************
+* @Name: receive_frame
+* @Def: Receives a frame, from the stream's queue on a multiplexed socket
+* @Arg: In: conn = connection to receive from
+* @Ret: Received frame or NULL on failure
+*************************************************/
+Frame* receive_frame(Connection* conn) {
+    if (!conn) {
+        set_last_error("Invalid connection");
+        return NULL;
+    }
+    if (conn->mux) return take_frame(conn, conn->timeout_ms, NULL, 0, NULL);
+    return read_frame(conn);
+}
+
 /*************************************************
 * @Name: validate_frame
 * @Def: Validates a received frame
@@ -473,6 +781,27 @@ int vValidateFrame(Frame* pFrame, Connection* pConn) {
     return 1;
 }
 
+/*************************************************
+* @Name: wait_for_close
+* @Def: Waits for the peer to close the connection, discarding anything
+*       it still sends
+* @Arg: In: conn = connection
+*       In: timeout_sec = longest wait for each read
+* @Ret: true once the peer has closed, false on timeout or error
+*************************************************/
+bool wait_for_close(Connection* conn, int timeout_sec) {
+    char buffer[DATA_SIZE];
+    struct pollfd pfd = { .fd = conn->fd, .events = POLLIN, .revents = 0 };
+    for (;;) {
+        int nReady = poll(&pfd, 1, timeout_sec * 1000);
+        if (nReady < 0 && errno == EINTR) continue;
+        if (nReady <= 0) return false;
+        ssize_t nBytes = recv(conn->fd, buffer, sizeof(buffer), 0);
+        if (nBytes == 0) return true;
+        if (nBytes < 0 && errno != EINTR) return false;
+    }
+}
+
 /*************************************************
 * @Name: is_connected
 * @Def: Checks if connection is still active
@@ -483,6 +812,12 @@ bool is_connected(Connection* conn) {
     if (!conn || conn->fd < 0) {
         return false;
     }
+    if (conn->mux) {
+        pthread_mutex_lock(&conn->mux->mutex);
+        bool is_over = conn->mux->is_over;
+        pthread_mutex_unlock(&conn->mux->mutex);
+        return !is_over;
+    }
 
     struct pollfd pfd = {
         .fd = conn->fd,
@@ -497,6 +832,57 @@ bool is_connected(Connection* conn) {
     return !(pfd.revents & (POLLHUP | POLLERR));
 }
 
+/*************************************************
+* @Name: is_local_socket
+* @Def: Whether a connection runs over a unix socket, and so can carry
+*       descriptors to its peer
+* @Arg: In: conn = connected socket
+* @Ret: true for an AF_UNIX connection
+*************************************************/
+bool is_local_socket(Connection* conn) {
+    struct sockaddr_storage self;
+    socklen_t nLen = sizeof(self);
+    return conn && getsockname(conn->fd, (struct sockaddr*)&self, &nLen) == 0 && self.ss_family == AF_UNIX;
+}
+
+/*************************************************
+* @Name: mode_has_option
+* @Def: Looks for an option in a "MODE+OPTION+OPTION" string
+* @Arg: In: mode = mode string as sent in WORKER_CONNECT
+*       In: option = option name, e.g. BULK_MODE
+* @Ret: true if the option is present
+*************************************************/
+bool mode_has_option(const char* mode, const char* option) {
+    size_t nLen = strlen(option);
+    for (const char* psOption = strchr(mode, '+'); psOption; psOption = strchr(psOption, '+')) {
+        psOption++;
+        if (strncmp(psOption, option, nLen) == 0 && (psOption[nLen] == '+' || psOption[nLen] == '\0' ||
+                                                     psOption[nLen] == '&')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*************************************************
+* @Name: make_cache_key
+* @Def: Builds the "md5&factor&extension" key a distortion result is
+*       cached under. The engines go by extension, so it is part of it
+* @Arg: Out: key = cache key
+*       In: md5 = input MD5, 32 hex characters
+*       In: factor = distortion factor
+*       In: filename = input file name
+* @Ret: true if the request can be cached
+*************************************************/
+bool make_cache_key(char key[CACHE_KEY_LENGTH], const char* md5, const char* factor, const char* filename) {
+    const char* psExt = strrchr(filename, '.');
+    if (strlen(md5) != 32 || strspn(md5, "0123456789abcdef") != 32 || !psExt || factor[0] == '\0') {
+        return false;
+    }
+    int nLen = snprintf(key, CACHE_KEY_LENGTH, "%s&%s&%s", md5, factor, psExt + 1);
+    return nLen > 0 && nLen < CACHE_KEY_LENGTH;
+}
+
 void* vHeartbeatThread(void* pvArg) {
     Connection* pConn = (Connection*)pvArg;
 
@@ -536,13 +922,30 @@ Frame* receive_frame_timeout(Connection* conn, int timeout_sec) {
         return NULL;
     }
 
+    if (conn->mux) return take_frame(conn, timeout_sec * 1000, NULL, 0, NULL);
+
     Frame* frame = malloc(sizeof(Frame));
     if (!frame) {
         set_last_error("Memory allocation failed");
         return NULL;
     }
 
-    if (receive_data_timeout(conn, frame, sizeof(Frame), timeout_sec) != sizeof(Frame)) {
+    /* io_uring bounds the read itself; the blocking path waits in select first */
+    bool received;
+    if (geIoBackend == IO_BACKEND_URING) {
+        received = read_full(conn->fd, frame, sizeof(Frame), timeout_sec * 1000) == sizeof(Frame);
+    } else {
+        fd_set readfds;
+        struct timeval tv;
+        FD_ZERO(&readfds);
+        FD_SET(conn->fd, &readfds);
+        tv.tv_sec = timeout_sec;
+        tv.tv_usec = 0;
+        received = select(conn->fd + 1, &readfds, NULL, NULL, &tv) > 0 &&
+                   read_full(conn->fd, frame, sizeof(Frame), conn->timeout_ms) == sizeof(Frame);
+    }
+
+    if (!received) {
         set_last_error("Failed to receive frame within timeout");
         free(frame);
         return NULL;
@@ -557,6 +960,1144 @@ Frame* receive_frame_timeout(Connection* conn, int timeout_sec) {
     return frame;
 }
 
+/*************************************************
+* @Name: send_frame_fds
+* @Def: Sends a frame with descriptors attached as SCM_RIGHTS. Only works
+*       over a unix socket
+* @Arg: In: conn = connection to send through
+*       In: frame = frame to send
+*       In: fds = descriptors to pass, the caller keeps its copies
+*       In: nfds = descriptor count, at most MAX_FRAME_FDS
+* @Ret: true on success, false on failure
+*************************************************/
+bool send_frame_fds(Connection* conn, const Frame* frame, const int* fds, int nfds) {
+    if (!conn || !frame || nfds < 0 || nfds > MAX_FRAME_FDS) {
+        set_last_error("Invalid parameters");
+        return false;
+    }
+
+    Frame temp = *frame;
+    temp.stream = conn->stream;
+    temp.timestamp = time(NULL);
+    temp.checksum = calculate_checksum(&temp);
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FRAME_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { &temp, sizeof(Frame) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+
+    Connection* wire = wire_of(conn);
+    if (!take_credit(conn, sizeof(Frame))) return false;
+    pthread_mutex_lock(&wire->send_lock);
+    ssize_t sent;
+    do {
+        sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    /* The descriptors travel with the first byte; the rest is plain data */
+    bool ok = sent > 0 && (sent == sizeof(Frame) ||
+              write_full(conn->fd, (char*)&temp + sent, sizeof(Frame) - sent, conn->timeout_ms) ==
+                  (ssize_t)(sizeof(Frame) - sent));
+    pthread_mutex_unlock(&wire->send_lock);
+
+    if (!ok) set_last_error("Failed to send frame with descriptors");
+    return ok;
+}
+
+/*************************************************
+* @Name: receive_frame_fds
+* @Def: Receives a frame and any descriptors sent with it by
+*       send_frame_fds. Descriptors beyond max_fds are closed
+* @Arg: In: conn = connection to receive from
+*       Out: fds = received descriptors, owned by the caller
+*       In: max_fds = room in fds
+*       Out: nfds = descriptors received
+* @Ret: Received frame or NULL on failure, in which case no descriptor
+*       is left open
+*************************************************/
+Frame* receive_frame_fds(Connection* conn, int* fds, int max_fds, int* nfds) {
+    *nfds = 0;
+    if (!conn) {
+        set_last_error("Invalid connection");
+        return NULL;
+    }
+    if (conn->mux) return take_frame(conn, conn->timeout_ms, fds, max_fds, nfds);
+    return read_frame_fds(conn, fds, max_fds, nfds);
+}
+
+/*************************************************
+* @Name: read_frame_fds
+* @Def: Reads the next frame off a unix socket with its descriptors
+* @Arg: In: conn = connection to read from
+*       Out: fds = received descriptors, owned by the caller
+*       In: max_fds = room in fds
+*       Out: nfds = descriptors received
+* @Ret: Received frame or NULL on failure, in which case no descriptor
+*       is left open
+*************************************************/
+static Frame* read_frame_fds(Connection* conn, int* fds, int max_fds, int* nfds) {
+    *nfds = 0;
+    Frame* frame = malloc(sizeof(Frame));
+    if (!frame) {
+        set_last_error("Memory allocation failed");
+        return NULL;
+    }
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_FRAME_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { frame, sizeof(Frame) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct pollfd pfd = { conn->fd, POLLIN, 0 };
+    ssize_t got = -1;
+    if (poll(&pfd, 1, conn->timeout_ms > 0 ? conn->timeout_ms : -1) > 0) {
+        do {
+            got = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        } while (got < 0 && errno == EINTR);
+    }
+
+    for (struct cmsghdr* cm = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int* received = (int*)CMSG_DATA(cm);
+        for (int i = 0; i < count; i++) {
+            if (*nfds < max_fds) fds[(*nfds)++] = received[i];
+            else close(received[i]);
+        }
+    }
+
+    bool ok = got > 0 && (got == sizeof(Frame) ||
+              read_full(conn->fd, (char*)frame + got, sizeof(Frame) - got, conn->timeout_ms) ==
+                  (ssize_t)(sizeof(Frame) - got));
+    if (!ok || !validate_frame(frame)) {
+        set_last_error(ok ? "Frame validation failed" : "Failed to receive frame with descriptors");
+        for (int i = 0; i < *nfds; i++) close(fds[i]);
+        *nfds = 0;
+        free(frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+/*************************************************
+* @Name: send_bulk_header
+* @Def: Sends the BULK_DATA frame announcing len raw bytes, packed into
+*       packed zlib bytes if packed is not 0, or moved through the shared
+*       ring if the connection has one. The caller holds send_lock until
+*       the bytes themselves are out
+* @Arg: In: conn = connection to send through
+*       In: len = raw bytes of the segment
+*       In: packed = zlib bytes that follow instead, 0 for raw bytes
+* @Ret: true on success, false on failure
+*************************************************/
+static bool send_bulk_header(Connection* conn, size_t len, size_t packed) {
+    char sLength[48];
+    Frame local;
+    Frame* header = geIoBackend == IO_BACKEND_URING ? pUringFramePool() : NULL;
+    if (!header) header = &local;
+    int nLength = packed > 0 ? snprintf(sLength, sizeof(sLength), "%zu&%zu", len, packed) :
+                  conn->shm ? snprintf(sLength, sizeof(sLength), "%zu&%s", len, SHM_MODE)
+                            : snprintf(sLength, sizeof(sLength), "%zu", len);
+    vFillFrame(header, FRAME_BULK_DATA, conn->stream, sLength, (uint16_t)nLength);
+    return write_full(conn->fd, header, sizeof(Frame), conn->timeout_ms) == sizeof(Frame);
+}
+
+/*************************************************
+* @Name: enable_bulk_compression
+* @Def: Lets BULK_DATA segments sent on a connection go out zlib-packed,
+*       once the peer has agreed to ZLIB_MODE. The first ZLIB_PROBE_BYTES
+*       of the stream decide whether packing stays on
+* @Arg: In: conn = connection
+* @Ret: None
+*************************************************/
+void enable_bulk_compression(Connection* conn) {
+    conn->zlib = 1;
+    conn->zlib_raw = 0;
+    conn->zlib_packed = 0;
+}
+
+/*************************************************
+* @Name: reset_bulk_options
+* @Def: Drops what a job negotiated for its BULK_DATA, the shared rings
+*       and zlib packing, so a connection kept for the next job starts
+*       plain on both ends
+* @Arg: In: conn = connection
+* @Ret: None
+*************************************************/
+void reset_bulk_options(Connection* conn) {
+    vDestroyShmLink(conn->shm);
+    conn->shm = NULL;
+    conn->zlib = 0;
+}
+
+/*************************************************
+* @Name: pZlibScratch
+* @Def: Allocates a compression scratch buffer on first use: room for a
+*       raw segment followed by the worst case packed one
+* @Arg: In/Out: ppScratch = scratch pointer of the connection
+* @Ret: Scratch buffer or NULL on failure
+*************************************************/
+static char* pZlibScratch(char** ppScratch) {
+    if (!*ppScratch) *ppScratch = malloc(BULK_SEGMENT_SIZE + compressBound(BULK_SEGMENT_SIZE));
+    return *ppScratch;
+}
+
+/*************************************************
+* @Name: nPackSegment
+* @Def: Packs a segment into the send scratch, after the raw area. While
+*       probing it also tallies the stream; a stream that does not shrink
+*       by an eighth, such as JPEG or PNG data, is sent raw from then on
+* @Arg: In: conn = connection, send_lock held
+*       In: raw = segment
+*       In: len = segment size
+* @Ret: Packed size, 0 to send the segment raw
+*************************************************/
+static size_t nPackSegment(Connection* conn, const char* raw, size_t len) {
+    if (conn->zlib <= 0 || conn->shm || !pZlibScratch(&conn->zlib_send)) return 0;
+
+    uLongf packed = compressBound(len);
+    if (compress2((Bytef*)conn->zlib_send + BULK_SEGMENT_SIZE, &packed, (const Bytef*)raw, len,
+                  ZLIB_LEVEL) != Z_OK) {
+        packed = len;
+    }
+
+    if (conn->zlib == 1) {
+        conn->zlib_raw += len;
+        conn->zlib_packed += packed;
+        if (conn->zlib_raw >= ZLIB_PROBE_BYTES) {
+            conn->zlib = conn->zlib_packed <= conn->zlib_raw - conn->zlib_raw / 8 ? 2 : -1;
+            char sMsg[128];
+            snprintf(sMsg, sizeof(sMsg), "Payload compression %s: %lu bytes probed, packed to %lu\n",
+                     conn->zlib > 0 ? "kept" : "dropped", (unsigned long)conn->zlib_raw,
+                     (unsigned long)conn->zlib_packed);
+            vWriteLog(sMsg);
+        }
+    }
+    return packed < len ? (size_t)packed : 0;
+}
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+/*************************************************
+* @Name: wait_zerocopy
+* @Def: Waits until the kernel has released every MSG_ZEROCOPY send, so
+*       the caller may reuse the buffer
+* @Arg: In: conn = connection with zero-copy sends in flight
+* @Ret: true on success, false on failure
+*************************************************/
+static bool wait_zerocopy(Connection* conn) {
+    while (conn->zc_done != conn->zc_sent) {
+        struct pollfd pfd = { conn->fd, 0, 0 };
+        if (poll(&pfd, 1, SOCKET_TIMEOUT_SEC * 1000) <= 0) return false;
+
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(conn->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                conn->zc_done = err->ee_data + 1;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+/*************************************************
+* @Name: send_bulk
+* @Def: Sends an in-memory payload as a BULK_DATA segment. Uses
+*       MSG_ZEROCOPY where the socket supports it, so the kernel sends
+*       straight from the caller's pages
+* @Arg: In: conn = connection to send through
+*       In: data = payload
+*       In: len = payload size, at most BULK_SEGMENT_SIZE
+* @Ret: true on success, false on failure
+*************************************************/
+bool send_bulk(Connection* conn, const void* data, size_t len) {
+    if (!conn || !data || len == 0 || len > BULK_SEGMENT_SIZE) {
+        set_last_error("Invalid parameters");
+        return false;
+    }
+
+    const char* psData = (const char*)data;
+    size_t total = 0;
+    Connection* wire = wire_of(conn);
+    if (!take_credit(conn, sizeof(Frame) + len)) return false;
+    pthread_mutex_lock(&wire->send_lock);
+    size_t packed = nPackSegment(conn, psData, len);
+    bool ok = send_bulk_header(conn, len, packed);
+    if (conn->shm) {
+        /* The ring belongs to this stream alone, so the socket is free again */
+        pthread_mutex_unlock(&wire->send_lock);
+        ok = ok && nShmSend(conn->shm, psData, len, conn->fd, conn->timeout_ms) == 0;
+        if (!ok) set_last_error("Failed to send bulk segment");
+        return ok;
+    }
+    if (ok && packed > 0) {
+        ok = write_full(conn->fd, conn->zlib_send + BULK_SEGMENT_SIZE, packed, conn->timeout_ms) == (ssize_t)packed;
+        total = len;
+    }
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (ok && total < len && conn->zerocopy == 0) {
+        int one = 1;
+        conn->zerocopy = setsockopt(conn->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ? 1 : -1;
+    }
+    while (ok && conn->zerocopy > 0 && total < len) {
+        ssize_t sent = send(conn->fd, psData + total, len - total, MSG_ZEROCOPY);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && errno == ENOBUFS) break;  // Out of pinnable memory: copy the rest
+        if (sent <= 0) {
+            ok = false;
+            break;
+        }
+        conn->zc_sent++;
+        total += (size_t)sent;
+    }
+    /* The pages belong to the kernel until it reports the sends done */
+    if (conn->zerocopy > 0 && !wait_zerocopy(conn)) ok = false;
+#endif
+    if (ok && total < len) {
+        ok = write_full(conn->fd, psData + total, len - total, conn->timeout_ms) == (ssize_t)(len - total);
+    }
+    pthread_mutex_unlock(&wire->send_lock);
+
+    if (!ok) set_last_error("Failed to send bulk segment");
+    return ok;
+}
+
+/*************************************************
+* @Name: send_bulk_file
+* @Def: Sends a file range as a BULK_DATA segment with sendfile(), so the
+*       bytes go from the page cache to the socket without a user copy
+* @Arg: In: conn = connection to send through
+*       In: fd = file to send from
+*       In: offset = first byte of the range
+*       In: len = range size, at most BULK_SEGMENT_SIZE
+* @Ret: true on success, false on failure
+*************************************************/
+bool send_bulk_file(Connection* conn, int fd, off_t offset, size_t len) {
+    if (!conn || fd < 0 || len == 0 || len > BULK_SEGMENT_SIZE) {
+        set_last_error("Invalid parameters");
+        return false;
+    }
+
+    size_t total = 0;
+    size_t packed = 0;
+    Connection* wire = wire_of(conn);
+    if (!take_credit(conn, sizeof(Frame) + len)) return false;
+    pthread_mutex_lock(&wire->send_lock);
+    /* Packing needs the bytes in memory, so they are read instead of sendfile()d */
+    if (conn->zlib > 0 && !conn->shm && pZlibScratch(&conn->zlib_send) &&
+        pread(fd, conn->zlib_send, len, offset) == (ssize_t)len) {
+        packed = nPackSegment(conn, conn->zlib_send, len);
+    }
+    bool ok = send_bulk_header(conn, len, packed);
+    if (conn->shm) {
+        pthread_mutex_unlock(&wire->send_lock);
+        ok = ok && nShmSendFile(conn->shm, fd, offset, len, conn->fd, conn->timeout_ms) == 0;
+        if (!ok) set_last_error("Failed to send bulk segment");
+        return ok;
+    }
+    if (ok && packed > 0) {
+        ok = write_full(conn->fd, conn->zlib_send + BULK_SEGMENT_SIZE, packed, conn->timeout_ms) == (ssize_t)packed;
+        total = len;
+    }
+    while (ok && total < len) {
+        ssize_t sent = sendfile(conn->fd, fd, &offset, len - total);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            ok = false;
+            break;
+        }
+        total += (size_t)sent;
+    }
+    pthread_mutex_unlock(&wire->send_lock);
+
+    if (!ok) set_last_error("Failed to send bulk segment");
+    return ok;
+}
+
+/*************************************************
+* @Name: nParseBulk
+* @Def: Reads the sizes a BULK_DATA frame announces, "raw", "raw&packed"
+*       or "raw&SHM"
+* @Arg: In: frame = received frame
+*       Out: pPacked = zlib bytes following the frame, 0 for raw bytes
+*       Out: pIsRing = the bytes go through the shared ring instead
+* @Ret: Raw bytes of the segment, 0 if the frame is malformed
+*************************************************/
+static size_t nParseBulk(const Frame* frame, size_t* pPacked, bool* pIsRing) {
+    *pPacked = 0;
+    *pIsRing = false;
+    if (!frame || frame->type != FRAME_BULK_DATA ||
+        frame->data_length == 0 || frame->data_length >= DATA_SIZE) {
+        return 0;
+    }
+
+    char sLength[DATA_SIZE];
+    memcpy(sLength, frame->data, frame->data_length);
+    sLength[frame->data_length] = '\0';
+
+    char* psEnd;
+    unsigned long len = strtoul(sLength, &psEnd, 10);
+    if (*psEnd == '&' && strcmp(psEnd + 1, SHM_MODE) == 0) {
+        *pIsRing = true;
+        psEnd += strlen(psEnd);
+    } else if (*psEnd == '&') {
+        unsigned long packed = strtoul(psEnd + 1, &psEnd, 10);
+        if (packed == 0 || packed > compressBound(BULK_SEGMENT_SIZE)) return 0;
+        *pPacked = (size_t)packed;
+    }
+    if (*psEnd != '\0' || len > BULK_SEGMENT_SIZE) return 0;
+    return (size_t)len;
+}
+
+/*************************************************
+* @Name: bulk_length
+* @Def: Reads the size a BULK_DATA frame announces
+* @Arg: In: frame = received frame
+* @Ret: Raw bytes of the segment, 0 if the frame is malformed
+*************************************************/
+size_t bulk_length(const Frame* frame) {
+    size_t packed;
+    bool is_ring;
+    return nParseBulk(frame, &packed, &is_ring);
+}
+
+/*************************************************
+* @Name: write_file_all
+* @Def: Writes a buffer at an offset of a file, retrying short writes
+* @Arg: In: fd = destination file
+*       In: data = bytes to write
+*       In: len = byte count
+*       In: offset = where the bytes go in the file
+* @Ret: true on success, false on failure
+*************************************************/
+static bool write_file_all(int fd, const char* data, size_t len, off_t offset) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t written = pwrite(fd, data + total, len - total, offset + (off_t)total);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        total += (size_t)written;
+    }
+    return true;
+}
+
+/*************************************************
+* @Name: unpack_to_file
+* @Def: Unpacks a zlib-packed segment into a file
+* @Arg: In: conn = connection whose receive scratch is used
+*       In: data = packed bytes, not in the scratch's raw area
+*       In: len = raw bytes of the segment
+*       In: packed = zlib bytes
+*       In: fd = destination file
+*       In: offset = where the bytes go in the file
+* @Ret: true on success, false on failure
+*************************************************/
+static bool unpack_to_file(Connection* conn, const char* data, size_t len, size_t packed, int fd, off_t offset) {
+    char* raw = pZlibScratch(&conn->zlib_recv);
+    uLongf unpacked = len;
+    if (!raw || uncompress((Bytef*)raw, &unpacked, (const Bytef*)data, packed) != Z_OK || unpacked != len) {
+        return false;
+    }
+    return write_file_all(fd, raw, len, offset);
+}
+
+/*************************************************
+* @Name: receive_packed_to_file
+* @Def: Reads a zlib-packed BULK_DATA segment and writes it unpacked
+* @Arg: In: conn = connection to receive from
+*       In: len = raw bytes of the segment
+*       In: packed = zlib bytes that follow
+*       In: fd = destination file
+*       In: offset = where the bytes go in the file
+* @Ret: true on success, false on failure
+*************************************************/
+static bool receive_packed_to_file(Connection* conn, size_t len, size_t packed, int fd, off_t offset) {
+    char* raw = pZlibScratch(&conn->zlib_recv);
+    if (!raw || read_full(conn->fd, raw + BULK_SEGMENT_SIZE, packed, conn->timeout_ms) != (ssize_t)packed) {
+        return false;
+    }
+    return unpack_to_file(conn, raw + BULK_SEGMENT_SIZE, len, packed, fd, offset);
+}
+
+/*************************************************
+* @Name: receive_bulk_to_file
+* @Def: Moves the raw bytes of a BULK_DATA segment from the socket into a
+*       file with splice(), through a pipe, without a user copy. A packed
+*       segment is read and unpacked instead. On a stream, the bytes were
+*       already read off the socket with the frame
+* @Arg: In: conn = connection to receive from
+*       In: header = BULK_DATA frame announcing the segment
+*       In: fd = destination file
+*       In: offset = where the bytes go in the file
+* @Ret: true on success, false on failure
+*************************************************/
+bool receive_bulk_to_file(Connection* conn, const Frame* header, int fd, off_t offset) {
+    size_t packed;
+    bool is_ring;
+    size_t len = nParseBulk(header, &packed, &is_ring);
+    if (conn && conn->mux && fd >= 0) {
+        if (receive_stream_bulk(conn, fd, offset)) return true;
+        set_last_error("Failed to receive bulk segment");
+        return false;
+    }
+    if (conn && packed > 0 && fd >= 0) {
+        if (receive_packed_to_file(conn, len, packed, fd, offset)) return true;
+        set_last_error("Failed to receive packed bulk segment");
+        return false;
+    }
+    if (conn && is_ring && conn->shm && fd >= 0) {
+        if (nShmReceiveToFile(conn->shm, fd, offset, len, conn->fd, conn->timeout_ms) == 0) return true;
+        set_last_error("Failed to receive bulk segment");
+        return false;
+    }
+
+    int pipefd[2];
+    if (!conn || fd < 0 || pipe2(pipefd, O_CLOEXEC) != 0) {
+        set_last_error("Failed to set up bulk receive");
+        return false;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, BULK_SEGMENT_SIZE);  // Best effort, the default size also works
+
+    size_t total = 0;
+    bool ok = true;
+    if (geIoBackend == IO_BACKEND_URING) {
+        ok = nUringSpliceToFile(conn->fd, pipefd, fd, offset, len, conn->timeout_ms) == (ssize_t)len;
+        total = len;
+    }
+    while (ok && total < len) {
+        ssize_t moved = splice(conn->fd, NULL, pipefd[1], NULL, len - total, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) {
+            ok = false;
+            break;
+        }
+        total += (size_t)moved;
+        while (ok && moved > 0) {
+            ssize_t written = splice(pipefd[0], NULL, fd, &offset, (size_t)moved, SPLICE_F_MOVE);
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) ok = false;
+            else moved -= written;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    if (!ok) set_last_error("Failed to receive bulk segment");
+    return ok;
+}
+
+/*************************************************
+* @Name: deadline_after
+* @Def: Absolute CLOCK_MONOTONIC time timeout_ms from now, for the
+*       demultiplexer's condition waits
+* @Arg: Out: deadline = time to wait until
+*       In: timeout_ms = delay
+* @Ret: None
+*************************************************/
+static void deadline_after(struct timespec* deadline, int timeout_ms) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout_ms / 1000;
+    deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/*************************************************
+* @Name: mux_wait
+* @Def: Waits for the demultiplexer to change. Called with its mutex held
+* @Arg: In: mux = demultiplexer
+*       In: deadline = time to give up at, NULL to wait indefinitely
+* @Ret: false once the deadline has passed
+*************************************************/
+static bool mux_wait(StreamMux* mux, const struct timespec* deadline) {
+    if (!deadline) return pthread_cond_wait(&mux->cond, &mux->mutex) == 0;
+    return pthread_cond_timedwait(&mux->cond, &mux->mutex, deadline) != ETIMEDOUT;
+}
+
+static MuxStream* find_stream(StreamMux* mux, uint16_t id) {
+    MuxStream* s = mux->streams;
+    while (s && s->id != id) s = s->next;
+    return s;
+}
+
+static MuxStream* add_stream(StreamMux* mux, uint16_t id) {
+    MuxStream* s = calloc(1, sizeof(MuxStream));
+    if (!s) return NULL;
+    s->id = id;
+    s->credit = STREAM_WINDOW;
+    s->next = mux->streams;
+    mux->streams = s;
+    if (id > mux->last_id) mux->last_id = id;
+    return s;
+}
+
+static StreamItem* pop_item(MuxStream* s) {
+    StreamItem* item = s->head;
+    if (item) {
+        s->head = item->next;
+        if (!s->head) s->tail = NULL;
+        item->next = NULL;
+    }
+    return item;
+}
+
+static void free_item(StreamItem* item) {
+    if (!item) return;
+    for (int i = 0; i < item->nfds; i++) close(item->fds[i]);
+    free(item->frame);
+    free(item->payload);
+    free(item);
+}
+
+static void free_stream(MuxStream* s) {
+    if (!s) return;
+    StreamItem* item;
+    while ((item = pop_item(s)) != NULL) free_item(item);
+    free_item(s->bulk);
+    free(s);
+}
+
+/*************************************************
+* @Name: send_stream_control
+* @Def: Writes a frame of the demultiplexer's own on a stream. Control
+*       frames need no credit, so they get through a full window
+* @Arg: In: mux = demultiplexer
+*       In: id = stream the frame is about
+*       In: type = FRAME_WINDOW or FRAME_DISCONNECT
+*       In: data = frame data, may be NULL
+*       In: len = length of data
+* @Ret: true on success, false on failure
+*************************************************/
+static bool send_stream_control(StreamMux* mux, uint16_t id, uint8_t type, const char* data, uint16_t len) {
+    Frame frame;
+    vFillFrame(&frame, type, id, data, len);
+    Connection* root = mux->root;
+    pthread_mutex_lock(&root->send_lock);
+    bool ok = write_full(root->fd, &frame, sizeof(Frame), root->timeout_ms) == sizeof(Frame);
+    pthread_mutex_unlock(&root->send_lock);
+    return ok;
+}
+
+/*************************************************
+* @Name: take_credit
+* @Def: Takes bytes from a stream's send window, waiting for the peer to
+*       grant more if it is spent. The socket itself is not limited
+* @Arg: In: conn = connection about to send
+*       In: bytes = bytes the send puts on the socket, frames included
+* @Ret: true once the bytes may be sent, false if the stream closed or
+*       no credit came within the connection's timeout
+*************************************************/
+static bool take_credit(Connection* conn, size_t bytes) {
+    if (!conn->mux || conn->stream == 0) return true;
+
+    StreamMux* mux = conn->mux;
+    struct timespec deadline;
+    deadline_after(&deadline, conn->timeout_ms);
+    pthread_mutex_lock(&mux->mutex);
+    MuxStream* s = find_stream(mux, conn->stream);
+    while (s && s->credit < bytes && !s->is_reset && !mux->is_over &&
+           mux_wait(mux, conn->timeout_ms > 0 ? &deadline : NULL)) {
+    }
+    bool ok = s && s->credit >= bytes && !s->is_reset && !mux->is_over;
+    if (ok) s->credit -= bytes;
+    pthread_mutex_unlock(&mux->mutex);
+
+    if (!ok) set_last_error("Stream closed or send window exhausted");
+    return ok;
+}
+
+/*************************************************
+* @Name: give_credit
+* @Def: Counts bytes taken off a stream and, once a quarter of the window
+*       is consumed, grants them back to the sender with FRAME_WINDOW
+* @Arg: In: conn = stream the bytes were taken from
+*       In: bytes = bytes taken, frames included
+* @Ret: None
+*************************************************/
+static void give_credit(Connection* conn, size_t bytes) {
+    if (conn->stream == 0) return;
+
+    StreamMux* mux = conn->mux;
+    size_t grant = 0;
+    pthread_mutex_lock(&mux->mutex);
+    MuxStream* s = find_stream(mux, conn->stream);
+    if (s && !s->is_reset) {
+        s->consumed += bytes;
+        if (s->consumed >= STREAM_WINDOW / 4) {
+            grant = s->consumed;
+            s->consumed = 0;
+        }
+    }
+    pthread_mutex_unlock(&mux->mutex);
+
+    if (grant > 0) {
+        char sGrant[24];
+        int nGrant = snprintf(sGrant, sizeof(sGrant), "%zu", grant);
+        send_stream_control(mux, conn->stream, FRAME_WINDOW, sGrant, (uint16_t)nGrant);
+    }
+}
+
+/*************************************************
+* @Name: read_payload
+* @Def: Reads the bytes following a BULK_DATA frame off the socket, so
+*       the next stream's frame can be read. Ring bytes stay in the ring
+* @Arg: In: root = multiplexed connection
+*       In/Out: item = frame just read; gets its sizes and bytes
+* @Ret: true on success, false on a malformed frame or failed read
+*************************************************/
+static bool read_payload(Connection* root, StreamItem* item) {
+    if (item->frame->type != FRAME_BULK_DATA) return true;
+
+    item->len = nParseBulk(item->frame, &item->packed, &item->is_ring);
+    if (item->len == 0) return false;
+    if (item->is_ring) return true;
+
+    size_t size = item->packed > 0 ? item->packed : item->len;
+    item->payload = malloc(size);
+    return item->payload && read_full(root->fd, item->payload, size, root->timeout_ms) == (ssize_t)size;
+}
+
+/*************************************************
+* @Name: route_item
+* @Def: Queues a received frame for its stream, applies FRAME_WINDOW
+*       grants and notes resets. A frame on an id above any in use opens
+*       that stream and those below it for accept_stream; frames of closed
+*       streams are dropped.
+*       Called with the demultiplexer's mutex held
+* @Arg: In: mux = demultiplexer
+*       In: item = received frame, owned by the demultiplexer from here
+* @Ret: None
+*************************************************/
+static void route_item(StreamMux* mux, StreamItem* item) {
+    Frame* frame = item->frame;
+    MuxStream* s = find_stream(mux, frame->stream);
+    if (!s && frame->stream > mux->last_id && frame->type != FRAME_WINDOW) {
+        /* Streams are opened in order but may start sending in any: the
+         * ones skipped were opened too, their first frames on the way. One
+         * closed before it sent anything is only skipped */
+        while (mux->last_id + 1 < frame->stream && add_stream(mux, (uint16_t)(mux->last_id + 1))) {}
+        if (frame->type == FRAME_DISCONNECT) mux->last_id = frame->stream;
+        else s = add_stream(mux, frame->stream);
+    }
+    if (!s) {
+        free_item(item);
+        return;
+    }
+
+    if (frame->type == FRAME_WINDOW && frame->stream != 0) {
+        char sGrant[24];
+        size_t nLen = frame->data_length < sizeof(sGrant) - 1 ? frame->data_length : sizeof(sGrant) - 1;
+        memcpy(sGrant, frame->data, nLen);
+        sGrant[nLen] = '\0';
+        s->credit += strtoul(sGrant, NULL, 10);
+        free_item(item);
+    } else {
+        if (frame->type == FRAME_DISCONNECT && frame->stream != 0) s->is_reset = true;
+        if (s->tail) s->tail->next = item;
+        else s->head = item;
+        s->tail = item;
+    }
+    pthread_cond_broadcast(&mux->cond);
+}
+
+/*************************************************
+* @Name: mux_reader
+* @Def: Demultiplexer thread: the only reader of the socket. Reads each
+*       frame, with its descriptors and bulk bytes, and routes it to its
+*       stream until the socket fails or is shut down
+* @Arg: In: pvArg = demultiplexer
+* @Ret: NULL
+*************************************************/
+static void* mux_reader(void* pvArg) {
+    StreamMux* mux = (StreamMux*)pvArg;
+    Connection* root = mux->root;
+
+    for (;;) {
+        struct pollfd pfd = { root->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        /* A hang-up between frames is how a multiplexed connection ends */
+        char cNext;
+        ssize_t nPeek = recv(root->fd, &cNext, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (nPeek < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (nPeek <= 0) break;
+
+        StreamItem* item = calloc(1, sizeof(StreamItem));
+        if (!item) break;
+        item->frame = read_frame_fds(root, item->fds, MAX_FRAME_FDS, &item->nfds);
+        if (!item->frame || !read_payload(root, item)) {
+            free_item(item);
+            break;
+        }
+
+        pthread_mutex_lock(&mux->mutex);
+        route_item(mux, item);
+        pthread_mutex_unlock(&mux->mutex);
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+    mux->is_over = true;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+    return NULL;
+}
+
+/*************************************************
+* @Name: enable_mux
+* @Def: Turns a connection into the root of multiplexed streams. From
+*       here one thread reads the socket and every frame is taken from
+*       its stream's queue; frames on stream 0 are the connection's own.
+*       MSG_ZEROCOPY is left off, since its completions would wake the
+*       reader
+* @Arg: In: conn = connected socket, not yet read from by other threads
+*       In: first = frame already read off the socket, NULL for none;
+*           owned by the demultiplexer from here, even on failure
+*       In: fds = descriptors that came with first
+*       In: nfds = descriptor count
+* @Ret: true on success, false on failure
+*************************************************/
+bool enable_mux(Connection* conn, Frame* first, const int* fds, int nfds) {
+    StreamItem* item = first ? calloc(1, sizeof(StreamItem)) : NULL;
+    StreamMux* mux = conn && !conn->mux ? calloc(1, sizeof(StreamMux)) : NULL;
+    if (item) {
+        item->frame = first;
+        for (int i = 0; i < nfds && i < MAX_FRAME_FDS; i++) item->fds[item->nfds++] = fds[i];
+    } else if (first) {
+        free(first);
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+    }
+    if (!mux || (first && !item) || (item && !read_payload(conn, item))) {
+        set_last_error("Failed to set up stream multiplexing");
+        free_item(item);
+        free(mux);
+        return false;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mux->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&mux->mutex, NULL);
+    mux->root = conn;
+    MuxStream* own = add_stream(mux, 0);
+    if (own) own->is_accepted = true;
+    if (item) route_item(mux, item);
+
+    conn->mux = mux;
+    conn->zerocopy = -1;
+    if (pthread_create(&mux->reader, NULL, mux_reader, mux) != 0) {
+        set_last_error("Failed to start stream reader");
+        conn->mux = NULL;
+        while (mux->streams) {
+            MuxStream* s = mux->streams;
+            mux->streams = s->next;
+            free_stream(s);
+        }
+        pthread_cond_destroy(&mux->cond);
+        pthread_mutex_destroy(&mux->mutex);
+        free(mux);
+        return false;
+    }
+    return true;
+}
+
+/*************************************************
+* @Name: stream_connection
+* @Def: Connection standing for one stream of a multiplexed socket
+* @Arg: In: root = multiplexed connection
+*       In: id = stream
+* @Ret: New connection or NULL on failure
+*************************************************/
+static Connection* stream_connection(Connection* root, uint16_t id) {
+    Connection* conn = calloc(1, sizeof(Connection));
+    if (!conn) {
+        set_last_error("Memory allocation failed");
+        return NULL;
+    }
+    conn->fd = root->fd;
+    conn->addr = root->addr;
+    conn->timeout_ms = root->timeout_ms;
+    conn->zerocopy = -1;
+    conn->mux = root->mux;
+    conn->stream = id;
+    pthread_mutex_init(&conn->send_lock, NULL);
+    return conn;
+}
+
+/*************************************************
+* @Name: open_stream
+* @Def: Opens a new stream on a multiplexed connection. Only the end
+*       that connected opens streams; the other accepts them
+* @Arg: In: conn = multiplexed connection
+* @Ret: Connection for the stream, closed with close_connection, or NULL
+*       on failure
+*************************************************/
+Connection* open_stream(Connection* conn) {
+    if (!conn || !conn->mux) {
+        set_last_error("Invalid connection");
+        return NULL;
+    }
+
+    StreamMux* mux = conn->mux;
+    MuxStream* s = NULL;
+    pthread_mutex_lock(&mux->mutex);
+    if (!mux->is_over && mux->last_id < UINT16_MAX) s = add_stream(mux, (uint16_t)(mux->last_id + 1));
+    if (s) s->is_accepted = true;
+    pthread_mutex_unlock(&mux->mutex);
+    if (!s) {
+        set_last_error("Failed to open stream");
+        return NULL;
+    }
+
+    Connection* stream = stream_connection(conn, s->id);
+    if (!stream) {
+        pthread_mutex_lock(&mux->mutex);
+        MuxStream** link = &mux->streams;
+        while (*link != s) link = &(*link)->next;
+        *link = s->next;
+        pthread_mutex_unlock(&mux->mutex);
+        free_stream(s);
+    }
+    return stream;
+}
+
+/*************************************************
+* @Name: accept_stream
+* @Def: Waits for the peer to open a stream, or to send a frame on the
+*       connection itself
+* @Arg: In: conn = multiplexed connection
+*       In: timeout_sec = how long to wait
+*       Out: frame = frame on stream 0 if one came first, else NULL
+* @Ret: Connection for the new stream, or NULL with *frame set, or NULL
+*       with *frame NULL on timeout or once the socket is gone
+*************************************************/
+Connection* accept_stream(Connection* conn, int timeout_sec, Frame** frame) {
+    *frame = NULL;
+    if (!conn || !conn->mux) {
+        set_last_error("Invalid connection");
+        return NULL;
+    }
+
+    StreamMux* mux = conn->mux;
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_sec * 1000);
+    MuxStream* fresh = NULL;
+    pthread_mutex_lock(&mux->mutex);
+    for (;;) {
+        for (MuxStream* s = mux->streams; s; s = s->next) {
+            if (!s->is_accepted && (!fresh || s->id < fresh->id)) fresh = s;
+        }
+        if (fresh) {
+            fresh->is_accepted = true;
+            break;
+        }
+        MuxStream* own = find_stream(mux, 0);
+        StreamItem* item = own ? pop_item(own) : NULL;
+        if (item) {
+            *frame = item->frame;
+            item->frame = NULL;
+            free_item(item);
+            break;
+        }
+        if (mux->is_over || !mux_wait(mux, &deadline)) break;
+    }
+    pthread_mutex_unlock(&mux->mutex);
+
+    return fresh ? stream_connection(conn, fresh->id) : NULL;
+}
+
+/*************************************************
+* @Name: take_frame
+* @Def: Takes the next frame queued for a stream. A BULK_DATA frame's
+*       bytes are kept for receive_bulk_to_file until the next take
+* @Arg: In: conn = stream, or the multiplexed connection itself
+*       In: timeout_ms = how long to wait, 0 for indefinitely
+*       Out: fds = descriptors sent with the frame, may be NULL
+*       In: max_fds = room in fds; extra descriptors are closed
+*       Out: nfds = descriptors received, may be NULL
+* @Ret: Received frame or NULL on timeout or once the stream is closed
+*************************************************/
+static Frame* take_frame(Connection* conn, int timeout_ms, int* fds, int max_fds, int* nfds) {
+    StreamMux* mux = conn->mux;
+    struct timespec deadline;
+    deadline_after(&deadline, timeout_ms);
+
+    pthread_mutex_lock(&mux->mutex);
+    MuxStream* s = find_stream(mux, conn->stream);
+    StreamItem* stale = s ? s->bulk : NULL;
+    if (s) s->bulk = NULL;
+    while (s && !s->head && !s->is_reset && !mux->is_over && mux_wait(mux, timeout_ms > 0 ? &deadline : NULL)) {
+    }
+    StreamItem* item = s ? pop_item(s) : NULL;
+    bool is_closed = !s || s->is_reset || mux->is_over;
+    pthread_mutex_unlock(&mux->mutex);
+
+    /* Bytes the caller never asked for are consumed all the same */
+    if (stale) {
+        give_credit(conn, stale->len);
+        free_item(stale);
+    }
+    if (!item) {
+        set_last_error(is_closed ? "Stream closed" : "Failed to receive frame within timeout");
+        return NULL;
+    }
+
+    Frame* frame = item->frame;
+    item->frame = NULL;
+    for (int i = 0; i < item->nfds; i++) {
+        if (fds && nfds && *nfds < max_fds) fds[(*nfds)++] = item->fds[i];
+        else close(item->fds[i]);
+    }
+    item->nfds = 0;
+    if (frame->type == FRAME_BULK_DATA) {
+        pthread_mutex_lock(&mux->mutex);
+        s = find_stream(mux, conn->stream);
+        if (s) s->bulk = item;
+        pthread_mutex_unlock(&mux->mutex);
+        if (!s) free_item(item);
+    } else {
+        free_item(item);
+    }
+    give_credit(conn, sizeof(Frame));
+    return frame;
+}
+
+/*************************************************
+* @Name: receive_stream_bulk
+* @Def: Writes the bytes of the BULK_DATA frame last taken off a stream
+*       into a file
+* @Arg: In: conn = stream
+*       In: fd = destination file
+*       In: offset = where the bytes go in the file
+* @Ret: true on success, false on failure
+*************************************************/
+static bool receive_stream_bulk(Connection* conn, int fd, off_t offset) {
+    StreamMux* mux = conn->mux;
+    pthread_mutex_lock(&mux->mutex);
+    MuxStream* s = find_stream(mux, conn->stream);
+    StreamItem* item = s ? s->bulk : NULL;
+    if (s) s->bulk = NULL;
+    pthread_mutex_unlock(&mux->mutex);
+    if (!item) return false;
+
+    bool ok;
+    if (item->is_ring) {
+        ok = conn->shm && nShmReceiveToFile(conn->shm, fd, offset, item->len, conn->fd, conn->timeout_ms) == 0;
+    } else if (item->packed > 0) {
+        ok = unpack_to_file(conn, item->payload, item->len, item->packed, fd, offset);
+    } else {
+        ok = write_file_all(fd, item->payload, item->len, offset);
+    }
+    give_credit(conn, item->len);
+    free_item(item);
+    return ok;
+}
+
+/*************************************************
+* @Name: reset_stream
+* @Def: Ends one stream from any thread, as the peer closing it would:
+*       the peer is told, and waits on the stream return at once. The
+*       socket stays open for the other streams; the stream is still
+*       closed with close_connection by its owner
+* @Arg: In: conn = stream
+* @Ret: None
+*************************************************/
+void reset_stream(Connection* conn) {
+    if (!conn || !conn->mux || conn->stream == 0) return;
+
+    StreamMux* mux = conn->mux;
+    pthread_mutex_lock(&mux->mutex);
+    MuxStream* s = find_stream(mux, conn->stream);
+    bool is_open = s && !s->is_reset && !mux->is_over;
+    if (s) s->is_reset = true;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+
+    if (is_open) send_stream_control(mux, conn->stream, FRAME_DISCONNECT, NULL, 0);
+}
+
+/*************************************************
+* @Name: close_stream
+* @Def: Closes one stream, telling the peer unless it closed first. The
+*       socket stays open for the other streams
+* @Arg: In: conn = stream
+* @Ret: None
+*************************************************/
+static void close_stream(Connection* conn) {
+    StreamMux* mux = conn->mux;
+    pthread_mutex_lock(&mux->mutex);
+    MuxStream** link = &mux->streams;
+    while (*link && (*link)->id != conn->stream) link = &(*link)->next;
+    MuxStream* s = *link;
+    if (s) *link = s->next;
+    bool is_open = s && !s->is_reset && !mux->is_over;
+    pthread_mutex_unlock(&mux->mutex);
+
+    if (is_open) send_stream_control(mux, conn->stream, FRAME_DISCONNECT, NULL, 0);
+    free_stream(s);
+    vDestroyShmLink(conn->shm);
+    free(conn->zlib_send);
+    free(conn->zlib_recv);
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn);
+}
+
+/*************************************************
+* @Name: stop_mux
+* @Def: Stops the reader of a multiplexed socket and frees its streams.
+*       Connections for the streams must be closed before
+* @Arg: In: mux = demultiplexer
+* @Ret: None
+*************************************************/
+static void stop_mux(StreamMux* mux) {
+    shutdown(mux->root->fd, SHUT_RDWR);
+    pthread_join(mux->reader, NULL);
+    while (mux->streams) {
+        MuxStream* s = mux->streams;
+        mux->streams = s->next;
+        free_stream(s);
+    }
+    pthread_cond_destroy(&mux->cond);
+    pthread_mutex_destroy(&mux->mutex);
+    free(mux);
+}
+
 int send_frame_conn(Connection* conn, const Frame* frame) {
     if (!conn || !frame) return -1;
     return send_data(conn, frame, sizeof(Frame)) == sizeof(Frame) ? 0 : -1;
@@ -0,0 +1,380 @@
+/*********************************
+*
+* @File: progress.c
+* @Purpose: Job progress table shared by the workers of one type on a
+*           host. The segment is guarded by a robust process-shared
+*           mutex, so a worker dying while holding it does not wedge
+*           the others
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "progress.h"
+#include "common.h"
+#include "shared.h"
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int nIsReady;                           // Set by the creator once the mutex is usable
+    ProgressEntry entries[PROGRESS_SLOTS];
+} ProgressSegment;
+
+struct ProgressTable {
+    ProgressSegment* pSegment;
+};
+
+/*************************************************
+* @Name: nIsOwnerAlive
+* @Def: Whether the process owning a slot still runs on this host
+* @Arg: In: nOwner = owner pid
+* @Ret: 1 if alive, 0 otherwise
+*************************************************/
+static int nIsOwnerAlive(pid_t nOwner) {
+    return nOwner > 0 && (kill(nOwner, 0) == 0 || errno == EPERM);
+}
+
+/*************************************************
+* @Name: nIsInUse
+* @Def: Whether a slot belongs to a job running now, in this process or
+*       another one on the host
+* @Arg: In: pEntry = slot
+* @Ret: 1 if in use, 0 if free or waiting for a resume
+*************************************************/
+static int nIsInUse(const ProgressEntry* pEntry) {
+    return pEntry->sJobId[0] != '\0' && pEntry->nIsRunning && nIsOwnerAlive(pEntry->nOwner);
+}
+
+/*************************************************
+* @Name: vLockTable
+* @Def: Takes the table mutex, recovering it if its holder died
+* @Arg: In: pTable = table
+* @Ret: None
+*************************************************/
+static void vLockTable(ProgressTable* pTable) {
+    if (pthread_mutex_lock(&pTable->pSegment->mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(&pTable->pSegment->mutex);
+    }
+}
+
+static void vUnlockTable(ProgressTable* pTable) {
+    pthread_mutex_unlock(&pTable->pSegment->mutex);
+}
+
+/*************************************************
+* @Name: pOpenProgressTable
+* @Def: Maps the progress table of a worker type, creating it if this is
+*       the first worker of that type on the host
+* @Arg: In: psType = worker type
+* @Ret: Table or NULL if shared memory is unavailable
+*************************************************/
+ProgressTable* pOpenProgressTable(const char* psType) {
+    char sName[64];
+    snprintf(sName, sizeof(sName), "/mrj_progress_%s", psType);
+
+    int nIsCreator = 1;
+    int fd = shm_open(sName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        nIsCreator = 0;
+        fd = shm_open(sName, O_RDWR, 0600);
+    }
+    if (fd < 0) return NULL;
+
+    if (nIsCreator && ftruncate(fd, sizeof(ProgressSegment)) != 0) {
+        close(fd);
+        shm_unlink(sName);
+        return NULL;
+    }
+
+    /* Another worker may still be sizing the segment it just created */
+    struct stat st;
+    for (int i = 0; i < 100 && fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(ProgressSegment); i++) {
+        usleep(10000);
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ProgressSegment)) {
+        close(fd);
+        return NULL;
+    }
+
+    ProgressSegment* pSegment = mmap(NULL, sizeof(ProgressSegment), PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (pSegment == MAP_FAILED) return NULL;
+
+    if (nIsCreator) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&pSegment->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&pSegment->nIsReady, 1, __ATOMIC_RELEASE);
+    } else {
+        for (int i = 0; i < 100 && !__atomic_load_n(&pSegment->nIsReady, __ATOMIC_ACQUIRE); i++) {
+            usleep(10000);
+        }
+        if (!__atomic_load_n(&pSegment->nIsReady, __ATOMIC_ACQUIRE)) {
+            munmap(pSegment, sizeof(ProgressSegment));
+            return NULL;
+        }
+    }
+
+    ProgressTable* pTable = malloc(sizeof(ProgressTable));
+    if (!pTable) {
+        munmap(pSegment, sizeof(ProgressSegment));
+        return NULL;
+    }
+    pTable->pSegment = pSegment;
+    return pTable;
+}
+
+/*************************************************
+* @Name: vCloseProgressTable
+* @Def: Unmaps the table. The segment outlives the process on purpose
+* @Arg: In: pTable = table, may be NULL
+* @Ret: None
+*************************************************/
+void vCloseProgressTable(ProgressTable* pTable) {
+    if (!pTable) return;
+    munmap(pTable->pSegment, sizeof(ProgressSegment));
+    free(pTable);
+}
+
+/*************************************************
+* @Name: nProgressClaim
+* @Def: Starts tracking a new job. Uses a free slot, or else the slot
+*       that has waited longest for a resume. Slots of running jobs are
+*       never taken, so with all of them in use the job goes untracked
+* @Arg: In: pTable = table, may be NULL
+*       In: psJobId = job id
+*       In: psSpoolPath = upload spool
+*       In: psOutPath = output spool
+* @Ret: Slot index or -1 if the job is not tracked
+*************************************************/
+int nProgressClaim(ProgressTable* pTable, const char* psJobId, const char* psSpoolPath,
+                   const char* psOutPath) {
+    if (!pTable) return -1;
+
+    int nSlot = -1;
+    ProgressEntry* pEntries = pTable->pSegment->entries;
+    vLockTable(pTable);
+    int nOldest = -1;
+    for (int i = 0; i < PROGRESS_SLOTS && nSlot < 0; i++) {
+        if (pEntries[i].sJobId[0] == '\0') {
+            nSlot = i;
+        } else if (!nIsInUse(&pEntries[i]) && (nOldest < 0 || pEntries[i].nUpdated < pEntries[nOldest].nUpdated)) {
+            nOldest = i;
+        }
+    }
+    if (nSlot < 0) nSlot = nOldest;
+    if (nSlot >= 0) {
+        ProgressEntry* pEntry = &pEntries[nSlot];
+        if (pEntry->sJobId[0] != '\0') {
+            char sMsg[256];
+            snprintf(sMsg, sizeof(sMsg), "Progress table full, job %s is no longer kept for a resume\n",
+                     pEntry->sJobId);
+            vWriteLog(sMsg);
+        }
+        memset(pEntry, 0, sizeof(*pEntry));
+        snprintf(pEntry->sJobId, sizeof(pEntry->sJobId), "%s", psJobId);
+        snprintf(pEntry->sSpoolPath, sizeof(pEntry->sSpoolPath), "%s", psSpoolPath);
+        snprintf(pEntry->sOutPath, sizeof(pEntry->sOutPath), "%s", psOutPath);
+        pEntry->nOwner = getpid();
+        pEntry->nIsRunning = 1;
+        pEntry->nUpdated = time(NULL);
+        vMd5Init(&pEntry->inMd5);
+        vMd5Init(&pEntry->outMd5);
+    }
+    vUnlockTable(pTable);
+    return nSlot;
+}
+
+/*************************************************
+* @Name: nProgressTakeOver
+* @Def: Looks a job up and, unless it is still running, takes it over
+* @Arg: In: pTable = table, may be NULL
+*       In: psJobId = job id
+*       Out: pEntry = copy of the job's progress
+* @Ret: Slot index or -1 if there is nothing to take over
+*************************************************/
+int nProgressTakeOver(ProgressTable* pTable, const char* psJobId, ProgressEntry* pEntry) {
+    if (!pTable) return -1;
+
+    int nSlot = -1;
+    vLockTable(pTable);
+    for (int i = 0; i < PROGRESS_SLOTS; i++) {
+        ProgressEntry* pSlot = &pTable->pSegment->entries[i];
+        if (pSlot->sJobId[0] != '\0' && strcmp(pSlot->sJobId, psJobId) == 0 && !nIsInUse(pSlot)) {
+            pSlot->nOwner = getpid();
+            pSlot->nIsRunning = 1;
+            pSlot->nUpdated = time(NULL);
+            *pEntry = *pSlot;
+            nSlot = i;
+            break;
+        }
+    }
+    vUnlockTable(pTable);
+    return nSlot;
+}
+
+/*************************************************
+* @Name: vProgressSaveHash
+* @Def: Records the upload MD5 state, so a takeover does not rehash the
+*       whole spool
+* @Arg: In: pTable = table, may be NULL
+*       In: nSlot = job slot
+*       In: nOffset = upload bytes hashed
+*       In: pMd5 = MD5 state after nOffset bytes
+* @Ret: None
+*************************************************/
+void vProgressSaveHash(ProgressTable* pTable, int nSlot, unsigned long nOffset, const Md5Context* pMd5) {
+    if (!pTable || nSlot < 0) return;
+    vLockTable(pTable);
+    pTable->pSegment->entries[nSlot].nHashOffset = nOffset;
+    pTable->pSegment->entries[nSlot].inMd5 = *pMd5;
+    pTable->pSegment->entries[nSlot].nUpdated = time(NULL);
+    vUnlockTable(pTable);
+}
+
+/*************************************************
+* @Name: vProgressSaveCheckpoint
+* @Def: Publishes an engine checkpoint together with the output MD5 at
+*       the same point
+* @Arg: In: pTable = table, may be NULL
+*       In: nSlot = job slot
+*       In: nInOffset = input the engine had consumed
+*       In: nOutOffset = output it had produced
+*       In: pOutMd5 = MD5 state of the first nOutOffset output bytes
+*       In: pState = engine state
+*       In: nStateSize = bytes in pState, at most PROGRESS_STATE_SIZE
+* @Ret: None
+*************************************************/
+void vProgressSaveCheckpoint(ProgressTable* pTable, int nSlot, unsigned long nInOffset,
+                             unsigned long nOutOffset, const Md5Context* pOutMd5,
+                             const void* pState, size_t nStateSize) {
+    if (!pTable || nSlot < 0 || nStateSize > PROGRESS_STATE_SIZE) return;
+    vLockTable(pTable);
+    ProgressEntry* pEntry = &pTable->pSegment->entries[nSlot];
+    pEntry->nInOffset = nInOffset;
+    pEntry->nOutOffset = nOutOffset;
+    pEntry->outMd5 = *pOutMd5;
+    memcpy(pEntry->pState, pState, nStateSize);
+    pEntry->nStateSize = nStateSize;
+    pEntry->nHasCheckpoint = 1;
+    pEntry->nUpdated = time(NULL);
+    vUnlockTable(pTable);
+}
+
+/*************************************************
+* @Name: vProgressRelease
+* @Def: Stops tracking a finished job
+* @Arg: In: pTable = table, may be NULL
+*       In: nSlot = job slot
+* @Ret: None
+*************************************************/
+void vProgressRelease(ProgressTable* pTable, int nSlot) {
+    if (!pTable || nSlot < 0) return;
+    vLockTable(pTable);
+    memset(&pTable->pSegment->entries[nSlot], 0, sizeof(ProgressEntry));
+    vUnlockTable(pTable);
+}
+
+/*************************************************
+* @Name: vProgressPark
+* @Def: Keeps the progress of a failed job for a resumed attempt. The
+*       slot is no longer in use, and expires if no resume comes
+* @Arg: In: pTable = table, may be NULL
+*       In: nSlot = job slot
+* @Ret: None
+*************************************************/
+void vProgressPark(ProgressTable* pTable, int nSlot) {
+    if (!pTable || nSlot < 0) return;
+    vLockTable(pTable);
+    pTable->pSegment->entries[nSlot].nIsRunning = 0;
+    pTable->pSegment->entries[nSlot].nUpdated = time(NULL);
+    vUnlockTable(pTable);
+}
+
+/*************************************************
+* @Name: nProgressExpire
+* @Def: Frees the slots of jobs that waited too long for a resume
+* @Arg: In: pTable = table, may be NULL
+*       In: nMaxAge = seconds a slot may wait
+* @Ret: Number of slots freed
+*************************************************/
+int nProgressExpire(ProgressTable* pTable, time_t nMaxAge) {
+    if (!pTable) return 0;
+
+    int nExpired = 0;
+    time_t nNow = time(NULL);
+    vLockTable(pTable);
+    for (int i = 0; i < PROGRESS_SLOTS; i++) {
+        ProgressEntry* pEntry = &pTable->pSegment->entries[i];
+        if (pEntry->sJobId[0] == '\0' || nIsInUse(pEntry) || nNow - pEntry->nUpdated <= nMaxAge) continue;
+
+        char sMsg[256];
+        snprintf(sMsg, sizeof(sMsg), "Job %s was not resumed in time, its progress is dropped\n",
+                 pEntry->sJobId);
+        vWriteLog(sMsg);
+        memset(pEntry, 0, sizeof(*pEntry));
+        nExpired++;
+    }
+    vUnlockTable(pTable);
+    return nExpired;
+}
+
+/*************************************************
+* @Name: nProgressHolds
+* @Def: Whether a tracked job, running or waiting for a resume, has a
+*       spool at a path
+* @Arg: In: pTable = table, may be NULL
+*       In: psPath = spool path
+* @Ret: 1 if a slot refers to it, 0 otherwise
+*************************************************/
+int nProgressHolds(ProgressTable* pTable, const char* psPath) {
+    if (!pTable) return 0;
+
+    int nHolds = 0;
+    vLockTable(pTable);
+    for (int i = 0; i < PROGRESS_SLOTS && !nHolds; i++) {
+        const ProgressEntry* pEntry = &pTable->pSegment->entries[i];
+        nHolds = pEntry->sJobId[0] != '\0' &&
+                 (strcmp(pEntry->sSpoolPath, psPath) == 0 || strcmp(pEntry->sOutPath, psPath) == 0);
+    }
+    vUnlockTable(pTable);
+    return nHolds;
+}
+
+/*************************************************
+* @Name: nProgressAdoptOrphans
+* @Def: Called on promotion to main worker. Takes over the jobs of dead
+*       workers, so their checkpoints are kept until the clients resume
+* @Arg: In: pTable = table, may be NULL
+* @Ret: Number of jobs adopted
+*************************************************/
+int nProgressAdoptOrphans(ProgressTable* pTable) {
+    if (!pTable) return 0;
+
+    int nAdopted = 0;
+    vLockTable(pTable);
+    for (int i = 0; i < PROGRESS_SLOTS; i++) {
+        ProgressEntry* pEntry = &pTable->pSegment->entries[i];
+        if (pEntry->sJobId[0] == '\0' || nIsOwnerAlive(pEntry->nOwner)) continue;
+
+        /* The resume window starts now */
+        pEntry->nOwner = getpid();
+        pEntry->nIsRunning = 0;
+        pEntry->nUpdated = time(NULL);
+        nAdopted++;
+
+        char sMsg[512];
+        snprintf(sMsg, sizeof(sMsg), "Adopted job %s: checkpoint at input %lu, output %lu\n",
+                 pEntry->sJobId, pEntry->nHasCheckpoint ? pEntry->nInOffset : 0,
+                 pEntry->nHasCheckpoint ? pEntry->nOutOffset : 0);
+        vWriteLog(sMsg);
+    }
+    vUnlockTable(pTable);
+    return nAdopted;
+}
@@ -0,0 +1,342 @@
+/*********************************
+*
+* @File: rescache.c
+* @Purpose: Distortion result cache, also used as the store of uploaded
+*           originals. Each entry is one file named after its hex-encoded
+*           key and a tag of the engine version, so results of an older
+*           engine are never served and simply age out. A hit refreshes
+*           the file's mtime, which orders eviction
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "rescache.h"
+#include "common.h"
+#include "config.h"
+#include "shared.h"
+#include "md5.h"
+
+#define CACHE_TAG_LENGTH 9      // 8 hex characters + '\0'
+#define CACHE_NAME_LENGTH (CACHE_KEY_LENGTH * 2 + CACHE_TAG_LENGTH + 1)
+
+struct ResultCache {
+    char sDir[MAX_PATH_LENGTH + sizeof(ORIGINALS_DIR) + 1];
+    char sTag[CACHE_TAG_LENGTH];    // Engine version tag, the suffix of every current entry
+    unsigned long nBudget;          // Bytes the entries may take
+};
+
+typedef struct {
+    char sName[CACHE_NAME_LENGTH];
+    struct timespec tUsed;          // Last store or hit
+    unsigned long nSize;
+} CacheEntry;
+
+/*************************************************
+* @Name: nEntryName
+* @Def: File name of a key: its hex encoding, a dot and the engine tag
+* @Arg: In: pCache = cache
+*       In: psKey = cache key
+*       Out: sName = file name
+* @Ret: 0 on success, -1 if the key is too long
+*************************************************/
+static int nEntryName(const ResultCache* pCache, const char* psKey, char sName[CACHE_NAME_LENGTH]) {
+    size_t nLen = strlen(psKey);
+    if (nLen >= CACHE_KEY_LENGTH) return -1;
+    for (size_t i = 0; i < nLen; i++) {
+        snprintf(sName + i * 2, 3, "%02x", (unsigned char)psKey[i]);
+    }
+    snprintf(sName + nLen * 2, CACHE_NAME_LENGTH - nLen * 2, ".%s", pCache->sTag);
+    return 0;
+}
+
+/*************************************************
+* @Name: nEntryKey
+* @Def: Recovers the key of a current entry from its file name
+* @Arg: In: pCache = cache
+*       In: psName = file name
+*       Out: sKey = cache key
+* @Ret: 0 on success, -1 for temporary files and other engines' entries
+*************************************************/
+static int nEntryKey(const ResultCache* pCache, const char* psName, char sKey[CACHE_KEY_LENGTH]) {
+    const char* psDot = strrchr(psName, '.');
+    size_t nHex = psDot ? (size_t)(psDot - psName) : 0;
+    if (nHex == 0 || nHex % 2 != 0 || nHex / 2 >= CACHE_KEY_LENGTH || strcmp(psDot + 1, pCache->sTag) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < nHex / 2; i++) {
+        unsigned int nByte;
+        if (sscanf(psName + i * 2, "%2x", &nByte) != 1) return -1;
+        sKey[i] = (char)nByte;
+    }
+    sKey[nHex / 2] = '\0';
+    return 0;
+}
+
+/*************************************************
+* @Name: pOpenResultCache
+* @Def: Opens a cache directory in a save folder, creating it. The
+*       budget comes from MRJ_CACHE_BYTES when set
+* @Arg: In: psFolder = worker save folder
+*       In: psDir = CACHE_DIR or ORIGINALS_DIR
+*       In: psEngine = engine name and version; results of any other
+*       version are not served
+* @Ret: Cache, or NULL when disabled or unavailable
+*************************************************/
+ResultCache* pOpenResultCache(const char* psFolder, const char* psDir, const char* psEngine) {
+    unsigned long nBudget = CACHE_DEFAULT_BYTES;
+    const char* psBudget = getenv(CACHE_BYTES_ENV);
+    if (psBudget && psBudget[0] != '\0') {
+        nBudget = strtoul(psBudget, NULL, 10);
+    }
+    if (nBudget == 0) return NULL;
+
+    ResultCache* pCache = malloc(sizeof(ResultCache));
+    if (!pCache) return NULL;
+    snprintf(pCache->sDir, sizeof(pCache->sDir), "%s/%s", psFolder, psDir);
+    if (nCreateDirectory(pCache->sDir) != 0) {
+        free(pCache);
+        return NULL;
+    }
+
+    char sHex[MD5_HEX_SIZE];
+    Md5Context md5;
+    vMd5Init(&md5);
+    vMd5Update(&md5, psEngine, strlen(psEngine));
+    vMd5FinalHex(&md5, sHex);
+    snprintf(pCache->sTag, sizeof(pCache->sTag), "%.8s", sHex);
+    pCache->nBudget = nBudget;
+    return pCache;
+}
+
+void vCloseResultCache(ResultCache* pCache) {
+    free(pCache);
+}
+
+/*************************************************
+* @Name: nCacheLookup
+* @Def: Opens the cached result of a key, marking it as just used
+* @Arg: In: pCache = cache, may be NULL
+*       In: psKey = cache key
+* @Ret: Read-only descriptor owned by the caller, -1 on a miss
+*************************************************/
+int nCacheLookup(ResultCache* pCache, const char* psKey) {
+    char sName[CACHE_NAME_LENGTH];
+    if (!pCache || nEntryName(pCache, psKey, sName) != 0) return -1;
+
+    char sPath[sizeof(pCache->sDir) + CACHE_NAME_LENGTH + 1];
+    snprintf(sPath, sizeof(sPath), "%s/%s", pCache->sDir, sName);
+    int fd = open(sPath, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) futimens(fd, NULL);
+    return fd;
+}
+
+/*************************************************
+* @Name: nCompareUse
+* @Def: qsort order of entries, least recently used first
+*************************************************/
+static int nCompareUse(const void* pvA, const void* pvB) {
+    const CacheEntry* pA = pvA;
+    const CacheEntry* pB = pvB;
+    if (pA->tUsed.tv_sec != pB->tUsed.tv_sec) return pA->tUsed.tv_sec < pB->tUsed.tv_sec ? -1 : 1;
+    if (pA->tUsed.tv_nsec != pB->tUsed.tv_nsec) return pA->tUsed.tv_nsec < pB->tUsed.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/*************************************************
+* @Name: nScanEntries
+* @Def: Lists the entries of the cache directory, least recently used
+*       first. Temporary files of stores in progress are left out
+* @Arg: In: pCache = cache
+*       Out: ppEntries = entries, to be freed by the caller
+*       Out: pnTotal = bytes they take
+* @Ret: Number of entries, -1 on failure
+*************************************************/
+static int nScanEntries(const ResultCache* pCache, CacheEntry** ppEntries, unsigned long* pnTotal) {
+    DIR* pDir = opendir(pCache->sDir);
+    if (!pDir) return -1;
+
+    CacheEntry* pEntries = NULL;
+    int nCount = 0, nCapacity = 0;
+    *pnTotal = 0;
+    struct dirent* pEntry;
+    while ((pEntry = readdir(pDir)) != NULL) {
+        struct stat st;
+        if (pEntry->d_name[0] == '.' || strlen(pEntry->d_name) >= CACHE_NAME_LENGTH ||
+            fstatat(dirfd(pDir), pEntry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (nCount == nCapacity) {
+            nCapacity = nCapacity ? nCapacity * 2 : 64;
+            CacheEntry* pGrown = realloc(pEntries, nCapacity * sizeof(CacheEntry));
+            if (!pGrown) break;
+            pEntries = pGrown;
+        }
+        memcpy(pEntries[nCount].sName, pEntry->d_name, strlen(pEntry->d_name) + 1);
+        pEntries[nCount].tUsed = st.st_mtim;
+        pEntries[nCount].nSize = (unsigned long)st.st_size;
+        *pnTotal += (unsigned long)st.st_size;
+        nCount++;
+    }
+    closedir(pDir);
+
+    if (nCount > 1) qsort(pEntries, nCount, sizeof(CacheEntry), nCompareUse);
+    *ppEntries = pEntries;
+    return nCount;
+}
+
+/*************************************************
+* @Name: vEvict
+* @Def: Removes the least recently used entries until the cache fits its
+*       budget again
+* @Arg: In: pCache = cache
+*       In: pfReport = told about each evicted key, may be NULL
+*       In: pvArg = passed to pfReport
+* @Ret: None
+*************************************************/
+static void vEvict(ResultCache* pCache, CacheReportFunc pfReport, void* pvArg) {
+    CacheEntry* pEntries = NULL;
+    unsigned long nTotal = 0;
+    int nCount = nScanEntries(pCache, &pEntries, &nTotal);
+
+    for (int i = 0; i < nCount && nTotal > pCache->nBudget; i++) {
+        char sKey[CACHE_KEY_LENGTH];
+        char sPath[sizeof(pCache->sDir) + CACHE_NAME_LENGTH + 1];
+        snprintf(sPath, sizeof(sPath), "%s/%s", pCache->sDir, pEntries[i].sName);
+        unlink(sPath);
+        nTotal -= pEntries[i].nSize;
+        if (pfReport && nEntryKey(pCache, pEntries[i].sName, sKey) == 0) pfReport(pvArg, '-', sKey);
+    }
+    free(pEntries);
+}
+
+/*************************************************
+* @Name: nWriteEntry
+* @Def: Writes an entry to a temporary file renamed into place, so a
+*       lookup never sees a partial one
+* @Arg: In: pCache = cache
+*       In: psName = entry file name
+*       In: fd = bytes to copy from its start, -1 to write pData instead
+*       In: pData = bytes to write when fd is -1
+*       In: nSize = bytes in the entry
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nWriteEntry(const ResultCache* pCache, const char* psName, int fd, const void* pData, size_t nSize) {
+    char sPath[sizeof(pCache->sDir) + CACHE_NAME_LENGTH + 1];
+    char sTemp[sizeof(pCache->sDir) + 16];
+    snprintf(sPath, sizeof(sPath), "%s/%s", pCache->sDir, psName);
+    snprintf(sTemp, sizeof(sTemp), "%s/.tmp.XXXXXX", pCache->sDir);
+    int fdTemp = mkostemp(sTemp, O_CLOEXEC);
+    if (fdTemp < 0) return -1;
+    int nResult = -1;
+    if (fchmod(fdTemp, 0644) == 0) {
+        nResult = fd >= 0 ? nCopyFd(fd, fdTemp, nSize)
+                          : write(fdTemp, pData, nSize) == (ssize_t)nSize ? 0 : -1;
+    }
+    close(fdTemp);
+    if (nResult != 0 || rename(sTemp, sPath) != 0) {
+        unlink(sTemp);
+        return -1;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: vCacheStore
+* @Def: Stores a result under its key, then brings the cache back to
+*       its budget
+* @Arg: In: pCache = cache, may be NULL
+*       In: psKey = cache key
+*       In: fd = finished result, read from its start
+*       In: pfReport = told about the stored key and evicted ones, may be NULL
+*       In: pvArg = passed to pfReport
+* @Ret: None
+*************************************************/
+void vCacheStore(ResultCache* pCache, const char* psKey, int fd, CacheReportFunc pfReport, void* pvArg) {
+    char sName[CACHE_NAME_LENGTH];
+    struct stat st;
+    if (!pCache || nEntryName(pCache, psKey, sName) != 0 || fstat(fd, &st) != 0 ||
+        (unsigned long)st.st_size > pCache->nBudget) {
+        return;
+    }
+
+    if (nWriteEntry(pCache, sName, fd, NULL, (size_t)st.st_size) != 0) {
+        vWriteLog("Could not store the result in the cache\n");
+        return;
+    }
+    if (pfReport) pfReport(pvArg, '+', psKey);
+    vEvict(pCache, pfReport, pvArg);
+}
+
+/*************************************************
+* @Name: vCachePut
+* @Def: Stores a small record under its key, the way vCacheStore stores
+*       a result; nothing is reported
+* @Arg: In: pCache = cache, may be NULL
+*       In: psKey = cache key
+*       In: pData = record
+*       In: nSize = bytes in pData
+* @Ret: None
+*************************************************/
+void vCachePut(ResultCache* pCache, const char* psKey, const void* pData, size_t nSize) {
+    char sName[CACHE_NAME_LENGTH];
+    if (!pCache || nEntryName(pCache, psKey, sName) != 0 || nSize > pCache->nBudget) return;
+
+    if (nWriteEntry(pCache, sName, -1, pData, nSize) != 0) {
+        vWriteLog("Could not store the record in the cache\n");
+        return;
+    }
+    vEvict(pCache, NULL, NULL);
+}
+
+/*************************************************
+* @Name: vCacheDrop
+* @Def: Removes an entry, e.g. one that no longer matches its key
+* @Arg: In: pCache = cache, may be NULL
+*       In: psKey = cache key
+*       In: pfReport = told about the removed key, may be NULL
+*       In: pvArg = passed to pfReport
+* @Ret: None
+*************************************************/
+void vCacheDrop(ResultCache* pCache, const char* psKey, CacheReportFunc pfReport, void* pvArg) {
+    char sName[CACHE_NAME_LENGTH];
+    if (!pCache || nEntryName(pCache, psKey, sName) != 0) return;
+
+    char sPath[sizeof(pCache->sDir) + CACHE_NAME_LENGTH + 1];
+    snprintf(sPath, sizeof(sPath), "%s/%s", pCache->sDir, sName);
+    if (unlink(sPath) == 0 && pfReport) pfReport(pvArg, '-', psKey);
+}
+
+/*************************************************
+* @Name: vCacheList
+* @Def: Reports the most recently used current entries, e.g. to tell
+*       Gotham what this worker holds after registering
+* @Arg: In: pCache = cache, may be NULL
+*       In: nMax = most keys reported
+*       In: pfReport = told about each key as stored
+*       In: pvArg = passed to pfReport
+* @Ret: None
+*************************************************/
+void vCacheList(ResultCache* pCache, int nMax, CacheReportFunc pfReport, void* pvArg) {
+    CacheEntry* pEntries = NULL;
+    unsigned long nTotal = 0;
+    int nCount = pCache ? nScanEntries(pCache, &pEntries, &nTotal) : -1;
+
+    for (int i = nCount - 1; i >= 0 && nMax > 0; i--) {
+        char sKey[CACHE_KEY_LENGTH];
+        if (nEntryKey(pCache, pEntries[i].sName, sKey) == 0) {
+            pfReport(pvArg, '+', sKey);
+            nMax--;
+        }
+    }
+    free(pEntries);
+}
+
+/*************************************************
+* @Name: nCacheBudget
+* @Def: Largest entry a cache can keep
+* @Arg: In: pCache = cache, may be NULL
+* @Ret: Budget in bytes, 0 if there is no cache
+*************************************************/
+unsigned long nCacheBudget(const ResultCache* pCache) {
+    return pCache ? pCache->nBudget : 0;
+}
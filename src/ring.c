@@ -0,0 +1,161 @@
+/*********************************
+*
+* @File: ring.c
+* @Purpose: Bounded SPSC byte ring. Each side owns its own index, so the
+*           copies happen outside the lock; the mutex only guards index
+*           publication and the blocking waits
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*************************************************
+* @Name: create_ring
+* @Def: Allocates an empty ring
+* @Arg: In: nCapacity = ring size in bytes
+* @Ret: Ring pointer or NULL on failure
+*************************************************/
+Ring* create_ring(size_t nCapacity) {
+    Ring* pRing = calloc(1, sizeof(Ring));
+    if (!pRing) return NULL;
+
+    pRing->pBuffer = malloc(nCapacity);
+    if (!pRing->pBuffer) {
+        free(pRing);
+        return NULL;
+    }
+    pRing->nCapacity = nCapacity;
+    pthread_mutex_init(&pRing->mutex, NULL);
+    pthread_cond_init(&pRing->notEmpty, NULL);
+    pthread_cond_init(&pRing->notFull, NULL);
+    return pRing;
+}
+
+/*************************************************
+* @Name: destroy_ring
+* @Def: Frees a ring. Both sides must be done with it
+* @Arg: In: pRing = ring to free
+* @Ret: None
+*************************************************/
+void destroy_ring(Ring* pRing) {
+    if (!pRing) return;
+    pthread_mutex_destroy(&pRing->mutex);
+    pthread_cond_destroy(&pRing->notEmpty);
+    pthread_cond_destroy(&pRing->notFull);
+    free(pRing->pBuffer);
+    free(pRing);
+}
+
+/*************************************************
+* @Name: ring_write
+* @Def: Copies nLen bytes into the ring, blocking while it is full
+* @Arg: In: pRing = ring
+*       In: pData = bytes to write
+*       In: nLen = number of bytes
+* @Ret: nLen on success, -1 if the ring was aborted or closed
+*************************************************/
+ssize_t ring_write(Ring* pRing, const void* pData, size_t nLen) {
+    const char* pSrc = pData;
+    size_t nLeft = nLen;
+
+    while (nLeft > 0) {
+        pthread_mutex_lock(&pRing->mutex);
+        while (!pRing->nIsAborted && !pRing->nIsClosed &&
+               pRing->nHead - pRing->nTail == pRing->nCapacity) {
+            pthread_cond_wait(&pRing->notFull, &pRing->mutex);
+        }
+        if (pRing->nIsAborted || pRing->nIsClosed) {
+            pthread_mutex_unlock(&pRing->mutex);
+            return -1;
+        }
+        size_t nFree = pRing->nCapacity - (pRing->nHead - pRing->nTail);
+        size_t nHead = pRing->nHead;
+        pthread_mutex_unlock(&pRing->mutex);
+
+        size_t nChunk = nLeft < nFree ? nLeft : nFree;
+        size_t nOffset = nHead % pRing->nCapacity;
+        size_t nFirst = pRing->nCapacity - nOffset;
+        if (nFirst > nChunk) nFirst = nChunk;
+        memcpy(pRing->pBuffer + nOffset, pSrc, nFirst);
+        memcpy(pRing->pBuffer, pSrc + nFirst, nChunk - nFirst);
+
+        pthread_mutex_lock(&pRing->mutex);
+        pRing->nHead += nChunk;
+        pthread_cond_signal(&pRing->notEmpty);
+        pthread_mutex_unlock(&pRing->mutex);
+
+        pSrc += nChunk;
+        nLeft -= nChunk;
+    }
+    return (ssize_t)nLen;
+}
+
+/*************************************************
+* @Name: ring_read
+* @Def: Copies up to nMax bytes out of the ring, blocking while it is
+*       empty and still open
+* @Arg: In: pRing = ring
+*       Out: pData = destination buffer
+*       In: nMax = buffer size
+* @Ret: Bytes read, 0 once closed and drained, -1 if aborted
+*************************************************/
+ssize_t ring_read(Ring* pRing, void* pData, size_t nMax) {
+    pthread_mutex_lock(&pRing->mutex);
+    while (!pRing->nIsAborted && !pRing->nIsClosed && pRing->nHead == pRing->nTail) {
+        pthread_cond_wait(&pRing->notEmpty, &pRing->mutex);
+    }
+    if (pRing->nIsAborted) {
+        pthread_mutex_unlock(&pRing->mutex);
+        return -1;
+    }
+    size_t nUsed = pRing->nHead - pRing->nTail;
+    size_t nTail = pRing->nTail;
+    pthread_mutex_unlock(&pRing->mutex);
+
+    if (nUsed == 0) return 0;
+
+    size_t nChunk = nMax < nUsed ? nMax : nUsed;
+    size_t nOffset = nTail % pRing->nCapacity;
+    size_t nFirst = pRing->nCapacity - nOffset;
+    if (nFirst > nChunk) nFirst = nChunk;
+    memcpy(pData, pRing->pBuffer + nOffset, nFirst);
+    memcpy((char*)pData + nFirst, pRing->pBuffer, nChunk - nFirst);
+
+    pthread_mutex_lock(&pRing->mutex);
+    pRing->nTail += nChunk;
+    pthread_cond_signal(&pRing->notFull);
+    pthread_mutex_unlock(&pRing->mutex);
+
+    return (ssize_t)nChunk;
+}
+
+/*************************************************
+* @Name: ring_close
+* @Def: Marks the end of the stream; the consumer drains what is left
+* @Arg: In: pRing = ring
+* @Ret: None
+*************************************************/
+void ring_close(Ring* pRing) {
+    pthread_mutex_lock(&pRing->mutex);
+    pRing->nIsClosed = 1;
+    pthread_cond_broadcast(&pRing->notEmpty);
+    pthread_cond_broadcast(&pRing->notFull);
+    pthread_mutex_unlock(&pRing->mutex);
+}
+
+/*************************************************
+* @Name: ring_abort
+* @Def: Fails the stream and wakes both sides
+* @Arg: In: pRing = ring
+* @Ret: None
+*************************************************/
+void ring_abort(Ring* pRing) {
+    pthread_mutex_lock(&pRing->mutex);
+    pRing->nIsAborted = 1;
+    pthread_cond_broadcast(&pRing->notEmpty);
+    pthread_cond_broadcast(&pRing->notFull);
+    pthread_mutex_unlock(&pRing->mutex);
+}
@@ -10,7 +10,9 @@
 #include "shared.h"
 #include "common.h"
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 void vWriteLog(const char* psMsg) {
     if (psMsg) {
@@ -29,4 +31,172 @@ int nCreateDirectory(const char* psPath) {
         return mkdir(psPath, 0755);
     }
     return 0;
-}
\ No newline at end of file
+}
+
+int nCopyFile(const char* psSrcPath, const char* psDstPath) {
+    int nSrc = open(psSrcPath, O_RDONLY);
+    if (nSrc < 0) return -1;
+
+    MappedFile src;
+    if (nMapInput(&src, nSrc) != 0) {
+        close(nSrc);
+        return -1;
+    }
+
+    int nDst = open(psDstPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (nDst < 0) {
+        vUnmapFile(&src);
+        close(nSrc);
+        return -1;
+    }
+
+    int nResult = 0;
+    size_t nWritten = 0;
+    while (nWritten < src.nMapped) {
+        ssize_t nBytes = write(nDst, src.pData + nWritten, src.nMapped - nWritten);
+        if (nBytes <= 0) {
+            nResult = -1;
+            break;
+        }
+        nWritten += (size_t)nBytes;
+    }
+
+    vUnmapFile(&src);
+    close(nSrc);
+    close(nDst);
+    return nResult;
+}
+
+/*************************************************
+* @Name: nCopyFd
+* @Def: Copies the first nLength bytes of one file into another, from
+*       offset 0. The kernel copies them, or shares the blocks where the
+*       filesystem can; a pair it cannot copy goes through a buffer
+* @Arg: In: fdSrc = source file
+*       In: fdDst = destination file, written from its start
+*       In: nLength = bytes to copy
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nCopyFd(int fdSrc, int fdDst, size_t nLength) {
+    loff_t nIn = 0, nOut = 0;
+    while ((size_t)nIn < nLength) {
+        ssize_t nBytes = copy_file_range(fdSrc, &nIn, fdDst, &nOut, nLength - (size_t)nIn, 0);
+        if (nBytes > 0) continue;
+        if (nBytes == 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) {
+            return -1;
+        }
+
+        char buffer[64 * 1024];
+        while ((size_t)nIn < nLength) {
+            size_t nWant = nLength - (size_t)nIn < sizeof(buffer) ? nLength - (size_t)nIn : sizeof(buffer);
+            ssize_t nRead = pread(fdSrc, buffer, nWant, nIn);
+            if (nRead <= 0 || pwrite(fdDst, buffer, (size_t)nRead, nOut) != nRead) return -1;
+            nIn += nRead;
+            nOut += nRead;
+        }
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nMapInput
+* @Def: Maps a whole file read-only for one sequential pass, so it is
+*       used in place instead of being read into a buffer
+* @Arg: Out: pMap = mapping; an empty file maps to no data
+*       In: fd = file, stays owned by the caller
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nMapInput(MappedFile* pMap, int fd) {
+    struct stat st;
+    pMap->fd = fd;
+    pMap->pData = NULL;
+    pMap->nMapped = 0;
+    if (fstat(fd, &st) != 0) return -1;
+    if (st.st_size == 0) return 0;
+
+    void* pData = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (pData == MAP_FAILED) return -1;
+    madvise(pData, (size_t)st.st_size, MADV_SEQUENTIAL);
+    pMap->pData = pData;
+    pMap->nMapped = (size_t)st.st_size;
+    return 0;
+}
+
+/*************************************************
+* @Name: nReserve
+* @Def: Allocates the blocks of a file up to nSize, extending it
+* @Arg: In: fd = file
+*       In: nSize = bytes the file must hold
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nReserve(int fd, size_t nSize) {
+    if (fallocate(fd, 0, 0, (off_t)nSize) == 0) return 0;
+    /* Filesystems without fallocate still get a sparse file of the size */
+    if (errno != EOPNOTSUPP) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    return (size_t)st.st_size >= nSize || ftruncate(fd, (off_t)nSize) == 0 ? 0 : -1;
+}
+
+/*************************************************
+* @Name: nMapOutput
+* @Def: Preallocates a file to nCapacity and maps it for writing, so data
+*       is received straight into the page cache. Bytes already in the
+*       file are kept
+* @Arg: Out: pMap = mapping
+*       In: fd = file opened read-write, stays owned by the caller
+*       In: nCapacity = expected size; 0 maps nothing until nGrowOutput
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nMapOutput(MappedFile* pMap, int fd, size_t nCapacity) {
+    pMap->fd = fd;
+    pMap->pData = NULL;
+    pMap->nMapped = 0;
+    return nCapacity > 0 ? nGrowOutput(pMap, nCapacity) : 0;
+}
+
+/*************************************************
+* @Name: nGrowOutput
+* @Def: Extends an output mapping when the data outgrows the capacity it
+*       was created with
+* @Arg: In: pMap = output mapping
+*       In: nCapacity = bytes that must be mapped
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nGrowOutput(MappedFile* pMap, size_t nCapacity) {
+    if (nCapacity <= pMap->nMapped) return 0;
+    if (nReserve(pMap->fd, nCapacity) != 0) return -1;
+
+    void* pData = pMap->pData ?
+        mremap(pMap->pData, pMap->nMapped, nCapacity, MREMAP_MAYMOVE) :
+        mmap(NULL, nCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, pMap->fd, 0);
+    if (pData == MAP_FAILED) return -1;
+    pMap->pData = pData;
+    pMap->nMapped = nCapacity;
+    return 0;
+}
+
+/*************************************************
+* @Name: nFinishOutput
+* @Def: Unmaps an output file and cuts it to the bytes actually written,
+*       so its size stays the resume point of the transfer
+* @Arg: In: pMap = output mapping
+*       In: nSize = bytes written
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nFinishOutput(MappedFile* pMap, size_t nSize) {
+    vUnmapFile(pMap);
+    return ftruncate(pMap->fd, (off_t)nSize);
+}
+
+/*************************************************
+* @Name: vUnmapFile
+* @Def: Releases a mapping; the file descriptor stays open
+* @Arg: In: pMap = mapping
+* @Ret: None
+*************************************************/
+void vUnmapFile(MappedFile* pMap) {
+    if (pMap->pData) munmap(pMap->pData, pMap->nMapped);
+    pMap->pData = NULL;
+    pMap->nMapped = 0;
+}
@@ -0,0 +1,318 @@
+/*********************************
+*
+* @File: shmring.c
+* @Purpose: Shared-memory data path between a Fleck and a worker on the
+*           same host. The creator owns ring 0 as producer and the peer
+*           that attaches owns ring 1. A side only signals the eventfd
+*           of a ring when the other side has said it is about to sleep,
+*           so a busy transfer makes no system calls at all
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "shmring.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHM_HEADER_SIZE 4096             // One page per ring header
+
+typedef struct {
+    uint64_t nHead;                      // Bytes produced, written by the producer only
+    uint32_t nConsumerWaiting;           // Consumer is about to sleep on the data eventfd
+    char pad[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+    uint64_t nTail;                      // Bytes consumed, written by the consumer only
+    uint32_t nProducerWaiting;           // Producer is about to sleep on the space eventfd
+} ShmRingHeader;
+
+typedef struct {
+    ShmRingHeader* pHeader;
+    char* pData;
+    int fdData;                          // Producer -> consumer: bytes were published
+    int fdSpace;                         // Consumer -> producer: bytes were released
+} ShmRing;
+
+struct ShmLink {
+    int fdMem;
+    char* pBase;
+    size_t nSize;
+    ShmRing tx;                          // Ring this side produces into
+    ShmRing rx;                          // Ring this side consumes from
+};
+
+static size_t nLinkSize(void) {
+    return 2 * SHM_HEADER_SIZE + 2 * (size_t)SHM_RING_SIZE;
+}
+
+/*************************************************
+* @Name: pMapLink
+* @Def: Maps the memfd and wires both rings. The creator produces into
+*       ring 0, the attaching side into ring 1
+* @Arg: In: pFds = memfd and eventfds, owned by the link on success
+*       In: nIsCreator = 1 for the side that created the link
+* @Ret: Link or NULL on failure
+*************************************************/
+static ShmLink* pMapLink(const int pFds[SHM_LINK_FDS], int nIsCreator) {
+    ShmLink* pLink = calloc(1, sizeof(ShmLink));
+    if (!pLink) return NULL;
+
+    pLink->nSize = nLinkSize();
+    pLink->pBase = mmap(NULL, pLink->nSize, PROT_READ | PROT_WRITE, MAP_SHARED, pFds[0], 0);
+    if (pLink->pBase == MAP_FAILED) {
+        free(pLink);
+        return NULL;
+    }
+    pLink->fdMem = pFds[0];
+
+    ShmRing rings[2];
+    for (int i = 0; i < 2; i++) {
+        rings[i].pHeader = (ShmRingHeader*)(pLink->pBase + i * SHM_HEADER_SIZE);
+        rings[i].pData = pLink->pBase + 2 * SHM_HEADER_SIZE + (size_t)i * SHM_RING_SIZE;
+        rings[i].fdData = pFds[1 + 2 * i];
+        rings[i].fdSpace = pFds[2 + 2 * i];
+    }
+    pLink->tx = rings[nIsCreator ? 0 : 1];
+    pLink->rx = rings[nIsCreator ? 1 : 0];
+    return pLink;
+}
+
+/*************************************************
+* @Name: pCreateShmLink
+* @Def: Creates the memfd and eventfds of a new link and maps it
+* @Arg: Out: pFds = descriptors to hand to the peer; they stay owned by
+*            the link, the peer gets its own copies
+* @Ret: Link or NULL on failure
+*************************************************/
+ShmLink* pCreateShmLink(int pFds[SHM_LINK_FDS]) {
+    for (int i = 0; i < SHM_LINK_FDS; i++) pFds[i] = -1;
+
+    pFds[0] = memfd_create("mrj_shm_link", MFD_CLOEXEC);
+    int nOk = pFds[0] >= 0 && ftruncate(pFds[0], (off_t)nLinkSize()) == 0;
+    for (int i = 1; nOk && i < SHM_LINK_FDS; i++) {
+        pFds[i] = eventfd(0, EFD_CLOEXEC);
+        nOk = pFds[i] >= 0;
+    }
+
+    ShmLink* pLink = nOk ? pMapLink(pFds, 1) : NULL;
+    if (!pLink) {
+        for (int i = 0; i < SHM_LINK_FDS; i++) {
+            if (pFds[i] >= 0) close(pFds[i]);
+            pFds[i] = -1;
+        }
+    }
+    return pLink;
+}
+
+/*************************************************
+* @Name: pAttachShmLink
+* @Def: Maps a link created by the peer, after checking the memfd has the
+*       expected size
+* @Arg: In: pFds = descriptors received from the peer, owned by the link
+*            on success; the caller closes them on failure
+* @Ret: Link or NULL on failure
+*************************************************/
+ShmLink* pAttachShmLink(const int pFds[SHM_LINK_FDS]) {
+    struct stat st;
+    if (fstat(pFds[0], &st) != 0 || (size_t)st.st_size != nLinkSize()) return NULL;
+    return pMapLink(pFds, 0);
+}
+
+/*************************************************
+* @Name: vDestroyShmLink
+* @Def: Unmaps a link and closes its descriptors
+* @Arg: In: pLink = link, may be NULL
+* @Ret: None
+*************************************************/
+void vDestroyShmLink(ShmLink* pLink) {
+    if (!pLink) return;
+    munmap(pLink->pBase, pLink->nSize);
+    close(pLink->fdMem);
+    close(pLink->tx.fdData);
+    close(pLink->tx.fdSpace);
+    close(pLink->rx.fdData);
+    close(pLink->rx.fdSpace);
+    free(pLink);
+}
+
+/*************************************************
+* @Name: nWaitEvent
+* @Def: Sleeps on an eventfd, giving up if the peer hangs up its socket
+*       or the timeout expires
+* @Arg: In: fdEvent = eventfd to wait on
+*       In: fdWatch = peer socket, -1 for none
+*       In: nTimeoutMs = timeout, 0 for none
+* @Ret: 0 once woken, -1 on hang-up or timeout
+*************************************************/
+static int nWaitEvent(int fdEvent, int fdWatch, int nTimeoutMs) {
+    struct pollfd pfds[2] = { { fdEvent, POLLIN, 0 }, { fdWatch, POLLRDHUP, 0 } };
+    int nReady = poll(pfds, fdWatch >= 0 ? 2 : 1, nTimeoutMs > 0 ? nTimeoutMs : -1);
+    if (nReady < 0) return errno == EINTR ? 0 : -1;
+    if (pfds[0].revents & POLLIN) {
+        uint64_t nCount;
+        if (read(fdEvent, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN) return -1;
+        return 0;
+    }
+    return -1;
+}
+
+static void vSignal(int fdEvent) {
+    uint64_t nOne = 1;
+    if (write(fdEvent, &nOne, sizeof(nOne)) < 0) {
+        /* The counter cannot overflow with one writer; nothing to recover */
+    }
+}
+
+/*************************************************
+* @Name: nAcquireSpace
+* @Def: Producer side. Waits for free space in the ring
+* @Arg: In: pRing = ring produced into
+*       Out: ppSpace = start of the contiguous free span
+*       In: fdWatch = peer socket
+*       In: nTimeoutMs = timeout per wait
+* @Ret: Bytes in the span, 0 on failure
+*************************************************/
+static size_t nAcquireSpace(ShmRing* pRing, char** ppSpace, int fdWatch, int nTimeoutMs) {
+    ShmRingHeader* pHeader = pRing->pHeader;
+    uint64_t nHead = pHeader->nHead;
+    for (;;) {
+        size_t nUsed = (size_t)(nHead - __atomic_load_n(&pHeader->nTail, __ATOMIC_ACQUIRE));
+        if (nUsed < SHM_RING_SIZE) {
+            size_t nOffset = (size_t)(nHead & (SHM_RING_SIZE - 1));
+            size_t nFree = SHM_RING_SIZE - nUsed;
+            *ppSpace = pRing->pData + nOffset;
+            return nFree < SHM_RING_SIZE - nOffset ? nFree : SHM_RING_SIZE - nOffset;
+        }
+
+        /* Announce the sleep, then look again so a release in between is not missed */
+        __atomic_store_n(&pHeader->nProducerWaiting, 1, __ATOMIC_SEQ_CST);
+        int nIsFull = nHead - __atomic_load_n(&pHeader->nTail, __ATOMIC_SEQ_CST) >= SHM_RING_SIZE;
+        int nResult = nIsFull ? nWaitEvent(pRing->fdSpace, fdWatch, nTimeoutMs) : 0;
+        __atomic_store_n(&pHeader->nProducerWaiting, 0, __ATOMIC_SEQ_CST);
+        if (nResult != 0) return 0;
+    }
+}
+
+static void vPublish(ShmRing* pRing, size_t nLen) {
+    ShmRingHeader* pHeader = pRing->pHeader;
+    __atomic_store_n(&pHeader->nHead, pHeader->nHead + nLen, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pHeader->nConsumerWaiting, __ATOMIC_SEQ_CST)) vSignal(pRing->fdData);
+}
+
+/*************************************************
+* @Name: nAcquireData
+* @Def: Consumer side. Waits for published bytes in the ring
+* @Arg: In: pRing = ring consumed from
+*       Out: ppData = start of the contiguous readable span
+*       In: fdWatch = peer socket
+*       In: nTimeoutMs = timeout per wait
+* @Ret: Bytes in the span, 0 on failure
+*************************************************/
+static size_t nAcquireData(ShmRing* pRing, const char** ppData, int fdWatch, int nTimeoutMs) {
+    ShmRingHeader* pHeader = pRing->pHeader;
+    uint64_t nTail = pHeader->nTail;
+    for (;;) {
+        size_t nUsed = (size_t)(__atomic_load_n(&pHeader->nHead, __ATOMIC_ACQUIRE) - nTail);
+        if (nUsed > 0) {
+            size_t nOffset = (size_t)(nTail & (SHM_RING_SIZE - 1));
+            *ppData = pRing->pData + nOffset;
+            return nUsed < SHM_RING_SIZE - nOffset ? nUsed : SHM_RING_SIZE - nOffset;
+        }
+
+        __atomic_store_n(&pHeader->nConsumerWaiting, 1, __ATOMIC_SEQ_CST);
+        int nIsEmpty = __atomic_load_n(&pHeader->nHead, __ATOMIC_SEQ_CST) == nTail;
+        int nResult = nIsEmpty ? nWaitEvent(pRing->fdData, fdWatch, nTimeoutMs) : 0;
+        __atomic_store_n(&pHeader->nConsumerWaiting, 0, __ATOMIC_SEQ_CST);
+        if (nResult != 0) return 0;
+    }
+}
+
+static void vRelease(ShmRing* pRing, size_t nLen) {
+    ShmRingHeader* pHeader = pRing->pHeader;
+    __atomic_store_n(&pHeader->nTail, pHeader->nTail + nLen, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pHeader->nProducerWaiting, __ATOMIC_SEQ_CST)) vSignal(pRing->fdSpace);
+}
+
+/*************************************************
+* @Name: nShmSend
+* @Def: Copies a buffer into the outgoing ring
+* @Arg: In: pLink = link
+*       In: pData = bytes to send
+*       In: nLen = byte count
+*       In: fdWatch = peer socket, a hang-up aborts the wait
+*       In: nTimeoutMs = limit on each wait for space, 0 for none
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nShmSend(ShmLink* pLink, const void* pData, size_t nLen, int fdWatch, int nTimeoutMs) {
+    const char* psData = (const char*)pData;
+    while (nLen > 0) {
+        char* pSpace;
+        size_t nSpan = nAcquireSpace(&pLink->tx, &pSpace, fdWatch, nTimeoutMs);
+        if (nSpan == 0) return -1;
+        if (nSpan > nLen) nSpan = nLen;
+        memcpy(pSpace, psData, nSpan);
+        vPublish(&pLink->tx, nSpan);
+        psData += nSpan;
+        nLen -= nSpan;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nShmSendFile
+* @Def: Reads a file range straight into the outgoing ring
+* @Arg: In: pLink = link
+*       In: fd = file to send from
+*       In: nOffset = first byte of the range
+*       In: nLen = range size
+*       In: fdWatch = peer socket, a hang-up aborts the wait
+*       In: nTimeoutMs = limit on each wait for space, 0 for none
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nShmSendFile(ShmLink* pLink, int fd, off_t nOffset, size_t nLen, int fdWatch, int nTimeoutMs) {
+    while (nLen > 0) {
+        char* pSpace;
+        size_t nSpan = nAcquireSpace(&pLink->tx, &pSpace, fdWatch, nTimeoutMs);
+        if (nSpan == 0) return -1;
+        if (nSpan > nLen) nSpan = nLen;
+        ssize_t nRead = pread(fd, pSpace, nSpan, nOffset);
+        if (nRead < 0 && errno == EINTR) continue;
+        if (nRead <= 0) return -1;
+        vPublish(&pLink->tx, (size_t)nRead);
+        nOffset += nRead;
+        nLen -= (size_t)nRead;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nShmReceiveToFile
+* @Def: Writes bytes from the incoming ring into a file
+* @Arg: In: pLink = link
+*       In: fd = destination file
+*       In: nOffset = where the bytes go in the file
+*       In: nLen = bytes to take from the ring
+*       In: fdWatch = peer socket, a hang-up aborts the wait
+*       In: nTimeoutMs = limit on each wait for data, 0 for none
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+int nShmReceiveToFile(ShmLink* pLink, int fd, off_t nOffset, size_t nLen, int fdWatch, int nTimeoutMs) {
+    while (nLen > 0) {
+        const char* pData;
+        size_t nSpan = nAcquireData(&pLink->rx, &pData, fdWatch, nTimeoutMs);
+        if (nSpan == 0) return -1;
+        if (nSpan > nLen) nSpan = nLen;
+        ssize_t nWritten = pwrite(fd, pData, nSpan, nOffset);
+        if (nWritten < 0 && errno == EINTR) continue;
+        if (nWritten <= 0) return -1;
+        vRelease(&pLink->rx, (size_t)nWritten);
+        nOffset += nWritten;
+        nLen -= (size_t)nWritten;
+    }
+    return 0;
+}
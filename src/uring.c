@@ -0,0 +1,437 @@
+/*********************************
+*
+* @File: uring.c
+* @Purpose: io_uring I/O backend. Talks to the kernel through the raw
+*           system calls, so it needs no liburing. Every thread gets its
+*           own ring on first use, with a pool of frames registered as a
+*           fixed buffer, and the ring is torn down when the thread exits
+* @Author: Karol Korszun
+*
+*********************************/
+
+#include "uring.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 8                  // Largest batch is an op pair plus its timeout
+
+typedef struct {
+    int fd;
+    unsigned nSqMask;
+    unsigned nCqMask;
+    unsigned nSqTail;                    // Local tail, published on submit
+    unsigned* pSqTail;
+    unsigned* pSqArray;
+    unsigned* pCqHead;
+    unsigned* pCqTail;
+    struct io_uring_sqe* pSqes;
+    struct io_uring_cqe* pCqes;
+    void* pSqRing;
+    void* pCqRing;
+    size_t nSqRingSize;
+    size_t nCqRingSize;
+    size_t nSqesSize;
+    int nIsFixed;                        // pool is registered for READ/WRITE_FIXED
+    Frame pool[URING_POOL_FRAMES];
+} Uring;
+
+static pthread_key_t gRingKey;
+static pthread_once_t gRingOnce = PTHREAD_ONCE_INIT;
+
+static int nSetup(unsigned nEntries, struct io_uring_params* pParams) {
+    return (int)syscall(__NR_io_uring_setup, nEntries, pParams);
+}
+
+static int nEnter(int fd, unsigned nSubmit, unsigned nWait, unsigned nFlags) {
+    return (int)syscall(__NR_io_uring_enter, fd, nSubmit, nWait, nFlags, NULL, 0);
+}
+
+static int nRegister(int fd, unsigned nOpcode, void* pArg, unsigned nArgs) {
+    return (int)syscall(__NR_io_uring_register, fd, nOpcode, pArg, nArgs);
+}
+
+/*************************************************
+* @Name: vDestroyUring
+* @Def: Unmaps and closes a ring. Runs as the thread-key destructor
+* @Arg: In: pvRing = ring, may be NULL
+* @Ret: None
+*************************************************/
+static void vDestroyUring(void* pvRing) {
+    Uring* pRing = (Uring*)pvRing;
+    if (!pRing) return;
+    if (pRing->pSqes && pRing->pSqes != MAP_FAILED) munmap(pRing->pSqes, pRing->nSqesSize);
+    if (pRing->pCqRing && pRing->pCqRing != MAP_FAILED && pRing->pCqRing != pRing->pSqRing) {
+        munmap(pRing->pCqRing, pRing->nCqRingSize);
+    }
+    if (pRing->pSqRing && pRing->pSqRing != MAP_FAILED) munmap(pRing->pSqRing, pRing->nSqRingSize);
+    close(pRing->fd);
+    free(pRing);
+}
+
+static void vCreateKey(void) {
+    pthread_key_create(&gRingKey, vDestroyUring);
+}
+
+/*************************************************
+* @Name: pCreateUring
+* @Def: Sets up a ring, maps its queues and registers the frame pool. A
+*       pool that cannot be registered (locked memory limit) only costs
+*       the fixed-buffer fast path
+* @Arg: None
+* @Ret: Ring or NULL if io_uring is unavailable
+*************************************************/
+static Uring* pCreateUring(void) {
+    Uring* pRing = calloc(1, sizeof(Uring));
+    if (!pRing) return NULL;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    pRing->fd = nSetup(URING_ENTRIES, &params);
+    if (pRing->fd < 0) {
+        free(pRing);
+        return NULL;
+    }
+
+    pRing->nSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    pRing->nCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    pRing->nSqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    int nIsSingle = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (nIsSingle && pRing->nCqRingSize > pRing->nSqRingSize) pRing->nSqRingSize = pRing->nCqRingSize;
+
+    pRing->pSqRing = mmap(NULL, pRing->nSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          pRing->fd, IORING_OFF_SQ_RING);
+    pRing->pCqRing = nIsSingle ? pRing->pSqRing :
+                     mmap(NULL, pRing->nCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          pRing->fd, IORING_OFF_CQ_RING);
+    pRing->pSqes = mmap(NULL, pRing->nSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        pRing->fd, IORING_OFF_SQES);
+    if (pRing->pSqRing == MAP_FAILED || pRing->pCqRing == MAP_FAILED || pRing->pSqes == MAP_FAILED) {
+        vDestroyUring(pRing);
+        return NULL;
+    }
+
+    char* pSq = (char*)pRing->pSqRing;
+    char* pCq = (char*)pRing->pCqRing;
+    pRing->nSqMask = *(unsigned*)(pSq + params.sq_off.ring_mask);
+    pRing->pSqTail = (unsigned*)(pSq + params.sq_off.tail);
+    pRing->pSqArray = (unsigned*)(pSq + params.sq_off.array);
+    pRing->nSqTail = *pRing->pSqTail;
+    pRing->nCqMask = *(unsigned*)(pCq + params.cq_off.ring_mask);
+    pRing->pCqHead = (unsigned*)(pCq + params.cq_off.head);
+    pRing->pCqTail = (unsigned*)(pCq + params.cq_off.tail);
+    pRing->pCqes = (struct io_uring_cqe*)(pCq + params.cq_off.cqes);
+
+    struct iovec pool = { pRing->pool, sizeof(pRing->pool) };
+    pRing->nIsFixed = nRegister(pRing->fd, IORING_REGISTER_BUFFERS, &pool, 1) == 0;
+    return pRing;
+}
+
+/*************************************************
+* @Name: pThreadUring
+* @Def: Returns the calling thread's ring, creating it on first use
+* @Arg: None
+* @Ret: Ring or NULL if io_uring is unavailable
+*************************************************/
+static Uring* pThreadUring(void) {
+    pthread_once(&gRingOnce, vCreateKey);
+    Uring* pRing = pthread_getspecific(gRingKey);
+    if (!pRing) {
+        pRing = pCreateUring();
+        if (pRing) pthread_setspecific(gRingKey, pRing);
+    }
+    return pRing;
+}
+
+/*************************************************
+* @Name: pQueueSqe
+* @Def: Takes the next submission entry. It reaches the kernel on the
+*       next nSubmitAndWait
+* @Arg: In: pRing = ring
+*       In: nOpcode = IORING_OP_*
+*       In: fd = target descriptor
+*       In: nTag = user_data, the result slot of the completion
+* @Ret: Cleared entry with opcode, fd and user_data filled in
+*************************************************/
+static struct io_uring_sqe* pQueueSqe(Uring* pRing, uint8_t nOpcode, int fd, uint64_t nTag) {
+    unsigned nIndex = pRing->nSqTail & pRing->nSqMask;
+    struct io_uring_sqe* pSqe = &pRing->pSqes[nIndex];
+    memset(pSqe, 0, sizeof(*pSqe));
+    pSqe->opcode = nOpcode;
+    pSqe->fd = fd;
+    pSqe->user_data = nTag;
+    pRing->pSqArray[nIndex] = nIndex;
+    pRing->nSqTail++;
+    return pSqe;
+}
+
+/*************************************************
+* @Name: vLinkTimeout
+* @Def: Bounds the previous entry with a linked timeout, the io_uring
+*       counterpart of SO_RCVTIMEO. A timeout of 0 adds nothing
+* @Arg: In: pRing = ring
+*       In: pPrev = entry to bound
+*       In: pTs = timeout storage, must live until completion
+*       In: nTimeoutMs = timeout in milliseconds
+*       In: nTag = result slot of the timeout, -ETIME there once it fires
+* @Ret: None
+*************************************************/
+static void vLinkTimeout(Uring* pRing, struct io_uring_sqe* pPrev, struct __kernel_timespec* pTs,
+                         int nTimeoutMs, uint64_t nTag) {
+    if (nTimeoutMs <= 0) return;
+    pTs->tv_sec = nTimeoutMs / 1000;
+    pTs->tv_nsec = (long long)(nTimeoutMs % 1000) * 1000000;
+    pPrev->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe* pSqe = pQueueSqe(pRing, IORING_OP_LINK_TIMEOUT, -1, nTag);
+    pSqe->addr = (uint64_t)(uintptr_t)pTs;
+    pSqe->len = 1;
+}
+
+/*************************************************
+* @Name: nSubmitAndWait
+* @Def: Hands every queued entry to the kernel in one batch and reaps
+*       all their completions
+* @Arg: In: pRing = ring
+*       Out: pnResults = completion result per tag, tags below nSlots
+*       In: nSlots = size of pnResults
+* @Ret: 0 on success, -1 if the ring itself failed
+*************************************************/
+static int nSubmitAndWait(Uring* pRing, int* pnResults, unsigned nSlots) {
+    unsigned nQueued = pRing->nSqTail - *pRing->pSqTail;
+    __atomic_store_n(pRing->pSqTail, pRing->nSqTail, __ATOMIC_RELEASE);
+
+    unsigned nSubmitted = 0;
+    while (nSubmitted < nQueued) {
+        int nRet = nEnter(pRing->fd, nQueued - nSubmitted, 0, 0);
+        if (nRet < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) continue;
+        if (nRet <= 0) return -1;
+        nSubmitted += (unsigned)nRet;
+    }
+
+    unsigned nReaped = 0;
+    while (nReaped < nQueued) {
+        unsigned nHead = *pRing->pCqHead;
+        unsigned nTail = __atomic_load_n(pRing->pCqTail, __ATOMIC_ACQUIRE);
+        if (nHead == nTail) {
+            if (nEnter(pRing->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) return -1;
+            continue;
+        }
+        for (; nHead != nTail; nHead++, nReaped++) {
+            struct io_uring_cqe* pCqe = &pRing->pCqes[nHead & pRing->nCqMask];
+            if (pCqe->user_data < nSlots) pnResults[pCqe->user_data] = pCqe->res;
+        }
+        __atomic_store_n(pRing->pCqHead, nHead, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nInPool
+* @Def: Whether a buffer lies inside the registered frame pool
+* @Arg: In: pRing = ring
+*       In: pvBuffer = buffer
+*       In: nLen = buffer size
+* @Ret: 1 if READ/WRITE_FIXED may be used on it, 0 otherwise
+*************************************************/
+static int nInPool(const Uring* pRing, const void* pvBuffer, size_t nLen) {
+    const char* pStart = (const char*)pRing->pool;
+    const char* pBuffer = (const char*)pvBuffer;
+    return pRing->nIsFixed && pBuffer >= pStart && pBuffer + nLen <= pStart + sizeof(pRing->pool);
+}
+
+/*************************************************
+* @Name: nTransfer
+* @Def: Moves exactly nLen bytes through a socket, one bounded operation
+*       at a time. Pool buffers go through READ/WRITE_FIXED, other
+*       buffers through RECV/SEND
+* @Arg: In: fd = socket
+*       In: pBuffer = data
+*       In: nLen = bytes to move
+*       In: nIsWrite = 1 to send, 0 to receive
+*       In: nTimeoutMs = limit on each operation, 0 for none
+* @Ret: Bytes moved (less than nLen on EOF/error/timeout)
+*************************************************/
+static ssize_t nTransfer(int fd, char* pBuffer, size_t nLen, int nIsWrite, int nTimeoutMs) {
+    Uring* pRing = pThreadUring();
+    if (!pRing) {
+        errno = ENOSYS;
+        return 0;
+    }
+
+    enum { TRANSFER_OP, TRANSFER_TIMEOUT, TRANSFER_SLOTS };
+    size_t nTotal = 0;
+    while (nTotal < nLen) {
+        struct __kernel_timespec ts;
+        struct io_uring_sqe* pSqe;
+        if (nInPool(pRing, pBuffer, nLen)) {
+            pSqe = pQueueSqe(pRing, nIsWrite ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED, fd,
+                             TRANSFER_OP);
+            pSqe->buf_index = 0;
+        } else {
+            pSqe = pQueueSqe(pRing, nIsWrite ? IORING_OP_SEND : IORING_OP_RECV, fd, TRANSFER_OP);
+        }
+        pSqe->addr = (uint64_t)(uintptr_t)(pBuffer + nTotal);
+        pSqe->len = (unsigned)(nLen - nTotal);
+        vLinkTimeout(pRing, pSqe, &ts, nTimeoutMs, TRANSFER_TIMEOUT);
+
+        int pnResults[TRANSFER_SLOTS] = { 0, 0 };
+        if (nSubmitAndWait(pRing, pnResults, TRANSFER_SLOTS) != 0) break;
+        int nResult = pnResults[TRANSFER_OP];
+        if (nResult > 0) {
+            nTotal += (size_t)nResult;
+        } else if (pnResults[TRANSFER_TIMEOUT] == -ETIME) {
+            errno = EAGAIN;  // Reported as SO_RCVTIMEO does
+            break;
+        } else if (nResult != -EINTR && nResult != -EAGAIN) {
+            errno = nResult < 0 ? -nResult : ECONNRESET;
+            break;
+        }
+    }
+    return (ssize_t)nTotal;
+}
+
+/*************************************************
+* @Name: nUringProbe
+* @Def: Checks that the kernel has io_uring and every operation this
+*       backend uses, and sets up the calling thread's ring
+* @Arg: None
+* @Ret: 1 if the backend is usable, 0 otherwise
+*************************************************/
+int nUringProbe(void) {
+    Uring* pRing = pThreadUring();
+    if (!pRing) return 0;
+
+    size_t nSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* pProbe = calloc(1, nSize);
+    if (!pProbe) return 0;
+
+    static const uint8_t pNeeded[] = {
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_LINK_TIMEOUT, IORING_OP_SPLICE
+    };
+    int nIsUsable = nRegister(pRing->fd, IORING_REGISTER_PROBE, pProbe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; nIsUsable && i < sizeof(pNeeded); i++) {
+        nIsUsable = pNeeded[i] <= pProbe->last_op &&
+                    (pProbe->ops[pNeeded[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(pProbe);
+    return nIsUsable;
+}
+
+/*************************************************
+* @Name: pUringFramePool
+* @Def: Returns the calling thread's registered frames. Frames built
+*       there are read and written without per-call page pinning
+* @Arg: None
+* @Ret: URING_POOL_FRAMES frames, or NULL if there is no registered pool
+*************************************************/
+Frame* pUringFramePool(void) {
+    Uring* pRing = pThreadUring();
+    return pRing && pRing->nIsFixed ? pRing->pool : NULL;
+}
+
+/*************************************************
+* @Name: nUringRead
+* @Def: Reads exactly nLen bytes from a socket
+* @Arg: In: fd = socket
+*       Out: pBuffer = destination
+*       In: nLen = bytes to read
+*       In: nTimeoutMs = limit on each receive, 0 for none
+* @Ret: Bytes read (less than nLen on EOF/error/timeout)
+*************************************************/
+ssize_t nUringRead(int fd, void* pBuffer, size_t nLen, int nTimeoutMs) {
+    return nTransfer(fd, (char*)pBuffer, nLen, 0, nTimeoutMs);
+}
+
+/*************************************************
+* @Name: nUringWrite
+* @Def: Writes exactly nLen bytes to a socket
+* @Arg: In: fd = socket
+*       In: pData = data
+*       In: nLen = bytes to write
+*       In: nTimeoutMs = limit on each send, 0 for none
+* @Ret: Bytes written (less than nLen on error/timeout)
+*************************************************/
+ssize_t nUringWrite(int fd, const void* pData, size_t nLen, int nTimeoutMs) {
+    return nTransfer(fd, (char*)pData, nLen, 1, nTimeoutMs);
+}
+
+/*************************************************
+* @Name: nUringSpliceToFile
+* @Def: Moves nLen bytes from a socket into a file through a pipe. Each
+*       batch drains what the previous one left in the pipe while the
+*       next socket splice, under its linked timeout, refills it
+* @Arg: In: fdSocket = socket
+*       In: pipefd = pipe, read end then write end
+*       In: fdFile = destination file
+*       In: nOffset = where the bytes go in the file
+*       In: nLen = bytes to move
+*       In: nTimeoutMs = limit on each socket splice, 0 for none
+* @Ret: Bytes written to the file (less than nLen on EOF/error/timeout)
+*************************************************/
+ssize_t nUringSpliceToFile(int fdSocket, const int pipefd[2], int fdFile, off_t nOffset,
+                           size_t nLen, int nTimeoutMs) {
+    Uring* pRing = pThreadUring();
+    if (!pRing) {
+        errno = ENOSYS;
+        return 0;
+    }
+
+    enum { SPLICE_IN, SPLICE_OUT, SPLICE_TIMEOUT, SPLICE_SLOTS };
+    size_t nIn = 0;
+    size_t nOut = 0;
+    while (nOut < nLen) {
+        struct __kernel_timespec ts;
+        int pnResults[SPLICE_SLOTS] = { 0, 0, 0 };
+
+        if (nIn > nOut) {
+            struct io_uring_sqe* pSqe = pQueueSqe(pRing, IORING_OP_SPLICE, fdFile, SPLICE_OUT);
+            pSqe->splice_fd_in = pipefd[0];
+            pSqe->splice_off_in = (uint64_t)-1;
+            pSqe->off = (uint64_t)(nOffset + (off_t)nOut);
+            pSqe->len = (unsigned)(nIn - nOut);
+            pSqe->splice_flags = SPLICE_F_MOVE;
+        }
+        if (nIn < nLen) {
+            struct io_uring_sqe* pSqe = pQueueSqe(pRing, IORING_OP_SPLICE, pipefd[1], SPLICE_IN);
+            pSqe->splice_fd_in = fdSocket;
+            pSqe->splice_off_in = (uint64_t)-1;
+            pSqe->off = (uint64_t)-1;
+            pSqe->len = (unsigned)(nLen - nIn);
+            pSqe->splice_flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+            vLinkTimeout(pRing, pSqe, &ts, nTimeoutMs, SPLICE_TIMEOUT);
+        }
+
+        int nHadIn = nIn < nLen;
+        int nHadOut = nIn > nOut;
+        if (nSubmitAndWait(pRing, pnResults, SPLICE_SLOTS) != 0) break;
+        if (nHadOut) {
+            if (pnResults[SPLICE_OUT] <= 0 && pnResults[SPLICE_OUT] != -EINTR) {
+                errno = pnResults[SPLICE_OUT] < 0 ? -pnResults[SPLICE_OUT] : EIO;
+                break;
+            }
+            if (pnResults[SPLICE_OUT] > 0) nOut += (size_t)pnResults[SPLICE_OUT];
+        }
+        if (nHadIn) {
+            int nResult = pnResults[SPLICE_IN];
+            if (nResult > 0) {
+                nIn += (size_t)nResult;
+            } else if (pnResults[SPLICE_TIMEOUT] == -ETIME) {
+                errno = EAGAIN;
+                break;
+            } else if (nResult != -EINTR && nResult != -EAGAIN) {
+                errno = nResult < 0 ? -nResult : ECONNRESET;
+                break;
+            }
+        }
+    }
+    return (ssize_t)nOut;
+}
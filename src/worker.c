@@ -9,16 +9,138 @@
 
 #include "worker.h"
 #include "utils.h"
+#include "md5.h"
+#include "merkle.h"
+#include "delta.h"
+#include "pack.h"
 #include <pthread.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/random.h>
+#include <glob.h>
+#include <dirent.h>
 
 #define SOCKET_TIMEOUT_SEC 3  // 3 second timeout for sockets
+#define PIPELINE_RING_SIZE (256 * 1024)  // Bytes buffered between pipeline stages
+#define PIPELINE_CHECK_KO -2             // Receive stage: upload failed its MD5 check
+#define BULK_SEND_SIZE (64 * 1024)       // Output bytes per BULK_DATA segment
+#define SPOOL_SWEEP_SEC 60               // Seconds between sweeps of abandoned job spools
+
+typedef struct {
+    dev_t nDev;                 // Identity of a file kept in the save folder
+    ino_t nIno;
+    unsigned long nSize;
+    struct timespec tModified;
+} KeptFile;
+
+typedef struct {
+    char sFactor[32];
+    KeptFile in;                // Input and output the job left in the save folder
+    KeptFile out;
+    Md5Context inMd5;           // MD5 states over both, not finalized
+    Md5Context outMd5;
+    size_t nStateSize;
+    unsigned char pState[PROGRESS_STATE_SIZE]; // Engine state at end of input
+} AppendState;
+
+typedef struct {
+    Connection* pConn;          // Client connection, or the stream of it the job runs on
+    char sUsername[64];
+    char sFileName[256];
+    unsigned long nFileSize;    // Bytes announced by the client
+    char sMD5[MD5_HEX_SIZE];    // Expected MD5 or MD5_DEFERRED
+    char sFactor[32];
+    char sJobId[JOB_ID_LENGTH]; // Id Gotham gave the job, names the upload spool
+    int nIsMerkle;              // Upload uses the chunked Merkle mode
+    int nIsBulk;                // Payload moves as raw BULK_DATA segments both ways
+    int nIsShm;                 // Client offered the shared-memory ring for BULK_DATA bytes
+    int nIsHandoff;             // Client offered to pass its files instead of uploading
+    int nIsZlib;                // Client offered zlib-packed BULK_DATA segments
+    int nIsDelta;               // Client offered a delta upload
+    int nIsAppend;              // Client offered to continue the last job on a grown file
+    int fdIn;                   // Handed-off input file, -1 when the upload uses the socket
+    int fdOut;                  // Handed-off output file, -1 when the output uses the socket
+    int fdCached;               // Cached result served instead of running the job, -1 if none
+    int fdBasis;                // Previous version the upload is a delta against, -1 if none
+    char sCacheKey[CACHE_KEY_LENGTH]; // Result cache key, empty when the request gives none
+    int nIsHeld;                // Input copied from the originals store instead of uploaded
+    int nIsContinued;           // Spools hold the last job on the file, continued from its end
+    AppendState append;         // End state of that job
+    unsigned long nInOffset;    // Upload bytes already spooled by an earlier attempt
+    unsigned long nOutOffset;   // Output bytes the client already holds
+    int nSlot;                  // Progress table slot, -1 if the job is not tracked
+    ProgressEntry progress;     // Spool paths, plus the checkpoint taken over if any
+} DistortJob;
+
+struct JobCheckpoint {
+    Worker* pWorker;
+    const DistortJob* pJob;
+    Ring* pIn;
+    Ring* pOut;
+    unsigned long nInBase;      // Job offsets the rings start at
+    unsigned long nOutBase;
+    unsigned long nLastIn;      // Input offset of the last checkpoint posted
+    pthread_mutex_t mutex;
+    int nIsPending;             // Posted by the engine, not yet published by the send stage
+    unsigned long nPendingIn;
+    unsigned long nPendingOut;
+    size_t nPendingSize;
+    unsigned char pPendingState[PROGRESS_STATE_SIZE];
+    int nHasEnd;                // Engine saved its state at end of input
+    size_t nEndSize;
+    unsigned char pEndState[PROGRESS_STATE_SIZE];
+    Md5Context endInMd5;        // MD5 states over all input and output, not finalized
+    Md5Context endOutMd5;
+    unsigned long nEndOut;      // Output bytes endOutMd5 covers
+};
+
+typedef struct PipelineStage {
+    Worker* pWorker;
+    Ring* pRing;                // Ring this stage produces into or consumes from
+    const DistortJob* pJob;
+    JobCheckpoint* pCheckpoint;
+    struct PipelineStage* pPeer; // Send stage: receive stage, for the failure reason
+    int nResult;                // 0 on success, -1 or PIPELINE_CHECK_KO on failure
+} PipelineStage;
+
+typedef struct {
+    Ring* pRing;                // Container input
+    char buffer[4096];
+    size_t nPos;                // Next byte of buffer to hand out
+    size_t nLen;                // Bytes in buffer
+} PackReader;
+
+typedef struct {
+    Worker* pWorker;
+    const char* psName;         // Member file name, picks the engine's handling
+    const char* psFactor;
+    Ring* pIn;                  // Member input, written whole before the engine starts
+    Ring* pOut;
+    int nResult;                // Engine result
+} PackMember;
+
+typedef struct {
+    Worker* pWorker;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;        // A stream's job finished
+    int nActive;                // Streams being served
+} StreamSession;
+
+typedef struct {
+    StreamSession* pSession;
+    Connection* pStream;
+} StreamTask;
 
 /* Global variables */
 static volatile int gnShutdownInProgress = 0;
 static pthread_mutex_t gShutdownMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t gPoolMutex = PTHREAD_MUTEX_INITIALIZER;   // Guards nPooledFd and pClientConn
+static pthread_cond_t gPoolCond = PTHREAD_COND_INITIALIZER;      // The client connection was let go
+static pthread_mutex_t gSlotMutex = PTHREAD_MUTEX_INITIALIZER;   // Guards nIsProcessing
+static pthread_cond_t gSlotCond = PTHREAD_COND_INITIALIZER;      // A job finished
 
 /* Forward declarations */
 static void* vMonitorGotham(void* pvArg);
@@ -26,7 +148,34 @@ static void* vHandleClient(void* pvArg);
 static void vHandleGothamCrash(Worker* pWorker);
 static void vHandleSigInt(int nSigNum);
 static void vHandleRegistration(Worker* pWorker);
-static void vSimulateDistortion(Worker* pWorker);
+static int nEvictPooled(Worker* pWorker);
+static void vReleaseClient(Worker* pWorker);
+static void vParkPooled(Worker* pWorker);
+static void vUnparkPooled(Worker* pWorker);
+static int nAwaitPooledJob(Worker* pWorker);
+static int nServeStreams(Worker* pWorker);
+static void* vServeStream(void* pvArg);
+static int nRunJob(Worker* pWorker, Connection* pConn, const Frame* frame, int* pFds, int nFds);
+static void vLogResultCheck(const Frame* pFrame);
+static int nWorkerSlots(void);
+static void vTakeSlot(Worker* pWorker);
+static void vReleaseSlot(Worker* pWorker);
+static void vReportIdle(Worker* pWorker);
+static void vOpenLocalEndpoint(Worker* pWorker);
+static int nParseJob(const Frame* pFrame, DistortJob* pJob);
+static int nAcceptHandoff(DistortJob* pJob, int fdIn, int fdOut);
+static void vReportCache(void* pvArg, char cOp, const char* psKey);
+static int nServeCached(const DistortJob* pJob);
+static void vPrepareJob(Worker* pWorker, DistortJob* pJob, int nIsResume);
+static void vSweepSpools(Worker* pWorker);
+static int nTakeOriginal(Worker* pWorker, DistortJob* pJob);
+static int nOpenBasis(Worker* pWorker, DistortJob* pJob);
+static int nSendBasisSignatures(const DistortJob* pJob);
+static int nOpenAppend(Worker* pWorker, DistortJob* pJob);
+static int nSendAppendState(Worker* pWorker, DistortJob* pJob);
+static int nProcessDistortion(Worker* pWorker, const DistortJob* pJob);
+static void* vReceiveStage(void* pvArg);
+static void* vSendStage(void* pvArg);
 
 /*************************************************
 * @Name: create_worker
@@ -42,10 +191,21 @@ Worker* create_worker(const char* psConfigFile) {
     pWorker->pGothamConn = NULL;
     pWorker->pClientConn = NULL;
     pWorker->pServerConn = NULL;
+    pWorker->pLocalConn = NULL;
+    pWorker->sLocalIP[0] = '\0';
     pWorker->nIsRunning = 1;
     pWorker->nIsProcessing = 0;
+    pWorker->nSlots = nWorkerSlots();
+    pWorker->nPooledFd = -1;
     pWorker->nIsMainWorker = 0;
     pWorker->nIsRegistered = 0;
+    pWorker->pfDistort = NULL;
+    pWorker->pfDistortStream = NULL;
+    pWorker->pProgress = NULL;
+    pWorker->psEngine = NULL;
+    pWorker->pCache = NULL;
+    pWorker->pOriginals = NULL;
+    pWorker->pAppends = NULL;
 
     /* Load configuration */
     load_worker_config(psConfigFile, &pWorker->config);
@@ -64,10 +224,24 @@ Worker* create_worker(const char* psConfigFile) {
     sa.sa_flags = 0;
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);   // A client that goes away must not take the worker with it
 
     return pWorker;
 }
 
+/*************************************************
+* @Name: nWorkerSlots
+* @Def: Jobs the worker runs at once: MRJ_WORKER_SLOTS when set, one
+*       per CPU otherwise
+* @Arg: None
+* @Ret: Slot count, at least 1
+*************************************************/
+static int nWorkerSlots(void) {
+    const char* psSlots = getenv(WORKER_SLOTS_ENV);
+    long nSlots = psSlots && psSlots[0] != '\0' ? strtol(psSlots, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    return nSlots < 1 ? 1 : (int)nSlots;
+}
+
 /*************************************************
 * @Name: run_worker
 * @Def: Runs the worker main loop
@@ -86,6 +260,28 @@ int run_worker(Worker* pWorker) {
         return -1;
     }
 
+    /* Workers of this type on the host share job progress for takeovers */
+    pWorker->pProgress = pOpenProgressTable(pWorker->psType);
+    if (!pWorker->pProgress) {
+        vWriteLog("Job progress table unavailable, takeovers will recompute\n");
+    }
+    vSweepSpools(pWorker);
+
+    /* Results are cached per engine version; type is the fallback tag */
+    pWorker->pCache = pOpenResultCache(pWorker->config.sSaveFolder, CACHE_DIR,
+                                       pWorker->psEngine ? pWorker->psEngine : pWorker->psType);
+    if (!pWorker->pCache) {
+        vWriteLog("Result cache disabled, every job runs the engine\n");
+    }
+    pWorker->pOriginals = pOpenResultCache(pWorker->config.sSaveFolder, ORIGINALS_DIR, ORIGINALS_TAG);
+    pWorker->pAppends = pOpenResultCache(pWorker->config.sSaveFolder, APPENDS_DIR,
+                                         pWorker->psEngine ? pWorker->psEngine : pWorker->psType);
+
+    /* Clients on this host may skip TCP, so Gotham learns this endpoint too */
+    if (!is_unix_endpoint(pWorker->sIP)) {
+        vOpenLocalEndpoint(pWorker);
+    }
+
     /* Register with Gotham */
     vHandleRegistration(pWorker);
     if (!pWorker->nIsRegistered) {
@@ -94,6 +290,24 @@ int run_worker(Worker* pWorker) {
         return -1;
     }
 
+    /* Gotham routes repeated requests to the worker holding their result,
+     * or else their input; results are reported last so they are kept.
+     * The budget tells it which results this worker can keep at all */
+    char sBudget[32];
+    snprintf(sBudget, sizeof(sBudget), "%lu", nCacheBudget(pWorker->pCache));
+    vReportCache(pWorker, '=', sBudget);
+    vCacheList(pWorker->pOriginals, CACHE_REPORT_KEYS / 4, vReportCache, pWorker);
+    vCacheList(pWorker->pCache, CACHE_REPORT_KEYS, vReportCache, pWorker);
+
+    /* Listen for Fleck connections on the advertised endpoint */
+    pWorker->pServerConn = create_server(pWorker->sIP, atoi(pWorker->sPort));
+    if (!pWorker->pServerConn) {
+        vWriteLog("Failed to create server for Fleck connections\n");
+        close_connection(pWorker->pGothamConn);
+        pWorker->pGothamConn = NULL;
+        return -1;
+    }
+
     vWriteLog("Connected to Mr. J System, ready to listen to Fleck petitions\n");
     vWriteLog("Waiting for connections...\n");
 
@@ -106,18 +320,23 @@ int run_worker(Worker* pWorker) {
     }
     pthread_detach(monitor_thread);
 
-    /* Main worker loop */
+    /* Main worker loop: Gotham traffic is owned by the monitor thread,
+     * this loop only accepts Fleck connections */
     while (pWorker->nIsRunning) {
-        // Use select() with timeout instead of blocking read
         fd_set readfds;
         struct timeval tv;
         FD_ZERO(&readfds);
-        FD_SET(pWorker->pGothamConn->fd, &readfds);
+        FD_SET(pWorker->pServerConn->fd, &readfds);
+        int nMaxFd = pWorker->pServerConn->fd;
+        if (pWorker->pLocalConn) {
+            FD_SET(pWorker->pLocalConn->fd, &readfds);
+            if (pWorker->pLocalConn->fd > nMaxFd) nMaxFd = pWorker->pLocalConn->fd;
+        }
 
         tv.tv_sec = SOCKET_TIMEOUT_SEC;
         tv.tv_usec = 0;
 
-        int ready = select(pWorker->pGothamConn->fd + 1, &readfds, NULL, NULL, &tv);
+        int ready = select(nMaxFd + 1, &readfds, NULL, NULL, &tv);
         if (ready < 0) {
             if (errno != EINTR) {
                 vWriteLog("Select error\n");
@@ -127,45 +346,44 @@ int run_worker(Worker* pWorker) {
         }
 
         if (ready == 0) {
-            // Timeout - continue loop
+            // Timeout - drop the jobs no client came back for
+            vSweepSpools(pWorker);
             continue;
         }
 
-        // Data available - read frame
-        Frame* frame = receive_frame(pWorker->pGothamConn);
-        if (!frame) {
-            if (pWorker->nIsRunning) {
-                vWriteLog("Lost connection to Gotham\n");
-                break;
-            }
+        Connection* pListener = pWorker->pServerConn;
+        if (pWorker->pLocalConn && FD_ISSET(pWorker->pLocalConn->fd, &readfds)) {
+            pListener = pWorker->pLocalConn;
+        }
+        int nClientFd = accept_connection(pListener);
+        if (nClientFd < 0) {
             continue;
         }
 
-        // Handle frame
-        switch (frame->type) {
-            case FRAME_HEARTBEAT:
-                // Heartbeat handled by monitor thread
-                break;
-            case FRAME_NEW_MAIN:
-                vWriteLog("Promoted to main worker\n");
-                pWorker->nIsMainWorker = 1;
-                break;
-            case FRAME_WORKER_CONNECT:
-                vWriteLog("Received client connection request\n");
-                // Handle client connection
-                break;
-            case FRAME_DISCONNECT:
-                vWriteLog("Received disconnect request\n");
-                pWorker->nIsRunning = 0;
-                break;
-            case FRAME_ERROR:
-                vWriteLog("Received error frame from Gotham\n");
-                break;
-            default:
-                vWriteLog("Received unknown frame type\n");
-                break;
+        /* Gotham hands this worker to one client at a time; a connection
+         * idle between pooled jobs gives way to the client it sent now */
+        if (!nEvictPooled(pWorker)) {
+            vWriteLog("Rejecting connection - worker busy\n");
+            close(nClientFd);
+            continue;
         }
-        free_frame(frame);
+
+        Connection* pConn = create_connection(nClientFd);
+        if (!pConn) {
+            close(nClientFd);
+            continue;
+        }
+        pthread_mutex_lock(&gPoolMutex);
+        pWorker->pClientConn = pConn;
+        pthread_mutex_unlock(&gPoolMutex);
+
+        pthread_t client_thread;
+        if (pthread_create(&client_thread, NULL, vHandleClient, pWorker) != 0) {
+            vWriteLog("Failed to create client thread\n");
+            vReleaseClient(pWorker);
+            continue;
+        }
+        pthread_detach(client_thread);
     }
 
     /* Cleanup */
@@ -202,6 +420,15 @@ void destroy_worker(Worker* pWorker) {
         close_connection(pWorker->pServerConn);
         pWorker->pServerConn = NULL;
     }
+    if (pWorker->pLocalConn) {
+        close_connection(pWorker->pLocalConn);
+        pWorker->pLocalConn = NULL;
+    }
+
+    vCloseProgressTable(pWorker->pProgress);
+    vCloseResultCache(pWorker->pCache);
+    vCloseResultCache(pWorker->pOriginals);
+    vCloseResultCache(pWorker->pAppends);
 
     /* Free allocated strings */
     if (pWorker->psType) {
@@ -244,7 +471,7 @@ static void* vMonitorGotham(void* pvArg) {
         if (ready == 0) {
             // Timeout - send heartbeat
             Frame* heartbeat = create_frame(FRAME_HEARTBEAT, "PING", 4);
-            if (send_frame(pWorker->pGothamConn, heartbeat) < 0) {
+            if (!send_frame(pWorker->pGothamConn, heartbeat)) {
                 free_frame(heartbeat);
                 vHandleGothamCrash(pWorker);
                 break;
@@ -270,7 +497,15 @@ static void* vMonitorGotham(void* pvArg) {
                 break;
             }
             case FRAME_NEW_MAIN:
+                vWriteLog("Promoted to main worker\n");
                 pWorker->nIsMainWorker = 1;
+                /* Keep the checkpoints of jobs whose worker died on this host
+                 * until their clients resume them here */
+                nProgressAdoptOrphans(pWorker->pProgress);
+                break;
+            case FRAME_DISCONNECT:
+                vWriteLog("Received disconnect request\n");
+                pWorker->nIsRunning = 0;
                 break;
             case FRAME_ERROR:
                 vWriteLog("Received error frame from Gotham\n");
@@ -293,55 +528,52 @@ static void* vMonitorGotham(void* pvArg) {
 *************************************************/
 static void* vHandleClient(void* pvArg) {
     Worker* pWorker = (Worker*)pvArg;
-    char sMsg[256];
-    char sUsername[64] = "Unknown";  // Default username
-    char sFileType[32] = "Unknown";
-    int nFactor = 0;
 
-    while (pWorker->nIsRunning && !pWorker->nIsProcessing) {
-        Frame* frame = receive_frame(pWorker->pClientConn);
+    /* Only a unix socket client can hand its files over with the request */
+    int nIsLocal = is_local_socket(pWorker->pClientConn);
+    int nIsIdle = 0;            // Gotham knows the worker is free, the client kept the connection
+    while (pWorker->nIsRunning) {
+        int pFds[2];
+        int nFds = 0;
+        if (nIsIdle && !nAwaitPooledJob(pWorker)) break;
+        Frame* frame = nIsLocal ? receive_frame_fds(pWorker->pClientConn, pFds, 2, &nFds)
+                                : receive_frame(pWorker->pClientConn);
         if (!frame) break;
+        /* A client numbering its frames runs its jobs as streams of this connection */
+        if (frame->stream != 0) {
+            if (enable_mux(pWorker->pClientConn, frame, pFds, nFds)) nIsIdle = nServeStreams(pWorker);
+            goto cleanup;
+        }
+        /* Gotham sent the client back here for this job */
+        if (frame->type == FRAME_WORKER_CONNECT || frame->type == FRAME_RESUME_REQ) nIsIdle = 0;
+        if (frame->type != FRAME_WORKER_CONNECT) {
+            for (int i = 0; i < nFds; i++) close(pFds[i]);
+            nFds = 0;
+        }
 
         switch (frame->type) {
             case FRAME_WORKER_CONNECT:
+            case FRAME_RESUME_REQ:
+                if (nRunJob(pWorker, pWorker->pClientConn, frame, pFds, nFds) != 0) {
+                    free_frame(frame);
+                    goto cleanup;
+                }
+                break;
+
+            case FRAME_MD5_CHECK:
+                vLogResultCheck(frame);
+                break;
+
+            case FRAME_WORKER_IDLE:
+                /* The client pools the connection for its next job. Gotham
+                 * hears the worker is free before the client does; by then
+                 * a client it sends here may take the worker over */
+                vParkPooled(pWorker);
+                if (!nIsIdle) vReportIdle(pWorker);
+                nIsIdle = 1;
+                reset_bulk_options(pWorker->pClientConn);
                 {
-                    // Parse connection info
-                    char sFileName[256], sMD5[33], sFactor[32];
-                    unsigned long nFileSize;
-                    if (sscanf(frame->data, "%[^&]&%[^&]&%lu&%[^&]&%s",
-                             sUsername, sFileName, &nFileSize, sMD5, sFactor) != 5) {
-                        Frame* response = create_frame(FRAME_ERROR, "Invalid connection format", 22);
-                        send_frame(pWorker->pClientConn, response);
-                        free_frame(response);
-                        break;
-                    }
-
-                    // Get file type from extension
-                    char* psExt = strrchr(sFileName, '.');
-                    if (psExt) {
-                        if (strcmp(psExt, ".txt") == 0) {
-                            strncpy(sFileType, "text", sizeof(sFileType)-1);
-                        } else {
-                            strncpy(sFileType, "media", sizeof(sFileType)-1);
-                        }
-                    }
-                    nFactor = atoi(sFactor);
-
-                    // Log connection
-                    snprintf(sMsg, sizeof(sMsg), "New user connected: %s.\n", sUsername);
-                    vWriteLog(sMsg);
-
-                    // Log distortion request
-                    snprintf(sMsg, sizeof(sMsg), "New request - %s wants to distort %s, with factor %d.\n",
-                            sUsername, sFileType, nFactor);
-                    vWriteLog(sMsg);
-
-                    vWriteLog("Receiving original text...\n");
-                    vWriteLog("Distorting...\n");
-                    vWriteLog("Sending distorted text...\n");
-
-                    // For Phase 1/2, just acknowledge
-                    Frame* response = create_frame(FRAME_WORKER_CONNECT, NULL, 0);
+                    Frame* response = create_frame(FRAME_WORKER_IDLE, NULL, 0);
                     send_frame(pWorker->pClientConn, response);
                     free_frame(response);
                 }
@@ -363,142 +595,2044 @@ static void* vHandleClient(void* pvArg) {
     }
 
 cleanup:
-    close_connection(pWorker->pClientConn);
-    pWorker->pClientConn = NULL;
+    /* Gotham keeps the worker reserved until told the session is over. The
+     * client waits for the hang-up below before its next request, so the
+     * report goes first and the worker takes connections before hanging up */
+    if (!nIsIdle) vReportIdle(pWorker);
+    vReleaseClient(pWorker);
     return NULL;
 }
 
 /*************************************************
-* @Name: vHandleGothamCrash
-* @Def: Handles Gotham server crash
+* @Name: nServeStreams
+* @Def: Serves a client running its jobs as streams of one connection.
+*       Each stream gets a thread running one job; the connection's own
+*       frames pool it between jobs, as on a plain connection
+* @Arg: In: pWorker = Worker pointer, whose client connection is multiplexed
+* @Ret: 1 if Gotham was already told the worker is free, 0 otherwise
+*************************************************/
+static int nServeStreams(Worker* pWorker) {
+    Connection* pConn = pWorker->pClientConn;
+    StreamSession session;
+    session.pWorker = pWorker;
+    session.nActive = 0;
+    pthread_mutex_init(&session.mutex, NULL);
+    pthread_cond_init(&session.cond, NULL);
+
+    int nIsIdle = 0;
+    while (pWorker->nIsRunning) {
+        Frame* frame = NULL;
+        Connection* pStream = accept_stream(pConn, nIsIdle ? POOL_IDLE_SEC + SOCKET_TIMEOUT_SEC : SOCKET_TIMEOUT_SEC,
+                                            &frame);
+        if (nIsIdle) vUnparkPooled(pWorker);
+
+        if (pStream) {
+            /* Gotham sent the client back here for this job */
+            nIsIdle = 0;
+            StreamTask* pTask = malloc(sizeof(StreamTask));
+            pthread_t stream_thread;
+            pthread_mutex_lock(&session.mutex);
+            session.nActive++;
+            pthread_mutex_unlock(&session.mutex);
+            if (pTask) {
+                pTask->pSession = &session;
+                pTask->pStream = pStream;
+            }
+            if (!pTask || pthread_create(&stream_thread, NULL, vServeStream, pTask) != 0) {
+                vWriteLog("Failed to create stream thread\n");
+                free(pTask);
+                close_connection(pStream);
+                pthread_mutex_lock(&session.mutex);
+                session.nActive--;
+                pthread_mutex_unlock(&session.mutex);
+                continue;
+            }
+            pthread_detach(stream_thread);
+            continue;
+        }
+
+        if (!frame) {
+            /* Streams still running keep the connection; otherwise it is over */
+            pthread_mutex_lock(&session.mutex);
+            int nActive = session.nActive;
+            pthread_mutex_unlock(&session.mutex);
+            if (!nIsIdle && nActive > 0 && is_connected(pConn)) continue;
+            break;
+        }
+
+        int nIsOver = frame->type == FRAME_DISCONNECT;
+        if (frame->type == FRAME_WORKER_IDLE) {
+            /* Every stream is closed by the time the client pools the connection */
+            pthread_mutex_lock(&session.mutex);
+            while (session.nActive > 0) pthread_cond_wait(&session.cond, &session.mutex);
+            pthread_mutex_unlock(&session.mutex);
+            vParkPooled(pWorker);
+            if (!nIsIdle) vReportIdle(pWorker);
+            nIsIdle = 1;
+            Frame* response = create_frame(FRAME_WORKER_IDLE, NULL, 0);
+            send_frame(pConn, response);
+            free_frame(response);
+        } else if (!nIsOver) {
+            vWriteLog("Received unknown frame type\n");
+        }
+        free_frame(frame);
+        if (nIsOver) break;
+    }
+
+    /* The stream threads use the socket until their jobs end */
+    pthread_mutex_lock(&session.mutex);
+    while (session.nActive > 0) pthread_cond_wait(&session.cond, &session.mutex);
+    pthread_mutex_unlock(&session.mutex);
+    pthread_cond_destroy(&session.cond);
+    pthread_mutex_destroy(&session.mutex);
+    return nIsIdle;
+}
+
+/*************************************************
+* @Name: vServeStream
+* @Def: Runs the one job of a stream, then waits for the client's MD5
+*       verdict on the result and closes the stream
+* @Arg: In: pvArg = StreamTask pointer, freed here
+* @Ret: NULL
+*************************************************/
+static void* vServeStream(void* pvArg) {
+    StreamTask* pTask = (StreamTask*)pvArg;
+    StreamSession* pSession = pTask->pSession;
+    Connection* pStream = pTask->pStream;
+    free(pTask);
+
+    int pFds[2];
+    int nFds = 0;
+    Frame* frame = receive_frame_fds(pStream, pFds, 2, &nFds);
+    if (frame && frame->type != FRAME_WORKER_CONNECT) {
+        for (int i = 0; i < nFds; i++) close(pFds[i]);
+        nFds = 0;
+    }
+    if (frame && (frame->type == FRAME_WORKER_CONNECT || frame->type == FRAME_RESUME_REQ) &&
+        nRunJob(pSession->pWorker, pStream, frame, pFds, nFds) == 0) {
+        Frame* check = receive_frame(pStream);
+        if (check && check->type == FRAME_MD5_CHECK) vLogResultCheck(check);
+        if (check) free_frame(check);
+    } else if (frame && frame->type != FRAME_WORKER_CONNECT && frame->type != FRAME_RESUME_REQ) {
+        vWriteLog("Received unknown frame type\n");
+    }
+    if (frame) free_frame(frame);
+    close_connection(pStream);
+
+    pthread_mutex_lock(&pSession->mutex);
+    pSession->nActive--;
+    pthread_cond_broadcast(&pSession->cond);
+    pthread_mutex_unlock(&pSession->mutex);
+    return NULL;
+}
+
+/*************************************************
+* @Name: vLogResultCheck
+* @Def: Logs the client's MD5 verdict on a distorted file
+* @Arg: In: pFrame = MD5_CHECK frame
+* @Ret: None
+*************************************************/
+static void vLogResultCheck(const Frame* pFrame) {
+    if (pFrame->data_length >= 8 && strncmp(pFrame->data, "CHECK_OK", 8) == 0) {
+        vWriteLog("Client confirmed distorted file integrity\n");
+    } else {
+        vWriteLog("Client reported distorted file integrity failure\n");
+    }
+}
+
+/*************************************************
+* @Name: vTakeSlot
+* @Def: Waits for one of the worker's job slots. Jobs beyond the slots
+*       stay acked, their uploads held back by the stream windows
 * @Arg: In: pWorker = Worker pointer
 * @Ret: None
 *************************************************/
-static void vHandleGothamCrash(Worker* pWorker) {
-    vWriteLog("Lost connection to Gotham. Finishing current work...\n");
-    pWorker->nIsRunning = 0;
+static void vTakeSlot(Worker* pWorker) {
+    pthread_mutex_lock(&gSlotMutex);
+    while (pWorker->nIsProcessing >= pWorker->nSlots) pthread_cond_wait(&gSlotCond, &gSlotMutex);
+    pWorker->nIsProcessing++;
+    pthread_mutex_unlock(&gSlotMutex);
+}
 
-    /* Wait for current distortion to complete */
-    while (pWorker->nIsProcessing) {
-        sleep(1);
+static void vReleaseSlot(Worker* pWorker) {
+    pthread_mutex_lock(&gSlotMutex);
+    pWorker->nIsProcessing--;
+    pthread_cond_broadcast(&gSlotCond);
+    pthread_mutex_unlock(&gSlotMutex);
+}
+
+/*************************************************
+* @Name: nRunJob
+* @Def: Runs the job a WORKER_CONNECT or RESUME_REQ asks for: acks it
+*       with the modes taken, then receives, distorts and sends back, or
+*       serves the result from the cache
+* @Arg: In: pWorker = Worker pointer
+*       In: pConn = client connection, or the stream the job came on
+*       In: frame = WORKER_CONNECT or RESUME_REQ
+*       In: pFds = files handed over with the request, closed here
+*       In: nFds = descriptor count
+* @Ret: 0 once the job is done or refused, -1 if the connection is lost
+*************************************************/
+static int nRunJob(Worker* pWorker, Connection* pConn, const Frame* frame, int* pFds, int nFds) {
+    char sMsg[256];
+    char sUsername[64] = "Unknown";  // Default username
+    char sFileType[32] = "Unknown";
+    DistortJob job;
+    if (nParseJob(frame, &job) != 0) {
+        for (int i = 0; i < nFds; i++) close(pFds[i]);
+        Frame* response = create_frame(frame->type, "CON_KO", 6);
+        send_frame(pConn, response);
+        free_frame(response);
+        return 0;
+    }
+    job.pConn = pConn;
+    snprintf(sUsername, sizeof(sUsername), "%s", job.sUsername);
+
+    // Get file type from extension
+    char* psExt = strrchr(job.sFileName, '.');
+    if (psExt) {
+        if (strcmp(psExt, ".txt") == 0) {
+            strncpy(sFileType, "text", sizeof(sFileType)-1);
+        } else {
+            strncpy(sFileType, "media", sizeof(sFileType)-1);
+        }
     }
 
-    /* Cleanup connections */
-    if (pWorker->pClientConn) {
-        close_connection(pWorker->pClientConn);
-        pWorker->pClientConn = NULL;
+    // Log connection
+    snprintf(sMsg, sizeof(sMsg), "New user connected: %s.\n", sUsername);
+    vWriteLog(sMsg);
+
+    // Log distortion request
+    snprintf(sMsg, sizeof(sMsg), "New request - %s wants to distort %s, with factor %s.\n",
+            sUsername, sFileType, job.sFactor);
+    vWriteLog(sMsg);
+
+    if (job.nIsHandoff && nFds == 2 && nAcceptHandoff(&job, pFds[0], pFds[1]) == 0) {
+        vWriteLog("Client handed over its files, nothing is uploaded\n");
+    } else {
+        for (int i = 0; i < nFds; i++) close(pFds[i]);
     }
-    if (pWorker->pGothamConn) {
-        close_connection(pWorker->pGothamConn);
-        pWorker->pGothamConn = NULL;
+
+    /* A result held in the cache is sent back before anything is uploaded */
+    if (frame->type == FRAME_WORKER_CONNECT && job.sCacheKey[0] != '\0') {
+        job.fdCached = nCacheLookup(pWorker->pCache, job.sCacheKey);
+    }
+    if (job.fdCached >= 0) {
+        vWriteLog("Result found in the cache, nothing is uploaded\n");
+        job.nIsMerkle = 0;
+    } else {
+        vPrepareJob(pWorker, &job, frame->type == FRAME_RESUME_REQ);
+        /* An input received earlier, e.g. for another factor, is not uploaded again */
+        if (frame->type == FRAME_WORKER_CONNECT && job.sCacheKey[0] != '\0' &&
+            job.fdIn < 0 && nTakeOriginal(pWorker, &job) == 0) {
+            vWriteLog("Original found in the store, nothing is uploaded\n");
+        }
+        /* A file that only grew continues from where the last job on it ended */
+        if (job.nIsAppend && !job.nIsHeld && job.sCacheKey[0] != '\0' &&
+            nOpenAppend(pWorker, &job) == 0) {
+            vWriteLog("Earlier version held with its end state, only the new bytes may be needed\n");
+        }
+        /* An edited file only sends what changed since the version kept here */
+        if (job.nIsDelta && !job.nIsHeld && !job.nIsContinued && job.fdIn < 0 && job.sCacheKey[0] != '\0' &&
+            nOpenBasis(pWorker, &job) == 0) {
+            vWriteLog("Previous version held, the upload is a delta against it\n");
+        }
+    }
+
+    /* A co-located client gets the bulk bytes through shared rings; the
+     * descriptors ride on the ack, the frames stay on the socket */
+    int pShmFds[SHM_LINK_FDS];
+    ShmLink* pLink = NULL;
+    if (job.nIsBulk && job.nIsShm && is_local_socket(pConn)) {
+        pLink = pCreateShmLink(pShmFds);
+        if (!pLink) vWriteLog("Shared-memory link unavailable, bulk data stays on the socket\n");
+    }
+
+    /* Packing only pays on a network link */
+    int nIsZlib = job.nIsBulk && job.nIsZlib && !pLink && !is_local_socket(pConn);
+
+    char sMode[32];
+    snprintf(sMode, sizeof(sMode), "%s%s%s%s%s%s%s%s%s", job.nIsMerkle ? MERKLE_MODE : PLAIN_MODE,
+             job.nIsBulk ? "+" BULK_MODE : "", pLink ? "+" SHM_MODE : "",
+             job.fdIn >= 0 ? "+" HANDOFF_MODE : "", nIsZlib ? "+" ZLIB_MODE : "",
+             job.fdCached >= 0 ? "+" CACHED_MODE : "", job.nIsHeld ? "+" HELD_MODE : "",
+             job.fdBasis >= 0 ? "+" DELTA_MODE : "", job.nIsContinued ? "+" APPEND_MODE : "");
+
+    Frame* response;
+    if (frame->type == FRAME_RESUME_REQ) {
+        /* Report what is held for this job: the spooled upload and the
+         * output the client already has, which is not sent again */
+        char sOffsets[DATA_SIZE];
+        snprintf(sOffsets, sizeof(sOffsets), "%s&%lu&%lu", sMode, job.nInOffset, job.nOutOffset);
+        response = create_frame(FRAME_RESUME_REQ, sOffsets, strlen(sOffsets));
+
+        snprintf(sMsg, sizeof(sMsg), "Resuming job %s: %lu input bytes held, output continues at %lu\n",
+                 job.sJobId, job.nInOffset, job.nOutOffset);
+        vWriteLog(sMsg);
+        if (job.progress.nHasCheckpoint) {
+            snprintf(sMsg, sizeof(sMsg), "Engine restarts from checkpoint at input %lu, output %lu\n",
+                     job.progress.nInOffset, job.progress.nOutOffset);
+            vWriteLog(sMsg);
+        }
+    } else {
+        // Accept, confirming the chunked Merkle, bulk and handoff modes if asked
+        // for, and telling the client to skip its upload on a cache or store hit
+        response = job.nIsMerkle || job.nIsBulk || job.fdIn >= 0 || job.fdCached >= 0 ||
+                   job.nIsHeld || job.fdBasis >= 0 || job.nIsContinued ?
+            create_frame(FRAME_WORKER_CONNECT, sMode, strlen(sMode)) :
+            create_frame(FRAME_WORKER_CONNECT, NULL, 0);
+    }
+    if (pLink) {
+        send_frame_fds(pConn, response, pShmFds, SHM_LINK_FDS);
+        vDestroyShmLink(pConn->shm);
+        pConn->shm = pLink;
+        vWriteLog("Bulk data moves through a shared-memory ring\n");
+    } else {
+        send_frame(pConn, response);
+    }
+    free_frame(response);
+    if (nIsZlib) enable_bulk_compression(pConn);
+
+    vTakeSlot(pWorker);
+    int nResult = job.fdBasis >= 0 ? nSendBasisSignatures(&job) :
+                  job.nIsContinued ? nSendAppendState(pWorker, &job) : 0;
+    if (nResult == 0) {
+        nResult = job.fdCached >= 0 ? nServeCached(&job)
+                                    : nProcessDistortion(pWorker, &job);
+    } else {
+        vProgressPark(pWorker->pProgress, job.nSlot);
+    }
+    vReleaseSlot(pWorker);
+    if (job.fdIn >= 0) {
+        close(job.fdIn);
+        close(job.fdOut);
     }
+    if (job.fdCached >= 0) close(job.fdCached);
+    if (job.fdBasis >= 0) close(job.fdBasis);
+    return nResult;
 }
 
 /*************************************************
-* @Name: vHandleSigInt
-* @Def: Handles SIGINT signal
-* @Arg: In: nSigNum = Signal number
+* @Name: vReportIdle
+* @Def: Tells Gotham the client is done with this worker
+* @Arg: In: pWorker = Worker pointer
 * @Ret: None
 *************************************************/
-static void vHandleSigInt(int nSigNum) {
-    (void)nSigNum;
-
-    pthread_mutex_lock(&gShutdownMutex);
-    if (gnShutdownInProgress) {
-        pthread_mutex_unlock(&gShutdownMutex);
-        return;
+static void vReportIdle(Worker* pWorker) {
+    if (pWorker->pGothamConn) {
+        Frame* idle = create_frame(FRAME_WORKER_IDLE, NULL, 0);
+        send_frame(pWorker->pGothamConn, idle);
+        free_frame(idle);
     }
-    gnShutdownInProgress = 1;
-    pthread_mutex_unlock(&gShutdownMutex);
+}
 
-    vWriteLog("Received CTRL+C. Initiating worker shutdown...\n");
-    exit(0);
+/*************************************************
+* @Name: vParkPooled
+* @Def: Marks the client connection idle between pooled jobs, so that a
+*       new client may have it closed
+* @Arg: In: pWorker = Worker pointer
+* @Ret: None
+*************************************************/
+static void vParkPooled(Worker* pWorker) {
+    pthread_mutex_lock(&gPoolMutex);
+    pWorker->nPooledFd = pWorker->pClientConn->fd;
+    pthread_mutex_unlock(&gPoolMutex);
 }
 
 /*************************************************
-* @Name: vHandleRegistration
-* @Def: Handles worker registration
+* @Name: nAwaitPooledJob
+* @Def: Waits on a parked connection for the client's next job, without
+*       the socket's receive timeout. The client drops the connection
+*       after POOL_IDLE_SEC; the worker gives up a little later, or as
+*       soon as another client is sent here
+* @Arg: In: pWorker = Worker pointer
+* @Ret: 1 once the client sends a frame, 0 if the connection is over
+*************************************************/
+static int nAwaitPooledJob(Worker* pWorker) {
+    struct pollfd pfd = { .fd = pWorker->pClientConn->fd, .events = POLLIN, .revents = 0 };
+    int nReady;
+    do {
+        nReady = poll(&pfd, 1, (POOL_IDLE_SEC + SOCKET_TIMEOUT_SEC) * 1000);
+    } while (nReady < 0 && errno == EINTR);
+
+    vUnparkPooled(pWorker);
+    return nReady > 0;
+}
+
+/*************************************************
+* @Name: vUnparkPooled
+* @Def: Marks the client connection in use again
 * @Arg: In: pWorker = Worker pointer
 * @Ret: None
 *************************************************/
-static void vHandleRegistration(Worker* pWorker) {
-    char sData[DATA_SIZE];
-    snprintf(sData, sizeof(sData), "%s&%s&%s",
-             pWorker->psType,
-             pWorker->sIP,
-             pWorker->sPort);
+static void vUnparkPooled(Worker* pWorker) {
+    pthread_mutex_lock(&gPoolMutex);
+    pWorker->nPooledFd = -1;
+    pthread_mutex_unlock(&gPoolMutex);
+}
 
-    vWriteLog("Sending registration frame to Gotham\n");
+/*************************************************
+* @Name: vReleaseClient
+* @Def: Closes the client connection and wakes a new client waiting for it
+* @Arg: In: pWorker = Worker pointer
+* @Ret: None
+*************************************************/
+static void vReleaseClient(Worker* pWorker) {
+    pthread_mutex_lock(&gPoolMutex);
+    Connection* pConn = pWorker->pClientConn;
+    pWorker->pClientConn = NULL;
+    pthread_cond_broadcast(&gPoolCond);
+    pthread_mutex_unlock(&gPoolMutex);
+    close_connection(pConn);
+}
 
-    Frame* frame = create_frame(FRAME_WORKER_REG, sData, strlen(sData));
-    if (!frame) {
-        vWriteLog("Failed to create registration frame\n");
-        return;
+/*************************************************
+* @Name: nEvictPooled
+* @Def: Makes room for a new client. A connection idle between pooled
+*       jobs is hung up, and its thread given a while to let go of it.
+*       That thread already told Gotham the worker is free, so it does
+*       not again
+* @Arg: In: pWorker = Worker pointer
+* @Ret: 1 if the worker has no client connection left, 0 if it is busy
+*************************************************/
+static int nEvictPooled(Worker* pWorker) {
+    pthread_mutex_lock(&gPoolMutex);
+    if (pWorker->pClientConn && pWorker->nPooledFd >= 0) {
+        shutdown(pWorker->nPooledFd, SHUT_RDWR);
+        vWriteLog("Closing an idle pooled connection for a new client\n");
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SOCKET_TIMEOUT_SEC;
+        while (pWorker->pClientConn) {
+            if (pthread_cond_timedwait(&gPoolCond, &gPoolMutex, &deadline) == ETIMEDOUT) break;
+        }
     }
+    int nIsFree = pWorker->pClientConn == NULL;
+    pthread_mutex_unlock(&gPoolMutex);
+    return nIsFree;
+}
 
-    if (send_frame(pWorker->pGothamConn, frame) != 0) {
-        vWriteLog("Failed to send registration frame\n");
-        free_frame(frame);
-        return;
+/*************************************************
+* @Name: nParseJob
+* @Def: Parses WORKER_CONNECT "user&file&size&md5&factor[&mode[&jobId]]"
+*       and RESUME_REQ, which adds "&outOffset" after the job id. The mode
+*       may carry "+BULK", "+SHM", "+FD", "+ZLIB", "+DELTA" and "+APPEND"
+*       options
+* @Arg: In: pFrame = received frame
+*       Out: pJob = parsed job
+* @Ret: 0 on success, -1 on malformed request
+*************************************************/
+static int nParseJob(const Frame* pFrame, DistortJob* pJob) {
+    char sMode[32] = PLAIN_MODE;
+    memset(pJob, 0, sizeof(*pJob));
+    pJob->fdIn = -1;
+    pJob->fdOut = -1;
+    pJob->fdCached = -1;
+    pJob->fdBasis = -1;
+    pJob->nSlot = -1;
+    snprintf(pJob->sJobId, sizeof(pJob->sJobId), "0");
+
+    int nFields = sscanf(pFrame->data, "%63[^&]&%255[^&]&%lu&%32[^&]&%31[^&]&%31[^&]&%23[^&]&%lu",
+                         pJob->sUsername, pJob->sFileName, &pJob->nFileSize, pJob->sMD5,
+                         pJob->sFactor, sMode, pJob->sJobId, &pJob->nOutOffset);
+    if (nFields < 5 || (pFrame->type == FRAME_RESUME_REQ && nFields != 8) ||
+        strchr(pJob->sFileName, '/') != NULL || strchr(pJob->sJobId, '/') != NULL) {
+        return -1;
     }
-    free_frame(frame);
+    pJob->nIsBulk = mode_has_option(sMode, BULK_MODE);
+    pJob->nIsShm = mode_has_option(sMode, SHM_MODE);
+    pJob->nIsZlib = mode_has_option(sMode, ZLIB_MODE);
+    pJob->nIsDelta = pFrame->type == FRAME_WORKER_CONNECT && mode_has_option(sMode, DELTA_MODE);
+    pJob->nIsAppend = pFrame->type == FRAME_WORKER_CONNECT && mode_has_option(sMode, APPEND_MODE);
+    pJob->nIsHandoff = pFrame->type == FRAME_WORKER_CONNECT && mode_has_option(sMode, HANDOFF_MODE);
+    /* Only a client announcing the input MD5 up front can be answered from the cache */
+    if (!make_cache_key(pJob->sCacheKey, pJob->sMD5, pJob->sFactor, pJob->sFileName)) {
+        pJob->sCacheKey[0] = '\0';
+    }
+    sMode[strcspn(sMode, "+")] = '\0';
+    pJob->nIsMerkle = strcmp(sMode, MERKLE_MODE) == 0;
+    return 0;
+}
 
-    Frame* response = receive_frame(pWorker->pGothamConn);
-    if (!response) {
-        vWriteLog("Failed to receive response\n");
-        return;
+/*************************************************
+* @Name: nAcceptHandoff
+* @Def: Takes over the files a co-located client passed with its request,
+*       if they are what the request describes: a regular input file of
+*       the announced size and a writable regular output file. The job
+*       then runs as a plain job whose bytes never touch the socket
+* @Arg: In/Out: pJob = parsed job, gets the descriptors on success
+*       In: fdIn = input file from the client
+*       In: fdOut = output file from the client
+* @Ret: 0 on success, -1 if the job must be uploaded instead
+*************************************************/
+static int nAcceptHandoff(DistortJob* pJob, int fdIn, int fdOut) {
+    struct stat stIn, stOut;
+    int nOutFlags = fcntl(fdOut, F_GETFL);
+    if (fstat(fdIn, &stIn) != 0 || !S_ISREG(stIn.st_mode) || (unsigned long)stIn.st_size != pJob->nFileSize ||
+        fstat(fdOut, &stOut) != 0 || !S_ISREG(stOut.st_mode) || nOutFlags < 0 || (nOutFlags & O_ACCMODE) == O_RDONLY) {
+        vWriteLog("Handed-over files do not match the request, falling back to an upload\n");
+        return -1;
     }
+    pJob->fdIn = fdIn;
+    pJob->fdOut = fdOut;
+    pJob->nIsMerkle = 0;
+    pJob->nIsBulk = 0;
+    return 0;
+}
 
-    switch (response->type) {
-        case FRAME_WORKER_REG:
-            if (response->data_length == 0) {
-                vWriteLog("Registration successful as backup worker\n");
-                pWorker->nIsRegistered = 1;
-            }
-            break;
-        case FRAME_NEW_MAIN:
-            vWriteLog("Registration successful as main worker\n");
-            pWorker->nIsMainWorker = 1;
-            pWorker->nIsRegistered = 1;
-            break;
-        case FRAME_ERROR:
-            vWriteLog("Registration failed - error frame received\n");
-            break;
-        default:
-            vWriteLog("Received unknown frame type\n");
+/*************************************************
+* @Name: nSizeOfFile
+* @Def: Size of a file, 0 if it does not exist
+* @Arg: In: psPath = file
+* @Ret: Size in bytes
+*************************************************/
+static unsigned long nSizeOfFile(const char* psPath) {
+    struct stat st;
+    return stat(psPath, &st) == 0 ? (unsigned long)st.st_size : 0;
+}
+
+/*************************************************
+* @Name: nHeldUpload
+* @Def: Upload bytes a plain-mode spool holds. A worker killed mid-upload
+*       leaves the spool at its preallocated size, so the zero tail is not
+*       counted; resending a few real zero bytes is harmless
+* @Arg: In: psPath = spool
+* @Ret: Bytes held
+*************************************************/
+static unsigned long nHeldUpload(const char* psPath) {
+    int fd = open(psPath, O_RDONLY);
+    if (fd < 0) return 0;
+
+    MappedFile spool;
+    unsigned long nHeld = 0;
+    if (nMapInput(&spool, fd) == 0) {
+        nHeld = spool.nMapped;
+        while (nHeld > 0 && spool.pData[nHeld - 1] == '\0') nHeld--;
     }
-    free_frame(response);
+    vUnmapFile(&spool);
+    close(fd);
+    return nHeld;
 }
 
 /*************************************************
-* @Name: vSimulateDistortion
-* @Def: Simulates distortion
+* @Name: vPrepareJob
+* @Def: Sets up the spools of a job and its progress table slot. A
+*       resumed job whose worker died on this host is taken over with
+*       its checkpoint; otherwise the spools are named by job id in the
+*       save folder, so a replacement worker sharing it can still pick
+*       up the upload received so far
 * @Arg: In: pWorker = Worker pointer
+*       In: pJob = parsed job, completed here
+*       In: nIsResume = client asked to resume the job
 * @Ret: None
 *************************************************/
-static void vSimulateDistortion(Worker* pWorker) {
-    vWriteLog("Receiving original file...\n");
+static void vPrepareJob(Worker* pWorker, DistortJob* pJob, int nIsResume) {
+    ProgressEntry* pProgress = &pJob->progress;
 
-    // Simulate receiving file
-    Frame* frame = receive_frame(pWorker->pClientConn);
-    if (!frame || frame->type != FRAME_FILE_DATA) {
-        if (frame) free_frame(frame);
-        return;
+    pJob->nSlot = -1;
+    if (nIsResume) {
+        pJob->nSlot = nProgressTakeOver(pWorker->pProgress, pJob->sJobId, pProgress);
     }
-    free_frame(frame);
+    if (pJob->nSlot < 0) {
+        /* Hidden while in progress; the name keeps the file's extension,
+         * which the whole-file engines go by */
+        snprintf(pProgress->sSpoolPath, sizeof(pProgress->sSpoolPath), "%s/.%s.%s",
+                 pWorker->config.sSaveFolder, pJob->sJobId, pJob->sFileName);
+        snprintf(pProgress->sOutPath, sizeof(pProgress->sOutPath), "%s/.%s.distorted_%s",
+                 pWorker->config.sSaveFolder, pJob->sJobId, pJob->sFileName);
+        pProgress->nHasCheckpoint = 0;
+        /* A handed-off job leaves nothing behind a replacement could use */
+        if (strcmp(pJob->sJobId, "0") != 0 && pJob->fdIn < 0) {
+            pJob->nSlot = nProgressClaim(pWorker->pProgress, pJob->sJobId,
+                                         pProgress->sSpoolPath, pProgress->sOutPath);
+        }
+    }
+    if (!nIsResume) return;
 
-    vWriteLog("Distorting...\n");
-    sleep(1); // Simulate processing
+    unsigned long nHeld = pJob->nIsMerkle ? nSizeOfFile(pProgress->sSpoolPath)
+                                          : nHeldUpload(pProgress->sSpoolPath);
+    pJob->nInOffset = nHeld < pJob->nFileSize ? nHeld : pJob->nFileSize;
+    if (pJob->nIsMerkle) {
+        pJob->nInOffset -= pJob->nInOffset % MERKLE_CHUNK_SIZE;
+    }
 
-    // Send completion info
-    Frame* info = create_frame(FRAME_FILE_INFO, "DONE", 4);
-    send_frame(pWorker->pClientConn, info);
-    free_frame(info);
+    /* The checkpoint is only usable if the spools still cover it */
+    if (pProgress->nHasCheckpoint &&
+        (pProgress->nInOffset > nHeld || pProgress->nInOffset > pJob->nFileSize ||
+         (!pJob->nIsMerkle && pProgress->nHashOffset > pJob->nInOffset) ||
+         (pJob->nOutOffset < pProgress->nOutOffset &&
+          nSizeOfFile(pProgress->sOutPath) < pProgress->nOutOffset))) {
+        pProgress->nHasCheckpoint = 0;
+    }
+    if (!pJob->nIsMerkle && pProgress->nHashOffset > pJob->nInOffset) {
+        pProgress->nHashOffset = 0;
+        vMd5Init(&pProgress->inMd5);
+    }
+}
 
-    // Send distorted data
-    Frame* data = create_frame(FRAME_FILE_DATA, "DISTORTED_DATA", 13);
-    send_frame(pWorker->pClientConn, data);
-    free_frame(data);
+/*************************************************
+* @Name: nIsSpoolName
+* @Def: Whether a save folder entry is named like a job spool,
+*       ".<jobId>.<file>" or ".<jobId>.distorted_<file>". Gotham's ids
+*       are hex time and counter; "0" marks a job it did not number
+* @Arg: In: psName = entry name
+* @Ret: 1 for a spool name, 0 otherwise
+*************************************************/
+static int nIsSpoolName(const char* psName) {
+    size_t nIdLen = psName[0] == '.' ? strspn(psName + 1, "0123456789abcdef") : 0;
+    int nIsId = (nIdLen >= 8 && nIdLen < JOB_ID_LENGTH) || (nIdLen == 1 && psName[1] == '0');
+    return nIsId && psName[1 + nIdLen] == '.' && psName[2 + nIdLen] != '\0';
+}
 
-    vWriteLog("Sending distorted file...\n");
-}
\ No newline at end of file
+/*************************************************
+* @Name: vSweepSpools
+* @Def: Deletes the spools of failed or cancelled jobs no client came
+*       back for. Progress slots past PROGRESS_EXPIRY_SEC are dropped
+*       first; a spool no slot refers to and untouched for as long goes
+*       with them. Runs at most every SPOOL_SWEEP_SEC
+* @Arg: In: pWorker = Worker pointer
+* @Ret: None
+*************************************************/
+static void vSweepSpools(Worker* pWorker) {
+    static time_t nLastSweep = 0;
+    time_t nNow = time(NULL);
+    if (nNow - nLastSweep < SPOOL_SWEEP_SEC) return;
+    nLastSweep = nNow;
+
+    nProgressExpire(pWorker->pProgress, PROGRESS_EXPIRY_SEC);
+
+    DIR* pDir = opendir(pWorker->config.sSaveFolder);
+    if (!pDir) return;
+
+    int nSwept = 0;
+    struct dirent* pEntry;
+    while ((pEntry = readdir(pDir)) != NULL) {
+        char sPath[PROGRESS_PATH_LENGTH];
+        struct stat st;
+        if (!nIsSpoolName(pEntry->d_name) ||
+            fstatat(dirfd(pDir), pEntry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        /* A link from the originals store only bumps the change time */
+        time_t nTouched = st.st_mtime > st.st_ctime ? st.st_mtime : st.st_ctime;
+        int nLen = snprintf(sPath, sizeof(sPath), "%s/%s", pWorker->config.sSaveFolder, pEntry->d_name);
+        if (nNow - nTouched <= PROGRESS_EXPIRY_SEC || nLen < 0 || (size_t)nLen >= sizeof(sPath) ||
+            nProgressHolds(pWorker->pProgress, sPath)) {
+            continue;
+        }
+        if (unlinkat(dirfd(pDir), pEntry->d_name, 0) == 0) nSwept++;
+    }
+    closedir(pDir);
+
+    if (nSwept > 0) {
+        char sMsg[128];
+        snprintf(sMsg, sizeof(sMsg), "Deleted %d spools of jobs no client came back for\n", nSwept);
+        vWriteLog(sMsg);
+    }
+}
+
+/*************************************************
+* @Name: nTakeOriginal
+* @Def: Fills the spool of a new job from the originals store when it
+*       holds an input of the announced MD5 and size. The job then runs
+*       as a plain job whose upload is complete; the receive stage still
+*       checks the spool against the announced MD5
+* @Arg: In: pWorker = Worker pointer
+*       In/Out: pJob = prepared job, marked held on success
+* @Ret: 0 on success, -1 if the input must be uploaded
+*************************************************/
+static int nTakeOriginal(Worker* pWorker, DistortJob* pJob) {
+    struct stat st;
+    int fdHeld = nCacheLookup(pWorker->pOriginals, pJob->sMD5);
+    if (fdHeld < 0) return -1;
+    if (fstat(fdHeld, &st) != 0 || (unsigned long)st.st_size != pJob->nFileSize) {
+        close(fdHeld);
+        return -1;
+    }
+
+    int fd = open(pJob->progress.sSpoolPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int nResult = fd >= 0 ? nCopyFd(fdHeld, fd, pJob->nFileSize) : -1;
+    if (fd >= 0 && nResult != 0) ftruncate(fd, 0);
+    if (fd >= 0) close(fd);
+    close(fdHeld);
+    if (nResult != 0) return -1;
+
+    pJob->nInOffset = pJob->nFileSize;
+    pJob->nIsMerkle = 0;
+    pJob->nIsHeld = 1;
+    return 0;
+}
+
+/*************************************************
+* @Name: nOpenBasis
+* @Def: Opens the input last kept under the job's file name as the basis
+*       of a delta upload. Files too small to gain from it are sent whole.
+*       The descriptor keeps the version the signatures describe, even
+*       once a finished job renames a newer one over it
+* @Arg: In: pWorker = Worker pointer
+*       In/Out: pJob = prepared job, gets the basis on success
+* @Ret: 0 on success, -1 if the input is uploaded whole
+*************************************************/
+static int nOpenBasis(Worker* pWorker, DistortJob* pJob) {
+    char sPath[MAX_PATH_LENGTH + 256];
+    struct stat st;
+    snprintf(sPath, sizeof(sPath), "%s/%s", pWorker->config.sSaveFolder, pJob->sFileName);
+    if (pJob->nFileSize < DELTA_MIN_SIZE) return -1;
+    int fd = open(sPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (unsigned long)st.st_size < DELTA_MIN_SIZE) {
+        close(fd);
+        return -1;
+    }
+    pJob->fdBasis = fd;
+    pJob->nIsMerkle = 0;
+    return 0;
+}
+
+/*************************************************
+* @Name: nSendBasisSignatures
+* @Def: Sends the block signatures of the basis, right after the ack
+* @Arg: In: pJob = job with a basis
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nSendBasisSignatures(const DistortJob* pJob) {
+    MappedFile basis;
+    int nResult = -1;
+    if (nMapInput(&basis, pJob->fdBasis) == 0) {
+        nResult = nDeltaSendSignatures(pJob->pConn, basis.pData, basis.nMapped);
+    }
+    vUnmapFile(&basis);
+    if (nResult != 0) vWriteLog("Failed to send the block signatures\n");
+    return nResult;
+}
+
+/*************************************************
+* @Name: vAppendKey
+* @Def: Key of a file name in the end state store: the name's MD5, as
+*       names may be longer than a key
+* @Arg: In: psFileName = file name
+*       Out: sKey = key
+* @Ret: None
+*************************************************/
+static void vAppendKey(const char* psFileName, char sKey[MD5_HEX_SIZE]) {
+    Md5Context md5;
+    vMd5Init(&md5);
+    vMd5Update(&md5, psFileName, strlen(psFileName));
+    vMd5FinalHex(&md5, sKey);
+}
+
+/*************************************************
+* @Name: nKeptFile
+* @Def: Takes the identity of a file kept in the save folder
+* @Arg: In: psPath = file
+*       Out: pFile = its identity
+* @Ret: 0 on success, -1 if it is not a regular file
+*************************************************/
+static int nKeptFile(const char* psPath, KeptFile* pFile) {
+    struct stat st;
+    if (stat(psPath, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    pFile->nDev = st.st_dev;
+    pFile->nIno = st.st_ino;
+    pFile->nSize = (unsigned long)st.st_size;
+    pFile->tModified = st.st_mtim;
+    return 0;
+}
+
+/*************************************************
+* @Name: nIsKeptFile
+* @Def: Tells whether a file is still the one an end state describes
+* @Arg: In: psPath = file
+*       In: pFile = identity taken when the state was saved
+* @Ret: 1 if it is unchanged, 0 otherwise
+*************************************************/
+static int nIsKeptFile(const char* psPath, const KeptFile* pFile) {
+    KeptFile now;
+    return nKeptFile(psPath, &now) == 0 && now.nDev == pFile->nDev && now.nIno == pFile->nIno &&
+           now.nSize == pFile->nSize && now.tModified.tv_sec == pFile->tModified.tv_sec &&
+           now.tModified.tv_nsec == pFile->tModified.tv_nsec;
+}
+
+/*************************************************
+* @Name: nOpenAppend
+* @Def: Looks for the end state of the last job on the file name, for a
+*       file that has grown since. When the input and output that job
+*       kept are unchanged they become the spools of this job, which
+*       then only needs the new bytes; the client confirms its file
+*       starts with that input before anything is continued. A
+*       handed-over file is given back, as the upload is then small
+* @Arg: In: pWorker = Worker pointer
+*       In/Out: pJob = prepared job, marked continued on success
+* @Ret: 0 on success, -1 if the job starts from scratch
+*************************************************/
+static int nOpenAppend(Worker* pWorker, DistortJob* pJob) {
+    AppendState* pState = &pJob->append;
+    char sKey[MD5_HEX_SIZE];
+    char sKeepPath[MAX_PATH_LENGTH + 256];
+    char sOutPath[MAX_PATH_LENGTH + 256 + 10];
+    vAppendKey(pJob->sFileName, sKey);
+    int fd = nCacheLookup(pWorker->pAppends, sKey);
+    if (fd < 0) return -1;
+    ssize_t nRead = read(fd, pState, sizeof(*pState));
+    close(fd);
+    pState->sFactor[sizeof(pState->sFactor) - 1] = '\0';
+    if (nRead != (ssize_t)sizeof(*pState) || strcmp(pState->sFactor, pJob->sFactor) != 0 ||
+        pState->nStateSize > PROGRESS_STATE_SIZE || pState->in.nSize == 0 ||
+        pState->in.nSize >= pJob->nFileSize) {
+        return -1;
+    }
+
+    snprintf(sKeepPath, sizeof(sKeepPath), "%s/%s", pWorker->config.sSaveFolder, pJob->sFileName);
+    snprintf(sOutPath, sizeof(sOutPath), "%s/distorted_%s", pWorker->config.sSaveFolder, pJob->sFileName);
+    if (!nIsKeptFile(sKeepPath, &pState->in) || !nIsKeptFile(sOutPath, &pState->out) ||
+        rename(sKeepPath, pJob->progress.sSpoolPath) != 0) {
+        return -1;
+    }
+    if (rename(sOutPath, pJob->progress.sOutPath) != 0) {
+        rename(pJob->progress.sSpoolPath, sKeepPath);
+        return -1;
+    }
+    if (pJob->fdIn >= 0) {
+        close(pJob->fdIn);
+        close(pJob->fdOut);
+        pJob->fdIn = -1;
+        pJob->fdOut = -1;
+    }
+    pJob->nIsMerkle = 0;
+    pJob->nIsContinued = 1;
+    return 0;
+}
+
+/*************************************************
+* @Name: nSendAppendState
+* @Def: Right after the ack, sends "inSize&inMd5&outSize&outMd5" of the
+*       kept input and output as FILE_INFO. The client answers MD5_CHECK
+*       "CHECK_OK&outHeld" if its file starts with that input, outHeld
+*       being the kept output it holds too, or "CHECK_KO". Confirmed, the
+*       job restarts at the end state as if taken over there; otherwise
+*       the spools are overwritten by a whole upload
+* @Arg: In: pWorker = Worker pointer
+*       In/Out: pJob = continued job, gets its offsets and checkpoint
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nSendAppendState(Worker* pWorker, DistortJob* pJob) {
+    const AppendState* pState = &pJob->append;
+    ProgressEntry* pProgress = &pJob->progress;
+    char sInMD5[MD5_HEX_SIZE], sOutMD5[MD5_HEX_SIZE], sInfo[DATA_SIZE];
+    Md5Context md5 = pState->inMd5;
+    vMd5FinalHex(&md5, sInMD5);
+    md5 = pState->outMd5;
+    vMd5FinalHex(&md5, sOutMD5);
+    snprintf(sInfo, sizeof(sInfo), "%lu&%s&%lu&%s", pState->in.nSize, sInMD5, pState->out.nSize, sOutMD5);
+    Frame* info = create_frame(FRAME_FILE_INFO, sInfo, strlen(sInfo));
+    int nOk = send_frame(pJob->pConn, info);
+    free_frame(info);
+    if (!nOk) return -1;
+
+    Frame* reply = receive_frame(pJob->pConn);
+    if (!reply || reply->type != FRAME_MD5_CHECK) {
+        if (reply) free_frame(reply);
+        return -1;
+    }
+    unsigned long nOutHeld = 0;
+    int nIsConfirmed = sscanf(reply->data, "CHECK_OK&%lu", &nOutHeld) == 1 && nOutHeld <= pState->out.nSize;
+    free_frame(reply);
+    if (!nIsConfirmed) {
+        vWriteLog("Client's file does not continue the one held, it is uploaded whole\n");
+        pJob->nIsContinued = 0;
+        return 0;
+    }
+
+    pJob->nInOffset = pState->in.nSize;
+    pJob->nOutOffset = nOutHeld;
+    pProgress->nHashOffset = pState->in.nSize;
+    pProgress->inMd5 = pState->inMd5;
+    pProgress->nHasCheckpoint = 1;
+    pProgress->nInOffset = pState->in.nSize;
+    pProgress->nOutOffset = pState->out.nSize;
+    pProgress->outMd5 = pState->outMd5;
+    pProgress->nStateSize = pState->nStateSize;
+    memcpy(pProgress->pState, pState->pState, pState->nStateSize);
+    vProgressSaveHash(pWorker->pProgress, pJob->nSlot, pProgress->nHashOffset, &pProgress->inMd5);
+    vProgressSaveCheckpoint(pWorker->pProgress, pJob->nSlot, pProgress->nInOffset, pProgress->nOutOffset,
+                            &pProgress->outMd5, pProgress->pState, pProgress->nStateSize);
+
+    char sMsg[256];
+    snprintf(sMsg, sizeof(sMsg), "Continuing the last job on the file at input %lu, output %lu\n",
+             pProgress->nInOffset, pProgress->nOutOffset);
+    vWriteLog(sMsg);
+    return 0;
+}
+
+/*************************************************
+* @Name: nRestoreCheckpoint
+* @Def: Gives a streaming engine the state it saved before a takeover
+* @Arg: In: pCheckpoint = checkpoint handle, may be NULL
+*       Out: pState = engine state
+*       In: nMax = size of pState
+* @Ret: State size, 0 when the engine starts from the beginning
+*************************************************/
+size_t nRestoreCheckpoint(JobCheckpoint* pCheckpoint, void* pState, size_t nMax) {
+    if (!pCheckpoint || !pCheckpoint->pJob->progress.nHasCheckpoint ||
+        pCheckpoint->pJob->progress.nStateSize > nMax) {
+        return 0;
+    }
+    memcpy(pState, pCheckpoint->pJob->progress.pState, pCheckpoint->pJob->progress.nStateSize);
+    return pCheckpoint->pJob->progress.nStateSize;
+}
+
+/*************************************************
+* @Name: vSaveCheckpoint
+* @Def: Called by a streaming engine between chunks. At most once every
+*       PROGRESS_INTERVAL input bytes the state is posted; the send stage
+*       publishes it once its output MD5 reaches the same point
+* @Arg: In: pCheckpoint = checkpoint handle, may be NULL
+*       In: pState = engine state
+*       In: nSize = bytes in pState
+* @Ret: None
+*************************************************/
+void vSaveCheckpoint(JobCheckpoint* pCheckpoint, const void* pState, size_t nSize) {
+    if (!pCheckpoint || pCheckpoint->pJob->nSlot < 0 || nSize > PROGRESS_STATE_SIZE) return;
+
+    /* The engine is the consumer of pIn and the producer of pOut, so it
+     * owns both of these counters */
+    unsigned long nIn = pCheckpoint->nInBase + pCheckpoint->pIn->nTail;
+    unsigned long nOut = pCheckpoint->nOutBase + pCheckpoint->pOut->nHead;
+    if (nIn - pCheckpoint->nLastIn < PROGRESS_INTERVAL) return;
+    pCheckpoint->nLastIn = nIn;
+
+    pthread_mutex_lock(&pCheckpoint->mutex);
+    pCheckpoint->nIsPending = 1;
+    pCheckpoint->nPendingIn = nIn;
+    pCheckpoint->nPendingOut = nOut;
+    pCheckpoint->nPendingSize = nSize;
+    if (nSize > 0) memcpy(pCheckpoint->pPendingState, pState, nSize);
+    pthread_mutex_unlock(&pCheckpoint->mutex);
+}
+
+/*************************************************
+* @Name: vSaveEndState
+* @Def: Called by a streaming engine once its input is complete, with
+*       the state it would continue from if more input followed
+* @Arg: In: pCheckpoint = checkpoint handle, may be NULL
+*       In: pState = engine state
+*       In: nSize = bytes in pState
+* @Ret: None
+*************************************************/
+void vSaveEndState(JobCheckpoint* pCheckpoint, const void* pState, size_t nSize) {
+    if (!pCheckpoint || nSize > PROGRESS_STATE_SIZE) return;
+    pCheckpoint->nHasEnd = 1;
+    pCheckpoint->nEndSize = nSize;
+    if (nSize > 0) memcpy(pCheckpoint->pEndState, pState, nSize);
+}
+
+/*************************************************
+* @Name: nPendingCheckpoint
+* @Def: Output offset of the checkpoint waiting to be published
+* @Arg: In: pCheckpoint = checkpoint handle
+* @Ret: Output offset, 0 if there is none
+*************************************************/
+static unsigned long nPendingCheckpoint(JobCheckpoint* pCheckpoint) {
+    pthread_mutex_lock(&pCheckpoint->mutex);
+    unsigned long nOut = pCheckpoint->nIsPending ? pCheckpoint->nPendingOut : 0;
+    pthread_mutex_unlock(&pCheckpoint->mutex);
+    return nOut;
+}
+
+/*************************************************
+* @Name: vPublishCheckpoint
+* @Def: Writes the pending checkpoint to the progress table, once the
+*       output up to it is hashed and in the output spool
+* @Arg: In: pCheckpoint = checkpoint handle
+*       In: nOut = output offset the MD5 state belongs to
+*       In: pMd5 = output MD5 state at nOut
+* @Ret: None
+*************************************************/
+static void vPublishCheckpoint(JobCheckpoint* pCheckpoint, unsigned long nOut, const Md5Context* pMd5) {
+    pthread_mutex_lock(&pCheckpoint->mutex);
+    if (pCheckpoint->nIsPending && pCheckpoint->nPendingOut == nOut) {
+        vProgressSaveCheckpoint(pCheckpoint->pWorker->pProgress, pCheckpoint->pJob->nSlot,
+                                pCheckpoint->nPendingIn, nOut, pMd5,
+                                pCheckpoint->pPendingState, pCheckpoint->nPendingSize);
+        pCheckpoint->nIsPending = 0;
+    }
+    pthread_mutex_unlock(&pCheckpoint->mutex);
+}
+
+/*************************************************
+* @Name: vHandleGothamCrash
+* @Def: Handles Gotham server crash
+* @Arg: In: pWorker = Worker pointer
+* @Ret: None
+*************************************************/
+static void vHandleGothamCrash(Worker* pWorker) {
+    vWriteLog("Lost connection to Gotham. Finishing current work...\n");
+    pWorker->nIsRunning = 0;
+
+    /* Wait for current distortion to complete */
+    while (pWorker->nIsProcessing) {
+        sleep(1);
+    }
+
+    /* Cleanup connections */
+    if (pWorker->pClientConn) {
+        close_connection(pWorker->pClientConn);
+        pWorker->pClientConn = NULL;
+    }
+    if (pWorker->pGothamConn) {
+        close_connection(pWorker->pGothamConn);
+        pWorker->pGothamConn = NULL;
+    }
+}
+
+/*************************************************
+* @Name: vHandleSigInt
+* @Def: Handles SIGINT signal
+* @Arg: In: nSigNum = Signal number
+* @Ret: None
+*************************************************/
+static void vHandleSigInt(int nSigNum) {
+    (void)nSigNum;
+
+    pthread_mutex_lock(&gShutdownMutex);
+    if (gnShutdownInProgress) {
+        pthread_mutex_unlock(&gShutdownMutex);
+        return;
+    }
+    gnShutdownInProgress = 1;
+    pthread_mutex_unlock(&gShutdownMutex);
+
+    vWriteLog("Received CTRL+C. Initiating worker shutdown...\n");
+    exit(0);
+}
+
+/*************************************************
+* @Name: vOpenLocalEndpoint
+* @Def: Listens on a unix socket in the save folder, named after the TCP
+*       port and a token drawn at start, for Flecks running on this host.
+*       Only there can a Fleck find that name, which is how it knows it
+*       may use the socket. The path is absolute, as Flecks resolve it
+*       from their own directory. Without it, local clients use TCP
+* @Arg: In: pWorker = Worker pointer
+* @Ret: None
+*************************************************/
+static void vOpenLocalEndpoint(Worker* pWorker) {
+    char sFolder[PATH_MAX];
+    char sLocalIP[MAX_IP_LENGTH];
+    unsigned long long nToken;
+    if (getrandom(&nToken, sizeof(nToken), 0) != (ssize_t)sizeof(nToken) ||
+        !realpath(pWorker->config.sSaveFolder, sFolder)) {
+        vWriteLog("Unix socket unavailable, local clients will use TCP\n");
+        return;
+    }
+    int nLen = snprintf(sLocalIP, sizeof(sLocalIP), UNIX_ENDPOINT "%s/.worker_%s_%016llx.sock",
+                        sFolder, pWorker->sPort, nToken);
+    if (nLen < 0 || (size_t)nLen >= sizeof(sLocalIP)) {
+        vWriteLog("Unix socket path too long, local clients will use TCP\n");
+        return;
+    }
+
+    // Sockets an earlier run on this port left behind, if it was killed
+    char sPattern[PATH_MAX + MAX_PORT_LENGTH + 16];
+    glob_t stale;
+    snprintf(sPattern, sizeof(sPattern), "%s/.worker_%s_*.sock", sFolder, pWorker->sPort);
+    if (glob(sPattern, 0, NULL, &stale) == 0) {
+        for (size_t i = 0; i < stale.gl_pathc; i++) unlink(stale.gl_pathv[i]);
+        globfree(&stale);
+    }
+
+    pWorker->pLocalConn = create_server(sLocalIP, 0);
+    if (!pWorker->pLocalConn) {
+        vWriteLog("Unix socket unavailable, local clients will use TCP\n");
+        return;
+    }
+    snprintf(pWorker->sLocalIP, sizeof(pWorker->sLocalIP), "%s", sLocalIP);
+}
+
+/*************************************************
+* @Name: vHandleRegistration
+* @Def: Handles worker registration
+* @Arg: In: pWorker = Worker pointer
+* @Ret: None
+*************************************************/
+static void vHandleRegistration(Worker* pWorker) {
+    char sData[DATA_SIZE];
+    int nLen = snprintf(sData, sizeof(sData), "%s&%s&%s%s%s",
+                        pWorker->psType,
+                        pWorker->sIP,
+                        pWorker->sPort,
+                        pWorker->sLocalIP[0] != '\0' ? "&" : "",
+                        pWorker->sLocalIP);
+    if (nLen < 0 || (size_t)nLen >= sizeof(sData)) {
+        vWriteLog("Endpoints do not fit the registration frame\n");
+        return;
+    }
+
+    vWriteLog("Sending registration frame to Gotham\n");
+
+    Frame* frame = create_frame(FRAME_WORKER_REG, sData, strlen(sData));
+    if (!frame) {
+        vWriteLog("Failed to create registration frame\n");
+        return;
+    }
+
+    if (!send_frame(pWorker->pGothamConn, frame)) {
+        vWriteLog("Failed to send registration frame\n");
+        free_frame(frame);
+        return;
+    }
+    free_frame(frame);
+
+    Frame* response = receive_frame(pWorker->pGothamConn);
+    if (!response) {
+        vWriteLog("Failed to receive response\n");
+        return;
+    }
+
+    switch (response->type) {
+        case FRAME_WORKER_REG:
+            if (response->data_length == 0) {
+                vWriteLog("Registration successful as backup worker\n");
+                pWorker->nIsRegistered = 1;
+            }
+            break;
+        case FRAME_NEW_MAIN:
+            vWriteLog("Registration successful as main worker\n");
+            pWorker->nIsMainWorker = 1;
+            pWorker->nIsRegistered = 1;
+            nProgressAdoptOrphans(pWorker->pProgress);
+            break;
+        case FRAME_ERROR:
+            vWriteLog("Registration failed - error frame received\n");
+            break;
+        default:
+            vWriteLog("Received unknown frame type\n");
+    }
+    free_frame(response);
+}
+
+/*************************************************
+* @Name: vReportCache
+* @Def: Tells Gotham a result or original was stored ("+key") or
+*       evicted ("-key"), so it can send repeated requests to this
+*       worker. An original's key is its MD5 alone. "=bytes" gives the
+*       budget of the result cache, 0 if there is none
+* @Arg: In: pvArg = Worker pointer
+*       In: cOp = '+', '-' or '='
+*       In: psKey = cache key, or the budget
+* @Ret: None
+*************************************************/
+static void vReportCache(void* pvArg, char cOp, const char* psKey) {
+    Worker* pWorker = (Worker*)pvArg;
+    char sUpdate[DATA_SIZE];
+    snprintf(sUpdate, sizeof(sUpdate), "%c%s", cOp, psKey);
+    if (pWorker->pGothamConn) {
+        Frame* update = create_frame(FRAME_CACHE_UPDATE, sUpdate, strlen(sUpdate));
+        send_frame(pWorker->pGothamConn, update);
+        free_frame(update);
+    }
+}
+
+/*************************************************
+* @Name: vReplaySpool
+* @Def: Feeds spooled upload bytes on, as if they had just been
+*       received: bytes from nFeedFrom go to the input ring, bytes from
+*       nHashFrom to the MD5
+* @Arg: In: pData = mapped spool
+*       In: nFeedFrom = first byte the engine still needs
+*       In: nHashFrom = first byte pMd5 does not cover yet
+*       In: nLength = bytes held
+*       In: pRing = input ring
+*       In: pMd5 = upload MD5
+* @Ret: None
+*************************************************/
+static void vReplaySpool(const char* pData, unsigned long nFeedFrom, unsigned long nHashFrom,
+                         unsigned long nLength, Ring* pRing, Md5Context* pMd5) {
+    /* Once the engine has failed the ring is aborted and drops the bytes */
+    if (nFeedFrom < nLength) ring_write(pRing, pData + nFeedFrom, nLength - nFeedFrom);
+    if (nHashFrom < nLength) vMd5Update(pMd5, pData + nHashFrom, nLength - nHashFrom);
+}
+
+/*************************************************
+* @Name: vCheckUpload
+* @Def: Ends the receive stage: compares the upload MD5 with the one the
+*       client announced, and closes the input ring only if they match
+* @Arg: In: pStage = receive stage
+*       In: pMd5 = MD5 of every upload byte
+* @Ret: None
+*************************************************/
+static void vCheckUpload(PipelineStage* pStage, Md5Context* pMd5) {
+    /* The client hashes while it sends, so its MD5 follows the data */
+    char sExpected[MD5_HEX_SIZE];
+    snprintf(sExpected, sizeof(sExpected), "%s", pStage->pJob->sMD5);
+    if (strcmp(sExpected, MD5_DEFERRED) == 0) {
+        Frame* info = receive_frame(pStage->pJob->pConn);
+        unsigned long nSize = 0;
+        if (!info || info->type != FRAME_FILE_INFO ||
+            sscanf(info->data, "%lu&%32s", &nSize, sExpected) != 2) {
+            if (info) free_frame(info);
+            vWriteLog("Client did not send the file MD5\n");
+            ring_abort(pStage->pRing);
+            return;
+        }
+        free_frame(info);
+    }
+
+    char sActual[MD5_HEX_SIZE];
+    Md5Context whole = *pMd5;
+    vMd5FinalHex(pMd5, sActual);
+    if (strcmp(sActual, sExpected) != 0) {
+        vWriteLog("Original file MD5 mismatch\n");
+        pStage->nResult = PIPELINE_CHECK_KO;
+        ring_abort(pStage->pRing);
+        return;
+    }
+
+    pStage->pCheckpoint->endInMd5 = whole;
+    ring_close(pStage->pRing);
+    pStage->nResult = 0;
+}
+
+/*************************************************
+* @Name: vReceiveStage
+* @Def: Pipeline stage 1. Reads the upload's FILE_DATA frames, keeps a
+*       copy in the save folder and feeds the bytes to the input ring.
+*       The spool is preallocated to the announced size and mapped, so
+*       frames land in it without a write and BULK_DATA segments spliced
+*       into it are fed from the mapping. The DELTA_COPY frames of a
+*       delta upload are filled in from the mapped basis.
+*       On a resumed job the spooled prefix is replayed first, from the
+*       engine checkpoint if there is one. A handed-off input is mapped
+*       and fed in place, with no spool. The input ring is only closed
+*       once the upload MD5 matches
+* @Arg: In: pvArg = PipelineStage pointer
+* @Ret: NULL
+*************************************************/
+static void* vReceiveStage(void* pvArg) {
+    PipelineStage* pStage = (PipelineStage*)pvArg;
+    const DistortJob* pJob = pStage->pJob;
+    const ProgressEntry* pProgress = &pJob->progress;
+    unsigned long nFeedFrom = pProgress->nHasCheckpoint ? pProgress->nInOffset : 0;
+    pStage->nResult = -1;
+
+    int nFlags = pJob->nInOffset > 0 ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC;
+    if (pStage->pJob->nIsMerkle) {
+        int fd = open(pProgress->sSpoolPath, nFlags, 0644);
+        int nResult = fd < 0 ? -1 : nMerkleReceive(pStage->pJob->pConn, fd, pJob->nFileSize,
+                                                   (int)(pJob->nInOffset / MERKLE_CHUNK_SIZE),
+                                                   nFeedFrom, pStage->pRing);
+        if (fd >= 0) close(fd);
+        if (nResult == 0) {
+            ring_close(pStage->pRing);
+        } else {
+            if (nResult == MERKLE_CHECK_KO) {
+                vWriteLog("Original file failed chunk verification\n");
+                pStage->nResult = PIPELINE_CHECK_KO;
+            }
+            ring_abort(pStage->pRing);
+            return NULL;
+        }
+        pStage->nResult = 0;
+        return NULL;
+    }
+
+    Md5Context md5 = pProgress->inMd5;
+    if (pProgress->nHashOffset == 0) vMd5Init(&md5);
+
+    MappedFile spool;
+    if (pJob->fdIn >= 0) {
+        if (nMapInput(&spool, pJob->fdIn) != 0 || spool.nMapped != pJob->nFileSize) {
+            vWriteLog("Failed to map the handed-over file\n");
+            vUnmapFile(&spool);
+            ring_abort(pStage->pRing);
+            return NULL;
+        }
+        vReplaySpool(spool.pData, 0, 0, pJob->nFileSize, pStage->pRing, &md5);
+        vUnmapFile(&spool);
+        vCheckUpload(pStage, &md5);
+        return NULL;
+    }
+
+    /* A delta upload refers to blocks of the previous version */
+    MappedFile basis;
+    int nHasBasis = pJob->fdBasis >= 0 && nMapInput(&basis, pJob->fdBasis) == 0;
+    int fd = open(pProgress->sSpoolPath, nFlags, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)pJob->nInOffset) != 0 || nMapOutput(&spool, fd, pJob->nFileSize) != 0) {
+        vWriteLog("Failed to create file in save folder\n");
+        if (fd >= 0) {
+            ftruncate(fd, (off_t)pJob->nInOffset);
+            close(fd);
+        }
+        if (nHasBasis) vUnmapFile(&basis);
+        ring_abort(pStage->pRing);
+        return NULL;
+    }
+    vReplaySpool(spool.pData, nFeedFrom, pProgress->nHashOffset, pJob->nInOffset, pStage->pRing, &md5);
+
+    unsigned long nReceived = pJob->nInOffset;
+    unsigned long nNextHash = nReceived + PROGRESS_INTERVAL;
+    while (nReceived < pJob->nFileSize) {
+        Frame* frame = receive_frame(pStage->pJob->pConn);
+        size_t nBulk = bulk_length(frame);
+        unsigned long nCopyFrom = 0, nCopyLength = 0;
+        int nIsCopy = nHasBasis && frame && frame->type == FRAME_DELTA_COPY &&
+                      nDeltaCopyRange(frame, basis.nMapped, &nCopyFrom, &nCopyLength) == 0;
+        if (!frame || (frame->type != FRAME_FILE_DATA && nBulk == 0 && !nIsCopy) || frame->data_length > DATA_SIZE ||
+            nReceived + (nIsCopy ? nCopyLength : nBulk > 0 ? nBulk : frame->data_length) > pJob->nFileSize) {
+            if (frame) free_frame(frame);
+            vWriteLog("Client stopped sending file data\n");
+            break;
+        }
+        /* Keep draining the socket even once the engine has failed, so the
+         * connection stays in sync */
+        if (nIsCopy) {
+            free_frame(frame);
+            memcpy(spool.pData + nReceived, basis.pData + nCopyFrom, nCopyLength);
+            vReplaySpool(spool.pData, nReceived, nReceived, nReceived + nCopyLength, pStage->pRing, &md5);
+            nReceived += nCopyLength;
+        } else if (nBulk > 0) {
+            int nOk = receive_bulk_to_file(pStage->pJob->pConn, frame, fd, (off_t)nReceived);
+            free_frame(frame);
+            if (!nOk) break;
+            vReplaySpool(spool.pData, nReceived, nReceived, nReceived + nBulk, pStage->pRing, &md5);
+            nReceived += nBulk;
+        } else {
+            memcpy(spool.pData + nReceived, frame->data, frame->data_length);
+            vReplaySpool(spool.pData, nReceived, nReceived, nReceived + frame->data_length, pStage->pRing, &md5);
+            nReceived += frame->data_length;
+            free_frame(frame);
+        }
+
+        if (nReceived >= nNextHash) {
+            vProgressSaveHash(pStage->pWorker->pProgress, pJob->nSlot, nReceived, &md5);
+            nNextHash = nReceived + PROGRESS_INTERVAL;
+        }
+    }
+    /* A short upload leaves the spool at what was received, for a resume */
+    int nIsComplete = nReceived == pJob->nFileSize;
+    if (nFinishOutput(&spool, nReceived) != 0) nIsComplete = 0;
+    close(fd);
+    if (nHasBasis) vUnmapFile(&basis);
+    if (!nIsComplete) {
+        ring_abort(pStage->pRing);
+        return NULL;
+    }
+
+    vCheckUpload(pStage, &md5);
+    return NULL;
+}
+
+/*************************************************
+* @Name: nSendHeldOutput
+* @Def: After a takeover, sends the output between what the client holds
+*       and the checkpoint from the output spool of the dead worker
+* @Arg: In: pConn = client connection
+*       In: fd = output spool
+*       In: nFrom = output the client holds
+*       In: nTo = checkpoint output offset
+*       In: nIsBulk = send BULK_DATA segments straight from the spool
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nSendHeldOutput(Connection* pConn, int fd, unsigned long nFrom, unsigned long nTo, int nIsBulk) {
+    while (nIsBulk && nFrom < nTo) {
+        size_t nWant = nTo - nFrom < BULK_SEGMENT_SIZE ? nTo - nFrom : BULK_SEGMENT_SIZE;
+        if (!send_bulk_file(pConn, fd, (off_t)nFrom, nWant)) return -1;
+        nFrom += nWant;
+    }
+
+    char buffer[FRAME_BATCH * DATA_SIZE];
+    while (nFrom < nTo) {
+        size_t nWant = nTo - nFrom < sizeof(buffer) ? nTo - nFrom : sizeof(buffer);
+        ssize_t nBytes = pread(fd, buffer, nWant, (off_t)nFrom);
+        if (nBytes <= 0) return -1;
+        if (!send_frames(pConn, FRAME_FILE_DATA, buffer, (size_t)nBytes)) return -1;
+        nFrom += (unsigned long)nBytes;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nServeCached
+* @Def: Answers a job from the result cache. The cached output goes out
+*       the way the send stage would send it, or into the handed-off
+*       output file, followed by its "size&md5" FILE_INFO trailer.
+*       Nothing is uploaded and the engine does not run
+* @Arg: In: pJob = job, with the cached result open
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nServeCached(const DistortJob* pJob) {
+    MappedFile result;
+    if (nMapInput(&result, pJob->fdCached) != 0) return -1;
+
+    char sMD5[MD5_HEX_SIZE];
+    Md5Context md5;
+    vMd5Init(&md5);
+    vMd5Update(&md5, result.pData, result.nMapped);
+    vMd5FinalHex(&md5, sMD5);
+    unsigned long nSize = result.nMapped;
+    vUnmapFile(&result);
+
+    /* A handed-off output file may hold an earlier result; it is replaced */
+    int nResult = pJob->fdOut >= 0 ? (ftruncate(pJob->fdOut, 0) == 0 ? nCopyFd(pJob->fdCached, pJob->fdOut, nSize) : -1)
+                                   : nSendHeldOutput(pJob->pConn, pJob->fdCached, 0, nSize, pJob->nIsBulk);
+    if (nResult != 0) return -1;
+
+    char sInfo[DATA_SIZE];
+    snprintf(sInfo, sizeof(sInfo), "%lu&%s", nSize, sMD5);
+    Frame* info = create_frame(FRAME_FILE_INFO, sInfo, strlen(sInfo));
+    int nOk = send_frame(pJob->pConn, info);
+    free_frame(info);
+    if (!nOk) return -1;
+    vWriteLog("Distorted file sent from the cache\n");
+    return 0;
+}
+
+/*************************************************
+* @Name: vSendStage
+* @Def: Pipeline stage 3. Streams the output ring back as FILE_DATA, hashing
+*       it on the way, and finishes with a "size&md5" FILE_INFO trailer, or
+*       with an error frame if the pipeline failed. In bulk mode the output
+*       goes out as BULK_DATA segments sent from the output spool. Output the client
+*       already holds from a previous attempt is hashed but not sent. The
+*       output is also kept in the output spool, and engine checkpoints
+*       are published once the output reaches them. A handed-off job only
+*       writes its output file and sends the trailer
+* @Arg: In: pvArg = PipelineStage pointer
+* @Ret: NULL
+*************************************************/
+static void* vSendStage(void* pvArg) {
+    PipelineStage* pStage = (PipelineStage*)pvArg;
+    Connection* pConn = pStage->pJob->pConn;
+    const DistortJob* pJob = pStage->pJob;
+    JobCheckpoint* pCheckpoint = pStage->pCheckpoint;
+    char buffer[BULK_SEND_SIZE];
+    size_t nCapacity = pJob->nIsBulk ? sizeof(buffer) : FRAME_BATCH * DATA_SIZE;
+    ssize_t nBytes = 0;
+    Md5Context md5;
+
+    /* After a takeover the engine restarts at the checkpoint */
+    unsigned long nSent = pCheckpoint->nOutBase;
+    if (pJob->progress.nHasCheckpoint) {
+        md5 = pJob->progress.outMd5;
+    } else {
+        vMd5Init(&md5);
+    }
+
+    /* A handed-off output file takes the place of the spool and the socket.
+     * The client leaves what it held in it; everything past where this
+     * output starts is replaced */
+    pStage->nResult = -1;
+    int fd = pJob->fdOut >= 0 ? dup(pJob->fdOut) :
+             open(pJob->progress.sOutPath,
+                  pJob->progress.nHasCheckpoint ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0 && pJob->fdOut >= 0 && ftruncate(fd, (off_t)nSent) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0 || (pJob->nOutOffset < nSent && nSendHeldOutput(pConn, fd, pJob->nOutOffset, nSent, pJob->nIsBulk) != 0)) {
+        if (fd >= 0) close(fd);
+        ring_abort(pStage->pRing);
+        return NULL;
+    }
+
+    for (;;) {
+        /* Fill whole frame batches; a short frame only goes out at end of stream.
+         * Reads stop at a pending checkpoint so the MD5 can be taken there */
+        size_t nFill = 0;
+        int nIsMarked = 0;
+        unsigned long nMark = 0;
+        Md5Context markMd5;
+        while (nFill < nCapacity) {
+            size_t nWant = nCapacity - nFill;
+            if (!nIsMarked) {
+                nMark = nPendingCheckpoint(pCheckpoint);
+                if (nMark > 0 && nMark == nSent + nFill) {
+                    markMd5 = md5;
+                    nIsMarked = 1;
+                } else if (nMark > nSent + nFill && nMark - (nSent + nFill) < nWant) {
+                    nWant = nMark - (nSent + nFill);
+                }
+            }
+            nBytes = ring_read(pStage->pRing, buffer + nFill, nWant);
+            if (nBytes <= 0) break;
+            vMd5Update(&md5, buffer + nFill, nBytes);
+            nFill += (size_t)nBytes;
+            if (!nIsMarked && nSent + nFill == nMark) {
+                markMd5 = md5;
+                nIsMarked = 1;
+            }
+        }
+        if (nBytes < 0) break;
+        if (nFill > 0) {
+            if (pwrite(fd, buffer, nFill, (off_t)nSent) != (ssize_t)nFill) {
+                ring_abort(pStage->pRing);
+                close(fd);
+                return NULL;
+            }
+            size_t nHeld = 0;
+            if (nSent < pJob->nOutOffset) {
+                unsigned long nLeft = pJob->nOutOffset - nSent;
+                nHeld = nLeft < nFill ? (size_t)nLeft : nFill;
+            }
+            if (nHeld < nFill && pJob->fdOut < 0) {
+                int nOk;
+                if (pJob->nIsBulk) {
+                    nOk = send_bulk_file(pConn, fd, (off_t)(nSent + nHeld), nFill - nHeld);
+                } else {
+                    nOk = send_frames(pConn, FRAME_FILE_DATA, buffer + nHeld, nFill - nHeld);
+                }
+                if (!nOk) {
+                    ring_abort(pStage->pRing);
+                    close(fd);
+                    return NULL;
+                }
+            }
+            nSent += nFill;
+        }
+        if (nIsMarked) vPublishCheckpoint(pCheckpoint, nMark, &markMd5);
+        if (nBytes == 0) break;
+    }
+    close(fd);
+
+    if (nBytes < 0) {
+        const char* psError = "DISTORT_KO";
+        if (pStage->pPeer->nResult == PIPELINE_CHECK_KO) {
+            psError = "CHECK_KO";
+        } else {
+            vWriteLog("Distortion failed\n");
+        }
+        Frame* error = create_frame(FRAME_ERROR, psError, strlen(psError));
+        send_frame(pConn, error);
+        free_frame(error);
+        return NULL;
+    }
+
+    // Send completion info now that the size and MD5 are known
+    char sMD5[MD5_HEX_SIZE];
+    char sInfo[DATA_SIZE];
+    pCheckpoint->endOutMd5 = md5;
+    pCheckpoint->nEndOut = nSent;
+    vMd5FinalHex(&md5, sMD5);
+    snprintf(sInfo, sizeof(sInfo), "%lu&%s", nSent, sMD5);
+    Frame* info = create_frame(FRAME_FILE_INFO, sInfo, strlen(sInfo));
+    if (send_frame(pConn, info)) {
+        pStage->nResult = 0;
+    }
+    free_frame(info);
+    return NULL;
+}
+
+/*************************************************
+* @Name: nDistortWholeFile
+* @Def: Fallback for engines that need the complete input. Waits for the
+*       upload to finish, runs the file engine and streams its output
+* @Arg: In: pWorker = Worker pointer
+*       In: pJob = job, whose spool is the engine input
+*       In: psOutPath = engine output path
+*       In: pIn = input ring
+*       In: pOut = output ring
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nDistortWholeFile(Worker* pWorker, const DistortJob* pJob, const char* psOutPath,
+                             Ring* pIn, Ring* pOut) {
+    const char* psInPath = pJob->progress.sSpoolPath;
+    char buffer[4096];
+    ssize_t nBytes;
+
+    /* The receive stage already spools an upload; a handed-off input is
+     * spooled here, since the file engines go by path and extension */
+    int fdSpool = pJob->fdIn >= 0 ? open(psInPath, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (pJob->fdIn >= 0 && fdSpool < 0) return -1;
+    while ((nBytes = ring_read(pIn, buffer, sizeof(buffer))) > 0) {
+        if (fdSpool >= 0 && write(fdSpool, buffer, nBytes) != nBytes) nBytes = -1;
+        if (nBytes < 0) break;
+    }
+    if (fdSpool >= 0) close(fdSpool);
+    if (nBytes < 0) return -1;
+
+    const char* psFactor = pJob->sFactor;
+    int nResult = pWorker->pfDistort ? pWorker->pfDistort(psInPath, psOutPath, psFactor)
+                                     : nCopyFile(psInPath, psOutPath);
+    if (nResult != 0) return -1;
+
+    int fd = open(psOutPath, O_RDONLY);
+    if (fd < 0) return -1;
+    while ((nBytes = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (ring_write(pOut, buffer, nBytes) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return nBytes < 0 ? -1 : 0;
+}
+
+/*************************************************
+* @Name: nPackRead
+* @Def: Reads exactly nLen bytes of a container
+* @Arg: In: pReader = container reader
+*       Out: pData = bytes read
+*       In: nLen = bytes wanted
+* @Ret: 0 on success, 1 at end of input before any byte, -1 on failure
+*************************************************/
+static int nPackRead(PackReader* pReader, char* pData, size_t nLen) {
+    size_t nDone = 0;
+    while (nDone < nLen) {
+        if (pReader->nPos == pReader->nLen) {
+            ssize_t nBytes = ring_read(pReader->pRing, pReader->buffer, sizeof(pReader->buffer));
+            if (nBytes <= 0) return nBytes == 0 && nDone == 0 ? 1 : -1;
+            pReader->nPos = 0;
+            pReader->nLen = (size_t)nBytes;
+        }
+        size_t nChunk = pReader->nLen - pReader->nPos;
+        if (nChunk > nLen - nDone) nChunk = nLen - nDone;
+        memcpy(pData + nDone, pReader->buffer + pReader->nPos, nChunk);
+        pReader->nPos += nChunk;
+        nDone += nChunk;
+    }
+    return 0;
+}
+
+/*************************************************
+* @Name: nPackReadLine
+* @Def: Reads an index line of a container, without its newline
+* @Arg: In: pReader = container reader
+*       Out: psLine = line, PACK_LINE_SIZE bytes
+* @Ret: 0 on success, 1 at end of input, -1 on failure
+*************************************************/
+static int nPackReadLine(PackReader* pReader, char* psLine) {
+    for (size_t i = 0; i < PACK_LINE_SIZE; i++) {
+        int nResult = nPackRead(pReader, psLine + i, 1);
+        if (nResult != 0) return i == 0 ? nResult : -1;
+        if (psLine[i] == '\n') {
+            psLine[i] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*************************************************
+* @Name: vRunMember
+* @Def: Runs the streaming engine over one member of a container
+* @Arg: In: pvArg = PackMember pointer
+* @Ret: NULL
+*************************************************/
+static void* vRunMember(void* pvArg) {
+    PackMember* pMember = (PackMember*)pvArg;
+    pMember->nResult = pMember->pWorker->pfDistortStream(pMember->psName, pMember->psFactor,
+                                                         pMember->pIn, pMember->pOut, NULL);
+    if (pMember->nResult == 0 || pMember->nResult == DISTORT_NOT_STREAMABLE) {
+        ring_close(pMember->pOut);
+    } else {
+        ring_abort(pMember->pOut);
+    }
+    return NULL;
+}
+
+/*************************************************
+* @Name: nStreamMember
+* @Def: Distorts a member with the streaming engine, collecting its
+*       output, since the index line giving its size goes first
+* @Arg: In: pWorker = Worker pointer
+*       In: psName = member file name
+*       In: psFactor = distortion factor
+*       In: pData = member bytes
+*       In: nSize = member size
+*       Out: ppOut = output, malloc'd
+*       Out: pnOut = output size
+* @Ret: 0 on success, DISTORT_NOT_STREAMABLE if the engine declined, -1 on failure
+*************************************************/
+static int nStreamMember(Worker* pWorker, const char* psName, const char* psFactor, const char* pData,
+                         unsigned long nSize, char** ppOut, unsigned long* pnOut) {
+    size_t nCapacity = nSize + 64;
+    PackMember member = { pWorker, psName, psFactor, create_ring(nSize + 1), create_ring(nCapacity), -1 };
+    char* pOut = malloc(nCapacity);
+    unsigned long nOut = 0;
+    pthread_t thread;
+    if (!member.pIn || !member.pOut || !pOut || pthread_create(&thread, NULL, vRunMember, &member) != 0) {
+        destroy_ring(member.pIn);
+        destroy_ring(member.pOut);
+        free(pOut);
+        return -1;
+    }
+
+    // The input ring holds the whole member, so this does not block
+    ssize_t nBytes = nSize > 0 ? ring_write(member.pIn, pData, nSize) : 0;
+    ring_close(member.pIn);
+    while (nBytes >= 0 && (nBytes = ring_read(member.pOut, pOut + nOut, nCapacity - nOut)) > 0) {
+        nOut += nBytes;
+        if (nOut == nCapacity) {
+            char* pGrown = realloc(pOut, nCapacity * 2);
+            if (!pGrown) {
+                nBytes = -1;
+                break;
+            }
+            pOut = pGrown;
+            nCapacity *= 2;
+        }
+    }
+    if (nBytes < 0) ring_abort(member.pOut);
+    pthread_join(thread, NULL);
+    destroy_ring(member.pIn);
+    destroy_ring(member.pOut);
+
+    if (nBytes < 0 || member.nResult != 0) {
+        free(pOut);
+        return nBytes >= 0 && member.nResult == DISTORT_NOT_STREAMABLE ? DISTORT_NOT_STREAMABLE : -1;
+    }
+    *ppOut = pOut;
+    *pnOut = nOut;
+    return 0;
+}
+
+/*************************************************
+* @Name: nDistortMember
+* @Def: Distorts one member of a container, with the streaming engine
+*       or, through files next to the job's spool, the file engine
+* @Arg: In: pWorker = Worker pointer
+*       In: pJob = container job
+*       In: psName = member file name
+*       In: pData = member bytes
+*       In: nSize = member size
+*       Out: ppOut = output, malloc'd
+*       Out: pnOut = output size
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nDistortMember(Worker* pWorker, const DistortJob* pJob, const char* psName, const char* pData,
+                          unsigned long nSize, char** ppOut, unsigned long* pnOut) {
+    int nResult = DISTORT_NOT_STREAMABLE;
+    if (pWorker->pfDistortStream) {
+        nResult = nStreamMember(pWorker, psName, pJob->sFactor, pData, nSize, ppOut, pnOut);
+    }
+    if (nResult != DISTORT_NOT_STREAMABLE) return nResult;
+
+    // The file engines go by path and extension
+    char sInPath[PROGRESS_PATH_LENGTH + 300];
+    char sOutPath[PROGRESS_PATH_LENGTH + 300];
+    if (snprintf(sInPath, sizeof(sInPath), "%s_%s", pJob->progress.sSpoolPath, psName) >= (int)sizeof(sInPath) ||
+        snprintf(sOutPath, sizeof(sOutPath), "%s_distorted_%s", pJob->progress.sSpoolPath,
+                 psName) >= (int)sizeof(sOutPath)) {
+        return -1;
+    }
+    int fd = open(sInPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    nResult = write(fd, pData, nSize) == (ssize_t)nSize ? 0 : -1;
+    close(fd);
+    if (nResult == 0) {
+        nResult = pWorker->pfDistort ? pWorker->pfDistort(sInPath, sOutPath, pJob->sFactor)
+                                     : nCopyFile(sInPath, sOutPath);
+    }
+
+    struct stat st;
+    fd = nResult == 0 ? open(sOutPath, O_RDONLY) : -1;
+    char* pOut = NULL;
+    nResult = -1;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (pOut = malloc(st.st_size + 1)) != NULL &&
+        read(fd, pOut, st.st_size) == st.st_size) {
+        *ppOut = pOut;
+        *pnOut = st.st_size;
+        nResult = 0;
+    } else {
+        free(pOut);
+    }
+    if (fd >= 0) close(fd);
+    unlink(sInPath);
+    unlink(sOutPath);
+    return nResult;
+}
+
+/*************************************************
+* @Name: nDistortPack
+* @Def: Distorts a container of small files member by member, writing
+*       each result with its index line as soon as it is done
+* @Arg: In: pWorker = Worker pointer
+*       In: pJob = container job
+*       In: pIn = input ring
+*       In: pOut = output ring
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nDistortPack(Worker* pWorker, const DistortJob* pJob, Ring* pIn, Ring* pOut) {
+    PackReader reader = { pIn, "", 0, 0 };
+    char sLine[PACK_LINE_SIZE];
+    size_t nMagic = strlen(PACK_MAGIC) - 1;     // Without its newline
+    if (nPackReadLine(&reader, sLine) != 0 || strlen(sLine) != nMagic || strncmp(sLine, PACK_MAGIC, nMagic) != 0 ||
+        ring_write(pOut, PACK_MAGIC, strlen(PACK_MAGIC)) < 0) {
+        vWriteLog("Invalid file container\n");
+        return -1;
+    }
+
+    int nMembers = 0;
+    int nResult;
+    while ((nResult = nPackReadLine(&reader, sLine)) == 0) {
+        char* psName = NULL;
+        unsigned long nSize = strtoul(sLine, &psName, 10);
+        if (psName == sLine || *psName != ' ' || *++psName == '\0' || strchr(psName, '/') ||
+            strlen(psName) >= sizeof(pJob->sFileName) || nSize > PACK_MAX_SIZE) {
+            vWriteLog("Invalid file container\n");
+            return -1;
+        }
+
+        char* pData = malloc(nSize + 1);
+        char* pResult = NULL;
+        unsigned long nOut = 0;
+        nResult = !pData || nPackRead(&reader, pData, nSize) != 0 ? -1
+                : nDistortMember(pWorker, pJob, psName, pData, nSize, &pResult, &nOut);
+        free(pData);
+
+        char sIndex[PACK_LINE_SIZE];
+        snprintf(sIndex, sizeof(sIndex), PACK_MEMBER_FORMAT, nOut, psName);
+        if (nResult == 0 && (ring_write(pOut, sIndex, strlen(sIndex)) < 0 ||
+                             (nOut > 0 && ring_write(pOut, pResult, nOut) < 0))) {
+            nResult = -1;
+        }
+        free(pResult);
+        if (nResult != 0) return -1;
+        nMembers++;
+    }
+    if (nResult < 0) return -1;
+
+    char sMsg[128];
+    snprintf(sMsg, sizeof(sMsg), "Distorted %d packed files\n", nMembers);
+    vWriteLog(sMsg);
+    return 0;
+}
+
+/*************************************************
+* @Name: vCacheResult
+* @Def: Keeps the output of a finished job in the result cache, and an
+*       uploaded input in the originals store. The key carries the MD5
+*       the client announced; a plain upload was checked against it, a
+*       Merkle upload is only checked against its root, so its input is
+*       hashed here before either is trusted
+* @Arg: In: pWorker = Worker pointer
+*       In: pJob = finished job
+*       In: psInPath = its input
+*       In: psOutPath = its output, unless handed off
+* @Ret: None
+*************************************************/
+static void vCacheResult(Worker* pWorker, const DistortJob* pJob, const char* psInPath, const char* psOutPath) {
+    int nIsUploaded = pJob->fdIn < 0 && !pJob->nIsHeld;
+    if ((!pWorker->pCache && (!pWorker->pOriginals || !nIsUploaded)) || pJob->sCacheKey[0] == '\0') return;
+
+    if (pJob->nIsMerkle) {
+        char sMD5[MD5_HEX_SIZE] = "";
+        MappedFile input;
+        int fd = open(psInPath, O_RDONLY);
+        if (fd >= 0 && nMapInput(&input, fd) == 0) {
+            Md5Context md5;
+            vMd5Init(&md5);
+            vMd5Update(&md5, input.pData, input.nMapped);
+            vMd5FinalHex(&md5, sMD5);
+            vUnmapFile(&input);
+        }
+        if (fd >= 0) close(fd);
+        if (strcmp(sMD5, pJob->sMD5) != 0) return;
+    }
+
+    int fd = pJob->fdOut >= 0 ? pJob->fdOut : open(psOutPath, O_RDONLY);
+    if (fd >= 0) {
+        vCacheStore(pWorker->pCache, pJob->sCacheKey, fd, vReportCache, pWorker);
+        if (fd != pJob->fdOut) close(fd);
+    }
+
+    fd = nIsUploaded && pWorker->pOriginals ? open(psInPath, O_RDONLY) : -1;
+    if (fd >= 0) {
+        vCacheStore(pWorker->pOriginals, pJob->sMD5, fd, vReportCache, pWorker);
+        close(fd);
+    }
+}
+
+/*************************************************
+* @Name: vKeepEndState
+* @Def: Saves the engine's end state of a finished job with the identity
+*       of the input and output it kept, so a request for the file once
+*       more bytes were appended only distorts those
+* @Arg: In: pWorker = Worker pointer
+*       In: pJob = finished job
+*       In: pCheckpoint = its checkpoint handle
+*       In: psInPath = kept input
+*       In: psOutPath = kept output
+* @Ret: None
+*************************************************/
+static void vKeepEndState(Worker* pWorker, const DistortJob* pJob, const JobCheckpoint* pCheckpoint,
+                          const char* psInPath, const char* psOutPath) {
+    if (!pWorker->pAppends || !pCheckpoint->nHasEnd) return;
+
+    AppendState state;
+    memset(&state, 0, sizeof(state));
+    snprintf(state.sFactor, sizeof(state.sFactor), "%s", pJob->sFactor);
+    if (nKeptFile(psInPath, &state.in) != 0 || nKeptFile(psOutPath, &state.out) != 0 ||
+        state.in.nSize != pJob->nFileSize || state.out.nSize != pCheckpoint->nEndOut) {
+        return;
+    }
+    state.inMd5 = pCheckpoint->endInMd5;
+    /* A Merkle upload is checked chunk by chunk, so its MD5 state is taken here */
+    if (pJob->nIsMerkle) {
+        MappedFile input;
+        int fd = open(psInPath, O_RDONLY);
+        int nIsHashed = fd >= 0 && nMapInput(&input, fd) == 0 && input.nMapped == state.in.nSize;
+        if (nIsHashed) {
+            vMd5Init(&state.inMd5);
+            vMd5Update(&state.inMd5, input.pData, input.nMapped);
+        }
+        if (fd >= 0) {
+            vUnmapFile(&input);
+            close(fd);
+        }
+        if (!nIsHashed) return;
+    }
+    state.outMd5 = pCheckpoint->endOutMd5;
+    state.nStateSize = pCheckpoint->nEndSize;
+    memcpy(state.pState, pCheckpoint->pEndState, pCheckpoint->nEndSize);
+
+    char sKey[MD5_HEX_SIZE];
+    vAppendKey(pJob->sFileName, sKey);
+    vCachePut(pWorker->pAppends, sKey, &state, sizeof(state));
+}
+
+/*************************************************
+* @Name: nKeepCopy
+* @Def: Copies a file the client handed off into the save folder, where a
+*       request for it once more bytes were appended finds what the last
+*       job read or wrote
+* @Arg: In: fdSrc = handed-off file
+*       In: psPath = copy to write
+*       In: nLength = bytes to copy
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nKeepCopy(int fdSrc, const char* psPath, unsigned long nLength) {
+    int fd = open(psPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int nResult = fd >= 0 ? nCopyFd(fdSrc, fd, nLength) : -1;
+    if (fd >= 0) close(fd);
+    if (fd >= 0 && nResult != 0) unlink(psPath);
+    return nResult;
+}
+
+/*************************************************
+* @Name: nProcessDistortion
+* @Def: Runs a job as a receive -> distort -> send pipeline. The stages are
+*       connected by bounded rings, so output streams back while the upload
+*       is still arriving; FILE_INFO is sent as a trailer. A job taken over
+*       with a checkpoint restarts both rings at the checkpoint offsets
+* @Arg: In: pWorker = Worker pointer
+*       In: pJob = job, with the offsets to resume from
+* @Ret: 0 on success, -1 on failure
+*************************************************/
+static int nProcessDistortion(Worker* pWorker, const DistortJob* pJob) {
+    const char* psFileName = pJob->sFileName;
+    const char* psFactor = pJob->sFactor;
+    const char* sInPath = pJob->progress.sSpoolPath;
+    char sKeepPath[MAX_PATH_LENGTH + 256];
+    char sOutPath[MAX_PATH_LENGTH + 256 + 10];
+    snprintf(sKeepPath, sizeof(sKeepPath), "%s/%s", pWorker->config.sSaveFolder, psFileName);
+    snprintf(sOutPath, sizeof(sOutPath), "%s/distorted_%s", pWorker->config.sSaveFolder, psFileName);
+
+    Ring* pIn = create_ring(PIPELINE_RING_SIZE);
+    Ring* pOut = create_ring(PIPELINE_RING_SIZE);
+    if (!pIn || !pOut) {
+        destroy_ring(pIn);
+        destroy_ring(pOut);
+        return -1;
+    }
+
+    JobCheckpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.pWorker = pWorker;
+    checkpoint.pJob = pJob;
+    checkpoint.pIn = pIn;
+    checkpoint.pOut = pOut;
+    if (pJob->progress.nHasCheckpoint) {
+        checkpoint.nInBase = pJob->progress.nInOffset;
+        checkpoint.nOutBase = pJob->progress.nOutOffset;
+        checkpoint.nLastIn = checkpoint.nInBase;
+    }
+    pthread_mutex_init(&checkpoint.mutex, NULL);
+
+    PipelineStage receive = { pWorker, pIn, pJob, &checkpoint, NULL, 0 };
+    PipelineStage send = { pWorker, pOut, pJob, &checkpoint, &receive, 0 };
+    pthread_t receive_thread, send_thread;
+
+    vWriteLog("Receiving original file...\n");
+    if (pthread_create(&receive_thread, NULL, vReceiveStage, &receive) != 0) {
+        pthread_mutex_destroy(&checkpoint.mutex);
+        destroy_ring(pIn);
+        destroy_ring(pOut);
+        return -1;
+    }
+    if (pthread_create(&send_thread, NULL, vSendStage, &send) != 0) {
+        ring_abort(pIn);
+        pthread_join(receive_thread, NULL);
+        pthread_mutex_destroy(&checkpoint.mutex);
+        destroy_ring(pIn);
+        destroy_ring(pOut);
+        return -1;
+    }
+
+    vWriteLog("Distorting...\n");
+    int nIsPack = strncmp(psFileName, PACK_PREFIX, strlen(PACK_PREFIX)) == 0;
+    int nResult = DISTORT_NOT_STREAMABLE;
+    if (nIsPack) {
+        nResult = nDistortPack(pWorker, pJob, pIn, pOut);
+    } else if (pWorker->pfDistortStream) {
+        nResult = pWorker->pfDistortStream(psFileName, psFactor, pIn, pOut, &checkpoint);
+    }
+    if (nResult == DISTORT_NOT_STREAMABLE) {
+        nResult = nDistortWholeFile(pWorker, pJob, sOutPath, pIn, pOut);
+    }
+
+    if (nResult == 0) {
+        ring_close(pOut);
+    } else {
+        ring_abort(pIn);
+        ring_abort(pOut);
+    }
+
+    pthread_join(send_thread, NULL);
+    pthread_join(receive_thread, NULL);
+    pthread_mutex_destroy(&checkpoint.mutex);
+    destroy_ring(pIn);
+    destroy_ring(pOut);
+
+    if (nResult != 0 || receive.nResult != 0 || send.nResult != 0) {
+        /* The spools and progress stay under the job id for a resumed
+         * attempt, unless the upload is corrupt */
+        if (receive.nResult == PIPELINE_CHECK_KO) {
+            if (pJob->nIsHeld) vCacheDrop(pWorker->pOriginals, pJob->sMD5, vReportCache, pWorker);
+            unlink(sInPath);
+            unlink(pJob->progress.sOutPath);
+            vProgressRelease(pWorker->pProgress, pJob->nSlot);
+        } else {
+            vProgressPark(pWorker->pProgress, pJob->nSlot);
+        }
+        return -1;
+    }
+    vProgressRelease(pWorker->pProgress, pJob->nSlot);
+    if (pJob->fdIn >= 0) {
+        /* The client holds both files; what a file engine left here makes
+         * way for copies of them if the end state is kept */
+        vCacheResult(pWorker, pJob, sInPath, NULL);
+        unlink(sInPath);
+        unlink(sOutPath);
+        if (!nIsPack && pWorker->pAppends && checkpoint.nHasEnd &&
+            nKeepCopy(pJob->fdIn, sKeepPath, pJob->nFileSize) == 0 &&
+            nKeepCopy(pJob->fdOut, sOutPath, checkpoint.nEndOut) == 0) {
+            vKeepEndState(pWorker, pJob, &checkpoint, sKeepPath, sOutPath);
+        }
+        vWriteLog("Distorted file written to the client's file\n");
+        return 0;
+    }
+    rename(sInPath, sKeepPath);
+    rename(pJob->progress.sOutPath, sOutPath);
+    vCacheResult(pWorker, pJob, sKeepPath, sOutPath);
+    if (nIsPack) {
+        // Its name is never asked for again
+        unlink(sKeepPath);
+        unlink(sOutPath);
+        vWriteLog("Distorted files sent\n");
+        return 0;
+    }
+    vKeepEndState(pWorker, pJob, &checkpoint, sKeepPath, sOutPath);
+    vWriteLog("Distorted file sent\n");
+    return 0;
+}